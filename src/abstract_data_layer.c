@@ -1,11 +1,15 @@
 #include <stdint.h>
 #include <time.h>
+#include <limits.h>
 #include <stdbool.h>
 
 #include "../../md4c/src/md4c.c"
 #include "../../md4c/src/md4c-html.c"
 #include "../../md4c/src/entity.c"
 #include "external/sha256.c"
+#include "arena.c"
+#include "search.c"
+#include "month_index.c"
 
 typedef uint32_t acl_mode;
 
@@ -58,6 +62,17 @@ struct unix_epoch_with_ms { // just like unix_epoch, but when we need more accur
 
 enum record_display {DISPLAY_INVALID = 0, DISPLAY_DATASOURCE, DISPLAY_DATA, DISPLAY_BOTH};
 
+#define EXCERPT_SEPARATOR "<hr>" // everything in datasource before it is an excerpt, which is displayed in lists of records
+
+// Data of a record which is written by chunks before the record itself is inserted (see draft_open()),
+// so big articles are never in memory as a whole
+struct record_draft {
+	int fd; // -1 if there's no draft
+	bool media; // uploaded file, which becomes media file with publish_media() instead of record's data
+	size_t len;
+	char name[NAME_MAX + 1];
+};
+
 struct blog_record {
 	void *stack;
 	size_t stack_space; // Pass here the amount of stack you have BEFORE executing get_record() or other functions.
@@ -71,13 +86,30 @@ struct blog_record {
 	const char *datasource; // the common source of data for displaying. Usually html
 	unsigned datalen;
 	const char *data; // the second source of data. Sometimes could be displayed, but usually is used as predecessor for datasource
+	unsigned excerptlen; // offset of EXCERPT_SEPARATOR in datasource (or whole datasource length if it's absent). 0 if unknown.
+	bool excerpt_only; // pass true to get_record() if only an excerpt part of datasource is needed
+	bool streamed; // pass true to get_record() if data and datasource are going to be read by stream_record().
+	               // They aren't read to the stack then, and their contents are up to engine
 	unsigned long chosen_record; // decimal that represents record in database. 0 if we need to create it, non-0 if we need to edit it
 	unix_epoch creation_date;
 	unix_epoch modification_date;   // seconds since unix epoch.
 	struct object_gbac rights;
 	char **tags; // array with tags. Empty string means end of this array.
+	struct arena *arena; // optional. If it's set, stack is taken from arena when it isn't big enough (or NULL)
+	struct record_draft *draft; // optional. If it's set, insert_record() takes data from it, datalen is draft's length
+	const char *unindexed; // set by insert_record() and alter_record() if record is written, but search index isn't updated. It's the reason
 };
 
+// Data layer engines are calling it before they write to the stack
+bool record_stack_reserve(struct blog_record *r, size_t need) {
+	if (r->stack and r->stack_space >= need) return true;
+	if (r->arena == NULL) return false;
+	void *stack = arena_lend(r->arena, need, &r->stack_space);
+	if (stack == NULL) return false;
+	r->stack = stack; // whatever has been written before is still there, arena never moves memory
+	return true;
+}
+
 struct layer_context {
 	uint32_t enough_space[14];
 }; // 14*4 byte context is probably enough for any engine needs
@@ -99,6 +131,9 @@ union expiration { // depending on status, different expiration should be used
 	unix_epoch deactivated_expiration; // DEACTIVATED
 };
 
+enum kdf_kind {KDF_LEGACY_SHA256 = 0, KDF_PBKDF2_SHA256 = 1};
+#define KDF_SALT_SIZE 16
+
 struct usr {
 	uint32_t id;
 	char display_name[64]; // enough for most of UTF-8 names
@@ -108,8 +143,17 @@ struct usr {
 	unix_epoch create_time;
 	char approve_code[8];
 	union expiration expiration;
+
+	// Fields below have been added with PBKDF2 (see kdf.c). Users which have been stored before are read
+	// with zeroes there, their credentials are plain SHA-256 of password (KDF_LEGACY_SHA256)
+	uint8_t kdf;
+	uint32_t kdf_iterations;
+	char kdf_salt[KDF_SALT_SIZE];
 };
 
+// The part of struct usr which is stored by old versions
+#define USR_LEGACY_SIZE offsetof(struct usr, kdf)
+
 enum user_operation {CHECK, SELECT, ALTER, ADD, REMOVE};
 enum user_filter {BY_ID, BY_NAME, BY_EMAIL};
 
@@ -129,6 +173,7 @@ const char data_layer_error_data_already_exist[] = "You are attempting to insert
 const char data_layer_error_user_already_exist[] = "You are attempting to create an user that's already exist";
 const char data_layer_error_unable_to_process_kval[] = "Operation with chosen key-value pair wasn't successful";
 const char data_layer_error_item_not_found[] = "Not found";
+const char data_layer_error_not_enough_memory[] = "Not enough memory";
 
 const char meta_display_source [] = "source";
 const char meta_display_data   [] = "data";
@@ -192,6 +237,132 @@ bool key_val_dummy(char *key, void *value, ssize_t *size, void *context, const c
 	return false;
 }
 
+// Receives the contents of record by chunks, it's the same as reqio->write() of app
+typedef void (*record_sink)(const void *, unsigned long, void *);
+
+#ifndef RECORD_STREAM_CHUNK
+#define RECORD_STREAM_CHUNK 16384
+#endif
+
+bool stream_record_dummy(struct blog_record *r, enum record_display part, record_sink sink, void *sink_context, void *context, const char **error) {
+	UNUSED(r);
+	UNUSED(part);
+	UNUSED(sink);
+	UNUSED(sink_context);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool record_file_dummy(struct blog_record *r, enum record_display part, int *fd, unsigned long *size, void *context, const char **error) {
+	UNUSED(r);
+	UNUSED(part);
+	UNUSED(fd);
+	UNUSED(size);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool draft_open_dummy(struct record_draft *d, void *context, const char **error) {
+	UNUSED(d);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool draft_write_dummy(struct record_draft *d, const void *data, size_t len, void *context, const char **error) {
+	UNUSED(d);
+	UNUSED(data);
+	UNUSED(len);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+void draft_close_dummy(struct record_draft *d, void *context) {
+	UNUSED(d);
+	UNUSED(context);
+}
+
+bool publish_media_dummy(struct record_draft *d, const char *filename, size_t filenamelen, char name[NAME_MAX + 1], void *context, const char **error) {
+	UNUSED(d);
+	UNUSED(filename);
+	UNUSED(filenamelen);
+	UNUSED(name);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool remove_media_dummy(const char *name, size_t len, void *context, const char **error) {
+	UNUSED(name);
+	UNUSED(len);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool media_file_dummy(const char *name, size_t len, int *fd, unsigned long *size, void *context, const char **error) {
+	UNUSED(name);
+	UNUSED(len);
+	UNUSED(fd);
+	UNUSED(size);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool stream_media_dummy(const char *name, size_t len, record_sink sink, void *sink_context, void *context, const char **error) {
+	UNUSED(name);
+	UNUSED(len);
+	UNUSED(sink);
+	UNUSED(sink_context);
+	UNUSED(context);
+
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool search_records_dummy(const char *query, size_t querylen, struct search_hit *hits, unsigned *amount, unsigned offset, unsigned *total, void *context, const char **error) {
+	UNUSED(query);
+	UNUSED(querylen);
+	UNUSED(hits);
+	UNUSED(amount);
+	UNUSED(offset);
+	UNUSED(total);
+	UNUSED(context);
+	*error = data_layer_error_init;
+	return false;
+}
+
+// Receives title or tag of a record, see record_names()
+enum record_name_kind {RECORD_NAME_TITLE, RECORD_NAME_TAG};
+typedef void (*record_name_sink)(unsigned long, enum record_name_kind, const char *, size_t, void *);
+
+bool record_names_dummy(record_name_sink sink, void *sink_context, void *context, const char **error) {
+	UNUSED(sink);
+	UNUSED(sink_context);
+	UNUSED(context);
+	*error = data_layer_error_init;
+	return false;
+}
+
+bool archive_months_dummy(struct month_bucket *months, size_t *amount, void *context, const char **error) {
+	UNUSED(months);
+	UNUSED(amount);
+	UNUSED(context);
+	*error = data_layer_error_init;
+	return false;
+}
+
 bool user_dummy(struct usr *usr, struct user_action action, void *context, const char **error) {
 	UNUSED(usr);
 	UNUSED(action);
@@ -207,10 +378,34 @@ bool (*list_records)(unsigned *, unsigned long *, unsigned, struct list_filter,
 bool (*get_record)(struct blog_record *, unsigned , void *, const char **) = get_record_dummy;
 // retrieve blog_record itself into empty structure. Non-empty structures are prohibited because of stack usage
 
+bool (*stream_record)(struct blog_record *, enum record_display, record_sink, void *, void *, const char **) = stream_record_dummy;
+// feed data or datasource of a record which has been retrieved by get_record() with "streamed" to sink, by chunks
+// of RECORD_STREAM_CHUNK bytes. So records of any size are sent without being read to memory as a whole
+
+bool (*record_file)(struct blog_record *, enum record_display, int *, unsigned long *, void *, const char **) = record_file_dummy;
+// the same, but storage gives descriptor of file and it's size, so frontend may send it without reading it at all.
+// Caller closes descriptor. Engines which don't keep records in files say no, stream_record() is there for them
+
 bool (*insert_record)(struct blog_record *, void *, const char **) = insert_record_dummy;
 // insert a blog_record
 // if "datasourcelen" field is zero, but requested by "display", markdown processing will be performed
 
+bool (*draft_open)(struct record_draft *, void *, const char **) = draft_open_dummy;
+bool (*draft_write)(struct record_draft *, const void *, size_t, void *, const char **) = draft_write_dummy;
+void (*draft_close)(struct record_draft *, void *) = draft_close_dummy;
+// data of new record is written to draft by chunks, then blog_record->draft is passed to insert_record().
+// draft_close() must be called in any case, it removes the draft unless insert_record() has taken it
+
+bool (*publish_media)(struct record_draft *, const char *, size_t, char [NAME_MAX + 1], void *, const char **) = publish_media_dummy;
+bool (*stream_media)(const char *, size_t, record_sink, void *, void *, const char **) = stream_media_dummy;
+bool (*remove_media)(const char *, size_t, void *, const char **) = remove_media_dummy;
+// uploaded file is written to draft with .media = true, then publish_media() gives it a name (made of
+// original filename) which is never changed. stream_media() gives it back by chunks. remove_media() takes
+// back what has been published, e.g. files of upload which has failed later
+
+bool (*media_file)(const char *, size_t, int *, unsigned long *, void *, const char **) = media_file_dummy;
+// descriptor and size of published file, like record_file()
+
 bool (*alter_record)(struct blog_record *, void *, const char **) = alter_record_dummy;
 // change the title, tags, or contents of a blog record
 // please, passing the following fields is mandatory "chosen_record" and "display".
@@ -224,6 +419,19 @@ bool (*key_val)(char[KEY_VAL_MAXKEYLEN], void *, ssize_t *, void *, const char *
 // if key points to buffer that starts with \0, they key will be provided for API user, but user should
 // provide PREFIX that exist right behind this \0 byte. Prefix should be null-terminated string
 
+bool (*search_records)(const char *, size_t, struct search_hit *, unsigned *, unsigned, unsigned *, void *, const char **) = search_records_dummy;
+// full-text search: records which have every word of query, best ones first. Up to *amount of them are placed
+// to the array after skipping offset of them, *amount is how many have been placed then, *total is how many
+// have been found at all. Words in double quotes are a phrase
+
+bool (*record_names)(record_name_sink, void *, void *, const char **) = record_names_dummy;
+// give title and every tag of every record to sink. It reads all records, so it's for building indexes which
+// are kept in memory (see prefix_index.c), not for requests
+
+bool (*archive_months)(struct month_bucket *, size_t *, void *, const char **) = archive_months_dummy;
+// every month which has records, older ones first (see month_index.c). Up to *amount of them are placed to the
+// array, *amount is how many have been placed then. list_records() with from or to takes records from these buckets
+
 bool (*user)(struct usr *, struct user_action, void *, const char **) = user_dummy;
 
 enum datalayer_engines {
@@ -280,9 +488,21 @@ bool initialize_engine(struct data_layer *d, const char **error) {
 	case ENGINE_MYSQL:
 		list_records = list_records_mysql;
 		get_record = get_record_mysql;
+		stream_record = stream_record_mysql;
+		record_file = record_file_mysql;
+		draft_open = draft_open_mysql;
+		draft_write = draft_write_mysql;
+		draft_close = draft_close_mysql;
+		publish_media = publish_media_mysql;
+		stream_media = stream_media_mysql;
+		media_file = media_file_mysql;
+		remove_media = remove_media_mysql;
 		insert_record = insert_record_mysql;
 		alter_record = alter_record_mysql;
 		key_val = key_val_mysql;
+		search_records = search_records_mysql;
+		record_names = record_names_mysql;
+		archive_months = archive_months_mysql;
 		user = user_mysql;
 		return initialize_mysql_context(d, error);
 #endif
@@ -290,9 +510,21 @@ bool initialize_engine(struct data_layer *d, const char **error) {
 	case ENGINE_FILENO:
 		list_records = list_records_fileno;
 		get_record = get_record_fileno;
+		stream_record = stream_record_fileno;
+		record_file = record_file_fileno;
+		draft_open = draft_open_fileno;
+		draft_write = draft_write_fileno;
+		draft_close = draft_close_fileno;
+		publish_media = publish_media_fileno;
+		stream_media = stream_media_fileno;
+		media_file = media_file_fileno;
+		remove_media = remove_media_fileno;
 		insert_record = insert_record_fileno;
 		alter_record = alter_record_fileno;
 		key_val = key_val_fileno;
+		search_records = search_records_fileno;
+		record_names = record_names_fileno;
+		archive_months = archive_months_fileno;
 		user = user_fileno;
 		return initialize_fileno_context(d, error);
 #endif
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <inttypes.h>
 #include "fileno_util.c"
 
@@ -19,6 +20,8 @@ const char fileno_tag_dir[] = "tags";
 const char fileno_keyval_dir[] = "sessions";
 const char fileno_users_dir[] = "users";
 const char fileno_rbac_dir[] = "rbac";
+const char fileno_media_dir[] = "media";
+const char fileno_index_dir[] = "index";
 const char fileno_last_record_file[] = "last_record";
 
 /* This engine is operating with the following directory structure
@@ -45,6 +48,14 @@ const char fileno_last_record_file[] = "last_record";
  *           sessions/
  *                    session_dasiodsaiodnas
  *                    session_cxzkclzxncckzz
+ *           media/
+ *                 photoKd81nZaQxWm.jpg
+ *           index/
+ *                 travel
+ *                 photos
+ *                 .record-1
+ *                 .segments
+ *                 .stats
  *           users/
  *                 1
  *                 2
@@ -72,6 +83,12 @@ const char fileno_last_record_file[] = "last_record";
  *
  * sessions/ is a directory with key-value storage. Each key is filename, value
  * is a file content.
+ *
+ * media/ is a directory with uploaded files. Their names are never changed, so
+ * records are referencing them as /media/name.
+ *
+ * index/ is a full-text index of records: posting list of every word, and
+ * records of every month, see index_record_fileno().
  */
 
 #if !defined strizeof
@@ -88,10 +105,17 @@ struct fileno_context {
 	int keyvalfd;
 	int users;
 	int rbac;
+	int mediafd;
+	int indexfd;
 };
 
 #define OUCH_ERROR(errmsg, action) do {if (error) *error = errmsg; action;} while(0)
 
+static bool index_months_build(struct fileno_context *f, const char **error);
+static void drafts_cleanup(int dirfd);
+bool index_compact_fileno(void *context, const char **error);
+void deinitialize_engine_fileno(void *context);
+
 
 static bool initialize_fileno_context(struct data_layer *d, const char **error) { // d->addr, d->context
 	char *path = realpath(d->addr, NULL);
@@ -110,9 +134,12 @@ static bool initialize_fileno_context(struct data_layer *d, const char **error)
 	ret->dfd = open(d->addr, O_DIRECTORY | O_RDONLY);
 	ret->datafd = -1;
 	ret->datasourcefd = -1;
+	ret->tagsfd = -1;
 	ret->keyvalfd = -1;
 	ret->users = -1;
 	ret->rbac = -1;
+	ret->mediafd = -1;
+	ret->indexfd = -1;
 
 	if (ret->dfd < 0) goto fail;
 	if (mkdirat(ret->dfd, fileno_data_dir, 0700) != 0 and errno != EEXIST) goto fail;
@@ -121,22 +148,35 @@ static bool initialize_fileno_context(struct data_layer *d, const char **error)
 	if (mkdirat(ret->dfd, fileno_keyval_dir, 0700) != 0 and errno != EEXIST) goto fail;
 	if (mkdirat(ret->dfd, fileno_users_dir, 0700) != 0 and errno != EEXIST) goto fail;
 	if (mkdirat(ret->dfd, fileno_rbac_dir, 0700) != 0 and errno != EEXIST) goto fail;
+	if (mkdirat(ret->dfd, fileno_media_dir, 0700) != 0 and errno != EEXIST) goto fail;
+	if (mkdirat(ret->dfd, fileno_index_dir, 0700) != 0 and errno != EEXIST) goto fail;
 	ret->datafd = openat(ret->dfd, fileno_data_dir, O_DIRECTORY | O_RDONLY);
 	ret->datasourcefd = openat(ret->dfd, fileno_datasource_dir, O_DIRECTORY | O_RDONLY);
 	ret->tagsfd = openat(ret->dfd, fileno_tag_dir, O_DIRECTORY | O_RDONLY);
 	ret->keyvalfd = openat(ret->dfd, fileno_keyval_dir, O_DIRECTORY | O_RDONLY);
 	ret->users = openat(ret->dfd, fileno_users_dir, O_DIRECTORY | O_RDONLY);
 	ret->rbac = openat(ret->dfd, fileno_rbac_dir, O_DIRECTORY | O_RDONLY);
-	if (ret->datafd < 0 or ret->datasourcefd < 0 or ret->tagsfd < 0 or ret->keyvalfd < 0 or ret->users < 0 or ret->rbac < 0) goto fail;
+	ret->mediafd = openat(ret->dfd, fileno_media_dir, O_DIRECTORY | O_RDONLY);
+	ret->indexfd = openat(ret->dfd, fileno_index_dir, O_DIRECTORY | O_RDONLY);
+	if (ret->datafd < 0 or ret->datasourcefd < 0 or ret->tagsfd < 0 or ret->keyvalfd < 0 or ret->users < 0 or ret->rbac < 0 or ret->mediafd < 0 or ret->indexfd < 0) goto fail;
+	drafts_cleanup(ret->datafd);
+	drafts_cleanup(ret->mediafd);
+	if (index_months_build(ret, error) == false or index_compact_fileno(ret, error) == false) {
+		deinitialize_engine_fileno(ret);
+		return false;
+	}
 	return true;
 
 fail:
 	close(ret->dfd);
 	close(ret->datafd);
 	close(ret->datasourcefd);
+	close(ret->tagsfd);
 	close(ret->keyvalfd);
 	close(ret->users);
 	close(ret->rbac);
+	close(ret->mediafd);
+	close(ret->indexfd);
 	OUCH_ERROR(strerror(errno), return false);
 }
 
@@ -145,9 +185,12 @@ void deinitialize_engine_fileno(void *context) {
 	close(ret->dfd);
 	close(ret->datafd);
 	close(ret->datasourcefd);
+	close(ret->tagsfd);
 	close(ret->keyvalfd);
 	close(ret->users);
 	close(ret->rbac);
+	close(ret->mediafd);
+	close(ret->indexfd);
 }
 
 struct fileno_scandir_pass {
@@ -195,7 +238,10 @@ static int filter_fun(const struct dirent *d, void *pass) {
 	return keep;
 }
 
+static bool list_records_months(unsigned *amount, unsigned long *result_list, unsigned offset, struct list_filter filter, struct fileno_context *f, bool *indexed, const char **error);
+
 // SELECT record_id from records WHERE modified_time > from and modified_time < to LIMIT amount OFFSET sort by modified_time;
+// When range is narrowed and there's no tag, it's creation time, records are taken from month buckets then
 bool list_records_fileno(unsigned *amount,// Pointer that could be used for limiting amount of results in list. After executing places amount of results.
 						unsigned long *result_list, // Array that will be filled with results
 						unsigned offset,            // Skip some amount rows/records/results
@@ -204,6 +250,12 @@ bool list_records_fileno(unsigned *amount,// Pointer that could be used for limi
 						const char **error) {
 	struct fileno_context *f = context;
 
+	if ((filter.tags == NULL or filter.tags[0] == NULL) and (filter.from.t > 0 or filter.to.t < INT32_MAX)) {
+		bool indexed;
+		bool result = list_records_months(amount, result_list, offset, filter, f, &indexed, error);
+		if (result == false or indexed == true) return result;
+	}
+
 	int scanfd = f->dfd;
 	const char *scanaddr = f->addr;
 
@@ -278,7 +330,7 @@ static size_t taglen(const char *str) {
 	return ptr - str;
 }
 
-static char *tag_processing(char *comma_separated_tags, struct blog_record *r) {
+static char *tag_processing(char *comma_separated_tags, size_t len, struct blog_record *r) {
 	size_t tags_amount;
 	if (comma_separated_tags[0] == '\n') {
 		tags_amount = 0;
@@ -287,6 +339,11 @@ static char *tag_processing(char *comma_separated_tags, struct blog_record *r) {
 	}
 
 	size_t stack_ptrs_space = sizeof(void *) * (tags_amount + 1);
+	// tags aren't longer than the line itself, plus '\0' after every one. Array of pointers is aligned
+	if (record_stack_reserve(r, sizeof(void *) + stack_ptrs_space + len + tags_amount) == false) return NULL;
+	size_t pad = (sizeof(void *) - (uintptr_t) r->stack % sizeof(void *)) % sizeof(void *);
+	r->stack += pad;
+	r->stack_space -= pad;
 	char *put = (char *) r->stack + stack_ptrs_space;
 	r->tags = r->stack;
 	r->stack += stack_ptrs_space;
@@ -327,8 +384,13 @@ struct metadata_strings {
 	char *tags;
 	char *creation_unixepoch;
 	char *modificated_unixepoch;
+	char *excerpt; // optional, NULL if absent
+	char *generated; // optional, NULL if absent
 };
 
+#define METADATA_EXCERPT_FMT "excerpt: %010u\n" // fixed width allows to update it in place
+#define METADATA_GENERATED "generated: markdown\n"
+
 bool parse_metadata(int fd, struct metadata_strings *meta_strings, const char **error) {
 	/* metadata format:
 	 *
@@ -342,6 +404,8 @@ bool parse_metadata(int fd, struct metadata_strings *meta_strings, const char **
 	 * datasource: filename_in_datasource_directory
 	 * tags: first tag, second tag
 	 * creation_unixepoch: 1652107591
+	 * excerpt: 0000000042 (offset of excerpt separator in datasource, optional)
+	 * generated: markdown (datasource has been rendered from data, optional)
 	 *
 	 * strict requirements for metadata:
 	 * 1. \n (newline) at the end of file
@@ -367,6 +431,8 @@ bool parse_metadata(int fd, struct metadata_strings *meta_strings, const char **
 	const char meta_tags[] = "\ntags: ";
 	const char meta_creation_unixepoch[] = "\ncreation_unixepoch: ";
 	const char meta_modificated_unixepoch[] = "\nmodificated_unixepoch: ";
+	const char meta_excerpt[] = "\nexcerpt: ";
+	const char meta_generated[] = "\n" METADATA_GENERATED;
 
 	meta_strings->meta = map_whole_file_shared(fd, &(meta_strings->metalen), error);
 	if (meta_strings->meta == NULL) return false;
@@ -385,6 +451,8 @@ bool parse_metadata(int fd, struct metadata_strings *meta_strings, const char **
 	meta_strings->tags = util_memmem(meta_strings->meta, meta_strings->metalen, meta_tags, strizeof(meta_tags));
 	meta_strings->creation_unixepoch = util_memmem(meta_strings->meta, meta_strings->metalen, meta_creation_unixepoch, strizeof(meta_creation_unixepoch));
 	meta_strings->modificated_unixepoch = util_memmem(meta_strings->meta, meta_strings->metalen, meta_modificated_unixepoch, strizeof(meta_modificated_unixepoch));
+	meta_strings->excerpt = util_memmem(meta_strings->meta, meta_strings->metalen, meta_excerpt, strizeof(meta_excerpt));
+	meta_strings->generated = util_memmem(meta_strings->meta, meta_strings->metalen, meta_generated, strizeof(meta_generated));
 
 	if (meta_strings->display == NULL or
 		meta_strings->unix_access == NULL or
@@ -409,6 +477,7 @@ bool parse_metadata(int fd, struct metadata_strings *meta_strings, const char **
 	meta_strings->tags += strizeof(meta_tags);
 	meta_strings->creation_unixepoch += strizeof(meta_creation_unixepoch);
 	meta_strings->modificated_unixepoch += strizeof(meta_modificated_unixepoch);
+	if (meta_strings->excerpt != NULL) meta_strings->excerpt += strizeof(meta_excerpt);
 
 	if (meta_strings->display[0] == '\n' or
 		meta_strings->unix_access[0] == '\n' or
@@ -439,7 +508,7 @@ bool retrieve_metadata(int fd, struct blog_record *r, const char **error) {
 	if (newline_fly == m.title) OUCH_ERROR(data_layer_error_metadata_corrupted, goto ohno);
 	r->titlelen = newline_fly - m.title;
 
-	if (r->stack_space < r->titlelen) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
+	if (record_stack_reserve(r, r->titlelen) == false) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
 	memcpy(r->stack, m.title, r->titlelen);
 	r->title = r->stack;
 	r->stack += r->titlelen;
@@ -448,7 +517,7 @@ bool retrieve_metadata(int fd, struct blog_record *r, const char **error) {
 	if (m.data[0] != '\n') {
 		newline_fly = strchr(m.data, '\n');
 		r->datalen = newline_fly - m.data;
-		if (r->stack_space < r->datalen) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
+		if (record_stack_reserve(r, r->datalen) == false) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
 		memcpy(r->stack, m.data, r->datalen);
 		r->data = r->stack;
 		r->stack += r->datalen;
@@ -458,19 +527,19 @@ bool retrieve_metadata(int fd, struct blog_record *r, const char **error) {
 	if (m.datasource[0] != '\n') {
 		newline_fly = strchr(m.datasource, '\n');
 		r->datasourcelen = newline_fly - m.datasource;
-		if (r->stack_space < r->datasourcelen) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
+		if (record_stack_reserve(r, r->datasourcelen) == false) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
 		memcpy(r->stack, m.datasource, r->datasourcelen);
 		r->datasource = r->stack;
 		r->stack += r->datasourcelen;
-		r->stack_space -= r->datalen;
+		r->stack_space -= r->datasourcelen;
 	}
 
 	newline_fly = strchr(m.tags, '\n');
-	if (r->stack_space < (size_t) (newline_fly - m.tags)) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
-	if (skip_spaces(m.tags) != newline_fly) tag_processing(m.tags, r);
+	if (skip_spaces(m.tags) != newline_fly and tag_processing(m.tags, newline_fly - m.tags, r) == NULL) OUCH_ERROR(data_layer_error_not_enough_stack_space, goto ohno);
 
 	r->creation_date.t = (time_t) strtoll(m.creation_unixepoch, NULL, 10);
 	r->modification_date.t = (time_t) strtoll(m.modificated_unixepoch, NULL, 10);
+	r->excerptlen = m.excerpt ? (unsigned) strtoul(m.excerpt, NULL, 10) : 0;
 
 	munmap(m.meta, m.metalen);
 	return true;
@@ -480,6 +549,35 @@ bool retrieve_metadata(int fd, struct blog_record *r, const char **error) {
 	return false;
 }
 
+// Whole file is read to the stack, so stack is made as big as file first
+static ssize_t read_to_stack(int fd, struct blog_record *r) {
+	struct stat st;
+	if (fstat(fd, &st) < 0) return -1;
+	if (record_stack_reserve(r, (size_t) st.st_size) == false) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return pread(fd, r->stack, (size_t) st.st_size, 0);
+}
+
+static ssize_t read_datasource(int fd, struct blog_record *r) {
+	if (r->excerpt_only == false or r->excerptlen == 0) return read_to_stack(fd, r);
+
+	// Lists of records are displaying only excerpts, so there's no need to read whole datasource.
+	// Separator is read as well in order to make sure that offset is still valid
+	size_t want = r->excerptlen + strizeof(EXCERPT_SEPARATOR);
+	if (record_stack_reserve(r, want) == false) return read_to_stack(fd, r);
+	ssize_t got = pread(fd, r->stack, want, 0);
+	if (got < 0) return got;
+	if ((size_t) got == want and memcmp((char *) r->stack + r->excerptlen, EXCERPT_SEPARATOR, strizeof(EXCERPT_SEPARATOR)) == STREQ) {
+		return r->excerptlen;
+	}
+
+	r->excerptlen = 0; // offset is unreliable, let the caller to find the separator by itself
+	if ((size_t) got < want) return got; // whole file has been read
+	return read_to_stack(fd, r);
+}
+
 static bool get_record_fileno(struct blog_record *r, unsigned choosen_record, void *context, const char **error) {
 	struct fileno_context *f = context;
 
@@ -493,6 +591,24 @@ static bool get_record_fileno(struct blog_record *r, unsigned choosen_record, vo
 	close(meta);
 	if (parse_result == false) OUCH_ERROR(data_layer_error_metadata_corrupted, return false);
 
+	if (r->streamed) {
+		// names of files are left in data and datasource, stream_record_fileno() opens them later
+		bool exists = false;
+		if (r->display == DISPLAY_BOTH or r->display == DISPLAY_DATA) {
+			memcpy(name, r->data, r->datalen);
+			name[r->datalen] = '\0';
+			exists = faccessat(f->datafd, name, R_OK, 0) == 0;
+		}
+		if (r->display == DISPLAY_BOTH or r->display == DISPLAY_DATASOURCE) {
+			memcpy(name, r->datasource, r->datasourcelen);
+			name[r->datasourcelen] = '\0';
+			exists = exists or faccessat(f->datasourcefd, name, R_OK, 0) == 0;
+		}
+		if (exists == false) return false;
+		r->chosen_record = choosen_record;
+		return true;
+	}
+
 	int fd[2] = {-1, -1};
 
 	if (r->display == DISPLAY_BOTH or r->display == DISPLAY_DATA) {
@@ -500,7 +616,7 @@ static bool get_record_fileno(struct blog_record *r, unsigned choosen_record, vo
 		name[r->datalen] = '\0';
 		fd[0] = openat(f->datafd, name, O_RDONLY);
 		if (fd[0] >= 0) {
-			ssize_t got = read(fd[0], r->stack, r->stack_space);
+			ssize_t got = read_to_stack(fd[0], r);
 			close(fd[0]);
 			if (got > 0) {
 				r->stack_space -= got;
@@ -518,7 +634,7 @@ static bool get_record_fileno(struct blog_record *r, unsigned choosen_record, vo
 		name[r->datasourcelen] = '\0';
 		fd[1] = openat(f->datasourcefd, name, O_RDONLY);
 		if (fd[1] >= 0) {
-			ssize_t got = read(fd[1], r->stack, r->stack_space);
+			ssize_t got = read_datasource(fd[1], r);
 			close(fd[1]);
 			if (got > 0) {
 				r->stack_space -= got;
@@ -538,6 +654,58 @@ static bool get_record_fileno(struct blog_record *r, unsigned choosen_record, vo
 	return true;
 }
 
+// Closes fd
+static bool stream_fd(int fd, record_sink sink, void *sink_context, const char **error) {
+	char chunk[RECORD_STREAM_CHUNK];
+	while(1) {
+		ssize_t got = read(fd, chunk, sizeof(chunk));
+		if (got < 0 and errno == EINTR) continue;
+		if (got < 0) {
+			close(fd);
+			OUCH_ERROR(strerror(errno), return false);
+		}
+		if (got == 0) break;
+		sink(chunk, (unsigned long) got, sink_context);
+	}
+	close(fd);
+	return true;
+}
+
+// Size of file which is given to caller, fd is closed if it's unknown
+static bool file_size(int fd, unsigned long *size, const char **error) {
+	struct stat st;
+	if (fstat(fd, &st) < 0) OUCH_ERROR(strerror(errno), close(fd); return false);
+	*size = (unsigned long) st.st_size;
+	return true;
+}
+
+static int record_open(struct fileno_context *f, struct blog_record *r, enum record_display part, const char **error) {
+	if (r->streamed == false or (part != DISPLAY_DATA and part != DISPLAY_DATASOURCE)) OUCH_ERROR(data_layer_error_invalid_argument, return -1);
+
+	const char *from = part == DISPLAY_DATA ? r->data : r->datasource;
+	unsigned len = part == DISPLAY_DATA ? r->datalen : r->datasourcelen;
+	if (from == NULL or len == 0 or len >= NAME_MAX) OUCH_ERROR(data_layer_error_item_not_found, return -1);
+	char name[NAME_MAX];
+	memcpy(name, from, len);
+	name[len] = '\0';
+
+	int fd = openat(part == DISPLAY_DATA ? f->datafd : f->datasourcefd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) OUCH_ERROR(strerror(errno), return -1);
+	return fd;
+}
+
+static bool stream_record_fileno(struct blog_record *r, enum record_display part, record_sink sink, void *sink_context, void *context, const char **error) {
+	int fd = record_open(context, r, part, error);
+	if (fd < 0) return false;
+	return stream_fd(fd, sink, sink_context, error);
+}
+
+static bool record_file_fileno(struct blog_record *r, enum record_display part, int *fd, unsigned long *size, void *context, const char **error) {
+	*fd = record_open(context, r, part, error);
+	if (*fd < 0) return false;
+	return file_size(*fd, size, error);
+}
+
 #define RANDBYTES_WIDTH 11
 
 static void randfilename(struct fileno_context *f, char *ptr, size_t len) {
@@ -567,9 +735,165 @@ static void normalize_filename(char *name) {
 	}
 }
 
+static bool write_whole(int fd, const void *ptr, size_t len) {
+	const char *p = ptr;
+	while(len > 0) {
+		ssize_t got = write(fd, p, len);
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		p += got;
+		len -= (size_t) got;
+	}
+
+	return true;
+}
+
+#define FILENO_TMP_PREFIX "tmp_"
+
+// Contents of staged file are written by callback, so they don't need to be in memory as a whole.
+// It returns false and leaves errno if it failed
+typedef bool (*stage_writer)(int fd, void *context);
+
+struct stage_bytes {
+	const void *ptr;
+	size_t len;
+};
+
+static bool stage_bytes_write(int fd, void *context) {
+	struct stage_bytes *b = context;
+	return write_whole(fd, b->ptr, b->len);
+}
+
+static bool stage_file(struct fileno_context *f, int dirfd, stage_writer writer, void *writer_context, char tmpname[NAME_MAX + 1]) {
+	// above
+	// Leaves a complete file with contents from writer under tmpname, which is a random name inside dirfd
+	int fd;
+#ifdef O_TMPFILE
+	// Unnamed file could never be seen by anyone until it's linked, so no garbage is left even if we crash in the middle.
+	// glibc gives O_TMPFILE with _GNU_SOURCE only, it's a regular temporary file otherwise
+	fd = openat(dirfd, ".", O_TMPFILE | O_WRONLY, DEFAULT_FILE_MODE);
+	if (fd >= 0) {
+		char procpath[sizeof("/proc/self/fd/") + CBL_INT32_STR_MAX];
+		sprintf(procpath, "/proc/self/fd/%d", fd);
+		if (writer(fd, writer_context) == false) {
+			int olderrno = errno;
+			close(fd);
+			errno = olderrno;
+			return false;
+		}
+		while(1) {
+			randfilename(f, tmpname, strizeof(FILENO_TMP_PREFIX));
+			if (linkat(AT_FDCWD, procpath, dirfd, tmpname, AT_SYMLINK_FOLLOW) == 0) {
+				close(fd);
+				return true;
+			}
+			if (errno != EEXIST) break;
+		}
+		close(fd); // no /proc? Fallback to a regular temporary file then.
+	}
+#endif
+	while(1) {
+		randfilename(f, tmpname, strizeof(FILENO_TMP_PREFIX));
+		fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_FILE_MODE);
+		if (fd >= 0) break;
+		if (errno != EEXIST) return false;
+	}
+
+	bool result = writer(fd, writer_context);
+	int olderrno = errno;
+	close(fd);
+	if (result == false) unlinkat(dirfd, tmpname, 0);
+	errno = olderrno;
+
+	return result;
+}
+
+static bool replace_file_with(struct fileno_context *f, int dirfd, const char *name, stage_writer writer, void *writer_context, const char **error) {
+	// Readers should never see half-written file. Contents are prepared in temporary file and then renamed over target.
+	char tmpname[NAME_MAX + 1] = FILENO_TMP_PREFIX;
+	if (stage_file(f, dirfd, writer, writer_context, tmpname) == false) OUCH_ERROR(strerror(errno), return false);
+	if (renameat(dirfd, tmpname, dirfd, name) != 0) {
+		int olderrno = errno;
+		unlinkat(dirfd, tmpname, 0);
+		OUCH_ERROR(strerror(olderrno), return false);
+	}
+
+	return true;
+}
+
+static bool replace_file_atomically(struct fileno_context *f, int dirfd, const char *name, const void *ptr, size_t len, const char **error) {
+	struct stage_bytes b = {.ptr = ptr, .len = len};
+	return replace_file_with(f, dirfd, name, stage_bytes_write, &b, error);
+}
+
+// Markdown is transformed to html right into the file. md4c needs whole markdown in memory, it's usually mapped
+// file (draft or data/), so kernel is able to drop it's pages. Html is never there as a whole: md4c emits it by
+// tiny fragments, they are collected to a buffer, which is written when it's full. Offset of EXCERPT_SEPARATOR
+// is found on the fly, "<hr>" doesn't overlap with itself, so partial match is just a counter
+struct markdown_sink {
+	int fd;
+	bool failed;
+	size_t len; // of html which is written and buffered
+	size_t matched;
+	size_t excerpt; // SIZE_MAX until separator is found
+	size_t used;
+	char buffer[RECORD_STREAM_CHUNK];
+};
+
+static void markdown_sink_flush(struct markdown_sink *m) {
+	if (m->failed == false and m->used > 0 and write_whole(m->fd, m->buffer, m->used) == false) m->failed = true;
+	m->used = 0;
+}
+
 static void markdown_output_process(const char *data, unsigned size, void *context) {
-	int *fd = context;
-	write(*fd, data, size);
+	struct markdown_sink *m = context;
+	if (m->failed) return;
+	for (unsigned i = 0; i < size and m->excerpt == SIZE_MAX; i++) {
+		if (data[i] != EXCERPT_SEPARATOR[m->matched]) m->matched = 0;
+		if (data[i] == EXCERPT_SEPARATOR[m->matched] and ++m->matched == strizeof(EXCERPT_SEPARATOR)) m->excerpt = m->len + i + 1 - strizeof(EXCERPT_SEPARATOR);
+	}
+	m->len += size;
+	while(size > 0 and m->failed == false) {
+		if (m->used == sizeof(m->buffer)) markdown_sink_flush(m);
+		unsigned chunk = (unsigned) CBL_MIN((size_t) size, sizeof(m->buffer) - m->used);
+		memcpy(m->buffer + m->used, data, chunk);
+		m->used += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+}
+
+// Html of markdown goes to fd. Returns false and leaves errno if it failed, ENOMEM if md4c did
+static bool markdown_render(int fd, const char *data, size_t datalen, unsigned *excerptlen, size_t *htmllen) {
+	struct markdown_sink m;
+	m.fd = fd;
+	m.failed = false;
+	m.len = m.matched = m.used = 0;
+	m.excerpt = SIZE_MAX;
+	int rendered = md_html(data, (unsigned) datalen, markdown_output_process, &m, 0, 0);
+	markdown_sink_flush(&m);
+	if (m.failed) return false;
+	if (rendered != 0) {
+		errno = ENOMEM;
+		return false;
+	}
+	*excerptlen = (unsigned) (m.excerpt == SIZE_MAX ? m.len : m.excerpt);
+	*htmllen = m.len;
+	return true;
+}
+
+struct markdown_stage {
+	const char *data;
+	size_t datalen;
+	unsigned excerptlen;
+	size_t htmllen;
+};
+
+static bool markdown_stage_write(int fd, void *context) {
+	struct markdown_stage *s = context;
+	return markdown_render(fd, s->data, s->datalen, &s->excerptlen, &s->htmllen);
 }
 
 static void add_to_tag(const char *tag, struct fileno_context *f, struct blog_record *r) {
@@ -599,6 +923,157 @@ void tag_writer(int fd, char **tags, struct fileno_context *f, struct blog_recor
 	write(fd, "\n", 1);
 }
 
+static unsigned excerpt_offset(const char *datasource, size_t len) {
+	const char *found = util_memmem(datasource, len, EXCERPT_SEPARATOR, strizeof(EXCERPT_SEPARATOR));
+	if (found == NULL) return (unsigned) len;
+	return (unsigned) (found - datasource);
+}
+
+// Draft is a hidden file in data (or media) directory. insert_record_fileno() and publish_media_fileno()
+// are linking it under usual name, so it's not copied. Drafts of crashed workers are left there with
+// ".draft" prefix, until engine is initialized next time
+#define FILENO_DRAFT_PREFIX ".draft-"
+#ifndef FILENO_DRAFT_STALE
+#define FILENO_DRAFT_STALE 3600 // seconds since draft has been written for the last time
+#endif
+
+// Other workers might be writing their drafts right now (engine is initialized on reload too), so only drafts
+// which haven't been touched for a while are removed. Draft which has been published already is just one more
+// name of record's data or media file
+static void drafts_cleanup(int dirfd) {
+	int fd = openat(dirfd, ".", O_DIRECTORY | O_RDONLY);
+	DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+	if (d == NULL) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+	time_t now = time(NULL);
+	struct dirent *e;
+	while((e = readdir(d)) != NULL) {
+		if (strncmp(e->d_name, FILENO_DRAFT_PREFIX, strizeof(FILENO_DRAFT_PREFIX)) != STREQ) continue;
+		struct stat st;
+		if (fstatat(dirfd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 or now - st.st_mtime < FILENO_DRAFT_STALE) continue;
+		unlinkat(dirfd, e->d_name, 0);
+	}
+	closedir(d);
+}
+
+static int draft_dir(struct fileno_context *f, struct record_draft *d) {
+	return d->media ? f->mediafd : f->datafd;
+}
+
+static bool draft_open_fileno(struct record_draft *d, void *context, const char **error) {
+	struct fileno_context *f = context;
+	memcpy(d->name, FILENO_DRAFT_PREFIX, strizeof(FILENO_DRAFT_PREFIX));
+	d->len = 0;
+	while(1) {
+		randfilename(f, d->name, strizeof(FILENO_DRAFT_PREFIX));
+		d->fd = openat(draft_dir(f, d), d->name, O_RDWR | O_CREAT | O_EXCL, DEFAULT_FILE_MODE);
+		if (d->fd >= 0) return true;
+		if (errno != EEXIST) OUCH_ERROR(strerror(errno), d->name[0] = '\0'; return false);
+	}
+}
+
+static bool draft_write_fileno(struct record_draft *d, const void *data, size_t len, void *context, const char **error) {
+	UNUSED(context);
+	if (d->fd < 0) OUCH_ERROR(data_layer_error_invalid_argument, return false);
+	if (write_whole(d->fd, data, len) == false) OUCH_ERROR(strerror(errno), return false);
+	d->len += len;
+	return true;
+}
+
+static void draft_close_fileno(struct record_draft *d, void *context) {
+	struct fileno_context *f = context;
+	if (d->fd >= 0) close(d->fd);
+	d->fd = -1;
+	if (d->name[0] != '\0') unlinkat(draft_dir(f, d), d->name, 0);
+	d->name[0] = '\0';
+}
+
+// Uploaded file gets a name made of it's original name, random part and extension (so content type is
+// known when it's served). Only letters, digits, '-', '_' and '.' are kept, other bytes are replaced by '-',
+// so URL of the file doesn't need escaping, neither in HTTP nor in markdown
+#define MEDIA_EXTENSION_MAX 16
+
+static bool media_name_char(char c) {
+	return emb_isalpha(c) or emb_isnumeric(c) or c == '-' or c == '_' or c == '.';
+}
+
+static bool publish_media_fileno(struct record_draft *d, const char *filename, size_t filenamelen, char name[NAME_MAX + 1], void *context, const char **error) {
+	struct fileno_context *f = context;
+	if (d->fd < 0 or d->media == false) OUCH_ERROR(data_layer_error_invalid_argument, return false);
+
+	const char *slash = NULL;
+	for (size_t i = 0; i < filenamelen; i++) if (filename[i] == '/' or filename[i] == '\\') slash = filename + i;
+	if (slash) { // some browsers are sending whole path
+		filenamelen -= (size_t) (slash + 1 - filename);
+		filename = slash + 1;
+	}
+	while(filenamelen > 0 and filename[0] == '.') { // no hidden files, drafts are hidden
+		filename++;
+		filenamelen--;
+	}
+
+	size_t extlen = 0;
+	for (size_t i = filenamelen; i > 0 and filenamelen - i < MEDIA_EXTENSION_MAX; i--) {
+		if (filename[i - 1] != '.') continue;
+		extlen = filenamelen - i + sizeof(char);
+		break;
+	}
+	size_t len = filenamelen - extlen;
+	if (len + RANDBYTES_WIDTH + extlen > NAME_MAX) len = NAME_MAX - RANDBYTES_WIDTH - extlen;
+	for (size_t i = 0; i < len; i++) name[i] = media_name_char(filename[i]) ? filename[i] : '-';
+
+	while(1) {
+		randfilename(f, name, len);
+		for (size_t i = 0; i < extlen; i++) name[len + RANDBYTES_WIDTH + i] = media_name_char(filename[filenamelen - extlen + i]) ? filename[filenamelen - extlen + i] : '-';
+		name[len + RANDBYTES_WIDTH + extlen] = '\0';
+		if (linkat(f->mediafd, d->name, f->mediafd, name, 0) == 0) break;
+		if (errno != EEXIST) OUCH_ERROR(strerror(errno), return false);
+	}
+	draft_close_fileno(d, f); // it has usual name now
+	return true;
+}
+
+// Only names which publish_media_fileno() could give are accepted, so nothing outside of media/ and no drafts
+static bool media_filename(const char *name, size_t len, char filename[NAME_MAX + 1], const char **error) {
+	if (len == 0 or len > NAME_MAX or name[0] == '.') OUCH_ERROR(data_layer_error_item_not_found, return false);
+	for (size_t i = 0; i < len; i++) if (media_name_char(name[i]) == false) OUCH_ERROR(data_layer_error_item_not_found, return false);
+	memcpy(filename, name, len);
+	filename[len] = '\0';
+	return true;
+}
+
+static int media_open(struct fileno_context *f, const char *name, size_t len, const char **error) {
+	char filename[NAME_MAX + 1];
+	if (media_filename(name, len, filename, error) == false) return -1;
+
+	int fd = openat(f->mediafd, filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 and errno == ENOENT) OUCH_ERROR(data_layer_error_item_not_found, return -1);
+	if (fd < 0) OUCH_ERROR(strerror(errno), return -1);
+	return fd;
+}
+
+static bool stream_media_fileno(const char *name, size_t len, record_sink sink, void *sink_context, void *context, const char **error) {
+	int fd = media_open(context, name, len, error);
+	if (fd < 0) return false;
+	return stream_fd(fd, sink, sink_context, error);
+}
+
+static bool media_file_fileno(const char *name, size_t len, int *fd, unsigned long *size, void *context, const char **error) {
+	*fd = media_open(context, name, len, error);
+	if (*fd < 0) return false;
+	return file_size(*fd, size, error);
+}
+
+static bool remove_media_fileno(const char *name, size_t len, void *context, const char **error) {
+	struct fileno_context *f = context;
+	char filename[NAME_MAX + 1];
+	if (media_filename(name, len, filename, error) == false) return false;
+	if (unlinkat(f->mediafd, filename, 0) != 0) OUCH_ERROR(errno == ENOENT ? data_layer_error_item_not_found : strerror(errno), return false);
+	return true;
+}
+
 static bool flush_files(int meta, struct fileno_context *f, struct blog_record *r, const char **error) {
 	char name[NAME_MAX + 1];
 	memcpy(name, r->title, r->titlelen);
@@ -615,7 +1090,11 @@ static bool flush_files(int meta, struct fileno_context *f, struct blog_record *
 
 	while(1) {
 		randfilename(f, name, len);
-		fd = openat(f->datafd, name, O_RDWR | O_CREAT | O_EXCL, DEFAULT_FILE_MODE);
+		if (r->draft) { // draft just gets one more name, that's all
+			fd = linkat(f->datafd, r->draft->name, f->datafd, name, 0) == 0 ? dup(r->draft->fd) : -1;
+		} else {
+			fd = openat(f->datafd, name, O_RDWR | O_CREAT | O_EXCL, DEFAULT_FILE_MODE);
+		}
 		if (fd >= 0) break;
 		if (errno != EEXIST) OUCH_ERROR(strerror(errno), return false);
 	}
@@ -631,6 +1110,35 @@ static bool flush_files(int meta, struct fileno_context *f, struct blog_record *
 		}
 	}
 
+	// Contents are flushed before metadata, so record never becomes visible with half-written files
+	const char *data = r->data;
+	if (r->draft) {
+		data = "";
+		if (r->datalen > 0) data = mmap(NULL, r->datalen, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) OUCH_ERROR(strerror(errno), close(fd); close(sfd); goto fail);
+	} else if (r->datalen > 0 and write_whole(fd, r->data, r->datalen) == false) {
+		OUCH_ERROR(strerror(errno), close(fd); close(sfd); goto fail);
+	}
+	close(fd);
+
+	unsigned excerptlen;
+	bool generated = (r->display == DISPLAY_BOTH or r->display == DISPLAY_DATASOURCE) and r->datasourcelen == 0;
+	if (generated) {
+		// cblog is transforming markdown to html when only markdown is provided, but displaying html is possible (html only or html+md).
+		// Html file is new, nobody sees it until metadata is written, so it's rendered right there
+		size_t htmllen;
+		bool rendered = markdown_render(sfd, data, r->datalen, &excerptlen, &htmllen);
+		int olderrno = errno;
+		close(sfd);
+		if (r->draft and r->datalen > 0) munmap((void *) data, r->datalen);
+		if (rendered == false) OUCH_ERROR(strerror(olderrno), goto fail);
+	} else {
+		if (r->draft and r->datalen > 0) munmap((void *) data, r->datalen);
+		if (r->datasourcelen > 0 and write_whole(sfd, r->datasource, r->datasourcelen) == false) OUCH_ERROR(strerror(errno), close(sfd); goto fail);
+		close(sfd);
+		excerptlen = excerpt_offset(r->datasource, r->datasourcelen);
+	}
+
 	const char *display = display_enum_to_str(r->display);
 	dprintf(meta, METADATA_FMT_WO_TAGS,
 			display,
@@ -643,28 +1151,672 @@ static bool flush_files(int meta, struct fileno_context *f, struct blog_record *
 			r->creation_date.t ? r->creation_date.t : time(NULL),
 			r->modification_date.t ? r->modification_date.t : time(NULL));
 	tag_writer(meta, r->tags, f, r);
+	dprintf(meta, METADATA_EXCERPT_FMT, excerptlen);
+	if (generated) dprintf(meta, METADATA_GENERATED); // rerender_record_fileno() never touches html of author
 	close(meta);
+	if (r->draft) draft_close_fileno(r->draft, f); // it has usual name now
+
+	return true;
+
+	fail:
+	unlinkat(f->datafd, name, 0);
+	unlinkat(f->datasourcefd, name2, 0);
+	return false;
+}
+
+// Full-text index (see search.c) is in index/. Every word has a file there with it's posting list. Record which
+// is (re)indexed doesn't rewrite them, it appends a segment to ".segments", and readers are merging segments into
+// lists of words they need (see index_list_read()). Segments are merged into lists for good by
+// index_compact_fileno(), which is done when engine is initialized, by cblog-rerender, and by the writer whose
+// segment makes ".segments" bigger than FILENO_INDEX_SEGMENTS_MAX, so every search reads a bounded amount of
+// segments however long the app is running. ".record-N" has length
+// of record N and it's words, one per line, so segment also tells which words record doesn't have anymore.
+// ".stats" has amount of indexed records and their total length. Words never have dots, so names are never mixed
+// up. Writers are taking flock() of index/, every one with it's own open(), so threads of the same process are
+// excluding each other too. Readers don't lock anything: segments are read before lists, and merging the same
+// segments twice changes nothing, so lists which have been compacted meanwhile are fine too.
+
+#define FILENO_INDEX_STATS ".stats"
+#define FILENO_INDEX_RECORD ".record-"
+#define FILENO_INDEX_SEGMENTS ".segments"
+#ifndef FILENO_INDEX_SEGMENTS_MAX
+#define FILENO_INDEX_SEGMENTS_MAX 262144
+#endif
 
-	if ((r->display == DISPLAY_BOTH or r->display == DISPLAY_DATASOURCE) and r->datasourcelen == 0) {
-		// cblog is transforming markdown to html when only markdown is provided, but displaying html is possible (html only or html+md)
+static bool index_compact(struct fileno_context *f, const char **error);
 
-		write(fd, r->data, r->datalen);
-		md_html(r->data, r->datalen, markdown_output_process, &sfd, 0, 0);
+static char *read_whole_at(int dirfd, const char *name, size_t *len) {
+	// malloc()'ed contents, NULL with errno otherwise (ENOENT if there's no such file)
+	int fd = openat(dirfd, name, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
 		close(fd);
-		close(sfd);
+		return NULL;
+	}
+	char *ptr = malloc((size_t) st.st_size + sizeof(char));
+	size_t got = 0;
+	while(ptr and got < (size_t) st.st_size) {
+		ssize_t r = read(fd, ptr + got, (size_t) st.st_size - got);
+		if (r < 0 and errno == EINTR) continue;
+		if (r <= 0) break;
+		got += (size_t) r;
+	}
+	close(fd);
+	if (ptr) ptr[got] = '\0';
+	*len = got;
+	return ptr;
+}
 
-		return true;
+static bool index_stats_read(int indexfd, uint32_t *documents, uint64_t *length) {
+	*documents = 0;
+	*length = 0;
+	size_t len;
+	char *stats = read_whole_at(indexfd, FILENO_INDEX_STATS, &len);
+	if (stats == NULL) return errno == ENOENT;
+	bool result = sscanf(stats, "%" SCNu32 " %" SCNu64, documents, length) == 2;
+	free(stats);
+	return result;
+}
+
+static uint8_t *index_list_read(struct fileno_context *f, const char *term, size_t termlen, const uint8_t *segments, size_t segmentslen, size_t *len, const char **error) {
+	// Posting list of word with segments merged into it, malloc()'ed. *len is 0 if there's no such word
+	char name[SEARCH_TERM_MAX + 1];
+	memcpy(name, term, termlen);
+	name[termlen] = '\0';
+	uint8_t *list = (uint8_t *) read_whole_at(f->indexfd, name, len);
+	if (list == NULL and errno != ENOENT) OUCH_ERROR(strerror(errno), return NULL);
+	if (list == NULL) *len = 0;
+
+	struct search_delta *deltas;
+	size_t amount, extra;
+	if (search_deltas_collect(segments, segmentslen, term, termlen, &deltas, &amount, &extra) == false) {
+		OUCH_ERROR(data_layer_error_not_enough_memory, free(list); return NULL);
 	}
+	if (amount == 0) return list ? list : malloc(1);
+	uint8_t *out = malloc(*len + extra);
+	if (out == NULL) OUCH_ERROR(data_layer_error_not_enough_memory, free(list); free(deltas); return NULL);
+	*len = search_postings_merge(out, list, *len, deltas, amount);
+	free(list);
+	free(deltas);
+	return out;
+}
 
-	if (r->datalen > 0) write(fd, r->data, r->datalen);
-	close(fd);
+static bool index_record_update(struct fileno_context *f, uint32_t record, const struct search_doc *d, bool *full, const char **error) {
+	// *full is true if segments have grown bigger than they should
+	char name[sizeof(FILENO_INDEX_RECORD) + CBL_UINT32_STR_MAX];
+	sprintf(name, FILENO_INDEX_RECORD "%" PRIu32, record);
+	size_t oldlen = 0;
+	char *old = read_whole_at(f->indexfd, name, &oldlen);
+	if (old == NULL and errno != ENOENT) OUCH_ERROR(strerror(errno), return false);
+
+	size_t forwardlen = CBL_UINT32_STR_MAX + sizeof('\n');
+	for (size_t i = 0; i < d->amount; i++) forwardlen += d->tokens[i].len + sizeof('\n');
+	// every token may be a word of it's own, and every old word may be the one which record doesn't have anymore
+	size_t segmentspace = 2 * SEARCH_VARINT_MAX + forwardlen + 5 * SEARCH_VARINT_MAX * d->amount + (2 * SEARCH_VARINT_MAX + 1) * oldlen;
+	char *forward = malloc(forwardlen);
+	uint8_t *entry = malloc(SEARCH_VARINT_MAX * (2 + d->amount));
+	uint8_t *segment = malloc(segmentspace);
+	if (forward == NULL or entry == NULL or segment == NULL) {
+		OUCH_ERROR(data_layer_error_not_enough_memory, free(old); free(forward); free(entry); free(segment); return false);
+	}
+	forwardlen = (size_t) sprintf(forward, "%" PRIu32 "\n", d->length);
+	size_t segmentlen = 2 * SEARCH_VARINT_MAX; // record and size are put before words when they are known
+
+	// both words of the old version and of the new one are sorted, they're walked together
+	char *oldterm = old ? strchr(old, '\n') : NULL;
+	uint32_t oldlength = old ? (uint32_t) strtoul(old, NULL, 10) : 0;
+	if (oldterm) oldterm++;
+	size_t i = 0;
+	bool result = true;
+	while(result) {
+		size_t oldtermlen = 0;
+		if (oldterm and *oldterm) oldtermlen = strchr(oldterm, '\n') ? (size_t) (strchr(oldterm, '\n') - oldterm) : strlen(oldterm);
+		if (oldtermlen == 0 and i >= d->amount) break;
+		int cmp = oldtermlen == 0 ? 1 : i >= d->amount ? -1 : search_term_compare(oldterm, oldtermlen, d->tokens[i].term, d->tokens[i].len);
+		if (cmp < 0) {
+			segmentlen += search_segment_put(segment + segmentlen, oldterm, oldtermlen, NULL, 0);
+		} else {
+			uint32_t tf;
+			size_t next = search_doc_next_term(d, i, &tf);
+			size_t entrylen = search_posting_entry(entry, d, i, tf);
+			segmentlen += search_segment_put(segment + segmentlen, d->tokens[i].term, d->tokens[i].len, entry, entrylen);
+			memcpy(forward + forwardlen, d->tokens[i].term, d->tokens[i].len);
+			forwardlen += d->tokens[i].len;
+			forward[forwardlen++] = '\n';
+			i = next;
+		}
+		if (cmp <= 0) {
+			oldterm += oldtermlen;
+			if (*oldterm == '\n') oldterm++;
+		}
+	}
+	free(entry);
+
+	uint8_t head[2 * SEARCH_VARINT_MAX];
+	size_t headlen = search_varint_put(head, record);
+	headlen += search_varint_put(head + headlen, (uint32_t) (segmentlen - sizeof(head)));
+	uint8_t *whole = segment + sizeof(head) - headlen;
+	memcpy(whole, head, headlen);
+	segmentlen -= sizeof(head) - headlen;
+	int fd = openat(f->indexfd, FILENO_INDEX_SEGMENTS, O_WRONLY | O_APPEND | O_CREAT, DEFAULT_FILE_MODE);
+	struct stat st;
+	if (fd < 0 or fstat(fd, &st) < 0) OUCH_ERROR(strerror(errno), result = false);
+	if (result == true and write_whole(fd, whole, segmentlen) == false) {
+		OUCH_ERROR(strerror(errno), result = false);
+		ftruncate(fd, st.st_size); // segments which are appended after it shouldn't be lost behind a half-written one
+	}
+	*full = result == true and (size_t) st.st_size + segmentlen > FILENO_INDEX_SEGMENTS_MAX;
+	if (fd >= 0) close(fd);
+	free(segment);
+
+	uint32_t documents;
+	uint64_t length;
+	if (result == true and index_stats_read(f->indexfd, &documents, &length) == false) OUCH_ERROR(data_layer_error_metadata_corrupted, result = false);
+	if (result == true) result = replace_file_atomically(f, f->indexfd, name, forward, forwardlen, error);
+	if (result == true) {
+		if (old and documents > 0) {
+			documents--;
+			length -= CBL_MIN(length, oldlength);
+		}
+		documents++;
+		length += d->length;
+		char stats[CBL_UINT32_STR_MAX + CBL_UINT64_STR_MAX + 2];
+		int statslen = sprintf(stats, "%" PRIu32 " %" PRIu64 "\n", documents, length);
+		result = replace_file_atomically(f, f->indexfd, FILENO_INDEX_STATS, stats, (size_t) statslen, error);
+	}
+	free(forward);
+	free(old);
+	return result;
+}
+
+// Records are also bucketed by month when they have been created (see month_index.c). ".months" has a line for
+// every month which has records: "2024-05 records first last", older ones first, and ".month-2024-05" has a line
+// for every record of that month: "record creation_unixepoch". So records of a month are listed by reading one
+// file, and nothing is stat()'ed (see list_records_months()). Buckets are written under the same lock.
+// ".months-complete" is written once every record which storage had has been bucketed (see index_months_build()),
+// buckets aren't trusted before that.
+
+#define FILENO_INDEX_MONTHS ".months"
+#define FILENO_INDEX_MONTHS_COMPLETE ".months-complete"
+#define FILENO_INDEX_MONTH ".month-"
+#define FILENO_INDEX_MONTH_NAME (sizeof(FILENO_INDEX_MONTH) + 2 * CBL_UINT32_STR_MAX)
+
+static bool index_months_read(int indexfd, struct month_bucket *months, size_t *amount) {
+	// *amount is how many buckets fit to months, then how many have been read
+	size_t max = *amount, len;
+	*amount = 0;
+	char *text = read_whole_at(indexfd, FILENO_INDEX_MONTHS, &len);
+	if (text == NULL) return errno == ENOENT;
+
+	bool result = true;
+	char *line = text;
+	while(*line and *amount < max) {
+		unsigned year, month;
+		struct month_bucket *b = &months[*amount];
+		if (sscanf(line, "%u-%u %" SCNu32 " %" SCNu32 " %" SCNu32, &year, &month, &b->records, &b->first, &b->last) != 5 or year > 9999 or month < 1 or month > 12) {
+			result = false;
+			break;
+		}
+		b->year = (uint16_t) year;
+		b->month = (uint8_t) month;
+		++*amount;
+		line = strchr(line, '\n');
+		if (line == NULL) break;
+		line++;
+	}
+	free(text);
+	return result;
+}
+
+static bool index_months_write(struct fileno_context *f, const struct month_bucket *months, size_t amount, const char **error) {
+	char *text = malloc(amount * (strizeof("9999-12 ") + 3 * (CBL_UINT32_STR_MAX + 1)) + 1);
+	if (text == NULL) OUCH_ERROR(data_layer_error_not_enough_memory, return false);
+	size_t textlen = 0;
+	for (size_t j = 0; j < amount; j++) {
+		textlen += (size_t) sprintf(text + textlen, "%04u-%02u %" PRIu32 " %" PRIu32 " %" PRIu32 "\n",
+		                            (unsigned) months[j].year, (unsigned) months[j].month, months[j].records, months[j].first, months[j].last);
+	}
+	bool result = replace_file_atomically(f, f->indexfd, FILENO_INDEX_MONTHS, text, textlen, error);
+	free(text);
+	return result;
+}
+
+static bool index_month_update(struct fileno_context *f, uint32_t record, time_t created, const char **error) {
+	uint16_t year;
+	uint8_t month;
+	month_of(created, &year, &month);
+	char name[FILENO_INDEX_MONTH_NAME];
+	sprintf(name, FILENO_INDEX_MONTH "%04u-%02u", (unsigned) year, (unsigned) month);
+
+	size_t len = 0;
+	char *bucket = read_whole_at(f->indexfd, name, &len);
+	if (bucket == NULL and errno != ENOENT) OUCH_ERROR(strerror(errno), return false);
+
+	// it's counted again from the bucket itself, so it's right even if .months hasn't been written last time
+	struct month_bucket b = {.year = year, .month = month, .records = 1, .first = record, .last = record};
+	for (char *line = bucket; line and *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+		uint32_t r = (uint32_t) strtoul(line, NULL, 10);
+		if (r == record) { // it's indexed again, creation time is never changed
+			free(bucket);
+			return true;
+		}
+		b.records++;
+		b.first = CBL_MIN(b.first, r);
+		b.last = CBL_MAX(b.last, r);
+	}
 
-	if (r->datasourcelen > 0) write(sfd, r->datasource, r->datasourcelen);
-	close(sfd);
+	char *out = malloc(len + CBL_UINT32_STR_MAX + CBL_UINT64_STR_MAX + 2);
+	struct month_bucket *months = malloc(MONTH_INDEX_MAX * sizeof(struct month_bucket));
+	if (out == NULL or months == NULL) OUCH_ERROR(data_layer_error_not_enough_memory, free(bucket); free(out); free(months); return false);
+	if (len) memcpy(out, bucket, len);
+	free(bucket);
+	len += (size_t) sprintf(out + len, "%" PRIu32 " %lld\n", record, (long long) created);
+	bool result = replace_file_atomically(f, f->indexfd, name, out, len, error);
+	free(out);
+
+	size_t amount = MONTH_INDEX_MAX;
+	if (result == true and index_months_read(f->indexfd, months, &amount) == false) OUCH_ERROR(data_layer_error_metadata_corrupted, result = false);
+	size_t i = month_bucket_find(months, amount, year, month);
+	if (result == true and (i == amount or month_bucket_compare(&months[i], year, month) != 0)) {
+		if (amount == MONTH_INDEX_MAX) OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+		else {
+			memmove(&months[i + 1], &months[i], (amount - i) * sizeof(struct month_bucket));
+			amount++;
+		}
+	}
+	if (result == true) {
+		months[i] = b;
+		result = index_months_write(f, months, amount, error);
+	}
+	free(months);
+	return result;
+}
 
+bool archive_months_fileno(struct month_bucket *months, size_t *amount, void *context, const char **error) {
+	struct fileno_context *f = context;
+	if (index_months_read(f->indexfd, months, amount) == false) OUCH_ERROR(data_layer_error_metadata_corrupted, return false);
 	return true;
 }
 
+struct fileno_month_record {
+	uint32_t record;
+	int64_t created;
+};
+
+static int month_record_older(const void *a, const void *b) {
+	const struct fileno_month_record *x = a, *y = b;
+	if (x->created != y->created) return x->created < y->created ? -1 : 1;
+	return x->record < y->record ? -1 : x->record > y->record;
+}
+
+static int month_record_newer(const void *a, const void *b) {
+	return month_record_older(b, a);
+}
+
+static bool index_months_build(struct fileno_context *f, const char **error) {
+	// Storage which has been written before buckets existed has records which aren't in any of them, so all of
+	// records are bucketed once, when engine is initialized. Every worker initializes it's engine, the first one
+	// does it under index lock, and the others are finding ".months-complete" then
+	if (faccessat(f->indexfd, FILENO_INDEX_MONTHS_COMPLETE, F_OK, 0) == 0) return true;
+	int lock = openat(f->dfd, fileno_index_dir, O_DIRECTORY | O_RDONLY);
+	if (lock < 0 or flock(lock, LOCK_EX) < 0) OUCH_ERROR(strerror(errno), if (lock >= 0) close(lock); return false);
+	if (faccessat(f->indexfd, FILENO_INDEX_MONTHS_COMPLETE, F_OK, 0) == 0) {
+		close(lock);
+		return true;
+	}
+
+	DIR *dir = opendir(f->addr);
+	if (dir == NULL) OUCH_ERROR(strerror(errno), close(lock); return false);
+	struct fileno_month_record *list = NULL;
+	size_t listlen = 0, listspace = 0;
+	bool result = true;
+	struct dirent *e;
+	while(result == true and (e = readdir(dir)) != NULL) {
+		if (is_str_unsignedint(e->d_name) == false) continue;
+		unsigned long record = strtoul(e->d_name, NULL, 10);
+		if (record == 0 or record > UINT32_MAX) continue;
+		int meta = openat(f->dfd, e->d_name, O_RDONLY);
+		if (meta < 0) continue;
+		struct metadata_strings m = {.meta = NULL};
+		bool parsed = parse_metadata(meta, &m, NULL);
+		close(meta);
+		if (parsed == false) { // it isn't listed anyway
+			if (m.meta) munmap(m.meta, m.metalen);
+			continue;
+		}
+		if (listlen == listspace) {
+			listspace = listspace ? listspace * 2 : 64;
+			void *grown = realloc(list, listspace * sizeof(struct fileno_month_record));
+			if (grown == NULL) OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+			else list = grown;
+		}
+		if (result == true) list[listlen++] = (struct fileno_month_record) {.record = (uint32_t) record, .created = strtoll(m.creation_unixepoch, NULL, 10)};
+		munmap(m.meta, m.metalen);
+	}
+	closedir(dir);
+
+	// records of a month are next to each other once they are sorted by creation time
+	struct month_bucket *months = result ? malloc(MONTH_INDEX_MAX * sizeof(struct month_bucket)) : NULL;
+	char *out = result ? malloc(listlen * (CBL_UINT32_STR_MAX + CBL_UINT64_STR_MAX + 2) + 1) : NULL;
+	if (result == true and (months == NULL or out == NULL)) OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+	if (result == true and listlen > 0) qsort(list, listlen, sizeof(struct fileno_month_record), month_record_older);
+	size_t amount = 0;
+	for (size_t i = 0; result == true and i < listlen; ) {
+		size_t len = 0;
+		if (month_bucket_add(months, &amount, MONTH_INDEX_MAX, (time_t) list[i].created, list[i].record) == false) {
+			OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+			break;
+		}
+		struct month_bucket *b = &months[amount - 1];
+		len += (size_t) sprintf(out + len, "%" PRIu32 " %lld\n", list[i].record, (long long) list[i].created);
+		for (i++; i < listlen; i++) {
+			uint16_t year;
+			uint8_t month;
+			month_of((time_t) list[i].created, &year, &month);
+			if (month_bucket_compare(b, year, month) != 0) break;
+			month_bucket_add(months, &amount, MONTH_INDEX_MAX, (time_t) list[i].created, list[i].record);
+			len += (size_t) sprintf(out + len, "%" PRIu32 " %lld\n", list[i].record, (long long) list[i].created);
+		}
+		char name[FILENO_INDEX_MONTH_NAME];
+		sprintf(name, FILENO_INDEX_MONTH "%04u-%02u", (unsigned) b->year, (unsigned) b->month);
+		result = replace_file_atomically(f, f->indexfd, name, out, len, error);
+	}
+	if (result == true) result = index_months_write(f, months, amount, error);
+	if (result == true) result = replace_file_atomically(f, f->indexfd, FILENO_INDEX_MONTHS_COMPLETE, "", 0, error);
+	free(out);
+	free(months);
+	free(list);
+	close(lock); // it unlocks
+	return result;
+}
+
+static bool list_records_months(unsigned *amount, unsigned long *result_list, unsigned offset, struct list_filter filter, struct fileno_context *f, bool *indexed, const char **error) {
+	// Records which have been created from filter.from to filter.to, only buckets of these months are read. If
+	// buckets aren't complete yet (see index_months_build()), *indexed is false and caller scans storage
+	unsigned limit = *amount;
+	*amount = 0;
+	*indexed = faccessat(f->indexfd, FILENO_INDEX_MONTHS_COMPLETE, F_OK, 0) == 0;
+	if (*indexed == false) return true;
+	size_t n = MONTH_INDEX_MAX;
+	struct month_bucket *months = malloc(MONTH_INDEX_MAX * sizeof(struct month_bucket));
+	if (months == NULL) OUCH_ERROR(data_layer_error_not_enough_memory, return false);
+	if (index_months_read(f->indexfd, months, &n) == false) OUCH_ERROR(data_layer_error_metadata_corrupted, free(months); return false);
+
+	uint16_t fromyear, toyear;
+	uint8_t frommonth, tomonth;
+	month_of(filter.from.t, &fromyear, &frommonth);
+	month_of(filter.to.t, &toyear, &tomonth);
+
+	struct fileno_month_record *list = NULL;
+	size_t listlen = 0, listspace = 0;
+	bool result = true;
+	for (size_t i = month_bucket_find(months, n, fromyear, frommonth); result and i < n and month_bucket_compare(&months[i], toyear, tomonth) <= 0; i++) {
+		char name[FILENO_INDEX_MONTH_NAME];
+		sprintf(name, FILENO_INDEX_MONTH "%04u-%02u", (unsigned) months[i].year, (unsigned) months[i].month);
+		size_t len;
+		char *bucket = read_whole_at(f->indexfd, name, &len);
+		if (bucket == NULL) {
+			if (errno != ENOENT) OUCH_ERROR(strerror(errno), result = false);
+			continue;
+		}
+		for (char *line = bucket; *line; ) {
+			char *end;
+			struct fileno_month_record r = {.record = (uint32_t) strtoul(line, &end, 10)};
+			r.created = (int64_t) strtoll(end, &end, 10);
+			if (r.created >= filter.from.t and r.created <= filter.to.t) {
+				if (listlen == listspace) {
+					listspace = listspace ? listspace * 2 : 64;
+					void *grown = realloc(list, listspace * sizeof(struct fileno_month_record));
+					if (grown == NULL) {
+						OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+						break;
+					}
+					list = grown;
+				}
+				list[listlen++] = r;
+			}
+			line = strchr(end, '\n');
+			if (line == NULL) break;
+			line++;
+		}
+		free(bucket);
+	}
+	free(months);
+
+	if (result == true and listlen > 0) {
+		qsort(list, listlen, sizeof(struct fileno_month_record), filter.sort == ASC ? month_record_older : month_record_newer);
+		for (size_t i = offset; i < listlen and *amount < limit; i++) result_list[(*amount)++] = list[i].record;
+	}
+	free(list);
+	return result;
+}
+
+bool index_record_fileno(unsigned long record, void *context, const char **error) {
+	// above
+	// (Re)index title and contents of record: markdown if it has one, html otherwise, and it's month. Insert and
+	// alter are doing it themselves, this is for records which have been written before index existed (see rerender.c)
+	struct fileno_context *f = context;
+	if (record == 0 or record > UINT32_MAX) OUCH_ERROR(data_layer_error_invalid_argument, return false);
+
+	char name[NAME_MAX + 1];
+	sprintf(name, "%lu", record);
+	int meta = openat(f->dfd, name, O_RDONLY);
+	if (meta < 0) {
+		if (errno == ENOENT) OUCH_ERROR(data_layer_error_item_not_found, return false);
+		OUCH_ERROR(strerror(errno), return false);
+	}
+	struct metadata_strings m = {.meta = NULL};
+	bool result = parse_metadata(meta, &m, error);
+	close(meta);
+	if (result == false) OUCH_ERROR(data_layer_error_metadata_corrupted, if (m.meta) munmap(m.meta, m.metalen); return false);
+	time_t created = (time_t) strtoll(m.creation_unixepoch, NULL, 10);
+
+	bool html = false;
+	int fd = -1;
+	struct stat st = {.st_size = 0};
+	const char *candidates[] = {m.data, m.datasource};
+	int dirs[] = {f->datafd, f->datasourcefd};
+	for (unsigned i = 0; i < 2 and st.st_size == 0; i++) {
+		size_t len = strchr(candidates[i], '\n') - candidates[i];
+		if (len == 0) continue;
+		memcpy(name, candidates[i], len);
+		name[len] = '\0';
+		if (fd >= 0) close(fd);
+		fd = openat(dirs[i], name, O_RDONLY);
+		if (fd < 0 or fstat(fd, &st) < 0) OUCH_ERROR(strerror(errno), if (fd >= 0) close(fd); munmap(m.meta, m.metalen); return false);
+		html = i == 1;
+	}
+	const char *body = "";
+	if (st.st_size > 0) {
+		body = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (body == MAP_FAILED) OUCH_ERROR(strerror(errno), close(fd); munmap(m.meta, m.metalen); return false);
+	}
+	if (fd >= 0) close(fd);
+
+	struct search_doc d;
+	result = search_doc_build(&d, m.title, strchr(m.title, '\n') - m.title, body, (size_t) st.st_size, html);
+	if (st.st_size > 0) munmap((void *) body, (size_t) st.st_size);
+	munmap(m.meta, m.metalen);
+	if (result == false) OUCH_ERROR(data_layer_error_not_enough_memory, return false);
+
+	int lock = openat(f->dfd, fileno_index_dir, O_DIRECTORY | O_RDONLY);
+	if (lock < 0 or flock(lock, LOCK_EX) < 0) {
+		OUCH_ERROR(strerror(errno), if (lock >= 0) close(lock); search_doc_free(&d); return false);
+	}
+	bool full = false;
+	result = index_record_update(f, (uint32_t) record, &d, &full, error);
+	if (result == true) result = index_month_update(f, (uint32_t) record, created, error);
+	const char *compacterror = NULL;
+	if (full) index_compact(f, &compacterror); // record is indexed anyway, the next writer tries again if it fails
+	close(lock); // it unlocks
+	search_doc_free(&d);
+	return result;
+}
+
+struct fileno_term_delta {
+	const char *term;
+	size_t termlen;
+	struct search_delta d;
+};
+
+static int term_delta_compare(const void *a, const void *b) {
+	const struct fileno_term_delta *x = a, *y = b;
+	int r = search_term_compare(x->term, x->termlen, y->term, y->termlen);
+	return r != 0 ? r : search_delta_compare(&x->d, &y->d);
+}
+
+static int latest_compare(const void *a, const void *b) {
+	const struct search_delta *x = a, *y = b;
+	return x->record < y->record ? -1 : x->record > y->record;
+}
+
+static uint8_t *index_list_merge(struct fileno_context *f, const char *name, struct search_delta *deltas, size_t amount, const struct search_delta *latest, size_t records, size_t *len, const char **error) {
+	// deltas of one word are sorted by record, the latest one of every record is kept. Record whose latest segment
+	// doesn't have this word doesn't have it anymore
+	size_t kept = 0, extra = 0;
+	for (size_t i = 0; i < amount; i++) {
+		if (i + 1 < amount and deltas[i + 1].record == deltas[i].record) continue;
+		const struct search_delta *last = bsearch(&deltas[i], latest, records, sizeof(struct search_delta), latest_compare);
+		if (last and last->order != deltas[i].order) deltas[i].entry = NULL;
+		extra += deltas[i].entrylen + SEARCH_VARINT_MAX;
+		deltas[kept++] = deltas[i];
+	}
+	uint8_t *list = (uint8_t *) read_whole_at(f->indexfd, name, len);
+	if (list == NULL and errno != ENOENT) OUCH_ERROR(strerror(errno), return NULL);
+	if (list == NULL) *len = 0;
+	uint8_t *out = malloc(*len + extra + 1);
+	if (out == NULL) OUCH_ERROR(data_layer_error_not_enough_memory, free(list); return NULL);
+	*len = search_postings_merge(out, list, *len, deltas, kept);
+	free(list);
+	return out;
+}
+
+static bool index_compact(struct fileno_context *f, const char **error) {
+	// Segments are merged into posting lists of every word they have, then they're removed. Every word and every
+	// record of segments are gathered in one pass, so every list is read and written once. Lock of index/ is taken
+	// by caller
+	size_t segmentslen = 0;
+	uint8_t *segments = (uint8_t *) read_whole_at(f->indexfd, FILENO_INDEX_SEGMENTS, &segmentslen);
+	if (segments == NULL) {
+		if (errno == ENOENT) return true;
+		OUCH_ERROR(strerror(errno), return false);
+	}
+
+	struct fileno_term_delta *all = NULL;
+	struct search_delta *latest = NULL;
+	size_t amount = 0, space = 0, records = 0, recordspace = 0;
+	bool result = true;
+	const uint8_t *p = segments;
+	struct search_segment s;
+	for (uint32_t order = 0; result == true and search_segments_next(&p, segments + segmentslen, &s); order++) {
+		if (records == recordspace) {
+			recordspace = recordspace ? recordspace * 2 : 64;
+			struct search_delta *more = realloc(latest, recordspace * sizeof(struct search_delta));
+			if (more == NULL) {
+				OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+				break;
+			}
+			latest = more;
+		}
+		latest[records++] = (struct search_delta) {.record = s.record, .order = order};
+		struct fileno_term_delta t = {.d = {.record = s.record, .order = order}};
+		while(search_segment_next(&s, &t.term, &t.termlen, &t.d.entry, &t.d.entrylen)) {
+			if (amount == space) {
+				space = space ? space * 2 : 256;
+				struct fileno_term_delta *more = realloc(all, space * sizeof(struct fileno_term_delta));
+				if (more == NULL) {
+					OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+					break;
+				}
+				all = more;
+			}
+			all[amount++] = t;
+		}
+	}
+	// the last segment of every record, it tells which words record has now
+	if (result == true and records > 1) {
+		qsort(latest, records, sizeof(struct search_delta), search_delta_compare);
+		size_t kept = 0;
+		for (size_t i = 0; i < records; i++) if (i + 1 == records or latest[i + 1].record != latest[i].record) latest[kept++] = latest[i];
+		records = kept;
+	}
+	if (result == true and amount > 1) qsort(all, amount, sizeof(struct fileno_term_delta), term_delta_compare);
+	struct search_delta *deltas = result ? malloc(CBL_MAX(amount, (size_t) 1) * sizeof(struct search_delta)) : NULL;
+	if (result == true and deltas == NULL) OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+
+	for (size_t i = 0; result == true and i < amount; ) {
+		size_t n = 0;
+		size_t first = i;
+		for (; i < amount and search_term_compare(all[i].term, all[i].termlen, all[first].term, all[first].termlen) == 0; i++) deltas[n++] = all[i].d;
+		char name[SEARCH_TERM_MAX + 1];
+		memcpy(name, all[first].term, all[first].termlen);
+		name[all[first].termlen] = '\0';
+		size_t len;
+		uint8_t *list = index_list_merge(f, name, deltas, n, latest, records, &len, error);
+		if (list == NULL) {
+			result = false;
+			break;
+		}
+		if (len > 0) {
+			result = replace_file_atomically(f, f->indexfd, name, list, len, error);
+		} else if (unlinkat(f->indexfd, name, 0) != 0 and errno != ENOENT) {
+			OUCH_ERROR(strerror(errno), result = false);
+		}
+		free(list);
+	}
+	if (result == true and unlinkat(f->indexfd, FILENO_INDEX_SEGMENTS, 0) != 0) OUCH_ERROR(strerror(errno), result = false);
+	free(deltas);
+	free(all);
+	free(latest);
+	free(segments);
+	return result;
+}
+
+bool index_compact_fileno(void *context, const char **error) {
+	struct fileno_context *f = context;
+	int lock = openat(f->dfd, fileno_index_dir, O_DIRECTORY | O_RDONLY);
+	if (lock < 0 or flock(lock, LOCK_EX) < 0) OUCH_ERROR(strerror(errno), if (lock >= 0) close(lock); return false);
+	bool result = index_compact(f, error);
+	close(lock); // it unlocks
+	return result;
+}
+
+bool search_records_fileno(const char *query, size_t querylen, struct search_hit *hits, unsigned *amount, unsigned offset, unsigned *total, void *context, const char **error) {
+	struct fileno_context *f = context;
+	struct search_query q;
+	search_query_parse(&q, query, querylen);
+
+	struct search_list lists[SEARCH_QUERY_TERMS] = {{NULL, 0}};
+	unsigned loaded = 0;
+	size_t segmentslen = 0;
+	uint8_t *segments = (uint8_t *) read_whole_at(f->indexfd, FILENO_INDEX_SEGMENTS, &segmentslen);
+	if (segments == NULL and errno != ENOENT) OUCH_ERROR(strerror(errno), return false);
+	bool result = true;
+	for (; result == true and loaded < q.amount; loaded++) {
+		lists[loaded].p = index_list_read(f, q.terms[loaded].term, q.terms[loaded].len, segments, segments ? segmentslen : 0, &lists[loaded].len, error);
+		if (lists[loaded].p == NULL) result = false;
+	}
+	free(segments);
+
+	uint32_t documents;
+	uint64_t length;
+	struct search_hit *found = NULL;
+	size_t foundamount = 0;
+	if (result == true) index_stats_read(f->indexfd, &documents, &length);
+	if (result == true and search_rank(&q, lists, documents, length, &found, &foundamount) == false) {
+		OUCH_ERROR(data_layer_error_not_enough_memory, result = false);
+	}
+	for (unsigned i = 0; i < loaded; i++) free((void *) lists[i].p);
+
+	*total = (unsigned) foundamount;
+	unsigned got = 0;
+	for (size_t i = offset; result == true and i < foundamount and got < *amount; i++) hits[got++] = found[i];
+	*amount = got;
+	free(found);
+	return result;
+}
+
 static bool last_prepare(int fd, char str[CBL_UINT32_STR_MAX + 1], unsigned long *val, const char **error) {
 	ssize_t got;
 
@@ -706,6 +1858,8 @@ bool insert_record_fileno(struct blog_record *r, void *context, const char **err
 	}
 
 	if (flush_files(metadata, f, r, error) == false) {
+		close(metadata);
+		unlinkat(f->dfd, last_record_str, 0);
 		close(last_record_storage_fd);
 		return false;
 	}
@@ -716,6 +1870,11 @@ bool insert_record_fileno(struct blog_record *r, void *context, const char **err
 	write(last_record_storage_fd, last_record_str, (size_t) got);
 	close(last_record_storage_fd);
 
+	// record is there already, it's just not found until it's indexed again (see cblog-rerender)
+	r->unindexed = NULL;
+	const char *indexerror = NULL;
+	if (index_record_fileno(r->chosen_record, f, &indexerror) == false) r->unindexed = indexerror;
+
 	return true;
 }
 
@@ -777,6 +1936,45 @@ bool alter_record_fileno(struct blog_record *r, void *context, const char **erro
 		tagslen = strchr(tags, '\n') - tags;
 	}
 
+	// Contents are changed first, so metadata (e.g. excerpt) always describes what's already written
+	char filename[NAME_MAX + 1];
+	unsigned excerptlen = m.excerpt ? (unsigned) strtoul(m.excerpt, NULL, 10) : 0;
+	bool generated = m.generated != NULL;
+	bool result = true;
+	if (r->datalen > 0) {
+		size_t len = strchr(m.data, '\n') - m.data;
+		memcpy(filename, m.data, len);
+		filename[len] = '\0';
+		result = replace_file_atomically(f, f->datafd, filename, r->data, r->datalen, error);
+
+		if (result == true and (old.display == DISPLAY_BOTH or old.display == DISPLAY_DATASOURCE) and r->datasourcelen == 0) {
+			// special case for markdown processing
+			len = strchr(m.datasource, '\n') - m.datasource;
+			memcpy(filename, m.datasource, len);
+			filename[len] = '\0';
+			struct markdown_stage md = {.data = r->data, .datalen = r->datalen};
+			result = replace_file_with(f, f->datasourcefd, filename, markdown_stage_write, &md, error);
+			if (result == true) {
+				excerptlen = md.excerptlen;
+				generated = true;
+			}
+		}
+	}
+
+	if (result == true and r->datasourcelen > 0) {
+		size_t len = strchr(m.datasource, '\n') - m.datasource;
+		memcpy(filename, m.datasource, len);
+		filename[len] = '\0';
+		excerptlen = excerpt_offset(r->datasource, r->datasourcelen);
+		result = replace_file_atomically(f, f->datasourcefd, filename, r->datasource, r->datasourcelen, error);
+		generated = false;
+	}
+
+	if (result == false) {
+		munmap(m.meta, m.metalen);
+		return false;
+	}
+
 	sprintf(second_filename, "new_%lu\n", r->chosen_record);
 	meta = openat(f->dfd, second_filename, O_RDWR | O_CREAT | O_EXCL, DEFAULT_FILE_MODE);
 	if (meta < 0) OUCH_ERROR(data_layer_error_metadata_corrupted, munmap(m.meta, m.metalen); return false);
@@ -785,7 +1983,7 @@ bool alter_record_fileno(struct blog_record *r, void *context, const char **erro
 	renameat(f->dfd, second_filename, f->dfd, first_filename);
 
 	const char *display = display_enum_to_str(old.display);
-	dprintf(meta, METADATA_FMT_WITH_TAGS_LIMITED,
+	dprintf(meta, METADATA_FMT_WITH_TAGS_LIMITED METADATA_EXCERPT_FMT,
 			display,
 			old.rights.mode,
 			old.rights.user,
@@ -795,48 +1993,167 @@ bool alter_record_fileno(struct blog_record *r, void *context, const char **erro
 			(int) old.datasourcelen, old.datasource,
 			old.creation_date.t,
 			time(NULL),
-			(int) tagslen, tags);
+			(int) tagslen, tags,
+			excerptlen);
+	if (generated) dprintf(meta, METADATA_GENERATED);
 	close(meta);
 
-	if (r->datalen > 0) {
-		size_t len = strchr(m.data, '\n') - m.data;
-		memcpy(first_filename, m.data, len);
-		first_filename[len] = '\0';
-		int fd = openat(f->datafd, first_filename, O_RDWR);
-		if (fd >= 0) {
-			ftruncate(fd, 0);
-			write(fd, r->data, r->datalen);
-			close(fd);
-		}
+	munmap(m.meta, m.metalen);
 
-		if ((old.display == DISPLAY_BOTH or old.display == DISPLAY_DATASOURCE) and r->datasourcelen == 0) {
-			// special case for markdown processing
-			len = strchr(m.datasource, '\n') - m.datasource;
-			memcpy(first_filename, m.datasource, len);
-			first_filename[len] = '\0';
-			fd = openat(f->datasourcefd, first_filename, O_RDWR);
-			if (fd >= 0) {
-				ftruncate(fd, 0);
-				md_html(r->data, r->datalen, markdown_output_process, &fd, 0, 0);
-				close(fd);
-			}
-		}
+	r->unindexed = NULL;
+	const char *indexerror = NULL;
+	if (index_record_fileno(r->chosen_record, f, &indexerror) == false) r->unindexed = indexerror;
+
+	return true;
+}
+
+static bool update_excerpt(struct fileno_context *f, const char *name, unsigned excerptlen, bool generated, const char **error) {
+	// Metadata is updated in place, because it's hardlinked to tags and it's mtime is used for sorting. Flag of
+	// generated html is appended if it's asked and metadata doesn't have it yet
+	int meta = openat(f->dfd, name, O_RDWR);
+	if (meta < 0) OUCH_ERROR(strerror(errno), return false);
+
+	struct stat st;
+	struct metadata_strings m = {.meta = NULL};
+	if (fstat(meta, &st) < 0 or parse_metadata(meta, &m, error) == false) {
+		OUCH_ERROR(data_layer_error_metadata_corrupted, if (m.meta) munmap(m.meta, m.metalen); close(meta); return false);
 	}
 
-	if (r->datasourcelen > 0) {
-		size_t len = strchr(m.datasource, '\n') - m.datasource;
-		memcpy(first_filename, m.datasource, len);
-		first_filename[len] = '\0';
-		int fd = openat(f->datasourcefd, first_filename, O_RDWR);
-		if (fd >= 0) {
-			ftruncate(fd, 0);
-			write(fd, r->datasource, r->datasourcelen);
-			close(fd);
-		}
+	char excerpt[sizeof(METADATA_EXCERPT_FMT) + CBL_UINT32_STR_MAX];
+	int excerpt_size = sprintf(excerpt, METADATA_EXCERPT_FMT, excerptlen);
+	ssize_t got;
+	off_t end = (off_t) m.metalen;
+	if (m.excerpt == NULL) {
+		got = pwrite(meta, excerpt, (size_t) excerpt_size, end);
+		if (got > 0) end += got;
+	} else if (strchr(m.excerpt, '\n') - m.excerpt == excerpt_size - (int) strizeof("excerpt: \n")) {
+		char *digits = excerpt + strizeof("excerpt: ");
+		got = pwrite(meta, digits, strlen(digits) - sizeof(char), m.excerpt - (char *) m.meta);
+	} else {
+		got = 0; // made by someone else, let's keep it as is
 	}
+	if (got >= 0 and generated and m.generated == NULL) got = pwrite(meta, METADATA_GENERATED, strizeof(METADATA_GENERATED), end);
+	munmap(m.meta, m.metalen);
+
+	struct timespec times[2] = {st.st_atim, st.st_mtim};
+	futimens(meta, times);
+	close(meta);
+
+	if (got < 0) OUCH_ERROR(strerror(errno), return false);
+	return true;
+}
+
+bool rerender_record_fileno(unsigned long record, bool legacy, bool *unflagged, size_t *markdown_size, size_t *html_size, void *context, const char **error) {
+	// above
+	// Transform markdown of chosen record into html again, e.g. after md4c flags or md4c itself have been changed.
+	// Only records which have html generated from markdown are rendered (see "generated" of metadata), html which has
+	// been written by author is kept as is. Others are skipped, *markdown_size and *html_size are zero then.
+	// Records which have been written before that flag existed can't be told apart from html of author, *unflagged
+	// is true for them. If legacy is true, they are treated as generated: html is rendered from non-empty markdown
+	// and the flag is written, so next time they are usual ones.
+
+	struct fileno_context *f = context;
+	*markdown_size = 0;
+	*html_size = 0;
+	*unflagged = false;
+
+	char name[NAME_MAX + 1];
+	sprintf(name, "%lu", record);
+
+	int meta = openat(f->dfd, name, O_RDONLY);
+	if (meta < 0) {
+		if (errno == ENOENT) OUCH_ERROR(data_layer_error_item_not_found, return false);
+		OUCH_ERROR(strerror(errno), return false);
+	}
+
+	struct metadata_strings m = {.meta = NULL};
+	bool result = parse_metadata(meta, &m, error);
+	close(meta);
+	if (result == false) OUCH_ERROR(data_layer_error_metadata_corrupted, if (m.meta) munmap(m.meta, m.metalen); return false);
+
+	enum record_display display = parse_meta_display(m.display, strchr(m.display, '\n') - m.display);
+	if ((display != DISPLAY_BOTH and display != DISPLAY_DATASOURCE) or m.data[0] == '\n' or m.datasource[0] == '\n') {
+		munmap(m.meta, m.metalen);
+		return true;
+	}
+	*unflagged = m.generated == NULL;
+	if (*unflagged and legacy == false) {
+		munmap(m.meta, m.metalen);
+		return true;
+	}
+
+	size_t len = strchr(m.data, '\n') - m.data;
+	memcpy(name, m.data, len);
+	name[len] = '\0';
+	int fd = openat(f->datafd, name, O_RDONLY);
+	if (fd < 0) OUCH_ERROR(strerror(errno), munmap(m.meta, m.metalen); return false);
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) OUCH_ERROR(strerror(errno), close(fd); munmap(m.meta, m.metalen); return false);
+	if (*unflagged and st.st_size == 0) { // there's nothing to render it from
+		close(fd);
+		munmap(m.meta, m.metalen);
+		return true;
+	}
+	const char *markdown = "";
+	if (st.st_size > 0) {
+		markdown = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (markdown == MAP_FAILED) OUCH_ERROR(strerror(errno), close(fd); munmap(m.meta, m.metalen); return false);
+	}
+	close(fd);
 
+	len = strchr(m.datasource, '\n') - m.datasource;
+	memcpy(name, m.datasource, len);
+	name[len] = '\0';
 	munmap(m.meta, m.metalen);
 
+	struct markdown_stage md = {.data = markdown, .datalen = (size_t) st.st_size};
+	result = replace_file_with(f, f->datasourcefd, name, markdown_stage_write, &md, error);
+	if (st.st_size > 0) munmap((void *) markdown, (size_t) st.st_size);
+	if (result == false) return false;
+
+	*markdown_size = (size_t) st.st_size;
+	*html_size = md.htmllen;
+
+	sprintf(name, "%lu", record);
+	return update_excerpt(f, name, md.excerptlen, *unflagged, error);
+}
+
+bool record_names_fileno(record_name_sink sink, void *sink_context, void *context, const char **error) {
+	// Title and tags of every record, metadata files are read one by one. Broken ones are skipped
+	struct fileno_context *f = context;
+	int fd = openat(f->dfd, ".", O_DIRECTORY | O_RDONLY);
+	DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+	if (d == NULL) OUCH_ERROR(strerror(errno), if (fd >= 0) close(fd); return false);
+
+	struct dirent *de;
+	while((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '\0' or is_str_unsignedint(de->d_name) == false) continue;
+		int meta = openat(f->dfd, de->d_name, O_RDONLY);
+		if (meta < 0) continue;
+		struct metadata_strings m = {.meta = NULL};
+		bool parsed = parse_metadata(meta, &m, NULL);
+		close(meta);
+		if (parsed == false) {
+			if (m.meta) munmap(m.meta, m.metalen);
+			continue;
+		}
+
+		unsigned long record = strtoul(de->d_name, NULL, 10);
+		sink(record, RECORD_NAME_TITLE, m.title, (size_t) (strchr(m.title, '\n') - m.title), sink_context);
+		char *tag = skip_spaces(m.tags);
+		while(*tag != '\n') {
+			char *end = tag;
+			while(*end != ',' and *end != '\n') end++;
+			size_t len = (size_t) (end - tag);
+			while(len > 0 and tag[len - 1] == ' ') len--;
+			if (len > 0) sink(record, RECORD_NAME_TAG, tag, len, sink_context);
+			tag = *end == ',' ? skip_spaces(end + 1) : end;
+		}
+		munmap(m.meta, m.metalen);
+	}
+
+	closedir(d);
 	return true;
 }
 
@@ -988,7 +2305,8 @@ bool user_fileno(struct usr *usr, struct user_action action, void *context, cons
 		ssize_t got = read(fd, usr, sizeof(struct usr));
 		close(fd);
 		if (got < 0) OUCH_ERROR(strerror(errno), return false);
-		if (got < (ssize_t) sizeof(struct usr) or usr->id == 0) OUCH_ERROR(data_layer_error_metadata_corrupted, return false);
+		if (got < (ssize_t) USR_LEGACY_SIZE or usr->id == 0) OUCH_ERROR(data_layer_error_metadata_corrupted, return false);
+		if (got < (ssize_t) sizeof(struct usr)) memset((char *) usr + USR_LEGACY_SIZE, 0, sizeof(struct usr) - USR_LEGACY_SIZE); // stored by old version
 		return true;
 	}
 	case ALTER:
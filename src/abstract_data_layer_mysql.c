@@ -12,6 +12,49 @@ bool get_record_mysql(struct blog_record *r, unsigned choosen_record, void *cont
 	return false;
 }
 
+bool stream_record_mysql(struct blog_record *r, enum record_display part, record_sink sink, void *sink_context, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool record_file_mysql(struct blog_record *r, enum record_display part, int *fd, unsigned long *size, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool draft_open_mysql(struct record_draft *d, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool draft_write_mysql(struct record_draft *d, const void *data, size_t len, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+void draft_close_mysql(struct record_draft *d, void *context) {
+}
+
+bool publish_media_mysql(struct record_draft *d, const char *filename, size_t filenamelen, char name[NAME_MAX + 1], void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool stream_media_mysql(const char *name, size_t len, record_sink sink, void *sink_context, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool media_file_mysql(const char *name, size_t len, int *fd, unsigned long *size, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool remove_media_mysql(const char *name, size_t len, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
 bool insert_record_mysql(struct blog_record *r, void *context, const char **error) {
 	*error = data_layer_error_havent_implemented;
 	return false;
@@ -27,6 +70,21 @@ bool key_val_mysql(char key[KEY_VAL_MAXKEYLEN], void *value, ssize_t *size, void
 	return false;
 }
 
+bool search_records_mysql(const char *query, size_t querylen, struct search_hit *hits, unsigned *amount, unsigned offset, unsigned *total, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool record_names_mysql(record_name_sink sink, void *sink_context, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
+bool archive_months_mysql(struct month_bucket *months, size_t *amount, void *context, const char **error) {
+	*error = data_layer_error_havent_implemented;
+	return false;
+}
+
 bool user_mysql(struct usr *usr, struct user_action action, void *context, const char **error) {
 	*error = data_layer_error_havent_implemented;
 	return false;
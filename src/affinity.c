@@ -0,0 +1,71 @@
+#ifndef GUARD_AFFINITY_C
+#define GUARD_AFFINITY_C
+
+// needs _GNU_SOURCE before any system header, it's defined by frontends
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "util.c"
+
+// Workers might be pinned to CPUs with "cpu_affinity: 0-3,8" in config. Worker N is pinned to N-th CPU of
+// that list, list is repeated if there are more workers than CPUs. Worker pins itself before it allocates
+// anything, so it's buffers are on it's own NUMA node (memory is allocated on first touch), not on node of
+// main thread. Without cpu_affinity workers are left to scheduler, as it was before.
+
+static unsigned affinity_cpus[CPU_SETSIZE];
+static unsigned affinity_amount = 0;
+
+const char affinity_error_list[] = "Invalid cpu_affinity, expected list of CPUs like 0-3,8";
+
+bool affinity_init(const char *list, const char **error) {
+	affinity_amount = 0;
+	if (list == NULL) return true;
+
+	const char *fly = list;
+	while(*fly != '\0') {
+		if (emb_isdigit(*fly) == false) goto fail;
+		char *end;
+		unsigned long from = strtoul(fly, &end, 10);
+		unsigned long to = from;
+		if (*end == '-') {
+			fly = end + 1;
+			if (emb_isdigit(*fly) == false) goto fail;
+			to = strtoul(fly, &end, 10);
+		}
+		if (from > to or to >= CPU_SETSIZE) goto fail;
+		for (unsigned long cpu = from; cpu <= to; cpu++) {
+			if (affinity_amount == CPU_SETSIZE) goto fail;
+			affinity_cpus[affinity_amount++] = (unsigned) cpu;
+		}
+		if (*end == ',') end++;
+		else if (*end != '\0') goto fail;
+		fly = end;
+	}
+	return true;
+
+	fail:
+	affinity_amount = 0;
+	OUCH_ERROR(affinity_error_list, return false);
+}
+
+// Called by worker thread (or worker process) itself, prints where it has been placed
+void affinity_pin(unsigned worker) {
+	if (affinity_amount > 0) {
+		unsigned want = affinity_cpus[worker % affinity_amount];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(want, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) printf("Worker %u can't be pinned to cpu %u: %s\n", worker, want, strerror(errno));
+	}
+
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return;
+	printf("Worker %u: cpu %u, node %u%s\n", worker, cpu, node, affinity_amount > 0 ? "" : " (not pinned)");
+}
+
+#endif // GUARD_AFFINITY_C
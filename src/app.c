@@ -1,12 +1,22 @@
 #ifndef GUARD_APP_C
 #define GUARD_APP_C
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 #include "util.c"
+#include "router.c"
+#include "shm_cache.c"
+#include "login_throttle.c"
+#include "prefix_index.c"
 
 #define DATA_LAYER_FILENO
 #define DATA_LAYER_MYSQL
 #include "abstract_data_layer.c"
 #include "libessb.c"
+#include "kdf.c"
+#include "hash_pool.c"
 
 #include "default_rodata.h"
 
@@ -31,6 +41,17 @@ struct appconfig {
 	int32_t minimum_passwd_len;
 	bool passwd_specialchars;
 
+	int32_t workers; // amount of worker threads, 0 means amount of CPUs
+	int32_t http_port; // for frontends which are http servers by themselves
+	int32_t prefork; // non-zero means workers are processes instead of threads, see prefork.c
+	const char *cpu_affinity; // list of CPUs for workers, see affinity.c
+	int32_t arena_max; // memory limit of one request, see arena.c
+	int32_t arena_initial; // first chunk of arena, it grows from here
+	int32_t max_body; // request body limit, frontends are checking it before body is read
+	int32_t kdf_iterations; // cost of password hashing, users are rehashed when they log in if it's changed
+	int32_t hash_threads; // password hashing threads, see hash_pool.c. Taken once, when the first login comes
+	int32_t hash_queue;
+
 	rand_fill r;
 	current_time t;
 };
@@ -39,10 +60,59 @@ struct appcontext {
 	essb templates;
 	struct layer_context layer;
 	struct appconfig *config;
-	char freebuffer[];
+	struct router routes;
 };
 
 typedef enum {POST, GET, PUT, PATCH, DELETE, UNKNOWN} http_methods;
+
+// Frontend provides these for every request. Context is servercontext1 for writing and setting status,
+// servercontext2 for reading and headers. Frontend keeps per-request state (like "headers are sent already")
+// in it's own context, so different threads may serve requests at the same time.
+// write() sends status 200 with no headers if they weren't sent yet, set_http_status_and_hdr() does
+// nothing if they were. flush() is optional (NULL if frontend sends everything when app is done): what has been
+// written so far goes to client right away, app calls it between parts of response which is streamed.
+// write_fd() is optional too: len bytes of file from offset are sent by frontend itself, later and without reading
+// them to memory (it dup()s descriptor). If it returns false, nothing is taken and app writes these bytes.
+struct reqio {
+	void (*write)(const void *, unsigned long, void *);
+	void (*read)(void *, unsigned long *, void *);
+	void (*set_http_status_and_hdr)(unsigned short, const char * const *, void *);
+	const char *(*locate_header)(const char *, size_t *, void *);
+	void (*flush)(void *);
+	bool (*write_fd)(int, unsigned long, unsigned long, void *);
+};
+
+// Address of client, IPv4 is kept as IPv4-mapped IPv6 one, so both kinds are compared the same way.
+// All zeroes if frontend doesn't know it (unix socket, or FastCGI server which didn't pass REMOTE_ADDR)
+struct client_address {
+	unsigned char ip[16];
+};
+
+static const unsigned char client_address_v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+void client_address_from_sockaddr(struct client_address *c, const struct sockaddr *sa) {
+	memset(c, 0, sizeof(*c));
+	if (sa->sa_family == AF_INET) {
+		memcpy(c->ip, client_address_v4mapped, sizeof(client_address_v4mapped));
+		memcpy(c->ip + sizeof(client_address_v4mapped), &((const struct sockaddr_in *) sa)->sin_addr, 4);
+	} else if (sa->sa_family == AF_INET6) {
+		memcpy(c->ip, &((const struct sockaddr_in6 *) sa)->sin6_addr, sizeof(c->ip));
+	}
+}
+
+void client_address_parse(struct client_address *c, const char *str, size_t len) {
+	char copy[INET6_ADDRSTRLEN];
+	memset(c, 0, sizeof(*c));
+	if (len == 0 or len >= sizeof(copy)) return;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	if (inet_pton(AF_INET, copy, c->ip + sizeof(client_address_v4mapped)) == 1) {
+		memcpy(c->ip, client_address_v4mapped, sizeof(client_address_v4mapped));
+	} else if (inet_pton(AF_INET6, copy, c->ip) != 1) {
+		memset(c, 0, sizeof(*c));
+	}
+}
+
 typedef struct reqargs {
 	const char *request;
 	size_t request_len;
@@ -50,28 +120,31 @@ typedef struct reqargs {
 	size_t query_len;
 	http_methods method;
 	void *appcontext; // struct appcontext
+	const struct reqio *io;
 	void *servercontext1;
 	void *servercontext2;
+	const struct route_match *route; // filled by app_request()
+	struct arena *arena; // worker's one, everything which lives until the end of request is there
+	struct client_address client;
 } reqargs;
 
-const char *(*locate_header)(const char *, size_t *, void *);
-void (*set_http_status_and_hdr) (unsigned short, const char * const *, void *);
-void (*app_write) (const void *, unsigned long, void *);
-void (*app_read) (void *, unsigned long *, void *);
-
 #define REQUEST a.request
 #define REQUEST_LEN a.request_len
 #define QUERY a.query
 #define QUERY_LEN a.query_len
 #define METHOD a.method
 #define CONTEXT a.appcontext
-#define LOCATE_HEADER(arg1, arg2) locate_header(arg1, arg2, a.servercontext2)
-#define SET_HTTP_STATUS_AND_HDR(arg1, arg2) set_http_status_and_hdr(arg1, arg2, a.servercontext1)
-#define APP_WRITE(arg1, arg2) app_write(arg1, arg2, a.servercontext1)
+#define ARENA a.arena
+#define CLIENT a.client
+#define LOCATE_HEADER(arg1, arg2) a.io->locate_header(arg1, arg2, a.servercontext2)
+#define SET_HTTP_STATUS_AND_HDR(arg1, arg2) a.io->set_http_status_and_hdr(arg1, arg2, a.servercontext1)
+#define APP_WRITE(arg1, arg2) a.io->write(arg1, arg2, a.servercontext1)
 #define APP_WRITECS(a) APP_WRITE(a, strizeof(a))
-#define APP_READ(arg1, argv2) app_read(arg1, argv2, a.servercontext2)
+#define APP_READ(arg1, argv2) a.io->read(arg1, argv2, a.servercontext2)
+#define APP_FLUSH() do {if (a.io->flush) a.io->flush(a.servercontext1);} while(0)
 
 const char default_header_content_type[] = "Content-Type: text/html;charset=utf-8";
+const char default_header_content_type_json[] = "Content-Type: application/json;charset=utf-8";
 const char default_header_server_type[] = "Server: cblog app operator";
 const char default_header_location_slash[] = "Location: /";
 const char default_header_location_user[] = "Location: /user";
@@ -89,7 +162,10 @@ const char default_header_nocache_3[] = "Expires: 0";
 
 const char * const default_headers_table[] = {default_header_content_type, default_header_server_type, NULL};
 
-#define CONTEXTAPPBUFFERSIZE 524288
+// Records and request bodies are in worker's arena now, so context is just a context. But app_prepare()
+// writes errors there, so it's not less than that
+#define CONTEXTAPPERRORSIZE 4096
+#define CONTEXTAPPBUFFERSIZE CBL_MAX(sizeof(struct appcontext), CONTEXTAPPERRORSIZE)
 
 // expected pages
 
@@ -170,6 +246,8 @@ static inline int32_t template_tag_to_number(const char *name, int32_t length) {
 	return UNKNOWN_PAGE_PART;
 }
 
+static bool compile_routes(struct router *r, const char **error);
+
 bool app_prepare(void **ptr, struct appconfig *config) {
 	srand((unsigned int) time(NULL));
 	struct appcontext *con = *ptr;
@@ -177,15 +255,26 @@ bool app_prepare(void **ptr, struct appconfig *config) {
 	struct layer_context *l = &con->layer;
 	memset(e, '\0', sizeof(essb));
 	parse_essb(e, config->template_type, config->temlate_name, NULL);
+	// error message is written over the context, so everything is freed before that
 	if (e->errreasonstr != NULL) {
-		snprintf(*ptr, CONTEXTAPPBUFFERSIZE, "Error during parsing essb: %s", e->errreasonstr);
+		free(e->records);
+		snprintf(*ptr, CONTEXTAPPERRORSIZE, "Error during parsing essb: %s", e->errreasonstr);
 		return false;
 	}
 
 	const char *error;
 	struct data_layer d = {.e = config->datalayer_type, .addr = config->datalayer_addr, .context = l, .randfun = config->r};
 	if (initialize_engine(&d, &error) == false) {
-		snprintf(*ptr, CONTEXTAPPBUFFERSIZE, "Error during initializing_engine: %s", error);
+		free(e->records);
+		snprintf(*ptr, CONTEXTAPPERRORSIZE, "Error during initializing_engine: %s", error);
+		return false;
+	}
+
+	router_init(&con->routes);
+	if (compile_routes(&con->routes, &error) == false) {
+		free(e->records);
+		deinitialize_engine(config->datalayer_type, l);
+		snprintf(*ptr, CONTEXTAPPERRORSIZE, "Error during compiling routes: %s", error);
 		return false;
 	}
 
@@ -203,37 +292,18 @@ void app_finish(void *ptr) {
 	struct appcontext *a = ptr;
 	essb *e = &a->templates;
 	free(e->records);
-}
-
-static bool em_isdigit(char c) {
-	if (c >= '0' && c <= '9') return true;
-	return false;
-}
-
-uint32_t get_u32_from_end_of_string(const char *string, size_t len) {
-	const char *locate = string + len;
-	while(em_isdigit(*(locate-1))) {
-		locate--;
-		if (locate == string) break;
-	}
-
-	if (em_isdigit(*locate) == false) return UINT32_MAX;
-
-	char buffer[strizeof(CBL_STRINGIZE(UINT32_MAX))];
-	long digitslen = string + len - locate;
-	memcpy(buffer, locate, digitslen);
-	buffer[digitslen] = '\0';
-
-	return strtoul(buffer, NULL, 10);
+	deinitialize_engine(a->config->datalayer_type, &a->layer);
 }
 
 size_t find_cookie_existence(reqargs a, const char *cookie_key, char cookie_value_buffer[KEY_VAL_MAXKEYLEN]) {
-	size_t cookiehdrlen = 0;
-	const char *cookie_header = LOCATE_HEADER("Cookie", &cookiehdrlen);
-	if (cookie_header == NULL) return 0;
-
-	size_t cookie_val_len;
-	char *cookie_val = http_query_finder(cookie_key, cookie_header, cookiehdrlen, &cookie_val_len, true);
+	// Frontends are parsing cookies once per request, so it's just a lookup by "Cookie:key"
+	size_t keylen = strlen(cookie_key);
+	char name[strizeof(COOKIE_PREFIX) + keylen + sizeof(char)];
+	memcpy(name, COOKIE_PREFIX, strizeof(COOKIE_PREFIX));
+	memcpy(name + strizeof(COOKIE_PREFIX), cookie_key, keylen + sizeof(char));
+
+	size_t cookie_val_len = 0;
+	const char *cookie_val = LOCATE_HEADER(name, &cookie_val_len);
 	if (cookie_val == NULL) return 0;
 	if (cookie_val_len >= KEY_VAL_MAXKEYLEN) cookie_val_len = KEY_VAL_MAXKEYLEN - 1;
 	memcpy(cookie_value_buffer, cookie_val, cookie_val_len);
@@ -254,9 +324,215 @@ bool is_user_legit(struct layer_context *l, struct usr *u) {
 	bool ret = user(&u2, action, l, NULL);
 	if (ret == false) return false;
 	if (memcmp(u->display_name, u2.display_name, sizeof(u2.display_name)) != STREQ or memcmp(u->email, u2.email, sizeof(u2.email)) != STREQ) return false;
+	// session is a copy of usr made at login, so it's gone with password which has been changed since then
+	if (u2.status != ACTIVE or memcmp(u->credentials, u2.credentials, sizeof(u2.credentials)) != STREQ) return false;
+	return true;
+}
+
+// Caches are shared between all workers, even if workers are processes (see shm_cache.c and prefork.c),
+// so frontend makes them before workers are started. Nothing is cached if frontend didn't make them.
+// Records may be changed outside of the app (rerender, editing files), so entries are expiring.
+#ifndef APP_CACHE_SESSIONS
+#define APP_CACHE_SESSIONS 4096
+#endif
+#ifndef APP_CACHE_RECORDS
+#define APP_CACHE_RECORDS 256
+#endif
+#ifndef APP_CACHE_PAGES
+#define APP_CACHE_PAGES 256
+#endif
+#ifndef APP_LOGIN_THROTTLE
+#define APP_LOGIN_THROTTLE 16384
+#endif
+#ifndef APP_PREFIX_NAMES
+#define APP_PREFIX_NAMES 1048576 // titles, and tags separately
+#endif
+#ifndef APP_PREFIX_POOL
+#define APP_PREFIX_POOL 134217728 // bytes of names, twice (see prefix_index.c)
+#endif
+#define APP_CACHE_RECORD_SLOT 65536
+#define APP_CACHE_PAGE_SLOT 65536
+#define APP_CACHE_PAGE_KEYMAX 512
+#define APP_CACHE_PAGE_HEADERS 16
+
+static struct {
+	struct shm_cache *sessions; // session id -> struct usr
+	struct shm_cache *records; // record number -> everything that get_record() gives
+	struct shm_cache *pages; // whole responses of ROUTE_CACHEABLE routes for anonymous visitors
+	struct login_throttle *logins; // failed logins, see login_throttle.c
+	struct prefix_index *names; // titles and tags for /suggest, see prefix_index.c
+	struct month_index *months; // records of every month for /archive, see month_index.c
+} app_caches;
+
+bool app_caches_create(const char **error) {
+	app_caches.sessions = shm_cache_create(APP_CACHE_SESSIONS, KEY_VAL_MAXKEYLEN + sizeof(struct usr), 60, error);
+	if (app_caches.sessions == NULL) return false;
+	app_caches.records = shm_cache_create(APP_CACHE_RECORDS, APP_CACHE_RECORD_SLOT, 60, error);
+	if (app_caches.records == NULL) goto fail;
+	app_caches.pages = shm_cache_create(APP_CACHE_PAGES, APP_CACHE_PAGE_SLOT, 10, error);
+	if (app_caches.pages == NULL) goto fail;
+	app_caches.logins = login_throttle_create(APP_LOGIN_THROTTLE, error);
+	if (app_caches.logins == NULL) goto fail;
+	app_caches.names = prefix_index_create(APP_PREFIX_NAMES, APP_PREFIX_POOL, error);
+	if (app_caches.names == NULL) goto fail;
+	app_caches.months = month_index_create(error);
+	if (app_caches.months == NULL) goto fail;
+	return true;
+
+	fail:
+	shm_cache_destroy(app_caches.sessions);
+	shm_cache_destroy(app_caches.records);
+	shm_cache_destroy(app_caches.pages);
+	login_throttle_destroy(app_caches.logins);
+	prefix_index_destroy(app_caches.names);
+	memset(&app_caches, 0, sizeof(app_caches));
+	return false;
+}
+
+void app_caches_clear(void) {
+	if (app_caches.sessions) shm_cache_clear(app_caches.sessions);
+	if (app_caches.records) shm_cache_clear(app_caches.records);
+	if (app_caches.pages) shm_cache_clear(app_caches.pages);
+	if (app_caches.names) prefix_index_clear(app_caches.names);
+	if (app_caches.months) month_index_clear(app_caches.months);
+}
+
+void app_caches_destroy(void) {
+	shm_cache_destroy(app_caches.sessions);
+	shm_cache_destroy(app_caches.records);
+	shm_cache_destroy(app_caches.pages);
+	login_throttle_destroy(app_caches.logins);
+	prefix_index_destroy(app_caches.names);
+	month_index_destroy(app_caches.months);
+	memset(&app_caches, 0, sizeof(app_caches));
+}
+
+static bool session_get(struct layer_context *l, char key[KEY_VAL_MAXKEYLEN], struct usr *u, const char **error) {
+	size_t keylen = strlen(key);
+	size_t cached = sizeof(struct usr);
+	if (app_caches.sessions and shm_cache_get(app_caches.sessions, key, keylen, u, &cached) and cached == sizeof(struct usr)) return true;
+
+	ssize_t size = - ((ssize_t) sizeof(struct usr));
+	if (key_val(key, u, &size, l, error) == false) return false;
+	if (size >= 0 and size < (ssize_t) sizeof(struct usr)) memset((char *) u + size, 0, sizeof(struct usr) - (size_t) size); // session of old version
+	if (app_caches.sessions) shm_cache_put(app_caches.sessions, key, keylen, u, sizeof(struct usr));
+	return true;
+}
+
+static void session_remove(struct layer_context *l, char key[KEY_VAL_MAXKEYLEN]) {
+	key_val(key, NULL, NULL, l, NULL);
+	if (app_caches.sessions) shm_cache_remove(app_caches.sessions, key, strlen(key));
+}
+
+// Every change of usr goes through here. Sessions aren't keyed by user, so all of them are evicted from cache
+// and read from storage again, which is rare enough. Otherwise cached session would outlive the change until TTL
+static bool user_alter(struct layer_context *l, struct usr *u) {
+	struct user_action alter = {.operation = ALTER, .filter = BY_ID};
+	bool result = user(u, alter, l, NULL);
+	if (app_caches.sessions) shm_cache_clear(app_caches.sessions);
+	return result;
+}
+
+// Record is cached as this header, then title, data, datasource and '\0'-terminated tags one after another
+struct cached_record {
+	enum record_display display;
+	unsigned titlelen;
+	unsigned datalen;
+	unsigned datasourcelen;
+	unsigned excerptlen;
+	unsigned tagslen;
+	unix_epoch creation_date;
+	unix_epoch modification_date;
+	struct object_gbac rights;
+};
+
+static void record_to_cache(struct blog_record *b, const char *key, size_t keylen) {
+	struct cached_record h = {.display = b->display, .titlelen = b->title ? b->titlelen : 0, .datalen = b->data ? b->datalen : 0,
+	                          .datasourcelen = b->datasource ? b->datasourcelen : 0, .excerptlen = b->excerptlen,
+	                          .creation_date = b->creation_date, .modification_date = b->modification_date, .rights = b->rights};
+	for (char **t = b->tags; t and *t; t++) h.tagslen += strlen(*t) + sizeof(char);
+
+	// rest of the stack is free, so entry is assembled there
+	size_t len = sizeof(h) + h.titlelen + h.datalen + h.datasourcelen + h.tagslen;
+	if (len > APP_CACHE_RECORD_SLOT or record_stack_reserve(b, len) == false) return;
+	char *put = b->stack;
+	memcpy(put, &h, sizeof(h));
+	put += sizeof(h);
+	memcpy(put, b->title, h.titlelen);
+	put += h.titlelen;
+	memcpy(put, b->data, h.datalen);
+	put += h.datalen;
+	memcpy(put, b->datasource, h.datasourcelen);
+	put += h.datasourcelen;
+	for (char **t = b->tags; t and *t; t++) {
+		size_t l = strlen(*t) + sizeof(char);
+		memcpy(put, *t, l);
+		put += l;
+	}
+	shm_cache_put(app_caches.records, key, keylen, b->stack, len);
+}
+
+static bool record_from_cache(struct blog_record *b, const char *key, size_t keylen) {
+	if (record_stack_reserve(b, APP_CACHE_RECORD_SLOT) == false) return false;
+	size_t len = b->stack_space;
+	if (shm_cache_get(app_caches.records, key, keylen, b->stack, &len) == false) return false;
+
+	struct cached_record h;
+	memcpy(&h, b->stack, sizeof(h));
+	size_t tags_amount = 0;
+	char *tags = (char *) b->stack + sizeof(h) + h.titlelen + h.datalen + h.datasourcelen;
+	for (size_t i = 0; i < h.tagslen; i++) tags_amount += tags[i] == '\0';
+
+	uintptr_t end = (uintptr_t) b->stack + len;
+	size_t ptrs_at = len + ((sizeof(void *) - end % sizeof(void *)) % sizeof(void *));
+	size_t used = ptrs_at + (tags_amount ? sizeof(char *) * (tags_amount + 1) : 0);
+	if (used > b->stack_space) return false;
+
+	char *fly = (char *) b->stack + sizeof(h);
+	b->display = h.display;
+	b->titlelen = h.titlelen;
+	b->title = h.titlelen ? fly : NULL;
+	fly += h.titlelen;
+	b->datalen = h.datalen;
+	b->data = h.datalen ? fly : NULL;
+	fly += h.datalen;
+	b->datasourcelen = h.datasourcelen;
+	b->datasource = h.datasourcelen ? fly : NULL;
+	b->excerptlen = h.excerptlen;
+	b->creation_date = h.creation_date;
+	b->modification_date = h.modification_date;
+	b->rights = h.rights;
+	b->tags = NULL;
+	if (tags_amount) {
+		b->tags = (char **) ((char *) b->stack + ptrs_at);
+		for (size_t i = 0; i < tags_amount; i++) {
+			b->tags[i] = tags;
+			tags += strlen(tags) + sizeof(char);
+		}
+		b->tags[tags_amount] = NULL;
+	}
+	b->stack = (char *) b->stack + used;
+	b->stack_space -= used;
 	return true;
 }
 
+static bool record_get(struct blog_record *b, unsigned record, struct layer_context *l) {
+	char key[sizeof(char) + CBL_UINT32_STR_MAX + sizeof(char)];
+	size_t keylen = (size_t) sprintf(key, "%c%u", b->streamed ? 's' : b->excerpt_only ? 'e' : 'r', record);
+	bool found = app_caches.records and record_from_cache(b, key, keylen);
+	if (found) {
+		b->chosen_record = record;
+	} else if (get_record(b, record, l, NULL) == true) {
+		found = true;
+		if (app_caches.records) record_to_cache(b, key, keylen);
+	}
+	// rest of the lent space is given back to arena, so next allocation might use it
+	if (b->arena and b->stack) arena_giveback(b->arena, b->stack, b->stack_space);
+	b->stack = NULL;
+	b->stack_space = 0;
+	return found;
+}
+
 #define BUF_USERDISPLAY_CALC (strizeof(LI_AND_A_PAGE_FULL_STR)+sizeof(u->display_name)+strizeof(LI_AND_A_LOGOUT_FULL_STR)+strizeof(LI_AND_A_USER)+strizeof(LI_A_SUFF)+sizeof(char))
 
 static void internal_server_error(reqargs a, const char *error) {
@@ -280,8 +556,7 @@ static void internal_server_error(reqargs a, const char *error) {
 
 	struct usr u[1];
 	char buffer[CBL_MAX(KEY_VAL_MAXKEYLEN, BUF_USERDISPLAY_CALC)];
-	ssize_t size = - ((ssize_t) sizeof(struct usr));
-	if (find_cookie_existence(a, "id", buffer) != 0 and key_val(buffer, u, &size, l, NULL) == true and is_user_valid(u) == true) {
+	if (find_cookie_existence(a, "id", buffer) != 0 and session_get(l, buffer, u, NULL) == true and is_user_valid(u) == true) {
 		size_t strsize = (size_t) sprintf(buffer, LI_AND_A_PAGE_FULL_STR LI_AND_A_USER "%s" LI_A_SUFF LI_AND_A_LOGOUT_FULL_STR, u->display_name);
 		out[USER_PAGE_PART] = buffer;
 		outsizes[USER_PAGE_PART] = strsize;
@@ -314,8 +589,7 @@ static void notfound(reqargs a) {
 
 	struct usr u[1];
 	char buffer[CBL_MAX(KEY_VAL_MAXKEYLEN, BUF_USERDISPLAY_CALC)];
-	ssize_t size = - ((ssize_t) sizeof(struct usr));
-	if (find_cookie_existence(a, "id", buffer) != 0 and key_val(buffer, u, &size, l, NULL) == true and is_user_valid(u) == true) {
+	if (find_cookie_existence(a, "id", buffer) != 0 and session_get(l, buffer, u, NULL) == true and is_user_valid(u) == true) {
 		size_t strsize = (size_t) sprintf(buffer, LI_AND_A_PAGE_FULL_STR LI_AND_A_USER "%s" LI_A_SUFF LI_AND_A_LOGOUT_FULL_STR, u->display_name);
 		out[USER_PAGE_PART] = buffer;
 		outsizes[USER_PAGE_PART] = strsize;
@@ -327,6 +601,130 @@ static void notfound(reqargs a) {
 	}
 }
 
+#define VLINE_HTMLTAG EXCERPT_SEPARATOR
+
+static char *find_vline(struct blog_record *b) {
+	// Storage usually knows where the separator is, so scanning whole datasource is needed only for old records
+	char *target = (char *) b->datasource;
+	if (b->excerptlen == 0) return util_memmem(target, b->datasourcelen, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG));
+	if (b->excerptlen + strizeof(VLINE_HTMLTAG) > b->datasourcelen) return NULL;
+	if (memcmp(target + b->excerptlen, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG)) != STREQ) {
+		return util_memmem(target, b->datasourcelen, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG));
+	}
+	return target + b->excerptlen;
+}
+
+// The same as find_vline() with memset(), but for record which is streamed by chunks (see stream_record()).
+// Beginning of separator at the end of chunk is held until next chunk shows if it's a separator or not.
+// "<hr>" doesn't overlap with itself, so held bytes can't be a beginning of another one
+struct vline_filter {
+	reqargs a;
+	size_t held;
+	bool done;
+};
+
+static void vline_filter_feed(struct vline_filter *f, const void *ptr, unsigned long len) {
+	reqargs a = f->a;
+	const char *fly = ptr;
+	const char *end = fly + len;
+	while(f->done == false and fly < end) {
+		if (f->held) {
+			size_t n = CBL_MIN(strizeof(VLINE_HTMLTAG) - f->held, (size_t) (end - fly));
+			if (memcmp(fly, VLINE_HTMLTAG + f->held, n) != STREQ) {
+				APP_WRITE(VLINE_HTMLTAG, f->held);
+				f->held = 0;
+				continue;
+			}
+			f->held += n;
+			fly += n;
+			if (f->held < strizeof(VLINE_HTMLTAG)) return;
+			APP_WRITE("    ", strizeof(VLINE_HTMLTAG));
+			f->held = 0;
+			f->done = true;
+			break;
+		}
+		const char *found = util_memmem(fly, end - fly, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG));
+		if (found) {
+			APP_WRITE(fly, found - fly);
+			APP_WRITE("    ", strizeof(VLINE_HTMLTAG));
+			fly = found + strizeof(VLINE_HTMLTAG);
+			f->done = true;
+			break;
+		}
+		size_t tail = CBL_MIN(strizeof(VLINE_HTMLTAG) - sizeof(char), (size_t) (end - fly));
+		while(tail > 0 and memcmp(end - tail, VLINE_HTMLTAG, tail) != STREQ) tail--;
+		APP_WRITE(fly, end - fly - tail);
+		f->held = tail;
+		return;
+	}
+	if (fly < end) APP_WRITE(fly, end - fly);
+}
+
+// Every chunk of record goes to client as soon as it's read
+static void vline_filter_write(const void *ptr, unsigned long len, void *context) {
+	struct vline_filter *f = context;
+	reqargs a = f->a;
+	vline_filter_feed(f, ptr, len);
+	APP_FLUSH();
+}
+
+static void vline_filter_finish(struct vline_filter *f) {
+	reqargs a = f->a;
+	if (f->held) APP_WRITE(VLINE_HTMLTAG, f->held);
+	f->held = 0;
+}
+
+// Part of file goes to client by frontend (see reqio's write_fd()), or it's read here by chunks if frontend can't
+static void app_write_fd(reqargs a, int fd, unsigned long offset, unsigned long len) {
+	if (len == 0 or (a.io->write_fd and a.io->write_fd(fd, offset, len, a.servercontext1))) return;
+	char chunk[RECORD_STREAM_CHUNK];
+	while(len > 0) {
+		ssize_t got = pread(fd, chunk, CBL_MIN(len, sizeof(chunk)), (off_t) offset);
+		if (got < 0 and errno == EINTR) continue;
+		if (got <= 0) break;
+		APP_WRITE(chunk, (unsigned long) got);
+		offset += (unsigned long) got;
+		len -= (unsigned long) got;
+	}
+}
+
+static unsigned long fd_find_vline(int fd, unsigned long size, unsigned excerptlen) {
+	// The same as find_vline(), but for file. It's size if there's no separator
+	char chunk[RECORD_STREAM_CHUNK];
+	if (excerptlen > 0 and excerptlen + strizeof(VLINE_HTMLTAG) > size) return size;
+	if (excerptlen > 0 and pread(fd, chunk, strizeof(VLINE_HTMLTAG), excerptlen) == strizeof(VLINE_HTMLTAG) and
+	    memcmp(chunk, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG)) == STREQ) return excerptlen;
+	unsigned long at = 0;
+	while(at < size) {
+		ssize_t got = pread(fd, chunk, CBL_MIN(size - at, sizeof(chunk)), (off_t) at);
+		if (got < 0 and errno == EINTR) continue;
+		if (got < (ssize_t) strizeof(VLINE_HTMLTAG)) break;
+		const char *found = util_memmem(chunk, (size_t) got, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG));
+		if (found) return at + (unsigned long) (found - chunk);
+		if (at + (unsigned long) got >= size) break;
+		at += (unsigned long) got - (strizeof(VLINE_HTMLTAG) - sizeof(char)); // separator might be cut by the end of chunk
+	}
+	return size;
+}
+
+// Record goes to client right from it's file, only separator is replaced with spaces in between. Frontend sends
+// it when client is ready to take it, so nobody waits for slow client. False if storage doesn't keep it in file
+static bool record_by_fd(reqargs a, struct blog_record *b) {
+	struct appcontext *con = CONTEXT;
+	int fd;
+	unsigned long size;
+	const char *error;
+	if (record_file(b, DISPLAY_DATASOURCE, &fd, &size, &con->layer, &error) == false) return false;
+	unsigned long vline = fd_find_vline(fd, size, b->excerptlen);
+	app_write_fd(a, fd, 0, vline);
+	if (vline < size) {
+		APP_WRITE("    ", strizeof(VLINE_HTMLTAG));
+		app_write_fd(a, fd, vline + strizeof(VLINE_HTMLTAG), size - vline - strizeof(VLINE_HTMLTAG));
+	}
+	close(fd);
+	return true;
+}
+
 static void rewind_back(essb *e, long looking_for, unsigned *position) {
 	while(e->record_size[*position] != -looking_for) --*position;
 	--*position;
@@ -339,6 +737,7 @@ struct select {
 	unsigned position;
 	bool href;
 	bool end_at_vline;
+	struct arena_mark mark; // every record is read after it, previous one isn't needed anymore
 };
 
 static inline void selector_show_tag_processing(reqargs a, struct blog_record *b, struct select *s, struct usr *u) {
@@ -355,7 +754,7 @@ static inline void selector_show_tag_processing(reqargs a, struct blog_record *b
 		break;
 	case TITLE_PAGE_PART:
 		if (s->href) {
-			APP_WRITE("<a href=\"", strizeof("<a href=\""));
+			APP_WRITE("<a href=\"/", strizeof("<a href=\"/")); // lists are on nested paths too, like /archive/2024
 			APP_WRITE(b->title, b->titlelen);
 			APP_WRITE("-", strizeof("-"));
 			char buffer[CBL_UINT32_STR_MAX];
@@ -386,10 +785,11 @@ static inline void selector_show_tag_processing(reqargs a, struct blog_record *b
 	case REPEATTWO_PAGE_PART:
 		if (s->position >= s->limit) break;
 
+		arena_rewind(ARENA, s->mark);
 		memset(b, '\0', sizeof(struct blog_record));
-		b->stack = con->freebuffer;
-		b->stack_space = CONTEXTAPPBUFFERSIZE - (con->freebuffer - (char *) con);
-		bool get_record_result = get_record(b, s->found[s->position], l, NULL);
+		b->arena = ARENA;
+		b->excerpt_only = s->end_at_vline;
+		bool get_record_result = record_get(b, s->found[s->position], l);
 		s->position++;
 		if (get_record_result == false) {
 			s->iter--;
@@ -397,8 +797,7 @@ static inline void selector_show_tag_processing(reqargs a, struct blog_record *b
 		} else {
 			s->href = true;
 			const char *target = b->datasource;
-#define VLINE_HTMLTAG "<hr>"
-			char *found = util_memmem(target, b->datasourcelen, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG));
+			char *found = find_vline(b);
 			if (found) {
 				if (s->end_at_vline == true) {
 					b->datasourcelen -= b->datasourcelen - (found - target);
@@ -415,38 +814,47 @@ static inline void selector_show_tag_processing(reqargs a, struct blog_record *b
 	}
 }
 
-static void selector(reqargs a, unsigned limit, unsigned offset, struct list_filter filter, struct blog_record *b, bool end_at_vline) {
-	// above
-	// select records by criteria on a single page
+static void selector_render(reqargs a, struct select *s, struct blog_record *b) {
+	// records of s->found are shown by REPEAT parts of template, b is shown before them
 
 	struct appcontext *con = CONTEXT;
 	essb *e = &con->templates;
 	struct layer_context *l = &con->layer;
 
-	struct select s = {.limit = limit, .end_at_vline = end_at_vline};
-	s.found = alloca(sizeof(unsigned long) * limit);
-	memset(s.found, 0, sizeof(unsigned long) * limit); // TODO: for some reason valgrind yells and unitialized values when tag filter is used, this memset should be absent
-	if (list_records(&limit, s.found, offset, filter, l, NULL) == false) return notfound(a);
-	SET_HTTP_STATUS_AND_HDR(200, default_headers_table);
-
 	char key[KEY_VAL_MAXKEYLEN];
 	struct usr u_anon[1];
 	struct usr *u = NULL;
-	ssize_t usize = - ((ssize_t) sizeof(struct usr));
-	if (find_cookie_existence(a, "id", key) != 0 and key_val(key, u_anon, &usize, l, NULL) == true and is_user_valid(u_anon) == true) u = u_anon;
+	if (find_cookie_existence(a, "id", key) != 0 and session_get(l, key, u_anon, NULL) == true and is_user_valid(u_anon) == true) u = u_anon;
 
-	for (; s.iter < e->records_amount; s.iter++) {
-		if (e->record_size[s.iter] < 0) {
-			selector_show_tag_processing(a, b, &s, u);
+	for (; s->iter < e->records_amount; s->iter++) {
+		if (e->record_size[s->iter] < 0) {
+			selector_show_tag_processing(a, b, s, u);
 		} else {
-			char *target = &e->records[e->record_seek[s.iter]];
-			size_t size = e->record_size[s.iter];
+			char *target = &e->records[e->record_seek[s->iter]];
+			size_t size = e->record_size[s->iter];
 
 			APP_WRITE(target, size);
 		}
 	}
 }
 
+static void selector(reqargs a, unsigned limit, unsigned offset, struct list_filter filter, struct blog_record *b, bool end_at_vline) {
+	// above
+	// select records by criteria on a single page
+
+	struct appcontext *con = CONTEXT;
+	struct layer_context *l = &con->layer;
+
+	struct select s = {.limit = limit, .end_at_vline = end_at_vline};
+	s.found = arena_alloc(ARENA, sizeof(unsigned long) * limit);
+	if (s.found == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	memset(s.found, 0, sizeof(unsigned long) * limit); // TODO: for some reason valgrind yells and unitialized values when tag filter is used, this memset should be absent
+	if (list_records(&limit, s.found, offset, filter, l, NULL) == false) return notfound(a);
+	s.mark = arena_mark(ARENA);
+	SET_HTTP_STATUS_AND_HDR(200, default_headers_table);
+	selector_render(a, &s, b);
+}
+
 static void title(reqargs a) {
 	// show tittle page with pre-record values
 	struct appcontext *con = CONTEXT;
@@ -468,16 +876,19 @@ static void title(reqargs a) {
 static void show_with_tags(reqargs a) {
 	// show records with specific tag
 
+	char *query = arena_alloc(ARENA, QUERY_LEN + sizeof(char));
+	if (query == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	memcpy(query, QUERY, QUERY_LEN);
+	struct form_index form;
+	form_parse(&form, query, QUERY_LEN);
+
 	size_t size = 0;
-	char *find = http_query_finder("tag", QUERY, QUERY_LEN, &size, false);
-	if (find == NULL or size == 0) return notfound(a);
-	char tag[size + sizeof(char)];
-	memcpy(tag, find, size);
-	tag[size] = '\0';
+	char *tag = form_get(&form, "tag", &size);
+	if (tag == NULL or size == 0) return notfound(a);
 	char *tags[2] = {tag, NULL};
 
 	struct blog_record b = {
-		.title = find,
+		.title = tag,
 		.titlelen = size,
 		.datasource = default_show_tags_content,
 		.datasourcelen = default_show_tag_content_len,
@@ -487,6 +898,261 @@ static void show_with_tags(reqargs a) {
 	selector(a, 4, 0, filter, &b, true);
 }
 
+static size_t html_escape(char *dst, const char *src, size_t len) {
+	// dst should have 6 bytes for every byte of src, that's the longest entity
+	char *fly = dst;
+	for (size_t i = 0; i < len; i++) {
+		switch (src[i]) {
+		case '&':  memcpy(fly, "&amp;", strizeof("&amp;"));   fly += strizeof("&amp;");  break;
+		case '<':  memcpy(fly, "&lt;", strizeof("&lt;"));     fly += strizeof("&lt;");   break;
+		case '>':  memcpy(fly, "&gt;", strizeof("&gt;"));     fly += strizeof("&gt;");   break;
+		case '"':  memcpy(fly, "&quot;", strizeof("&quot;")); fly += strizeof("&quot;"); break;
+		case '\'': memcpy(fly, "&#39;", strizeof("&#39;"));   fly += strizeof("&#39;");  break;
+		default:   *fly++ = src[i];
+		}
+	}
+	return (size_t) (fly - dst);
+}
+
+static void search(reqargs a) {
+	// full-text search, "/search?q=words or \"a phrase\"". Records are shown just like on title page, best ones first
+
+	struct appcontext *con = CONTEXT;
+	struct layer_context *l = &con->layer;
+
+	char *query = arena_alloc(ARENA, QUERY_LEN + sizeof(char));
+	if (query == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	memcpy(query, QUERY, QUERY_LEN);
+	struct form_index form;
+	form_parse(&form, query, QUERY_LEN);
+
+	size_t size = 0;
+	char *q = form_get(&form, "q", &size);
+	if (q == NULL) size = 0;
+	if (size > SEARCH_QUERY_MAXLEN) {
+		size = SEARCH_QUERY_MAXLEN;
+		while(size > 0 and (q[size] & 0xc0) == 0x80) size--; // don't cut UTF-8 character
+	}
+
+	struct search_hit hits[HOW_MANY_SEARCH_RESULTS];
+	unsigned amount = HOW_MANY_SEARCH_RESULTS, total = 0;
+	const char *error = NULL;
+	if (size == 0) amount = 0;
+	else if (search_records(q, size, hits, &amount, 0, &total, l, &error) == false) return internal_server_error(a, error);
+
+	struct select s = {.limit = amount, .end_at_vline = true};
+	s.found = arena_alloc(ARENA, sizeof(unsigned long) * HOW_MANY_SEARCH_RESULTS);
+	char *content = arena_alloc(ARENA, strizeof(default_search_form_html_1) + size * 6 + strizeof(default_search_form_html_2) + sizeof("<p>Records found: </p>") + CBL_UINT32_STR_MAX);
+	if (s.found == NULL or content == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	for (unsigned i = 0; i < amount; i++) s.found[i] = hits[i].record;
+
+	size_t len = 0;
+	memcpy(content, default_search_form_html_1, strizeof(default_search_form_html_1));
+	len += strizeof(default_search_form_html_1);
+	len += html_escape(content + len, q, size);
+	memcpy(content + len, default_search_form_html_2, strizeof(default_search_form_html_2));
+	len += strizeof(default_search_form_html_2);
+	if (size > 0) len += (size_t) sprintf(content + len, "<p>Records found: %u</p>", total);
+
+	struct blog_record b = {
+		.title = default_search_title,
+		.titlelen = strizeof(default_search_title),
+		.datasource = content,
+		.datasourcelen = (unsigned) len,
+	};
+	s.mark = arena_mark(ARENA);
+	SET_HTTP_STATUS_AND_HDR(200, default_headers_table);
+	selector_render(a, &s, &b);
+}
+
+static void names_sink(unsigned long record, enum record_name_kind kind, const char *name, size_t len, void *context) {
+	prefix_index_append(context, kind == RECORD_NAME_TITLE ? PREFIX_TITLES : PREFIX_TAGS, name, len, (uint32_t) record);
+}
+
+static void names_fill(struct layer_context *l) {
+	// the first worker after start (or after reload) reads names of all records, others are waiting for it
+	if (prefix_index_begin_fill(app_caches.names) == false) return;
+	prefix_index_end_fill(app_caches.names, record_names(names_sink, app_caches.names, l, NULL));
+}
+
+static void names_add(struct blog_record *b) {
+	if (app_caches.names == NULL) return;
+	prefix_index_title(app_caches.names, (uint32_t) b->chosen_record, b->title, b->titlelen);
+	for (char **tag = b->tags; tag and *tag; tag++) prefix_index_tag(app_caches.names, *tag, strlen(*tag));
+}
+
+static size_t json_escape(char *dst, const char *src, size_t len) {
+	// dst should have 6 bytes for every byte of src, that's "\u001f"
+	char *fly = dst;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) src[i];
+		if (c == '"' or c == '\\') {
+			*fly++ = '\\';
+			*fly++ = (char) c;
+		} else if (c < 0x20) {
+			fly += sprintf(fly, "\\u%04x", c);
+		} else {
+			*fly++ = (char) c;
+		}
+	}
+	return (size_t) (fly - dst);
+}
+
+static void suggest(reqargs a) {
+	// names which are starting with what has been typed: "/suggest?tag=tra" gives [{"tag":"travel","records":3}],
+	// "/suggest?title=des" gives [{"title":"Desert island","href":"/Desert island-3"}]
+
+	struct appcontext *con = CONTEXT;
+	struct layer_context *l = &con->layer;
+
+	char *query = arena_alloc(ARENA, QUERY_LEN + sizeof(char));
+	if (query == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	memcpy(query, QUERY, QUERY_LEN);
+	struct form_index form;
+	form_parse(&form, query, QUERY_LEN);
+
+	size_t size = 0;
+	enum prefix_kind kind = PREFIX_TAGS;
+	char *prefix = form_get(&form, "tag", &size);
+	if (prefix == NULL) {
+		kind = PREFIX_TITLES;
+		prefix = form_get(&form, "title", &size);
+	}
+	if (prefix == NULL or size > NAME_MAX) size = 0;
+
+	struct prefix_match matches[HOW_MANY_SUGGESTIONS];
+	size_t found = 0;
+	char *names = arena_alloc(ARENA, HOW_MANY_SUGGESTIONS * NAME_MAX);
+	char *out = arena_alloc(ARENA, HOW_MANY_SUGGESTIONS * (NAME_MAX * 12 + 64) + strizeof("[]"));
+	if (names == NULL or out == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	if (app_caches.names and size > 0) {
+		names_fill(l);
+		found = prefix_index_find(app_caches.names, kind, prefix, size, matches, HOW_MANY_SUGGESTIONS, names, HOW_MANY_SUGGESTIONS * NAME_MAX);
+	}
+
+	size_t len = 0;
+	out[len++] = '[';
+	for (size_t i = 0; i < found; i++) {
+		if (i > 0) out[len++] = ',';
+		if (kind == PREFIX_TAGS) {
+			len += (size_t) sprintf(out + len, "{\"tag\":\"");
+			len += json_escape(out + len, matches[i].name, matches[i].len);
+			len += (size_t) sprintf(out + len, "\",\"records\":%" PRIu32 "}", matches[i].value);
+		} else {
+			len += (size_t) sprintf(out + len, "{\"title\":\"");
+			len += json_escape(out + len, matches[i].name, matches[i].len);
+			len += (size_t) sprintf(out + len, "\",\"href\":\"/");
+			len += json_escape(out + len, matches[i].name, matches[i].len);
+			len += (size_t) sprintf(out + len, "-%" PRIu32 "\"}", matches[i].value);
+		}
+	}
+	out[len++] = ']';
+
+	const char *headers_table[] = {default_header_content_type_json, default_header_server_type, NULL};
+	SET_HTTP_STATUS_AND_HDR(200, headers_table);
+	APP_WRITE(out, len);
+}
+
+static void months_fill(struct layer_context *l) {
+	// just like names_fill(), storage is read by the first worker which needs it
+	struct month_bucket *months = month_index_begin_fill(app_caches.months);
+	if (months == NULL) return;
+	size_t amount = MONTH_INDEX_MAX;
+	bool filled = archive_months(months, &amount, l, NULL);
+	month_index_end_fill(app_caches.months, amount, filled);
+}
+
+static void months_add(struct blog_record *b) {
+	if (app_caches.months == NULL) return;
+	month_index_add(app_caches.months, b->creation_date.t ? b->creation_date.t : time(NULL), (uint32_t) b->chosen_record);
+}
+
+static void archive(reqargs a) {
+	// "/archive/2024/05" shows records of May 2024, "/archive/2024" of the whole year, newest first, and "?page=2"
+	// is the next HOW_MANY_ARCHIVE_RECORDS of them. Years and months with amounts of their records are taken from
+	// month_index.c, so navigation costs nothing, and records are listed from buckets of these months only
+
+	struct appcontext *con = CONTEXT;
+	struct layer_context *l = &con->layer;
+
+	unsigned year = a.route->params_amount > 0 ? a.route->params[0] : 0;
+	unsigned month = a.route->params_amount > 1 ? a.route->params[1] : 0;
+	if (a.route->params_amount > 0 and (year == 0 or year > 9999)) return notfound(a);
+	if (a.route->params_amount > 1 and (month == 0 or month > 12)) return notfound(a);
+
+	char *query = arena_alloc(ARENA, QUERY_LEN + sizeof(char));
+	if (query == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	memcpy(query, QUERY, QUERY_LEN);
+	struct form_index form;
+	form_parse(&form, query, QUERY_LEN);
+	size_t size = 0;
+	char *pagestr = form_get(&form, "page", &size);
+	unsigned page = 1;
+	if (pagestr and size > 0 and size < 6 and is_str_unsignedint(pagestr)) page = (unsigned) strtoul(pagestr, NULL, 10);
+	if (page == 0) return notfound(a);
+
+	struct month_bucket *months = arena_alloc(ARENA, MONTH_INDEX_MAX * sizeof(struct month_bucket));
+	if (months == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	size_t amount = 0;
+	if (app_caches.months) {
+		months_fill(l);
+		amount = month_index_copy(app_caches.months, 0, 9999, months, MONTH_INDEX_MAX);
+	}
+
+	unsigned total = 0;
+	for (size_t i = 0; i < amount; i++) {
+		if (months[i].year == year and (month == 0 or months[i].month == month)) total += months[i].records;
+	}
+	if (year and (total == 0 or (page - 1) * HOW_MANY_ARCHIVE_RECORDS >= total)) return notfound(a);
+
+	// years are newest first, then months of the chosen year
+	char *content = arena_alloc(ARENA, (amount + 12) * 96 + 256);
+	char *title = arena_alloc(ARENA, sizeof(default_archive_title) + 32);
+	if (content == NULL or title == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	size_t len = (size_t) sprintf(content, "<ul class=\"archive\">");
+	for (size_t i = amount; i > 0; ) {
+		unsigned y = months[i - 1].year, records = 0;
+		for (; i > 0 and months[i - 1].year == y; i--) records += months[i - 1].records;
+		len += (size_t) sprintf(content + len, "<li><a href=\"/archive/%u\">%u</a> (%u)</li>", y, y, records);
+	}
+	len += (size_t) sprintf(content + len, "</ul>");
+	if (year) {
+		len += (size_t) sprintf(content + len, "<ul class=\"archive\">");
+		for (size_t i = amount; i > 0; i--) {
+			if (months[i - 1].year != year) continue;
+			len += (size_t) sprintf(content + len, "<li><a href=\"/archive/%u/%02u\">%s</a> (%" PRIu32 ")</li>",
+			                        year, (unsigned) months[i - 1].month, default_month_names[months[i - 1].month - 1], months[i - 1].records);
+		}
+		len += (size_t) sprintf(content + len, "</ul>");
+	}
+	if (page > 1) len += (size_t) sprintf(content + len, "<a href=\"?page=%u\">Newer</a> ", page - 1);
+	if (page * HOW_MANY_ARCHIVE_RECORDS < total) len += (size_t) sprintf(content + len, "<a href=\"?page=%u\">Older</a>", page + 1);
+
+	size_t titlelen;
+	if (month) titlelen = (size_t) sprintf(title, "%s: %s %u", default_archive_title, default_month_names[month - 1], year);
+	else if (year) titlelen = (size_t) sprintf(title, "%s: %u", default_archive_title, year);
+	else titlelen = (size_t) sprintf(title, "%s", default_archive_title);
+
+	struct blog_record b = {
+		.title = title,
+		.titlelen = titlelen,
+		.datasource = content,
+		.datasourcelen = (unsigned) len,
+	};
+	struct select s = {.limit = 0, .end_at_vline = true};
+	s.found = arena_alloc(ARENA, sizeof(unsigned long) * HOW_MANY_ARCHIVE_RECORDS);
+	if (s.found == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	if (year) {
+		struct list_filter filter = {.from.t = month_start(year, month ? month : 1), .to.t = month_start(year, month ? month + 1 : 13) - 1, .sort = DESC};
+		const char *error = NULL;
+		s.limit = HOW_MANY_ARCHIVE_RECORDS;
+		if (list_records(&s.limit, s.found, (page - 1) * HOW_MANY_ARCHIVE_RECORDS, filter, l, &error) == false) return internal_server_error(a, error);
+	}
+	s.mark = arena_mark(ARENA);
+	SET_HTTP_STATUS_AND_HDR(200, default_headers_table);
+	selector_render(a, &s, &b);
+}
+
 static inline void record_show_tag_processing(reqargs a, int32_t tag, struct blog_record b, struct usr *u) {
 	struct appcontext *con = CONTEXT;
 //	essb *e = &con->templates;
@@ -504,9 +1170,15 @@ static inline void record_show_tag_processing(reqargs a, int32_t tag, struct blo
 		break;
 	case CONTENT_PAGE_PART:
 	{
-		const char *target = b.datasource;
-		size_t size = b.datasourcelen;
-		char *found = util_memmem(target, size, VLINE_HTMLTAG, strizeof(VLINE_HTMLTAG));
+		if (b.streamed) {
+			if (b.display != DISPLAY_BOTH and b.display != DISPLAY_DATASOURCE) break;
+			if (a.io->write_fd and record_by_fd(a, &b)) break;
+			struct vline_filter f = {.a = a};
+			stream_record(&b, DISPLAY_DATASOURCE, vline_filter_write, &f, &con->layer, NULL);
+			vline_filter_finish(&f);
+			break;
+		}
+		char *found = find_vline(&b);
 		if (found) {
 			memset(found, ' ', strizeof(VLINE_HTMLTAG));
 		}
@@ -553,19 +1225,15 @@ static void show_record(reqargs a, uint32_t record) {
 	essb *e = &con->templates;
 	struct layer_context *l = &con->layer;
 
-	struct blog_record b = {
-		.stack = con->freebuffer,
-		.stack_space = CONTEXTAPPBUFFERSIZE - (con->freebuffer - (char *) con)
-	};
-	if (get_record(&b, record, l, NULL) == false) {
+	struct blog_record b = {.arena = ARENA, .streamed = true}; // body goes to client by chunks, whatever size it has
+	if (record_get(&b, record, l) == false) {
 		return notfound(a);
 	}
 
 	char key[KEY_VAL_MAXKEYLEN];
 	struct usr u_anon[1];
 	struct usr *u = NULL;
-	ssize_t size = - ((ssize_t) sizeof(struct usr));
-	if (find_cookie_existence(a, "id", key) != 0 and key_val(key, u_anon, &size, l, NULL) == true and is_user_valid(u_anon) == true) u = u_anon;
+	if (find_cookie_existence(a, "id", key) != 0 and session_get(l, key, u_anon, NULL) == true and is_user_valid(u_anon) == true) u = u_anon;
 
 	for (unsigned i = 0; i < e->records_amount; i++) {
 		if (e->record_size[i] < 0) record_show_tag_processing(a, e->record_size[i], b, u);
@@ -573,6 +1241,78 @@ static void show_record(reqargs a, uint32_t record) {
 	}
 }
 
+// Salt of PBKDF2 is random salt of user followed by salt from config, so users/ directory alone isn't enough
+// to guess passwords. Users of old versions have plain SHA-256 of password, it's checked as it was
+static void password_derive(struct appconfig *config, const struct usr *u, const void *password, size_t password_len, BYTE out[SHA256_BLOCK_SIZE]) {
+	if (u->kdf == KDF_LEGACY_SHA256) {
+		SHA256_CTX ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, password, password_len);
+		sha256_final(&ctx, out);
+		return;
+	}
+
+	char salt[KDF_SALT_SIZE + CRED_HASHING_SALT_SIZE];
+	memcpy(salt, u->kdf_salt, KDF_SALT_SIZE);
+	memcpy(salt + KDF_SALT_SIZE, config->salt, CRED_HASHING_SALT_SIZE);
+	pbkdf2_hmac_sha256(password, password_len, salt, sizeof(salt), u->kdf_iterations, out, SHA256_BLOCK_SIZE);
+}
+
+static uint32_t password_iterations(struct appconfig *config) {
+	return config->kdf_iterations > 0 ? (uint32_t) config->kdf_iterations : (uint32_t) default_kdf_iterations;
+}
+
+void password_hash(struct appconfig *config, struct usr *u, const void *password, size_t password_len) {
+	config->r(u->kdf_salt, sizeof(u->kdf_salt));
+	u->kdf = KDF_PBKDF2_SHA256;
+	u->kdf_iterations = password_iterations(config);
+	BYTE out[SHA256_BLOCK_SIZE];
+	password_derive(config, u, password, password_len, out);
+	memcpy(u->credentials, out, SHA256_BLOCK_SIZE);
+}
+
+bool check_user_password(struct appconfig *config, const struct usr *u, const void *password, size_t password_len) {
+	BYTE out[SHA256_BLOCK_SIZE];
+	password_derive(config, u, password, password_len, out);
+	return kdf_equal(out, u->credentials, SHA256_BLOCK_SIZE);
+}
+
+// Login is checked on hashing pool. If password is right, but user has been hashed with old KDF or other
+// cost, new credentials are made right there, while password is known
+static struct hash_pool app_hash_pool = HASH_POOL_INITIALIZER;
+
+struct login_job {
+	struct appconfig *config;
+	struct usr *u;
+	const char *password;
+	size_t password_len;
+	bool valid;
+	bool rehashed;
+};
+
+static void login_job(void *arg) {
+	struct login_job *j = arg;
+	j->valid = check_user_password(j->config, j->u, j->password, j->password_len);
+	if (j->valid == false) return;
+	if (j->u->kdf == KDF_PBKDF2_SHA256 and j->u->kdf_iterations == password_iterations(j->config)) return;
+	password_hash(j->config, j->u, j->password, j->password_len);
+	j->rehashed = true;
+}
+
+static void too_busy(reqargs a) {
+	const char *headers_table[] = {default_header_content_type, default_header_server_type, "Retry-After: 1", NULL};
+	SET_HTTP_STATUS_AND_HDR(503, headers_table);
+	APP_WRITECS("503 Service Unavailable: too many logins at once, try again");
+}
+
+static void too_many_logins(reqargs a, unsigned long seconds) {
+	char retry[sizeof("Retry-After: ") + CBL_UINT64_STR_MAX];
+	sprintf(retry, "Retry-After: %lu", seconds);
+	const char *headers_table[] = {default_header_content_type, default_header_server_type, retry, NULL};
+	SET_HTTP_STATUS_AND_HDR(429, headers_table);
+	APP_WRITECS("429 Too Many Requests: too many failed logins, try again later");
+}
+
 static bool minimum_passwd_requirements(char *password, size_t passwd_minlen, bool passwd_specialchar) {
 	if (utf8_check(password, strlen(password)) != NULL) return false;
 	size_t passwd_len = 0;
@@ -611,10 +1351,7 @@ bool newuser(reqargs a, char *display_name, char *email, char *password) {
 	memcpy(u.display_name, display_name, name_len); u.display_name[name_len] = '\0';
 
 
-	SHA256_CTX ctx;
-	sha256_init(&ctx);
-	sha256_update(&ctx, (BYTE *) password, password_len);
-	sha256_final(&ctx, (BYTE *) u.credentials);
+	password_hash(config, &u, password, password_len);
 
 	struct user_action action = {.operation = ADD};
 	user_fileno(&u, action, l, NULL);
@@ -668,17 +1405,101 @@ void user_panel(reqargs a, struct usr *u) {
 	}
 }
 
-bool check_user_password(const void *password, size_t password_len, char password_hashed[SHA256_BLOCK_SIZE]) {
-	SHA256_CTX ctx;
-	sha256_init(&ctx);
-	sha256_update(&ctx, password, password_len);
-	BYTE buf[SHA256_BLOCK_SIZE];
-	sha256_final(&ctx, buf);
-	if (memcmp(buf, password_hashed, SHA256_BLOCK_SIZE) == STREQ) return true;
+// Request body is given to form_stream (or multipart_stream) by chunks, so it's never in memory as a whole.
+// Content-Length is checked before anything is read (epoll and fcgi frontends are checking it too, mongoose
+// doesn't), and bytes are counted while reading for those who are sending more than they have said
+#define BODY_CHUNK 16384
 
-	return false;
+enum body_result {BODY_OK, BODY_TOO_LARGE, BODY_NO_MEMORY, BODY_REJECTED};
+
+typedef bool (*body_feed)(void *stream, char *chunk, size_t len);
+
+static enum body_result read_body(reqargs a, body_feed feed, void *stream) {
+	struct appcontext *con = CONTEXT;
+	struct appconfig *config = con->config;
+	size_t limit = config->max_body > 0 ? (size_t) config->max_body : SIZE_MAX;
+
+	size_t hdrlen = 0;
+	const char *hdr = LOCATE_HEADER("Content-Length", &hdrlen);
+	if (hdr) {
+		size_t announced = 0;
+		for (size_t i = 0; i < hdrlen and hdr[i] >= '0' and hdr[i] <= '9'; i++) {
+			if (announced > limit) break;
+			announced = announced * 10 + (size_t) (hdr[i] - '0');
+		}
+		if (announced > limit) return BODY_TOO_LARGE;
+	}
+
+	char *chunk = arena_alloc(ARENA, BODY_CHUNK);
+	if (chunk == NULL) return BODY_NO_MEMORY;
+	size_t got = 0;
+	while(1) {
+		unsigned long amount = BODY_CHUNK;
+		APP_READ(chunk, &amount);
+		if (amount == 0) break;
+		got += amount;
+		if (got > limit) return BODY_TOO_LARGE;
+		if (feed(stream, chunk, amount) == false) return BODY_REJECTED;
+	}
+	return got > 0 ? BODY_OK : BODY_REJECTED;
+}
+
+static bool form_feed(void *stream, char *chunk, size_t len) {
+	return form_stream_feed(stream, chunk, len);
 }
 
+static enum body_result read_form(reqargs a, struct form_stream *s) {
+	enum body_result result = read_body(a, form_feed, s);
+	if (result == BODY_OK and form_stream_finish(s) == false) return BODY_REJECTED;
+	return result;
+}
+
+// Small fields are collected into fixed buffers. The first field with the key wins, like with form_get()
+struct form_collect {
+	const char *key;
+	char *value;
+	size_t space;
+	size_t len;
+	bool found;
+	bool done;
+	bool overflow;
+};
+
+static void form_collect_piece(struct form_collect *c, const char *piece, size_t len, bool last) {
+	if (c->done) return;
+	c->found = true;
+	if (last) {
+		c->done = true;
+		return;
+	}
+	if (len > c->space - c->len) {
+		c->overflow = true;
+		len = c->space - c->len;
+	}
+	memcpy(c->value + c->len, piece, len);
+	c->len += len;
+}
+
+static struct form_collect *form_collect_find(struct form_collect *fields, const char *key, size_t keylen) {
+	for (; fields->key; fields++) {
+		if (strlen(fields->key) == keylen and memcmp(fields->key, key, keylen) == STREQ) return fields;
+	}
+	return NULL;
+}
+
+// Callback for form_stream, context is an array of fields which ends with {.key = NULL}
+static bool form_collect_value(const char *key, size_t keylen, const char *piece, size_t len, bool last, void *context) {
+	struct form_collect *c = form_collect_find(context, key, keylen);
+	if (c) form_collect_piece(c, piece, len, last);
+	return true;
+}
+
+static void payload_too_large(reqargs a) {
+	SET_HTTP_STATUS_AND_HDR(413, default_headers_table);
+	APP_WRITECS("413 Payload Too Large");
+}
+
+#define LOGIN_PASSWORD_MAX 4096
 #define SETCOOKIEID "Set-Cookie: id="
 #define SESSION_KEY "session_"
 #define SMCOL_EXPIRES "; expires=Thu, 01 Jan 1970 00:00:00 GMT"
@@ -714,8 +1535,7 @@ void user_login(reqargs a) {
 		char key[KEY_VAL_MAXKEYLEN];
 		if (find_cookie_existence(a, "id", key) == 0) break;
 
-		ssize_t size = - ((ssize_t) sizeof(logged_in_user));
-		bool ret = key_val(key, &logged_in_user, &size, l, &error);
+		bool ret = session_get(l, key, &logged_in_user, &error);
 		if (ret == false or is_user_legit(l, &logged_in_user) == false) {
 			sprintf(cookie, "Set-Cookie: id=%s%s", key, SMCOL_EXPIRES);
 			headers_table_append(headers_table, cookie);
@@ -749,40 +1569,52 @@ void user_login(reqargs a) {
 		return;
 	}
 
-	size_t freespace = CONTEXTAPPBUFFERSIZE - (con->freebuffer - (char *) con);
-	size_t size = freespace;
-	char *post_data = con->freebuffer;
-	char *nextbuffer = NULL;
-	APP_READ(post_data, &size);
-	if (size > 0) do {
-		post_data[size] = '\0';
-		size = urldecode2(post_data, post_data) - post_data;
-		nextbuffer = post_data + size;
-		struct usr *u = (void *) nextbuffer;
-		freespace -= size;
-		if (freespace < sizeof(struct usr)) return internal_server_error(a, data_layer_error_not_enough_stack_space);
-		size_t namelen;
-		char *name = http_query_finder("name", post_data, size, &namelen, false);
-		if (name == NULL or namelen >= sizeof(u->display_name)) {
+	struct usr *u = arena_alloc(ARENA, sizeof(struct usr));
+	char *password = arena_alloc(ARENA, LOGIN_PASSWORD_MAX);
+	if (u == NULL or password == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	struct form_collect fields[] = {
+		{.key = "name", .value = u->display_name, .space = sizeof(u->display_name) - sizeof(char)},
+		{.key = "password", .value = password, .space = LOGIN_PASSWORD_MAX},
+		{.key = NULL},
+	};
+	struct form_stream form;
+	form_stream_init(&form, form_collect_value, fields);
+	enum body_result body = read_form(a, &form);
+	if (body == BODY_TOO_LARGE) return payload_too_large(a);
+	if (body == BODY_NO_MEMORY) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	if (body == BODY_OK) do {
+		if (fields[0].found == false or fields[0].overflow or fields[1].found == false or fields[1].overflow) {
 			out[TITLE_PAGE_PART] = data_layer_error_invalid_argument;
 			outsizes[TITLE_PAGE_PART] = strizeof(data_layer_error_invalid_argument);
 			break;
 		}
-		size_t passwordlen;
-		char *password = http_query_finder("password", post_data, size, &passwordlen, false);
-		if (password == NULL) {
-			out[TITLE_PAGE_PART] = data_layer_error_invalid_argument;
-			outsizes[TITLE_PAGE_PART] = strizeof(data_layer_error_invalid_argument);
-			break;
+		u->display_name[fields[0].len] = '\0';
+		size_t namelen = fields[0].len;
+		size_t passwordlen = fields[1].len;
+		// name is copied, because user() overwrites u with whatever it has found
+		char name[sizeof(u->display_name)];
+		memcpy(name, u->display_name, namelen);
+		struct login_throttle *throttle = app_caches.logins;
+		if (throttle) {
+			unsigned long wait = login_throttle_check(throttle, name, namelen, CLIENT.ip);
+			if (wait > 0) return too_many_logins(a, wait);
 		}
-		name[namelen] = '\0';
-		password[passwordlen] = '\0';
-		memcpy(u->display_name, name, namelen);
-		u->display_name[namelen] = '\0';
 		struct user_action action = {.operation = SELECT, .filter = BY_NAME};
 		char key[KEY_VAL_MAXKEYLEN] = "\0"SESSION_KEY;
 		ssize_t keyval_size = sizeof(struct usr);
-		if (user(u, action, l, NULL) == false or check_user_password(password, passwordlen, u->credentials) == false or key_val(key, u, &keyval_size, l, NULL) == false) {
+		bool found = user(u, action, l, NULL);
+		struct login_job job = {.config = config, .u = u, .password = password, .password_len = passwordlen};
+		if (found) {
+			unsigned threads = config->hash_threads > 0 ? (unsigned) config->hash_threads : 0;
+			unsigned queue = config->hash_queue > 0 ? (unsigned) config->hash_queue : 0;
+			if (hash_pool_run(&app_hash_pool, threads, queue, login_job, &job) == false) return too_busy(a);
+		}
+		if (throttle and job.valid) login_throttle_succeeded(throttle, name, namelen, CLIENT.ip);
+		if (throttle and job.valid == false) login_throttle_failed(throttle, name, namelen, CLIENT.ip);
+		if (job.rehashed) {
+			user_alter(l, u); // if it fails, user is just rehashed next time
+		}
+		if (job.valid == false or key_val(key, u, &keyval_size, l, NULL) == false) {
 			out[TITLE_PAGE_PART] = data_layer_error_invalid_argument;
 			outsizes[TITLE_PAGE_PART] = strizeof(data_layer_error_invalid_argument);
 			break;
@@ -817,7 +1649,7 @@ void user_logout(reqargs a) {
 	char key[KEY_VAL_MAXKEYLEN];
 	size_t keylen = find_cookie_existence(a, "id", key);
 	if (keylen != 0) {
-		key_val(key, NULL, NULL, l, NULL);
+		session_remove(l, key);
 		sprintf(cookie, "Set-Cookie: id=%s%s", key, SMCOL_EXPIRES);
 		headers_table_append(logout_headers_table, cookie);
 	}
@@ -826,7 +1658,32 @@ void user_logout(reqargs a) {
 	APP_WRITECS("Redirecting: /");
 }
 
-static inline void editor_processing(reqargs a, int32_t tag, struct usr *u, char *error, size_t errorlen) {
+// New record's data goes straight to the draft while body is being read, only title is kept in memory
+struct page_form {
+	struct form_collect title;
+	struct record_draft draft;
+	bool data_done;
+	const char *error;
+	void *layer;
+};
+
+static bool page_form_value(const char *key, size_t keylen, const char *piece, size_t len, bool last, void *context) {
+	struct page_form *p = context;
+	if (keylen == strizeof("title") and memcmp(key, "title", keylen) == STREQ) {
+		form_collect_piece(&p->title, piece, len, last);
+		return true;
+	}
+	if (keylen != strizeof("data") or memcmp(key, "data", keylen) != STREQ or p->data_done) return true;
+
+	if (p->draft.fd < 0 and draft_open(&p->draft, p->layer, &p->error) == false) return false;
+	if (last) {
+		p->data_done = true;
+		return true;
+	}
+	return draft_write(&p->draft, piece, len, p->layer, &p->error);
+}
+
+static inline void editor_processing(reqargs a, int32_t tag, struct usr *u, char *error, size_t errorlen, const char *notice, size_t noticelen) {
 	struct appcontext *con = CONTEXT;
 //	essb *e = &con->templates;
 //	struct layer_context *l = &con->layer;
@@ -847,7 +1704,12 @@ static inline void editor_processing(reqargs a, int32_t tag, struct usr *u, char
 			APP_WRITE(error, errorlen);
 			APP_WRITECS("<br><br>");
 		}
+		if (notice != NULL and noticelen > 0) {
+			APP_WRITE(notice, noticelen);
+			APP_WRITECS("<br><br>");
+		}
 		APP_WRITE(default_add_edit_form_html, strizeof(default_add_edit_form_html));
+		APP_WRITE(default_upload_form_html, strizeof(default_upload_form_html));
 		break;
 	case USER_PAGE_PART:
 		APP_WRITECS(LI_AND_A_PAGE_FULL_STR);
@@ -878,8 +1740,7 @@ void page(reqargs a) {
 		char key[KEY_VAL_MAXKEYLEN];
 		if (find_cookie_existence(a, "id", key) == 0) break;
 
-		ssize_t size = - ((ssize_t) sizeof(logged_in_user));
-		bool ret = key_val(key, &logged_in_user, &size, l, NULL);
+		bool ret = session_get(l, key, &logged_in_user, NULL);
 		if (ret == false or is_user_legit(l, &logged_in_user) == false) {
 			sprintf(cookie, "Set-Cookie: id=%s%s", key, SMCOL_EXPIRES);
 			headers_table_append(headers_table, cookie);
@@ -899,55 +1760,52 @@ void page(reqargs a) {
 		return;
 	}
 
-	size_t freespace = CONTEXTAPPBUFFERSIZE - (con->freebuffer - (char *) con);
-	char *input_data = con->freebuffer;
-
 	if (METHOD == GET) {
+		char *input_data = arena_alloc(ARENA, QUERY_LEN + sizeof(char));
+		if (input_data == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
 		SET_HTTP_STATUS_AND_HDR(200, headers_table);
+		memcpy(input_data, QUERY, QUERY_LEN);
+		struct form_index form;
+		form_parse(&form, input_data, QUERY_LEN);
 		size_t size = 0;
-		char *find = http_query_finder("error", QUERY, QUERY_LEN, &size, false);
-		memcpy(input_data, find, size);
-		input_data[size] = '\0';
-		size = urldecode2(input_data, input_data) - input_data;
+		char *error = form_get(&form, "error", &size);
 
 		for (unsigned i = 0; i < e->records_amount; i++) {
-			if (e->record_size[i] < 0) editor_processing(a, e->record_size[i], &logged_in_user, input_data, size);
+			if (e->record_size[i] < 0) editor_processing(a, e->record_size[i], &logged_in_user, error, size, NULL, 0);
 			else APP_WRITE(&e->records[e->record_seek[i]], e->record_size[i]);
 		}
 
 		return;
 	}
 
-	size_t size = freespace;
-	APP_READ(input_data, &size);
-
-	if (size == 0) {
-		headers_table_append(headers_table, default_header_location_page);
-		SET_HTTP_STATUS_AND_HDR(302, headers_table);
-		APP_WRITECS("Redirecting: /page");
-		return;
+	char title[NAME_MAX + 1];
+	struct page_form form = {
+		.title = {.key = "title", .value = title, .space = sizeof(title)},
+		.draft = {.fd = -1},
+		.layer = l,
+	};
+	struct form_stream stream;
+	form_stream_init(&stream, page_form_value, &form);
+	enum body_result body = read_form(a, &stream);
+	if (body == BODY_TOO_LARGE or body == BODY_NO_MEMORY) {
+		draft_close(&form.draft, l);
+		if (body == BODY_TOO_LARGE) return payload_too_large(a);
+		return internal_server_error(a, data_layer_error_not_enough_stack_space);
 	}
 
-	input_data[size] = '\0';
-	size = urldecode2(input_data, input_data) - input_data;
-	input_data[size] = '\0';
-
-	size_t titlelen;
-	char *title = http_query_finder("title", input_data, size, &titlelen, false);
-
-	size_t datalen;
-	char *data = http_query_finder("data", input_data, size, &datalen, false);
-
-	if (title == NULL or data == NULL) {
+	const char *error = form.error;
+	if (error == NULL and (form.title.found == false or form.data_done == false)) {
+		draft_close(&form.draft, l);
 		headers_table_append(headers_table, default_header_location_page);
 		SET_HTTP_STATUS_AND_HDR(302, headers_table);
 		APP_WRITECS("Redirecting: /page");
 		return;
 	}
 
-	struct blog_record b = {.title = title, .titlelen = titlelen, .data = data, .datalen = datalen, .display = DISPLAY_DATASOURCE};
-	const char *error;
-	bool result = insert_record(&b, l, &error);
+	struct blog_record b = {.title = title, .titlelen = form.title.len, .draft = &form.draft, .datalen = form.draft.len, .display = DISPLAY_DATASOURCE};
+	if (form.title.overflow) error = data_layer_error_invalid_argument;
+	bool result = error == NULL and insert_record(&b, l, &error);
+	draft_close(&form.draft, l);
 	char strhdr[200];
 	if (result == false) {
 		printf("error: %s\n", error);
@@ -958,6 +1816,10 @@ void page(reqargs a) {
 		APP_WRITECS("Redirecting: /page");
 		return;
 	}
+	if (b.unindexed) printf("Record %lu isn't indexed for search: %s\n", b.chosen_record, b.unindexed);
+	if (app_caches.pages) shm_cache_clear(app_caches.pages); // new record is on lists now
+	names_add(&b);
+	months_add(&b);
 
 	snprintf(strhdr, sizeof(strhdr), "Location: /newpage-%lu", b.chosen_record);
 	headers_table_append(headers_table, strhdr);
@@ -965,16 +1827,355 @@ void page(reqargs a) {
 	APP_WRITECS("Redirecting: /newpage...");
 }
 
-//#define IFREQ(page, fun) do{if(REQUEST_LEN==strizeof(page) and memcmp(REQUEST, page, strizeof(page)) == STREQ) return fun(a);}while(0)
+// Uploaded files are written to drafts while body is being read, and they get their names in media/ only
+// when they are complete. Fields without filename are ignored
+#define MEDIA_UPLOAD_FILES 8
+#define MEDIA_URL_PREFIX "/media/"
+
+struct media_upload {
+	void *layer;
+	struct record_draft draft;
+	bool in_file;
+	unsigned amount;
+	char names[MEDIA_UPLOAD_FILES][NAME_MAX + 1];
+	const char *error;
+};
+
+static bool media_upload_value(const struct multipart_part *part, const char *piece, size_t len, bool last, void *context) {
+	struct media_upload *u = context;
+	if (piece == NULL and last == false) { // part begins
+		u->in_file = part->filenamelen > 0;
+		if (u->in_file == false) return true;
+		if (u->amount == MEDIA_UPLOAD_FILES) {
+			u->error = data_layer_error_invalid_argument;
+			return false;
+		}
+		u->draft = (struct record_draft) {.fd = -1, .media = true};
+		return draft_open(&u->draft, u->layer, &u->error);
+	}
+	if (u->in_file == false) return true;
+	if (last == false) return draft_write(&u->draft, piece, len, u->layer, &u->error);
+
+	u->in_file = false;
+	return publish_media(&u->draft, part->filename, part->filenamelen, u->names[u->amount++], u->layer, &u->error);
+}
+
+static bool multipart_feed(void *stream, char *chunk, size_t len) {
+	return multipart_stream_feed(stream, chunk, len);
+}
+
+void media_upload(reqargs a) {
+	struct appcontext *con = CONTEXT;
+	essb *e = &con->templates;
+	struct layer_context *l = &con->layer;
+
+	const char *headers_table[] = {default_header_nocache_1, default_header_nocache_2, default_header_nocache_3,
+                                   default_header_content_type, default_header_server_type, NULL, NULL};
+
+	struct usr logged_in_user;
+	char key[KEY_VAL_MAXKEYLEN];
+	if (find_cookie_existence(a, "id", key) == 0 or session_get(l, key, &logged_in_user, NULL) == false or is_user_legit(l, &logged_in_user) == false) {
+		headers_table_append(headers_table, default_header_location_user);
+		SET_HTTP_STATUS_AND_HDR(302, headers_table);
+		APP_WRITECS("Redirecting: /user");
+		return;
+	}
+
+	size_t typelen = 0;
+	const char *type = LOCATE_HEADER("Content-Type", &typelen);
+	struct media_upload *u = arena_alloc(ARENA, sizeof(struct media_upload));
+	struct multipart_stream *m = arena_alloc(ARENA, sizeof(struct multipart_stream));
+	if (u == NULL or m == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	*u = (struct media_upload) {.layer = l, .draft = {.fd = -1}};
+	if (type == NULL or typelen < strizeof("multipart/form-data") or memcmp(type, "multipart/form-data", strizeof("multipart/form-data")) != STREQ or
+	    multipart_stream_init(m, type, typelen, media_upload_value, u) == false) {
+		SET_HTTP_STATUS_AND_HDR(400, default_headers_table);
+		APP_WRITECS("400 Bad Request");
+		return;
+	}
+
+	enum body_result body = read_body(a, multipart_feed, m);
+	draft_close(&u->draft, l); // if the last file wasn't complete
+	if (body == BODY_TOO_LARGE) return payload_too_large(a);
+	if (body == BODY_NO_MEMORY) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	if (body == BODY_OK and multipart_stream_finish(m) == false and u->error == NULL) u->error = data_layer_error_invalid_argument;
+	if (u->error != NULL or u->amount == 0) {
+		// upload is all or nothing, files which have been published already are taken back
+		const char *removeerror;
+		for (unsigned i = 0; i < u->amount; i++) remove_media(u->names[i], strlen(u->names[i]), l, &removeerror);
+		char strhdr[200];
+		snprintf(strhdr, sizeof(strhdr), "Location: /page?error=%s", u->error ? u->error : data_layer_error_invalid_argument);
+		headers_table_append(headers_table, strhdr);
+		SET_HTTP_STATUS_AND_HDR(302, headers_table);
+		APP_WRITECS("Redirecting: /page");
+		return;
+	}
+
+	// markdown which refers to uploaded files is shown above the editor
+#define MEDIA_NOTICE_PREFIX "Uploaded: "
+#define MEDIA_NOTICE_ITEM_PREFIX "<br><code>![](" MEDIA_URL_PREFIX
+#define MEDIA_NOTICE_ITEM_SUFFIX ")</code>"
+	char *notice = arena_alloc(ARENA, strizeof(MEDIA_NOTICE_PREFIX) + u->amount * (strizeof(MEDIA_NOTICE_ITEM_PREFIX) + NAME_MAX + strizeof(MEDIA_NOTICE_ITEM_SUFFIX)));
+	char *location = arena_alloc(ARENA, strizeof("Location: " MEDIA_URL_PREFIX) + NAME_MAX + sizeof(char));
+	if (notice == NULL or location == NULL) return internal_server_error(a, data_layer_error_not_enough_stack_space);
+	size_t noticelen = (size_t) sprintf(notice, MEDIA_NOTICE_PREFIX);
+	for (unsigned i = 0; i < u->amount; i++) {
+		noticelen += (size_t) sprintf(notice + noticelen, MEDIA_NOTICE_ITEM_PREFIX "%s" MEDIA_NOTICE_ITEM_SUFFIX, u->names[i]);
+	}
+	sprintf(location, "Location: " MEDIA_URL_PREFIX "%s", u->names[0]);
+	headers_table_append(headers_table, location);
+	SET_HTTP_STATUS_AND_HDR(201, headers_table);
+
+	for (unsigned i = 0; i < e->records_amount; i++) {
+		if (e->record_size[i] < 0) editor_processing(a, e->record_size[i], &logged_in_user, NULL, 0, notice, noticelen);
+		else APP_WRITE(&e->records[e->record_seek[i]], e->record_size[i]);
+	}
+}
+
+static const struct media_type {
+	const char *extension;
+	const char *header;
+} media_types[] = {
+	{".jpg",  "Content-Type: image/jpeg"},
+	{".jpeg", "Content-Type: image/jpeg"},
+	{".png",  "Content-Type: image/png"},
+	{".gif",  "Content-Type: image/gif"},
+	{".webp", "Content-Type: image/webp"},
+	{".svg",  "Content-Type: image/svg+xml"},
+	{".pdf",  "Content-Type: application/pdf"},
+	{".txt",  "Content-Type: text/plain;charset=utf-8"},
+	{".mp3",  "Content-Type: audio/mpeg"},
+	{".mp4",  "Content-Type: video/mp4"},
+	{".webm", "Content-Type: video/webm"},
+};
+
+struct media_sink {
+	reqargs *a;
+	const char **headers;
+	bool started;
+};
+
+static void media_sink_write(const void *ptr, unsigned long len, void *context) {
+	struct media_sink *s = context;
+	reqargs a = *s->a;
+	if (s->started == false) SET_HTTP_STATUS_AND_HDR(200, s->headers);
+	s->started = true;
+	APP_WRITE(ptr, len);
+}
+
+// Names of media files are never reused, so they are cached forever. Sandbox doesn't let uploaded
+// svg or html run scripts on our origin
+static void media(reqargs a) {
+	struct appcontext *con = CONTEXT;
+	struct layer_context *l = &con->layer;
+
+	const char *headers_table[] = {"Content-Type: application/octet-stream", "Cache-Control: public, max-age=31536000, immutable",
+                                   "Content-Security-Policy: sandbox", "X-Content-Type-Options: nosniff", default_header_server_type, NULL};
+	const char *dot = NULL;
+	for (size_t i = 0; i < a.route->sluglen; i++) if (a.route->slug[i] == '.') dot = a.route->slug + i;
+	for (unsigned i = 0; dot and i < sizeof(media_types) / sizeof(media_types[0]); i++) {
+		size_t extlen = (size_t) (a.route->slug + a.route->sluglen - dot);
+		if (strlen(media_types[i].extension) == extlen and memcmp(media_types[i].extension, dot, extlen) == STREQ) headers_table[0] = media_types[i].header;
+	}
+
+	const char *error;
+	int fd;
+	unsigned long size;
+	if (a.io->write_fd and media_file(a.route->slug, a.route->sluglen, &fd, &size, l, &error) == true) {
+		SET_HTTP_STATUS_AND_HDR(200, headers_table);
+		app_write_fd(a, fd, 0, size);
+		close(fd);
+		return;
+	}
+	if (a.io->write_fd and error == data_layer_error_item_not_found) return notfound(a);
+
+	struct media_sink s = {.a = &a, .headers = headers_table};
+	bool result = stream_media(a.route->slug, a.route->sluglen, media_sink_write, &s, l, &error);
+	if (s.started) return; // nothing can be done if it has failed in the middle
+	if (result == true) {
+		SET_HTTP_STATUS_AND_HDR(200, headers_table);
+		return;
+	}
+	if (error == data_layer_error_item_not_found) return notfound(a);
+	internal_server_error(a, error);
+}
+
+static void record(reqargs a) {
+	show_record(a, a.route->params[0]);
+}
+
+static void login_required(reqargs a) {
+	const char *headers_table[] = {default_header_nocache_1, default_header_nocache_2, default_header_nocache_3,
+	                               default_header_content_type, default_header_server_type, default_header_location_user, NULL};
+	SET_HTTP_STATUS_AND_HDR(302, headers_table);
+	APP_WRITECS("Redirecting: /user");
+}
+
+#define ROUTE_CACHEABLE (1u << 0) // page is the same for every anonymous visitor
+#define ROUTE_AUTH      (1u << 1) // session cookie is required, otherwise visitor is redirected to /user
+#define HTTP_METHOD(m) (1u << (m))
+
+static void method_not_allowed(reqargs a, unsigned allowed) {
+	// path is known, method isn't. Methods of the path are listed in "Allow:"
+	static const char *const names[] = {[POST] = "POST", [GET] = "GET", [PUT] = "PUT", [PATCH] = "PATCH", [DELETE] = "DELETE"};
+	char allow[sizeof("Allow: POST, GET, PUT, PATCH, DELETE")] = "Allow:";
+	for (http_methods m = POST; m < UNKNOWN; m++) {
+		if ((allowed & HTTP_METHOD(m)) == 0) continue;
+		strcat(allow, allow[strizeof("Allow:")] ? ", " : " ");
+		strcat(allow, names[m]);
+	}
+	const char *headers_table[] = {default_header_content_type, default_header_server_type, allow, NULL};
+	SET_HTTP_STATUS_AND_HDR(405, headers_table);
+	APP_WRITECS("405 Method Not Allowed");
+}
+
+static const struct app_route {
+	const char *pattern;
+	unsigned methods;
+	unsigned flags;
+	void (*handler)(reqargs);
+} app_routes[] = {
+	{"/",                  HTTP_METHOD(GET),                     ROUTE_CACHEABLE, title},
+	{"/tags",              HTTP_METHOD(GET),                     ROUTE_CACHEABLE, show_with_tags},
+	{"/search",            HTTP_METHOD(GET),                     0,               search}, // any query would push real pages out of cache
+	{"/suggest",           HTTP_METHOD(GET),                     0,               suggest},
+	{"/archive",           HTTP_METHOD(GET),                     ROUTE_CACHEABLE, archive},
+	{"/archive/{id}",      HTTP_METHOD(GET),                     ROUTE_CACHEABLE, archive}, // year
+	{"/archive/{id}/{id}", HTTP_METHOD(GET),                     ROUTE_CACHEABLE, archive}, // year and month
+	{"/user",              HTTP_METHOD(GET) | HTTP_METHOD(POST), 0,               user_login},
+	{"/page",              HTTP_METHOD(GET) | HTTP_METHOD(POST), ROUTE_AUTH,      page},
+	{"/logout",            HTTP_METHOD(GET) | HTTP_METHOD(POST), 0,               user_logout},
+	{"/media",             HTTP_METHOD(POST),                    ROUTE_AUTH,      media_upload},
+	{"/media/{name}",      HTTP_METHOD(GET),                     0,               media},
+	{"/{slug-id}",         HTTP_METHOD(GET),                     ROUTE_CACHEABLE, record}, // "/Record title-42"
+};
+
+static bool compile_routes(struct router *r, const char **error) {
+	for (unsigned i = 0; i < sizeof(app_routes) / sizeof(app_routes[0]); i++) {
+		if (router_add(r, app_routes[i].pattern, app_routes[i].methods, i, error) == false) return false;
+	}
+	return true;
+}
+
+// Response of ROUTE_CACHEABLE route is written both to frontend and here. It's stored as status code,
+// '\0'-terminated headers, empty string and body.
+struct page_capture {
+	const struct reqio *io;
+	void *servercontext1;
+	bool headers_done;
+	bool overflow;
+	unsigned short status;
+	size_t len;
+	char *buffer; // APP_CACHE_PAGE_SLOT bytes from arena, it's too big for stack
+};
+
+static void page_capture_append(struct page_capture *p, const void *data, size_t len) {
+	if (p->overflow or len > APP_CACHE_PAGE_SLOT - p->len) {
+		p->overflow = true;
+		return;
+	}
+	memcpy(p->buffer + p->len, data, len);
+	p->len += len;
+}
+
+static void page_capture_status(unsigned short code, const char * const *headers, void *context) {
+	struct page_capture *p = context;
+	p->io->set_http_status_and_hdr(code, headers, p->servercontext1);
+	if (p->headers_done) return;
+	p->headers_done = true;
+	p->status = code;
+	page_capture_append(p, &code, sizeof(code));
+	for (unsigned i = 0; headers and headers[i]; i++) {
+		if (i == APP_CACHE_PAGE_HEADERS) p->overflow = true;
+		page_capture_append(p, headers[i], strlen(headers[i]) + sizeof(char));
+	}
+	page_capture_append(p, "", sizeof(char));
+}
+
+static void page_capture_write(const void *data, unsigned long len, void *context) {
+	struct page_capture *p = context;
+	if (p->headers_done == false) page_capture_status(200, NULL, context); // that's what frontends do
+	p->io->write(data, len, p->servercontext1);
+	page_capture_append(p, data, len);
+}
+
+static void page_capture_flush(void *context) {
+	struct page_capture *p = context;
+	if (p->io->flush) p->io->flush(p->servercontext1);
+}
+
+// Part of file which fits is written as usual, so it's captured too. Bigger one isn't cached anyway
+static bool page_capture_write_fd(int fd, unsigned long offset, unsigned long len, void *context) {
+	struct page_capture *p = context;
+	if (p->overflow == false and len <= APP_CACHE_PAGE_SLOT - p->len) return false;
+	if (p->headers_done == false) page_capture_status(200, NULL, context);
+	p->overflow = true;
+	return p->io->write_fd(fd, offset, len, p->servercontext1);
+}
+
+static bool page_from_cache(reqargs a, const char *key, size_t keylen, char *buffer) {
+	size_t len = APP_CACHE_PAGE_SLOT;
+	if (shm_cache_get(app_caches.pages, key, keylen, buffer, &len) == false) return false;
+
+	unsigned short code;
+	memcpy(&code, buffer, sizeof(code));
+	const char *headers[APP_CACHE_PAGE_HEADERS + 1];
+	unsigned amount = 0;
+	char *fly = buffer + sizeof(code);
+	while(*fly != '\0') {
+		headers[amount++] = fly;
+		fly += strlen(fly) + sizeof(char);
+	}
+	headers[amount] = NULL;
+	fly++;
+
+	SET_HTTP_STATUS_AND_HDR(code, headers);
+	APP_WRITE(fly, len - (size_t) (fly - buffer));
+	return true;
+}
+
+static void cached_page(reqargs a, const struct app_route *route) {
+	char key[APP_CACHE_PAGE_KEYMAX];
+	if (REQUEST_LEN + QUERY_LEN + sizeof(char) > sizeof(key)) return route->handler(a);
+	memcpy(key, REQUEST, REQUEST_LEN);
+	key[REQUEST_LEN] = '?';
+	if (QUERY_LEN) memcpy(key + REQUEST_LEN + sizeof(char), QUERY, QUERY_LEN);
+	size_t keylen = REQUEST_LEN + sizeof(char) + QUERY_LEN;
+
+	struct page_capture p = {.io = a.io, .servercontext1 = a.servercontext1, .buffer = arena_alloc(ARENA, APP_CACHE_PAGE_SLOT)};
+	if (p.buffer == NULL) return route->handler(a);
+	if (page_from_cache(a, key, keylen, p.buffer)) return;
+
+	const struct reqio io = {page_capture_write, a.io->read, page_capture_status, a.io->locate_header, page_capture_flush,
+	                         a.io->write_fd ? page_capture_write_fd : NULL};
+	reqargs captured = a;
+	captured.io = &io;
+	captured.servercontext1 = &p;
+	route->handler(captured);
+	if (p.overflow == false and p.status == 200) shm_cache_put(app_caches.pages, key, keylen, p.buffer, p.len);
+}
 
 void app_request(reqargs a) {
-	if ((METHOD != GET and METHOD != POST) or REQUEST_LEN == 0 or REQUEST[0] != '/') return notfound(a);
-	if (REQUEST_LEN == 1 and REQUEST[0] == '/') return title(a);
-	if (REQUEST_LEN == strizeof("/tags") and memcmp(REQUEST, "/tags", strizeof("/tags")) == STREQ) return show_with_tags(a);
-	if (REQUEST_LEN == strizeof("/user") and memcmp(REQUEST, "/user", strizeof("/user")) == STREQ) return user_login(a);
-	if (REQUEST_LEN == strizeof("/page") and memcmp(REQUEST, "/page", strizeof("/page")) == STREQ) return page(a);
-	if (REQUEST_LEN == strizeof("/logout") and memcmp(REQUEST, "/logout", strizeof("/logout")) == STREQ) return user_logout(a);
-	return show_record(a, get_u32_from_end_of_string(REQUEST, REQUEST_LEN));
+	struct appcontext *con = CONTEXT;
+	arena_limit(ARENA, con->config->arena_max > 0 ? (size_t) con->config->arena_max : SIZE_MAX,
+	            con->config->arena_initial > 0 ? (size_t) con->config->arena_initial : 0);
+	struct route_match m;
+	enum router_result found = router_match(&con->routes, REQUEST, REQUEST_LEN, HTTP_METHOD(METHOD), &m);
+	if (found == ROUTE_METHOD_NOT_ALLOWED) return method_not_allowed(a, m.allowed);
+	if (found != ROUTE_FOUND) return notfound(a);
+
+	const struct app_route *route = &app_routes[m.index];
+	if (route->flags & ROUTE_AUTH) {
+		char key[KEY_VAL_MAXKEYLEN];
+		if (find_cookie_existence(a, "id", key) == 0) return login_required(a);
+	}
+
+	a.route = &m;
+	if (route->flags & ROUTE_CACHEABLE and app_caches.pages) {
+		char key[KEY_VAL_MAXKEYLEN];
+		if (find_cookie_existence(a, "id", key) == 0) return cached_page(a, route);
+	}
+	route->handler(a);
 }
 
 #endif // GUARD_APP_C
@@ -0,0 +1,169 @@
+#ifndef GUARD_ARENA_C
+#define GUARD_ARENA_C
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "util.c"
+
+// Every worker has an arena for things which live until the end of request: records, tags, POST bodies.
+// Allocation is just a bump of pointer in current chunk. If it doesn't fit, next chunk is allocated (twice
+// bigger than current one, or as big as needed), until all chunks together reach the cap. After request the
+// arena is reset and only the first chunk is kept, so one huge post doesn't keep memory forever and small
+// boxes are using small first chunk only. Size of the first chunk is "arena_initial" of config, it's applied
+// when arena is reset.
+
+#ifndef ARENA_ALIGN
+#define ARENA_ALIGN 16
+#endif
+
+#ifndef ARENA_INITIAL
+#define ARENA_INITIAL 16384 // until config says otherwise
+#endif
+
+struct arena_chunk {
+	struct arena_chunk *prev;
+	size_t size;
+	size_t used;
+	size_t before; // bytes used in previous chunks when this one has been made
+};
+
+#define ARENA_HEADER ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+#define ARENA_DATA(c) ((char *) (c) + ARENA_HEADER)
+
+struct arena {
+	struct arena_chunk *current;
+	size_t cap; // all chunks together
+	size_t initial; // size of the first chunk
+	size_t allocated;
+	bool grew; // during this request
+
+	// statistics
+	size_t high_water; // the most bytes that one request has used
+	unsigned long requests;
+	unsigned long grown; // requests which didn't fit into first chunk
+	unsigned long failed; // allocations which have hit the cap
+};
+
+struct arena_mark {
+	struct arena_chunk *chunk;
+	size_t used;
+};
+
+static struct arena_chunk *arena_grow(struct arena *a, size_t need) {
+	size_t size = a->current ? a->current->size * 2 : a->initial;
+	if (size < need) size = need;
+	if (a->current and a->allocated + size > a->cap) {
+		size = a->cap > a->allocated ? a->cap - a->allocated : 0;
+		if (size < need) {
+			a->failed++;
+			return NULL;
+		}
+	}
+
+	struct arena_chunk *c = malloc(ARENA_HEADER + size);
+	if (c == NULL) return NULL;
+	*c = (struct arena_chunk) {.prev = a->current, .size = size, .before = a->current ? a->current->before + a->current->used : 0};
+	if (a->current) a->grew = true;
+	a->current = c;
+	a->allocated += size;
+	return c;
+}
+
+// Called by worker itself, after it has been pinned to CPU (see affinity.c)
+bool arena_init(struct arena *a, size_t cap) {
+	*a = (struct arena) {.cap = cap, .initial = ARENA_INITIAL};
+	return arena_grow(a, 0) != NULL;
+}
+
+void arena_free(struct arena *a) {
+	while(a->current) {
+		struct arena_chunk *prev = a->current->prev;
+		free(a->current);
+		a->current = prev;
+	}
+	a->allocated = 0;
+}
+
+// Cap might be changed between requests, allocated chunks are left as is. First chunk gets new size (0 is
+// ARENA_INITIAL) when arena is reset
+void arena_limit(struct arena *a, size_t cap, size_t initial) {
+	a->cap = cap;
+	a->initial = initial > 0 ? initial : ARENA_INITIAL;
+	if (a->initial > cap) a->initial = cap;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+	struct arena_chunk *c = a->current;
+	size_t pad = (ARENA_ALIGN - c->used % ARENA_ALIGN) % ARENA_ALIGN;
+	if (c->size - c->used < pad + size) {
+		c = arena_grow(a, size);
+		if (c == NULL) return NULL;
+		pad = 0;
+	}
+	void *ptr = ARENA_DATA(c) + c->used + pad;
+	c->used += pad + size;
+	return ptr;
+}
+
+// For those who don't know how much they will write (like get_record() with blog_record->stack): gives
+// whole free space of current chunk, but not less than need bytes. Unused end should be given back
+void *arena_lend(struct arena *a, size_t need, size_t *space) {
+	void *ptr = arena_alloc(a, need);
+	if (ptr == NULL) return NULL;
+	struct arena_chunk *c = a->current;
+	*space = need + c->size - c->used;
+	c->used = c->size;
+	return ptr;
+}
+
+// Only the end of current chunk can be given back, otherwise it's just wasted until reset
+void arena_giveback(struct arena *a, void *ptr, size_t len) {
+	struct arena_chunk *c = a->current;
+	if ((char *) ptr + len != ARENA_DATA(c) + c->size or len > c->used) return;
+	c->used -= len;
+}
+
+struct arena_mark arena_mark(struct arena *a) {
+	return (struct arena_mark) {.chunk = a->current, .used = a->current->used};
+}
+
+// Frees everything that was allocated after mark
+void arena_rewind(struct arena *a, struct arena_mark m) {
+	size_t usage = a->current->before + a->current->used;
+	if (usage > a->high_water) a->high_water = usage;
+
+	while(a->current != m.chunk) {
+		struct arena_chunk *prev = a->current->prev;
+		a->allocated -= a->current->size;
+		free(a->current);
+		a->current = prev;
+	}
+	a->current->used = m.used;
+}
+
+// After every request
+void arena_reset(struct arena *a) {
+	struct arena_chunk *first = a->current;
+	while(first->prev) first = first->prev;
+	arena_rewind(a, (struct arena_mark) {.chunk = first, .used = 0});
+	if (first->size != a->initial) {
+		struct arena_chunk *c = malloc(ARENA_HEADER + a->initial);
+		if (c) { // otherwise the old one is kept
+			*c = (struct arena_chunk) {.size = a->initial};
+			free(first);
+			a->current = c;
+			a->allocated = a->initial;
+		}
+	}
+	a->requests++;
+	if (a->grew) a->grown++;
+	a->grew = false;
+}
+
+void arena_print_stats(struct arena *a, unsigned worker) {
+	printf("Worker %u: %lu requests, high water %zu bytes, %lu requests didn't fit into %zu bytes, %lu allocations have hit the limit of %zu bytes\n",
+	       worker, a->requests, a->high_water, a->grown, a->initial, a->failed, a->cap);
+}
+
+#endif // GUARD_ARENA_C
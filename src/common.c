@@ -1,3 +1,6 @@
+#ifndef GUARD_COMMON_C
+#define GUARD_COMMON_C
+
 const char config_parser_error[] = "Invalid config file";
 const char config_parser_fcreated[] = "File with default config has been created";
 
@@ -15,6 +18,23 @@ void set_config_defaults(struct appconfig *conf) {
 	memcpy(conf->salt, DEFAULT_CRED_HASHING_SALT, CRED_HASHING_SALT_SIZE);
 	conf->minimum_passwd_len = DEFAULT_MINIMUM_PASSWORD_LEN;
 	conf->passwd_specialchars = default_password_specialchars_needed;
+	conf->workers = default_workers;
+	conf->http_port = default_http_port;
+	conf->prefork = default_prefork;
+	conf->cpu_affinity = default_cpu_affinity;
+	conf->arena_max = default_arena_max;
+	conf->arena_initial = default_arena_initial;
+	conf->max_body = default_max_body;
+	conf->kdf_iterations = default_kdf_iterations;
+	conf->hash_threads = default_hash_threads;
+	conf->hash_queue = default_hash_queue;
+}
+
+unsigned config_workers(struct appconfig *conf) {
+	if (conf->workers > 0) return (unsigned) conf->workers;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) return 1;
+	return (unsigned) cpus;
 }
 
 #define CONFIG_HEADER "CBLOG1:"
@@ -24,6 +44,16 @@ void set_config_defaults(struct appconfig *conf) {
 #define CONFIG_DATALAYER_ADDR "datalayer_addr: "
 #define CONFIG_TITLE_PAGE_NAME "title_page_name: "
 #define CONFIG_TITLE_PAGE_CONTENT "title_page_content: "
+#define CONFIG_WORKERS "workers: "
+#define CONFIG_HTTP_PORT "http_port: "
+#define CONFIG_PREFORK "prefork: "
+#define CONFIG_CPU_AFFINITY "cpu_affinity: "
+#define CONFIG_ARENA_MAX "arena_max: "
+#define CONFIG_ARENA_INITIAL "arena_initial: "
+#define CONFIG_MAX_BODY "max_body: "
+#define CONFIG_KDF_ITERATIONS "kdf_iterations: "
+#define CONFIG_HASH_THREADS "hash_threads: "
+#define CONFIG_HASH_QUEUE "hash_queue: "
 bool if_empty_flush_default_config(int fd) {
 	char a;
 	ssize_t got = read(fd, &a, sizeof(char));
@@ -37,21 +67,42 @@ bool if_empty_flush_default_config(int fd) {
 				CONFIG_DATALAYER_TYPE"%s\n"
 				CONFIG_DATALAYER_ADDR"%s\n"
 				CONFIG_TITLE_PAGE_NAME"%s\n"
-				CONFIG_TITLE_PAGE_CONTENT"%s\n",
+				CONFIG_TITLE_PAGE_CONTENT"%s\n"
+				CONFIG_WORKERS"%d\n"
+				CONFIG_HTTP_PORT"%d\n"
+				CONFIG_PREFORK"%d\n"
+				CONFIG_CPU_AFFINITY"%s\n"
+				CONFIG_ARENA_MAX"%d\n"
+				CONFIG_ARENA_INITIAL"%d\n"
+				CONFIG_MAX_BODY"%d\n"
+				CONFIG_KDF_ITERATIONS"%d\n"
+				CONFIG_HASH_THREADS"%d\n"
+				CONFIG_HASH_QUEUE"%d\n",
 				default_appname,
 				default_template_name,
 layer_engine_to_str(default_datalayer_type),
 				default_datalayer_addr,
 				default_title_page_name,
-				default_title_content);
+				default_title_content,
+				default_workers,
+				default_http_port,
+				default_prefork,
+				default_cpu_affinity,
+				default_arena_max,
+				default_arena_initial,
+				default_max_body,
+				default_kdf_iterations,
+				default_hash_threads,
+				default_hash_queue);
 
 	return true;
 }
 
 bool config_int32t(char *conf, int32_t *value) {
 	char *invalid = NULL;
+	errno = 0;
 	long int val = strtol(conf, &invalid, 10);
-	if (invalid != NULL) return false;
+	if (invalid == conf or *invalid != '\0' or errno or val < INT32_MIN or val > INT32_MAX) return false;
 	*value = (int32_t) val;
 	return true;
 }
@@ -59,7 +110,7 @@ bool config_int32t(char *conf, int32_t *value) {
 #define CONFIG_TEST(TEST, FIELD, LEN) do {if (strpartcmp(str, TEST) == STREQ) {str += strlen(TEST);if (*str != '\0' and *str != '\n') {conf->FIELD = str;conf->LEN = strlen(str);} return true;}} while(0)
 #define CONFIG_TEST_WOLEN(TEST, FIELD) do {if (strpartcmp(str, TEST) == STREQ) {str += strlen(TEST);if (*str != '\0' and *str != '\n') {conf->FIELD = str;} return true;}} while(0)
 #define CONFIG_TEST_OBJ(TEST, OBJ) do {if (strpartcmp(str, TEST) == STREQ) {str += strlen(TEST);if (*str != '\0' and *str != '\n') {OBJ = str;} return true;}} while(0)
-#define CONFIG_TEST_INT32_T(TEST, FIELD) do {if (strpartcmp(str, TEST) == STREQ) {str += strlen(TEST);if (*str != '\0' and *str != '\n') return config_int32t(str, conf->FIELD);}} while(0)
+#define CONFIG_TEST_INT32_T(TEST, FIELD) do {if (strpartcmp(str, TEST) == STREQ) {str += strlen(TEST);if (*str != '\0' and *str != '\n') return config_int32t(str, &conf->FIELD);}} while(0)
 
 bool config_record(struct appconfig *conf, char *str) {
 	CONFIG_TEST(CONFIG_APPNAME, appname, appnamelen);
@@ -70,6 +121,16 @@ bool config_record(struct appconfig *conf, char *str) {
 	CONFIG_TEST_WOLEN(CONFIG_DATALAYER_ADDR, datalayer_addr);
 	CONFIG_TEST(CONFIG_TITLE_PAGE_NAME, title_page_name, title_page_name_len);
 	CONFIG_TEST(CONFIG_TITLE_PAGE_CONTENT, title_page_content, title_page_content_len);
+	CONFIG_TEST_INT32_T(CONFIG_WORKERS, workers);
+	CONFIG_TEST_INT32_T(CONFIG_HTTP_PORT, http_port);
+	CONFIG_TEST_INT32_T(CONFIG_PREFORK, prefork);
+	CONFIG_TEST_WOLEN(CONFIG_CPU_AFFINITY, cpu_affinity);
+	CONFIG_TEST_INT32_T(CONFIG_ARENA_MAX, arena_max);
+	CONFIG_TEST_INT32_T(CONFIG_ARENA_INITIAL, arena_initial);
+	CONFIG_TEST_INT32_T(CONFIG_MAX_BODY, max_body);
+	CONFIG_TEST_INT32_T(CONFIG_KDF_ITERATIONS, kdf_iterations);
+	CONFIG_TEST_INT32_T(CONFIG_HASH_THREADS, hash_threads);
+	CONFIG_TEST_INT32_T(CONFIG_HASH_QUEUE, hash_queue);
 
 	return false;
 }
@@ -120,3 +181,5 @@ void parse_config_erase(struct appconfig *conf) {
 	if (conf->context == NULL) return;
 	munmap(conf->context, conf->contextsize);
 }
+
+#endif // GUARD_COMMON_C
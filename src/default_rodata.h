@@ -2,6 +2,10 @@
 #define CBLOG_DEFAULT_RODATA_H
 
 #define HOW_MANY_RECORDS_U_WANT_TO_SEE_ON_TITLEPAGE 4
+#define HOW_MANY_SEARCH_RESULTS 10
+#define SEARCH_QUERY_MAXLEN 256
+#define HOW_MANY_SUGGESTIONS 10
+#define HOW_MANY_ARCHIVE_RECORDS 10
 #define DEFAULT_MINIMUM_PASSWORD_LEN 7
 
 #define DEFAULT_CRED_HASHING_SALT "change_this_salt"
@@ -21,12 +25,29 @@ const char default_title_content[] = ""
 size_t default_title_content_len = strizeof(default_title_content);
 const char default_show_tags_content[] = "Displaying blog by tag";
 size_t default_show_tag_content_len = strizeof(default_show_tags_content);
+const char default_search_title[] = "Search";
+const char default_archive_title[] = "Archive";
+const char *const default_month_names[] = {"January", "February", "March", "April", "May", "June", "July",
+                                           "August", "September", "October", "November", "December"};
 const bool default_password_specialchars_needed = false;
+const int32_t default_workers = 0; // amount of CPUs
+const int32_t default_http_port = 8000;
+const int32_t default_prefork = 0; // threads
+const char default_cpu_affinity[] = ""; // workers aren't pinned
+const int32_t default_arena_max = 16777216; // bytes which one request might use
+const int32_t default_arena_initial = 65536; // first chunk of arena, most of pages fit
+const int32_t default_max_body = 1048576; // bytes of request body, bigger ones are refused with 413
+const int32_t default_kdf_iterations = 100000; // PBKDF2-HMAC-SHA256 iterations for passwords
+const int32_t default_hash_threads = 0; // half of CPUs
+const int32_t default_hash_queue = 16; // logins which might wait for hashing threads, others get 503
 
 const char default_form_html[] = "<form action=\"/user\" method=\"POST\"><input type=\"text\" placeholder=\"Enter Username\" name=\"name\" required autofocus><br><input type=\"password\" placeholder=\"Enter Password\" name=\"password\" required><br><button type=\"submit\">Login</button></form>";
 size_t default_form_html_len = strizeof(default_form_html);
 
 const char default_add_edit_form_html[] = "<form action=\"/page\" method=\"post\" enctype=\"application/x-www-form-urlencoded\"><input type=\"text\" placeholder=\"Title\" name=\"title\" required autofocus><br><textarea id=\"txt\" name=\"data\" minlength=\"1\"></textarea><script>var simplemde = new SimpleMDE({ element: document.getElementById(\"txt\"), forceSync: true, spellChecker: false, tabSiz: 4});</script><br><button type=\"submit\">Send</button></form>";
+const char default_search_form_html_1[] = "<form action=\"/search\" method=\"get\"><input type=\"search\" placeholder=\"Words or &quot;a phrase&quot;\" name=\"q\" value=\"";
+const char default_search_form_html_2[] = "\" required autofocus><button type=\"submit\">Search</button></form>";
+const char default_upload_form_html[] = "<form action=\"/media\" method=\"post\" enctype=\"multipart/form-data\"><input type=\"file\" name=\"file\" multiple required><button type=\"submit\">Upload</button></form>";
 
 const char default_welcome_after_login_title[] = "Welcome!";
 const char default_welcome_after_login[] = "You can visit <a href=\"/\">home page</a> or <a href=\"/user\">user panel</a>";
@@ -0,0 +1,510 @@
+#ifndef GUARD_EPOLL_LOOP_C
+#define GUARD_EPOLL_LOOP_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "util.c"
+
+// Minimal edge-triggered epoll core for native frontends, so the way from socket to app_request() is
+// just recv() into connection buffer and a parser which points into that buffer. Every loop is a thread
+// with it's own epoll instance, connections and copy of appcontext, nothing is shared between loops.
+// Listening socket is either per loop (SO_REUSEPORT, kernel spreads connections) or shared, then it's
+// registered with EPOLLEXCLUSIVE, so only one loop is woken up for new connection.
+//
+// Protocol is plugged in with struct eloop_protocol. on_data() is called when connection got new bytes,
+// it handles as many complete requests as there are in c->in, appends responses to c->out and returns
+// amount of consumed bytes. Pointers into c->in are valid until on_data() returns, unconsumed tail is
+// moved to the beginning of buffer afterwards. Output is flushed after every on_data(), and when kernel
+// is not able to take everything, the rest is sent on EPOLLOUT. Parts of files may be put between bytes
+// of c->out (see eloop_add_file()), they are sent by sendfile() when output reaches them, so nobody waits
+// for slow client and files aren't read to memory. The same way big request body doesn't have to be kept
+// in c->in: protocol may tell to put next bytes of input to a file (see eloop_sink()), they are moved there
+// by splice() without being copied to userspace and on_data() is called again when all of them are there.
+
+#ifndef ELOOP_BUFFER_INITIAL
+#define ELOOP_BUFFER_INITIAL 16384
+#endif
+#ifndef ELOOP_BUFFER_KEEP
+#define ELOOP_BUFFER_KEEP 65536 // bigger buffers are freed when connection becomes idle
+#endif
+#ifndef ELOOP_IN_MAX
+#define ELOOP_IN_MAX (2 * 1024 * 1024)
+#endif
+#ifndef ELOOP_OUT_HIGH
+#define ELOOP_OUT_HIGH (1024 * 1024) // stop handling pipelined requests until client reads that much
+#endif
+#ifndef ELOOP_IDLE_TIMEOUT
+#define ELOOP_IDLE_TIMEOUT 30 // seconds
+#endif
+#define ELOOP_EVENTS 256
+
+static volatile sig_atomic_t eloop_stop = 0;
+
+struct ebuf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static bool ebuf_reserve(struct ebuf *b, size_t extra) {
+	if (b->cap - b->len >= extra) return true;
+	size_t cap = b->cap ? b->cap : ELOOP_BUFFER_INITIAL;
+	while(cap - b->len < extra) {
+		if (cap > SIZE_MAX / 2) return false;
+		cap *= 2;
+	}
+	char *data = realloc(b->data, cap);
+	if (data == NULL) return false;
+	b->data = data;
+	b->cap = cap;
+	return true;
+}
+
+static bool ebuf_append(struct ebuf *b, const void *data, size_t len) {
+	if (ebuf_reserve(b, len) == false) return false;
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return true;
+}
+
+#define ebuf_appendcs(b, s) ebuf_append(b, s, strizeof(s))
+
+static void ebuf_free(struct ebuf *b) {
+	free(b->data);
+	*b = (struct ebuf) {0};
+}
+
+// Part of file which goes to client after c->out is sent up to "at"
+struct eloop_file {
+	int fd;
+	off_t offset;
+	size_t left;
+	size_t at;
+};
+
+struct conn {
+	int fd;
+	struct ebuf in;
+	struct ebuf out;
+	size_t out_sent;
+	struct eloop_file *files; // ordered by "at"
+	size_t files_len, files_cap, files_sent;
+	size_t files_left; // bytes of files which aren't sent yet
+	int sink;          // file for input which bypasses c->in, -1 if there's none
+	size_t sink_left;  // bytes of input which still have to go there
+	bool closing; // close as soon as output is flushed
+	bool eof;     // peer won't send anything anymore
+	bool broken;  // close right now
+	unsigned protoflags; // for protocol's own needs
+	void *state;         // the same
+	time_t last_active;
+	struct conn *prev, *next; // by activity, the oldest is first
+	struct sockaddr_storage peer; // family is AF_UNSPEC if accept() didn't tell
+};
+
+struct eloop;
+
+struct eloop_protocol {
+	bool (*on_open)(struct conn *c, struct eloop *l); // optional
+	size_t (*on_data)(struct conn *c, struct eloop *l);
+	void (*on_close)(struct conn *c, struct eloop *l); // optional
+};
+
+struct eloop {
+	int epfd;
+	int listenfd;
+	const struct eloop_protocol *proto;
+	void *userdata;
+	time_t now;
+	struct conn *oldest, *newest;
+	unsigned connections;
+	int pipe[2]; // for splice() from socket to sink, -1 if there's no pipe
+};
+
+static time_t eloop_time(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+	return t.tv_sec;
+}
+
+// whether protocol should stop handling pipelined requests for now
+static inline bool eloop_congested(const struct conn *c) {
+	return c->out.len - c->out_sent + c->files_left >= ELOOP_OUT_HIGH;
+}
+
+// whether something is waiting for EPOLLOUT
+static inline bool eloop_pending(const struct conn *c) {
+	return c->out.len > 0 or c->files_len > 0;
+}
+
+// Part of file goes to client after what's in c->out now. Descriptor is dup()'ed, caller still has it's own.
+// Returns false if nothing is added
+static bool eloop_add_file(struct conn *c, int fd, off_t offset, size_t len) {
+	if (len == 0) return true;
+	if (c->files_len == c->files_cap) {
+		size_t cap = c->files_cap ? c->files_cap * 2 : 4;
+		struct eloop_file *files = realloc(c->files, cap * sizeof(struct eloop_file));
+		if (files == NULL) return false;
+		c->files = files;
+		c->files_cap = cap;
+	}
+	int dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup < 0) return false;
+	c->files[c->files_len++] = (struct eloop_file) {.fd = dup, .offset = offset, .left = len, .at = c->out.len};
+	c->files_left += len;
+	return true;
+}
+
+static void eloop_files_free(struct conn *c) {
+	for (size_t i = c->files_sent; i < c->files_len; i++) close(c->files[i].fd);
+	free(c->files);
+	c->files = NULL;
+	c->files_len = c->files_cap = c->files_sent = c->files_left = 0;
+}
+
+// Unnamed temporary file for input which is too big to be kept in memory, it's gone as soon as it's closed
+static int eloop_spool_open(void) {
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL or *dir == '\0') dir = "/tmp";
+#ifdef O_TMPFILE
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0) return fd;
+#endif
+	// filesystem doesn't know about O_TMPFILE
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/cblog-XXXXXX", dir) >= (int) sizeof(path)) return -1;
+	int tmp = mkostemp(path, O_CLOEXEC);
+	if (tmp >= 0) unlink(path);
+	return tmp;
+}
+
+static bool eloop_write_whole(int fd, const char *data, size_t len) {
+	while(len > 0) {
+		ssize_t put = write(fd, data, len);
+		if (put < 0 and errno == EINTR) continue;
+		if (put <= 0) return false;
+		data += put;
+		len -= (size_t) put;
+	}
+	return true;
+}
+
+// Next len bytes of input go to file fd instead of c->in, protocol gets on_data() when all of them are there
+// (c->sink_left is 0 then). Connection owns fd from now on, see eloop_sink_close()
+static inline void eloop_sink(struct conn *c, int fd, size_t len) {
+	c->sink = fd;
+	c->sink_left = len;
+}
+
+static void eloop_sink_close(struct conn *c) {
+	if (c->sink >= 0) close(c->sink);
+	c->sink = -1;
+	c->sink_left = 0;
+}
+
+static void eloop_unlink(struct eloop *l, struct conn *c) {
+	if (c->prev) c->prev->next = c->next; else l->oldest = c->next;
+	if (c->next) c->next->prev = c->prev; else l->newest = c->prev;
+	c->prev = c->next = NULL;
+}
+
+static void eloop_touch(struct eloop *l, struct conn *c) {
+	c->last_active = l->now;
+	if (l->newest == c) return;
+	eloop_unlink(l, c);
+	c->prev = l->newest;
+	if (l->newest) l->newest->next = c; else l->oldest = c;
+	l->newest = c;
+}
+
+static void eloop_close(struct eloop *l, struct conn *c) {
+	if (l->proto->on_close) l->proto->on_close(c, l);
+	eloop_unlink(l, c);
+	close(c->fd);
+	ebuf_free(&c->in);
+	ebuf_free(&c->out);
+	eloop_files_free(c);
+	eloop_sink_close(c);
+	free(c);
+	l->connections--;
+}
+
+// Sends as much as kernel takes right now, the rest waits for EPOLLOUT. Returns false if connection is broken
+static bool eloop_flush(struct conn *c) {
+	while(1) {
+		struct eloop_file *f = c->files_sent < c->files_len ? &c->files[c->files_sent] : NULL;
+		size_t until = f ? f->at : c->out.len;
+		while(c->out_sent < until) {
+			ssize_t sent = send(c->fd, c->out.data + c->out_sent, until - c->out_sent, MSG_NOSIGNAL);
+			if (sent > 0) {
+				c->out_sent += (size_t) sent;
+				continue;
+			}
+			if (sent < 0 and errno == EINTR) continue;
+			if (sent < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) return true;
+			return false;
+		}
+		if (f == NULL) break;
+		while(f->left > 0) {
+			ssize_t sent = sendfile(c->fd, f->fd, &f->offset, f->left);
+			if (sent > 0) {
+				f->left -= (size_t) sent;
+				c->files_left -= (size_t) sent;
+				continue;
+			}
+			if (sent < 0 and errno == EINTR) continue;
+			if (sent < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) return true;
+			return false; // file has been truncated, length which client was told can't be right anymore
+		}
+		close(f->fd);
+		c->files_sent++;
+	}
+	c->out.len = c->out_sent = 0;
+	c->files_len = c->files_sent = 0;
+	if (c->out.cap > ELOOP_BUFFER_KEEP) ebuf_free(&c->out);
+	return true;
+}
+
+// returns false if connection was closed
+static bool eloop_process(struct eloop *l, struct conn *c) {
+	if (c->in.len > 0 and c->closing == false and eloop_congested(c) == false) {
+		size_t used = l->proto->on_data(c, l);
+		if (used > c->in.len) c->broken = true;
+		else if (used > 0) {
+			memmove(c->in.data, c->in.data + used, c->in.len - used);
+			c->in.len -= used;
+		}
+		if (c->in.len == 0 and c->in.cap > ELOOP_BUFFER_KEEP) ebuf_free(&c->in);
+	}
+
+	if (c->broken or eloop_flush(c) == false) goto fail;
+	if (eloop_pending(c) == false and (c->closing or c->eof)) goto fail; // nothing to wait for
+	return true;
+
+	fail:
+	eloop_close(l, c);
+	return false;
+}
+
+// Moves input to c->sink, returns true when c->sink_left bytes are there. Otherwise socket has nothing
+// for now, or it's the end, the same as for recv() to c->in.
+static bool eloop_sink_read(struct eloop *l, struct conn *c) {
+	while(c->sink_left > 0) {
+		ssize_t got = -1;
+		errno = EINVAL;
+		if (l->pipe[0] >= 0) got = splice(c->fd, NULL, l->pipe[1], NULL, c->sink_left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (got > 0) {
+			c->sink_left -= (size_t) got;
+			while(got > 0) {
+				ssize_t put = splice(l->pipe[0], NULL, c->sink, NULL, (size_t) got, SPLICE_F_MOVE);
+				if (put < 0 and errno == EINTR) continue;
+				if (put <= 0) {
+					// pipe is shared by connections of this loop, it must be empty for the next one
+					char trash[4096];
+					while(read(l->pipe[0], trash, sizeof(trash)) > 0);
+					c->broken = true;
+					return false;
+				}
+				got -= put;
+			}
+			continue;
+		}
+		if (got < 0 and errno == EINVAL) {
+			// no pipe, or this kind of socket can't be spliced
+			char chunk[16384];
+			got = recv(c->fd, chunk, c->sink_left < sizeof(chunk) ? c->sink_left : sizeof(chunk), 0);
+			if (got > 0) {
+				if (eloop_write_whole(c->sink, chunk, (size_t) got) == false) {
+					c->broken = true;
+					return false;
+				}
+				c->sink_left -= (size_t) got;
+				continue;
+			}
+		}
+		if (got == 0) c->eof = true;
+		else if (errno == EINTR) continue;
+		else if (errno != EAGAIN and errno != EWOULDBLOCK) c->broken = true;
+		return false;
+	}
+	return true;
+}
+
+static bool eloop_readable(struct eloop *l, struct conn *c) {
+	while(c->closing == false and c->eof == false) {
+		if (c->sink_left > 0) {
+			if (eloop_sink_read(l, c)) continue; // the rest goes to c->in again
+			break;
+		}
+		if (c->in.len == c->in.cap) {
+			if (c->in.cap >= ELOOP_IN_MAX or ebuf_reserve(&c->in, c->in.cap ? c->in.cap : ELOOP_BUFFER_INITIAL) == false) {
+				// buffer is full, let protocol to consume something first
+				size_t before = c->in.len;
+				if (eloop_process(l, c) == false) return false;
+				if (c->in.len < before) continue;
+				if (eloop_congested(c)) return true; // will be back after EPOLLOUT
+				eloop_close(l, c); // request is too big and protocol didn't say anything
+				return false;
+			}
+		}
+		ssize_t got = recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len, 0);
+		if (got > 0) {
+			c->in.len += (size_t) got;
+			continue;
+		}
+		if (got == 0) c->eof = true;
+		else if (errno == EINTR) continue;
+		else if (errno != EAGAIN and errno != EWOULDBLOCK) c->broken = true;
+		break;
+	}
+	return eloop_process(l, c);
+}
+
+static bool eloop_writable(struct eloop *l, struct conn *c) {
+	if (eloop_flush(c) == false) {
+		eloop_close(l, c);
+		return false;
+	}
+	if (eloop_pending(c)) return true;
+	// everything is sent, there may be pipelined requests which were waiting for that
+	return c->eof ? eloop_process(l, c) : eloop_readable(l, c);
+}
+
+static void eloop_accept(struct eloop *l) {
+	while(eloop_stop == 0) {
+		struct sockaddr_storage peer;
+		socklen_t peerlen = sizeof(peer);
+		int fd = accept4(l->listenfd, (struct sockaddr *) &peer, &peerlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR or errno == ECONNABORTED) continue;
+			return; // EAGAIN or out of descriptors
+		}
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails for unix sockets, it's fine
+
+		struct conn *c = calloc(1, sizeof(struct conn));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->sink = -1;
+		if (peerlen <= sizeof(peer)) c->peer = peer; // otherwise it's zeroed by calloc(), AF_UNSPEC
+		l->connections++;
+		eloop_touch(l, c);
+		if (l->proto->on_open and l->proto->on_open(c, l) == false) {
+			eloop_close(l, c);
+			continue;
+		}
+
+		struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c};
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			eloop_close(l, c);
+			continue;
+		}
+		// with TCP_DEFER_ACCEPT or fast client there is something to read already, and ET won't tell about it
+		eloop_readable(l, c);
+	}
+}
+
+bool eloop_init(struct eloop *l, int listenfd, const struct eloop_protocol *proto, void *userdata) {
+	*l = (struct eloop) {.listenfd = listenfd, .proto = proto, .userdata = userdata, .now = eloop_time(), .pipe = {-1, -1}};
+	l->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->epfd < 0) return false;
+	// listenfd is marked with NULL
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, .data.ptr = NULL};
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+		close(l->epfd);
+		return false;
+	}
+	if (pipe2(l->pipe, O_NONBLOCK | O_CLOEXEC) < 0) l->pipe[0] = l->pipe[1] = -1; // sink works without it, just slower
+	return true;
+}
+
+void eloop_run(struct eloop *l) {
+	struct epoll_event events[ELOOP_EVENTS];
+	while(eloop_stop == 0) {
+		int n = epoll_wait(l->epfd, events, ELOOP_EVENTS, 1000);
+		if (n < 0 and errno != EINTR) break;
+		l->now = eloop_time();
+
+		for (int i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+			uint32_t e = events[i].events;
+			if (c == NULL) {
+				eloop_accept(l);
+				continue;
+			}
+			eloop_touch(l, c);
+			if (e & EPOLLERR) {
+				eloop_close(l, c);
+				continue;
+			}
+			if ((e & EPOLLOUT) and eloop_pending(c) and eloop_writable(l, c) == false) continue;
+			if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) eloop_readable(l, c);
+		}
+
+		while(l->oldest and l->now - l->oldest->last_active > ELOOP_IDLE_TIMEOUT) eloop_close(l, l->oldest);
+	}
+}
+
+void eloop_free(struct eloop *l) {
+	while(l->oldest) eloop_close(l, l->oldest);
+	close(l->epfd);
+	if (l->pipe[0] >= 0) {
+		close(l->pipe[0]);
+		close(l->pipe[1]);
+	}
+}
+
+int eloop_listen_tcp(int port, bool reuseport) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	int on = 1;
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t) port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) goto fail;
+	if (reuseport and setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) goto fail;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) goto fail;
+	if (listen(fd, SOMAXCONN) < 0) goto fail;
+	return fd;
+
+	fail:
+	close(fd);
+	return -1;
+}
+
+int eloop_listen_unix(const char *path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	size_t len = strlen(path);
+	if (len >= sizeof(addr.sun_path)) return -1;
+	memcpy(addr.sun_path, path, len + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) goto fail;
+	if (listen(fd, SOMAXCONN) < 0) goto fail;
+	chmod(path, 0777);
+	return fd;
+
+	fail:
+	close(fd);
+	return -1;
+}
+
+#endif // GUARD_EPOLL_LOOP_C
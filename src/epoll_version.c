@@ -0,0 +1,589 @@
+// Standalone http server without any dependencies, see epoll_loop.c
+// It's able to serve static files from static/ by itself, but feel free to put it behind any reverse proxy.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+
+#include "app.c"
+#include "common.c"
+#include "epoll_loop.c"
+#include "reload.c"
+#include "prefork.c"
+#include "affinity.c"
+
+#ifndef HTTP_HEAD_MAX
+#define HTTP_HEAD_MAX 16384
+#endif
+#ifndef HTTP_BODY_MEMORY
+#define HTTP_BODY_MEMORY 65536 // bigger body which didn't come with head goes to spool file, see eloop_sink()
+#endif
+#define HTTP_STATIC_DIR "static/"
+#define HTTP_CONTINUE_SENT 1u // conn protoflags
+
+// Request is handled while it's still in connection buffer, everything here points into it.
+// Response is buffered in c->out as a whole, so Content-Length is known when app is done with it:
+// there is a placeholder of spaces, which is replaced with actual length (trailing whitespace is fine for http).
+// If app flushes (record is streamed), the same line becomes Transfer-Encoding and body is sent by chunks. Every
+// chunk begins with placeholder of it's size too, so what app writes is never moved. Files (records, media and
+// static/) are only referred from c->out by position (see eloop_add_file()), their bytes are counted separately.
+// Big request body is the other way around: it goes to spool file as it comes, only head stays in the buffer.
+struct http_request {
+	struct conn *c;
+	struct worker_generation *gen;
+	void *workerbuffer;
+	struct arena arena;
+	struct header_index headers;
+	const char *body;
+	int spool; // body is read from there if it's not -1
+	size_t bodylen;
+	size_t bodyread;
+	bool headers_sent;
+	bool close;
+	bool http10;
+	bool chunked;
+	size_t length_at;  // offset of Content-Length value in c->out
+	size_t body_start; // offset of response body in c->out
+	size_t chunk_at;   // offset of size of current chunk in c->out
+	size_t filebytes;  // of body, they're sent from files
+	time_t date_t;
+	char date[64];
+};
+
+#define HTTP_LENGTH_PLACEHOLDER "                    " // CBL_UINT64_STR_MAX
+#define HTTP_CHUNKED_LINE "Transfer-Encoding: chunked          " // as long as "Content-Length: " with placeholder
+#define HTTP_CHUNK_PLACEHOLDER "00000000\r\n" // leading zeroes are fine for chunk size
+
+static const char *http_reason(unsigned short status) {
+	switch (status) {
+	case 100: return "Continue";
+	case 200: return "OK";
+	case 201: return "Created";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Content Too Large";
+	case 429: return "Too Many Requests";
+	case 431: return "Request Header Fields Too Large";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 503: return "Service Unavailable";
+	case 505: return "HTTP Version Not Supported";
+	default: return "";
+	}
+}
+
+static const char *http_date(struct http_request *r) {
+	time_t t = time(NULL);
+	if (t != r->date_t) {
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		strftime(r->date, sizeof(r->date), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+		r->date_t = t;
+	}
+	return r->date;
+}
+
+static void set_http_status_and_hdr_fun(unsigned short status, const char * const *headers, void *context) {
+	struct http_request *r = context;
+	if (r->headers_sent) return;
+	r->headers_sent = true;
+
+	struct ebuf *out = &r->c->out;
+	if (status > 999 or status < 100) status = 503;
+	char line[64];
+	int len = snprintf(line, sizeof(line), "HTTP/1.1 %u %s\r\n", status, http_reason(status));
+	bool ok = ebuf_append(out, line, (size_t) len);
+	const char *date = http_date(r);
+	ok = ok and ebuf_append(out, date, strlen(date));
+	if (headers != NULL) {
+		for (unsigned i = 0; headers[i] != NULL; i++) {
+			ok = ok and ebuf_append(out, headers[i], strlen(headers[i])) and ebuf_appendcs(out, "\r\n");
+		}
+	}
+	if (r->close) ok = ok and ebuf_appendcs(out, "Connection: close\r\n");
+	ok = ok and ebuf_appendcs(out, "Content-Length: ");
+	r->length_at = out->len;
+	ok = ok and ebuf_appendcs(out, HTTP_LENGTH_PLACEHOLDER "\r\n\r\n");
+	r->body_start = out->len;
+	if (ok == false) r->c->broken = true;
+}
+
+static void write_fun(const void *addr, unsigned long amount, void *context) {
+	struct http_request *r = context;
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, context);
+	if (amount == 0) return;
+	if (ebuf_append(&r->c->out, addr, amount) == false) r->c->broken = true;
+}
+
+static void http_chunk_size(struct http_request *r, uint32_t len) {
+	char digits[strizeof(HTTP_CHUNK_PLACEHOLDER)];
+	snprintf(digits, sizeof(digits), "%08x", (unsigned) len);
+	memcpy(r->c->out.data + r->chunk_at, digits, strizeof("00000000"));
+}
+
+// Size of current chunk is filled and it's closed. Empty one is left open, it would end the body
+static bool http_chunk_close(struct http_request *r) {
+	struct ebuf *out = &r->c->out;
+	size_t len = out->len - r->chunk_at - strizeof(HTTP_CHUNK_PLACEHOLDER);
+	if (len == 0) return false;
+	if (len > UINT32_MAX) { // placeholder has 8 hex digits, ebuf never gets that big anyway
+		r->c->broken = true;
+		return true;
+	}
+	http_chunk_size(r, (uint32_t) len);
+	if (ebuf_appendcs(out, "\r\n") == false) r->c->broken = true;
+	return true;
+}
+
+static void http_chunk_open(struct http_request *r) {
+	r->chunk_at = r->c->out.len;
+	if (ebuf_appendcs(&r->c->out, HTTP_CHUNK_PLACEHOLDER) == false) r->c->broken = true;
+}
+
+// Body which is written so far goes to client as much as it takes right now, the rest of it follows by chunks.
+// HTTP/1.0 client doesn't know chunked encoding, it gets everything at once with Content-Length. So does the
+// response which has parts of files already, they can't be moved into a chunk
+static void flush_fun(void *context) {
+	struct http_request *r = context;
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, context);
+	struct conn *c = r->c;
+	if (c->broken or r->http10 or (r->chunked == false and r->filebytes > 0)) return;
+	if (r->chunked == false) {
+		if (ebuf_reserve(&c->out, strizeof(HTTP_CHUNK_PLACEHOLDER)) == false) {
+			c->broken = true;
+			return;
+		}
+		char *body = c->out.data + r->body_start;
+		memcpy(c->out.data + r->length_at - strizeof("Content-Length: "), HTTP_CHUNKED_LINE, strizeof(HTTP_CHUNKED_LINE));
+		memmove(body + strizeof(HTTP_CHUNK_PLACEHOLDER), body, c->out.len - r->body_start);
+		memcpy(body, HTTP_CHUNK_PLACEHOLDER, strizeof(HTTP_CHUNK_PLACEHOLDER));
+		c->out.len += strizeof(HTTP_CHUNK_PLACEHOLDER);
+		r->chunk_at = r->body_start;
+		r->chunked = true;
+	}
+	if (http_chunk_close(r) == false) return;
+	if (c->broken == false and eloop_flush(c) == false) c->broken = true;
+	http_chunk_open(r);
+}
+
+// Part of file is sent by eloop_flush() when everything before it is sent. It's a chunk of it's own if
+// response is chunked already
+static bool write_fd_fun(int fd, unsigned long offset, unsigned long len, void *context) {
+	struct http_request *r = context;
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, context);
+	struct conn *c = r->c;
+	if (len == 0 or c->broken) return true;
+	if (r->chunked == false) {
+		if (eloop_add_file(c, fd, (off_t) offset, len) == false) return false;
+		r->filebytes += len;
+		return true;
+	}
+	if (len > UINT32_MAX) return false;
+	if (http_chunk_close(r)) http_chunk_open(r);
+	if (c->broken or eloop_add_file(c, fd, (off_t) offset, len) == false) return false; // empty chunk is still open
+	http_chunk_size(r, (uint32_t) len);
+	if (ebuf_appendcs(&c->out, "\r\n") == false) c->broken = true;
+	http_chunk_open(r);
+	return true;
+}
+
+static void read_fun(void *addr, unsigned long *amount, void *context) {
+	struct http_request *r = context;
+	size_t left = r->bodylen - r->bodyread;
+	if (*amount > left) *amount = left;
+	if (*amount > 0 and r->spool >= 0) {
+		ssize_t got;
+		do got = pread(r->spool, addr, *amount, (off_t) r->bodyread); while(got < 0 and errno == EINTR);
+		*amount = got > 0 ? (unsigned long) got : 0;
+	} else if (*amount > 0) memcpy(addr, r->body + r->bodyread, *amount);
+	r->bodyread += *amount;
+}
+
+static const char *locate_header_fun(const char *hdr, size_t *len, void *context) {
+	struct http_request *r = context;
+	return header_index_find(&r->headers, hdr, len);
+}
+
+static const struct reqio http_io = {
+	.write = write_fun,
+	.read = read_fun,
+	.set_http_status_and_hdr = set_http_status_and_hdr_fun,
+	.locate_header = locate_header_fun,
+	.flush = flush_fun,
+	.write_fd = write_fd_fun,
+};
+
+static void http_finish(struct http_request *r) {
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, r);
+	if (r->c->broken) return;
+	if (r->chunked) {
+		if (http_chunk_close(r) == false) r->c->out.len = r->chunk_at;
+		if (ebuf_appendcs(&r->c->out, "0\r\n\r\n") == false) r->c->broken = true;
+	} else {
+		char digits[CBL_UINT64_STR_MAX + 1];
+		int len = snprintf(digits, sizeof(digits), "%zu", r->c->out.len - r->body_start + r->filebytes);
+		memcpy(r->c->out.data + r->length_at, digits, (size_t) len);
+	}
+	if (r->close) r->c->closing = true;
+}
+
+// Response for requests which can't be handled at all, connection is closed after it
+static size_t http_error(struct http_request *r, unsigned short status, size_t consumed) {
+	r->headers_sent = false;
+	r->chunked = false;
+	r->close = true;
+	set_http_status_and_hdr_fun(status, NULL, r);
+	http_finish(r);
+	return consumed;
+}
+
+static const struct {
+	const char *ext;
+	const char *header;
+} http_mime[] = {
+	{".css", "Content-Type: text/css; charset=utf-8"},
+	{".js", "Content-Type: text/javascript; charset=utf-8"},
+	{".html", "Content-Type: text/html; charset=utf-8"},
+	{".txt", "Content-Type: text/plain; charset=utf-8"},
+	{".svg", "Content-Type: image/svg+xml"},
+	{".png", "Content-Type: image/png"},
+	{".jpg", "Content-Type: image/jpeg"},
+	{".jpeg", "Content-Type: image/jpeg"},
+	{".gif", "Content-Type: image/gif"},
+	{".webp", "Content-Type: image/webp"},
+	{".ico", "Content-Type: image/x-icon"},
+	{".woff2", "Content-Type: font/woff2"},
+};
+
+static void http_static(struct http_request *r, http_methods method, const char *path, size_t pathlen) {
+	char filename[PATH_MAX];
+	if (method != GET) {
+		set_http_status_and_hdr_fun(405, NULL, r);
+		return;
+	}
+	// no way out of static/, and no hidden files
+	if (pathlen == 0 or pathlen >= sizeof(filename) - strizeof(HTTP_STATIC_DIR) or path[0] == '.'
+		or memchr(path, '\0', pathlen) or util_memmem(path, pathlen, "/.", strizeof("/.")) or util_memmem(path, pathlen, "..", strizeof(".."))) {
+		set_http_status_and_hdr_fun(404, NULL, r);
+		return;
+	}
+	memcpy(filename, HTTP_STATIC_DIR, strizeof(HTTP_STATIC_DIR));
+	memcpy(filename + strizeof(HTTP_STATIC_DIR), path, pathlen);
+	filename[strizeof(HTTP_STATIC_DIR) + pathlen] = '\0';
+
+	struct stat st;
+	int fd = open(filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 or fstat(fd, &st) < 0 or S_ISREG(st.st_mode) == 0) {
+		if (fd >= 0) close(fd);
+		set_http_status_and_hdr_fun(404, NULL, r);
+		return;
+	}
+
+	const char *headers[] = {"Content-Type: application/octet-stream", NULL};
+	const char *dot = memrchr(path, '.', pathlen);
+	for (size_t i = 0; dot and i < sizeof(http_mime) / sizeof(http_mime[0]); i++) {
+		size_t extlen = strlen(http_mime[i].ext);
+		if ((size_t) (path + pathlen - dot) == extlen and memcmp(dot, http_mime[i].ext, extlen) == 0) headers[0] = http_mime[i].header;
+	}
+	set_http_status_and_hdr_fun(200, headers, r);
+	if (write_fd_fun(fd, 0, (unsigned long) st.st_size, r) == false) r->c->broken = true;
+	close(fd);
+}
+
+static bool http_has_token(const char *value, size_t len, const char *token, size_t tokenlen) {
+	const char *end = value + len;
+	while(value < end) {
+		while(value < end and (*value == ' ' or *value == '\t' or *value == ',')) value++;
+		const char *comma = memchr(value, ',', (size_t) (end - value));
+		const char *tokenend = comma ? comma : end;
+		while(tokenend > value and (tokenend[-1] == ' ' or tokenend[-1] == '\t')) tokenend--;
+		if ((size_t) (tokenend - value) == tokenlen and header_name_eq(value, token, tokenlen)) return true;
+		value = comma ? comma + 1 : end;
+	}
+	return false;
+}
+
+#define HEADER_IS(name) (namelen == strizeof(name) and header_name_eq(p, name, strizeof(name)))
+
+// Returns amount of consumed bytes, or 0 if request is not complete yet
+static size_t http_handle(struct http_request *r, char *data, size_t len) {
+	struct conn *c = r->c;
+	r->headers_sent = false;
+	r->chunked = false;
+	r->http10 = false;
+	r->close = false;
+	r->filebytes = 0;
+
+	if (data[0] == '\r' or data[0] == '\n') { // empty lines before request are allowed
+		size_t skip = 0;
+		while(skip < len and (data[skip] == '\r' or data[skip] == '\n')) skip++;
+		return skip;
+	}
+
+	char *end = util_memmem(data, len < HTTP_HEAD_MAX ? len : HTTP_HEAD_MAX, "\r\n\r\n", strizeof("\r\n\r\n"));
+	if (end == NULL) return len >= HTTP_HEAD_MAX ? http_error(r, 431, len) : 0;
+	size_t headlen = (size_t) (end - data) + strizeof("\r\n\r\n");
+	char *lines_end = end + strizeof("\r\n");
+
+	// request line
+	char *line_end = memchr(data, '\r', headlen);
+	char *method = data;
+	char *target = memchr(data, ' ', (size_t) (line_end - data));
+	if (target == NULL or target == method) return http_error(r, 400, len);
+	size_t methodlen = (size_t) (target++ - method);
+	char *version = memchr(target, ' ', (size_t) (line_end - target));
+	if (version == NULL or version == target or target[0] != '/') return http_error(r, 400, len);
+	char *target_end = version++;
+	if (line_end - version != strizeof("HTTP/1.1") or memcmp(version, "HTTP/1.", strizeof("HTTP/1.")) != 0) return http_error(r, 400, len);
+	if (version[7] != '0' and version[7] != '1') return http_error(r, 505, len);
+	bool http10 = version[7] == '0';
+	r->http10 = http10;
+
+	// headers
+	header_index_reset(&r->headers);
+	size_t content_length = 0;
+	bool has_length = false, chunked = false, keepalive = false, expect_continue = false;
+	for (char *p = line_end + strizeof("\r\n"); p < lines_end;) {
+		char *eol = memchr(p, '\r', (size_t) (lines_end - p));
+		if (eol[1] != '\n' or *p == ' ' or *p == '\t') return http_error(r, 400, len); // no obsolete line folding
+		char *colon = memchr(p, ':', (size_t) (eol - p));
+		if (colon == NULL or colon == p or memchr(p, ' ', (size_t) (colon - p)) or memchr(p, '\t', (size_t) (colon - p))) return http_error(r, 400, len);
+		size_t namelen = (size_t) (colon - p);
+		char *value = colon + 1, *value_end = eol;
+		while(value < value_end and (*value == ' ' or *value == '\t')) value++;
+		while(value_end > value and (value_end[-1] == ' ' or value_end[-1] == '\t')) value_end--;
+		size_t valuelen = (size_t) (value_end - value);
+
+		if (HEADER_IS("Content-Length")) {
+			size_t v = 0;
+			if (valuelen == 0 or valuelen > CBL_UINT32_STR_MAX) return http_error(r, valuelen ? 413 : 400, len);
+			for (size_t i = 0; i < valuelen; i++) {
+				if (value[i] < '0' or value[i] > '9') return http_error(r, 400, len);
+				v = v * 10 + (size_t) (value[i] - '0');
+			}
+			if (has_length and v != content_length) return http_error(r, 400, len);
+			content_length = v;
+			has_length = true;
+		} else if (HEADER_IS("Transfer-Encoding")) {
+			chunked = true;
+		} else if (HEADER_IS("Connection")) {
+			if (http_has_token(value, valuelen, "close", strizeof("close"))) r->close = true;
+			if (http_has_token(value, valuelen, "keep-alive", strizeof("keep-alive"))) keepalive = true;
+		} else if (HEADER_IS("Expect")) {
+			expect_continue = valuelen == strizeof("100-continue") and header_name_eq(value, "100-continue", valuelen);
+		}
+		header_index_add(&r->headers, p, namelen, value, valuelen);
+		p = eol + strizeof("\r\n");
+	}
+	if (http10 and keepalive == false) r->close = true;
+
+	if (chunked) return http_error(r, 501, len); // nobody sends chunked forms
+	if (content_length > generation_max_body()) return http_error(r, 413, len);
+	if (c->sink_left > 0) return 0; // body is still going to spool
+	bool spooled = c->sink >= 0;
+	if (spooled == false and len - headlen < content_length) {
+		if (expect_continue and http10 == false and (c->protoflags & HTTP_CONTINUE_SENT) == 0) {
+			if (ebuf_appendcs(&c->out, "HTTP/1.1 100 Continue\r\n\r\n") == false) c->broken = true;
+			c->protoflags |= HTTP_CONTINUE_SENT;
+		}
+		if (content_length > HTTP_BODY_MEMORY) {
+			int fd = eloop_spool_open();
+			if (fd < 0 or eloop_write_whole(fd, data + headlen, len - headlen) == false) {
+				if (fd >= 0) close(fd);
+				return http_error(r, 500, len);
+			}
+			eloop_sink(c, fd, content_length - (len - headlen));
+			c->in.len = (size_t) (data - c->in.data) + headlen; // what's after head is in spool already
+		}
+		return 0;
+	}
+	c->protoflags &= ~HTTP_CONTINUE_SENT;
+
+	// Request is complete. Target and query are NUL terminated in place, just in case
+	*target_end = '\0';
+	char *query = memchr(target, '?', (size_t) (target_end - target));
+	size_t targetlen = query ? (size_t) (query - target) : (size_t) (target_end - target);
+	if (query) *query++ = '\0';
+	r->body = data + headlen;
+	r->spool = c->sink;
+	r->bodylen = content_length;
+	r->bodyread = 0;
+
+	http_methods m = http_determine_method(method, methodlen);
+	if (targetlen > strizeof("/static/") and memcmp(target, "/static/", strizeof("/static/")) == 0) {
+		http_static(r, m, target + strizeof("/static/"), targetlen - strizeof("/static/"));
+	} else {
+		reqargs a = {.io = &http_io,
+					 .servercontext1 = r,
+					 .servercontext2 = r,
+					 .request = target,
+					 .request_len = targetlen,
+					 .query = query,
+					 .query_len = query ? (size_t) (target_end - query) : 0,
+					 .appcontext = generation_acquire(r->gen, r->workerbuffer),
+					 .method = m,
+					 .arena = &r->arena
+		};
+		client_address_from_sockaddr(&a.client, (const struct sockaddr *) &r->c->peer);
+		app_request(a);
+		arena_reset(&r->arena);
+		generation_release(r->gen);
+	}
+	http_finish(r);
+	if (spooled == false) return headlen + content_length;
+	eloop_sink_close(c);
+	r->spool = -1;
+	return headlen;
+}
+
+#undef HEADER_IS
+
+static size_t http_on_data(struct conn *c, struct eloop *l) {
+	struct http_request *r = l->userdata;
+	r->c = c;
+	size_t consumed = 0;
+	// pipelining: every complete request is answered right away, responses are going out in the same order
+	while(consumed < c->in.len and c->closing == false and c->broken == false and eloop_congested(c) == false) {
+		size_t used = http_handle(r, c->in.data + consumed, c->in.len - consumed);
+		if (used == 0) break;
+		consumed += used;
+	}
+	return consumed;
+}
+
+static const struct eloop_protocol http_protocol = {
+	.on_data = http_on_data,
+};
+
+int randfd;
+void rfill(void *ptr, size_t size) {
+	ssize_t got = read(randfd, ptr, size);
+	if (got < 0) unsafe_rand(ptr, size);
+}
+
+void get_time(struct unix_epoch_with_ms *epoch) {
+	struct timespec spec;
+	clock_gettime(CLOCK_REALTIME, &spec);
+	epoch->epoch.t = spec.tv_sec;
+	epoch->milliseconds = spec.tv_nsec / 1000000;
+	if (epoch->milliseconds > 999) { // overflow protection just in case
+		epoch->milliseconds = 0;
+		epoch->epoch.t--;
+	}
+}
+
+struct http_loop {
+	pthread_t thread;
+	struct eloop loop;
+	int listenfd;
+	unsigned index;
+	struct worker_generation *gen;
+};
+
+static void *http_loop(void *arg) {
+	struct http_loop *h = arg;
+	affinity_pin(h->index); // before anything is allocated, see affinity.c
+	struct http_request r = {.gen = h->gen, .workerbuffer = malloc(CONTEXTAPPBUFFERSIZE)};
+	if (r.workerbuffer == NULL or arena_init(&r.arena, SIZE_MAX) == false) { // limit is set by app_request()
+		perror("Unable to allocate worker buffer");
+		free(r.workerbuffer);
+		return NULL;
+	}
+
+	if (eloop_init(&h->loop, h->listenfd, &http_protocol, &r) == false) {
+		perror("Unable to create event loop");
+		arena_free(&r.arena);
+		free(r.workerbuffer);
+		return NULL;
+	}
+	eloop_run(&h->loop);
+	eloop_free(&h->loop);
+	arena_print_stats(&r.arena, h->index);
+	arena_free(&r.arena);
+	free(r.workerbuffer);
+	return NULL;
+}
+
+// Every loop has it's own listening socket, unless the one of master process is given (pre-fork mode)
+static int serve(unsigned first, unsigned n_loops, int sharedfd, int port, const char *configfile) {
+	if (generation_slots_init(n_loops) == false) return EXIT_FAILURE;
+	struct http_loop loops[n_loops];
+	unsigned started = 0;
+	for (; started < n_loops; started++) {
+		int listenfd = sharedfd >= 0 ? sharedfd : eloop_listen_tcp(port, true);
+		loops[started] = (struct http_loop) {.listenfd = listenfd, .index = first + started, .gen = generation_slot(started)};
+		if (loops[started].listenfd < 0) {
+			printf("Cannot listen on port %d: %s\n", port, strerror(errno));
+			break;
+		}
+		if (pthread_create(&loops[started].thread, NULL, http_loop, &loops[started]) != 0) {
+			if (sharedfd < 0) close(loops[started].listenfd);
+			break;
+		}
+	}
+	eloop_stop = started < n_loops ? SIGTERM : generation_wait(configfile, rfill, get_time);
+
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(loops[i].thread, NULL);
+		if (sharedfd < 0) close(loops[i].listenfd);
+	}
+	return started == n_loops ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct prefork_args {
+	int fd;
+	int port;
+	const char *configfile;
+};
+
+static int prefork_serve(unsigned index, void *arg) {
+	struct prefork_args *p = arg;
+	int ret = serve(index, 1, p->fd, p->port, p->configfile);
+	generation_finish();
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	signal(SIGPIPE, SIG_IGN);
+	generation_block_signals(); // SIGHUP reloads config, see reload.c
+	randfd = open("/dev/urandom", O_RDONLY);
+	if (randfd < 0) return EXIT_FAILURE;
+	const char *configfile = argc > 1 ? argv[1] : NULL;
+	const char *error;
+	struct generation *g = generation_create(configfile, rfill, get_time, &error);
+	if (g == NULL or affinity_init(g->config.cpu_affinity, &error) == false or app_caches_create(&error) == false) {
+		printf("%s\n", error);
+		return EXIT_FAILURE;
+	}
+	generation_publish(g);
+
+	// one loop per core, either threads of this process or processes with one thread each
+	const unsigned n_loops = config_workers(&g->config);
+	const int port = g->config.http_port;
+	int ret;
+	if (g->config.prefork) {
+		struct prefork_args p = {.fd = eloop_listen_tcp(port, false), .port = port, .configfile = configfile};
+		if (p.fd < 0) {
+			printf("Cannot listen on port %d: %s\n", port, strerror(errno));
+			ret = EXIT_FAILURE;
+		} else {
+			ret = prefork_run(n_loops, prefork_serve, &p, configfile, rfill, get_time);
+			close(p.fd);
+		}
+	} else {
+		ret = serve(0, n_loops, -1, port, configfile);
+	}
+	generation_finish();
+	app_caches_destroy();
+	close(randfd);
+	return ret;
+}
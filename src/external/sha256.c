@@ -12,9 +12,13 @@
               This implementation uses little endian byte order.
 *********************************************************************/
 
+#ifndef GUARD_SHA256_C
+#define GUARD_SHA256_C
+
 /*************************** HEADER FILES ***************************/
 #include <stdlib.h>
 #include <memory.h>
+#include <stdbool.h>
 #include "sha256.h"
 
 /****************************** MACROS ******************************/
@@ -41,23 +45,23 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
-void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+static void sha256_transform(WORD state[8], const BYTE data[])
 {
 	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
 
 	for (i = 0, j = 0; i < 16; ++i, j += 4)
-		m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
+		m[i] = ((WORD) data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
 	for ( ; i < 64; ++i)
 		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
 
-	a = ctx->state[0];
-	b = ctx->state[1];
-	c = ctx->state[2];
-	d = ctx->state[3];
-	e = ctx->state[4];
-	f = ctx->state[5];
-	g = ctx->state[6];
-	h = ctx->state[7];
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
 
 	for (i = 0; i < 64; ++i) {
 		t1 = h + EP1(e) + SHA_CH(e,f,g) + k[i] + m[i];
@@ -72,14 +76,20 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 		a = t1 + t2;
 	}
 
-	ctx->state[0] += a;
-	ctx->state[1] += b;
-	ctx->state[2] += c;
-	ctx->state[3] += d;
-	ctx->state[4] += e;
-	ctx->state[5] += f;
-	ctx->state[6] += g;
-	ctx->state[7] += h;
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+static void sha256_blocks_generic(WORD state[8], const BYTE data[], size_t blocks)
+{
+	for ( ; blocks > 0; blocks--, data += 64)
+		sha256_transform(state, data);
 }
 
 void sha256_init(SHA256_CTX *ctx)
@@ -96,19 +106,117 @@ void sha256_init(SHA256_CTX *ctx)
 	ctx->state[7] = 0x5be0cd19;
 }
 
+static void sha256_multi_generic(const BYTE *const data[], const size_t len[], size_t n, BYTE hash[][SHA256_BLOCK_SIZE])
+{
+	SHA256_CTX ctx;
+
+	for (size_t i = 0; i < n; i++) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, data[i], len[i]);
+		sha256_final(&ctx, hash[i]);
+	}
+}
+
+#include "sha256_x86.c"
+
+/**************************** DISPATCH ******************************/
+// CPU is checked only once, during first call, and pointers are replaced with the chosen functions. Every
+// thread would choose the same ones, so the race is harmless.
+typedef void (*sha256_blocks_fun)(WORD state[8], const BYTE data[], size_t blocks);
+typedef void (*sha256_multi_fun)(const BYTE *const data[], const size_t len[], size_t n, BYTE hash[][SHA256_BLOCK_SIZE]);
+
+static void sha256_blocks_resolve(WORD state[8], const BYTE data[], size_t blocks);
+static void sha256_multi_resolve(const BYTE *const data[], const size_t len[], size_t n, BYTE hash[][SHA256_BLOCK_SIZE]);
+
+static sha256_blocks_fun sha256_blocks_impl = sha256_blocks_resolve;
+static sha256_multi_fun sha256_multi_impl = sha256_multi_resolve;
+
+static void sha256_use(sha256_blocks_fun blocks, sha256_multi_fun multi)
+{
+	__atomic_store_n(&sha256_blocks_impl, blocks, __ATOMIC_RELAXED);
+	__atomic_store_n(&sha256_multi_impl, multi, __ATOMIC_RELAXED);
+}
+
+bool sha256_select(enum sha256_impl impl)
+{
+	switch (impl) {
+	case SHA256_IMPL_AUTO:
+#ifdef SHA256_X86
+		// 8 lanes of AVX2 were not slower than SHA-NI one message at a time, see tests/bench_sha256.c
+		sha256_use(sha256_x86_has_shani() ? sha256_blocks_shani : sha256_blocks_generic,
+		           sha256_x86_has_avx2() ? sha256_multi_avx2 : sha256_multi_generic);
+		return true;
+#endif
+	case SHA256_IMPL_GENERIC:
+		sha256_use(sha256_blocks_generic, sha256_multi_generic);
+		return true;
+#ifdef SHA256_X86
+	case SHA256_IMPL_SHANI:
+		if (sha256_x86_has_shani() == false)
+			return false;
+		sha256_use(sha256_blocks_shani, sha256_multi_generic);
+		return true;
+	case SHA256_IMPL_AVX2:
+		if (sha256_x86_has_avx2() == false)
+			return false;
+		sha256_use(sha256_blocks_generic, sha256_multi_avx2);
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+static void sha256_blocks(WORD state[8], const BYTE data[], size_t blocks)
+{
+	__atomic_load_n(&sha256_blocks_impl, __ATOMIC_RELAXED)(state, data, blocks);
+}
+
+static void sha256_blocks_resolve(WORD state[8], const BYTE data[], size_t blocks)
+{
+	sha256_select(SHA256_IMPL_AUTO);
+	sha256_blocks(state, data, blocks);
+}
+
+static void sha256_multi_resolve(const BYTE *const data[], const size_t len[], size_t n, BYTE hash[][SHA256_BLOCK_SIZE])
+{
+	sha256_select(SHA256_IMPL_AUTO);
+	sha256_multi(data, len, n, hash);
+}
+
+void sha256_multi(const BYTE *const data[], const size_t len[], size_t n, BYTE hash[][SHA256_BLOCK_SIZE])
+{
+	__atomic_load_n(&sha256_multi_impl, __ATOMIC_RELAXED)(data, len, n, hash);
+}
+
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-	WORD i;
+	size_t blocks;
+
+	if (ctx->datalen > 0) {
+		size_t take = 64 - ctx->datalen < len ? 64 - ctx->datalen : len;
+		memcpy(ctx->data + ctx->datalen, data, take);
+		ctx->datalen += take;
+		data += take;
+		len -= take;
+		if (ctx->datalen < 64)
+			return;
+		sha256_blocks(ctx->state, ctx->data, 1);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
 
-	for (i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	// whole blocks are taken right from the caller, without copying them into ctx->data
+	blocks = len / 64;
+	if (blocks > 0) {
+		sha256_blocks(ctx->state, data, blocks);
+		ctx->bitlen += 512ull * blocks;
+		data += blocks * 64;
+		len -= blocks * 64;
 	}
+	if (len > 0)
+		memcpy(ctx->data, data, len);
+	ctx->datalen = len;
 }
 
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
@@ -127,7 +235,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 		ctx->data[i++] = 0x80;
 		while (i < 64)
 			ctx->data[i++] = 0x00;
-		sha256_transform(ctx, ctx->data);
+		sha256_blocks(ctx->state, ctx->data, 1);
 		memset(ctx->data, 0, 56);
 	}
 
@@ -141,7 +249,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 	ctx->data[58] = ctx->bitlen >> 40;
 	ctx->data[57] = ctx->bitlen >> 48;
 	ctx->data[56] = ctx->bitlen >> 56;
-	sha256_transform(ctx, ctx->data);
+	sha256_blocks(ctx->state, ctx->data, 1);
 
 	// Since this implementation uses little endian byte ordering and SHA uses big endian,
 	// reverse all the bytes when copying the final state to the output hash.
@@ -156,3 +264,5 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 		hash[i + 28] = (ctx->state[7] >> (24 - i * 8)) & 0x000000ff;
 	}
 }
+
+#endif // GUARD_SHA256_C
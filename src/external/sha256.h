@@ -11,6 +11,7 @@
 
 /*************************** HEADER FILES ***************************/
 #include <stddef.h>
+#include <stdbool.h>
 
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 32            // SHA256 outputs a 32 byte digest
@@ -26,9 +27,20 @@ typedef struct {
 	WORD state[8];
 } SHA256_CTX;
 
+// Implementation is chosen by CPU at first use, sha256_select() is for tests and benchmarks
+enum sha256_impl {
+	SHA256_IMPL_AUTO,
+	SHA256_IMPL_GENERIC,
+	SHA256_IMPL_SHANI,              // x86 SHA extensions, one message at a time
+	SHA256_IMPL_AVX2,               // 8 messages at a time, sha256_multi() only
+};
+
 /*********************** FUNCTION DECLARATIONS **********************/
 void sha256_init(SHA256_CTX *ctx);
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len);
 void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
+// n independent messages, it's the fastest when they are about the same length
+void sha256_multi(const BYTE *const data[], const size_t len[], size_t n, BYTE hash[][SHA256_BLOCK_SIZE]);
+bool sha256_select(enum sha256_impl impl);  // false if CPU can't do it
 
 #endif   // SHA256_H
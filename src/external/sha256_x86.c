@@ -0,0 +1,229 @@
+/*********************************************************************
+* Filename:   sha256_x86.c
+* Details:    SHA-256 block functions for x86 CPUs, used by sha256.c
+              when CPU has them:
+               * SHA extensions (SHA-NI), one message at a time;
+               * AVX2, 8 independent messages at a time, lane per
+                 message (multi-buffer).
+              Compiled with target attributes, so the rest of the
+              program doesn't need -msha or -mavx2, and called only
+              after CPUID has been checked.
+*********************************************************************/
+
+#ifndef GUARD_SHA256_X86_C
+#define GUARD_SHA256_X86_C
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(CBL_NO_SIMD)
+#define SHA256_X86
+
+#include <immintrin.h>
+
+static bool sha256_x86_has_shani(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+
+static bool sha256_x86_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+/****************************** SHA-NI ******************************/
+// State is kept as ABEF and CDGH, because sha256rnds2 wants it so. Every group of 4 rounds adds K to 4
+// words of message, does 2 rounds with low half and 2 rounds with high half of them, and meanwhile message
+// schedule for next groups is computed by sha256msg1/sha256msg2.
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(WORD state[8], const BYTE data[], size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, msg, tmp, abef, cdgh, m[4];
+	unsigned g;
+
+	tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+	state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);              // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);        // EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);        // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);     // CDGH
+
+	for ( ; blocks > 0; blocks--, data += 64) {
+		abef = state0;
+		cdgh = state1;
+
+		for (g = 0; g < 16; g++) {
+			if (g < 4)
+				m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + g * 16)), bswap);
+			msg = _mm_add_epi32(m[g % 4], _mm_loadu_si128((const __m128i *) &k[g * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if (g >= 3 && g < 15) {
+				// W[t] for next group: msg1 part has been done two groups ago
+				tmp = _mm_alignr_epi8(m[g % 4], m[(g + 3) % 4], 4);
+				m[(g + 1) % 4] = _mm_add_epi32(m[(g + 1) % 4], tmp);
+				m[(g + 1) % 4] = _mm_sha256msg2_epu32(m[(g + 1) % 4], m[g % 4]);
+			}
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+			if (g >= 1 && g < 13)
+				m[(g + 3) % 4] = _mm_sha256msg1_epu32(m[(g + 3) % 4], m[g % 4]);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);           // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);        // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);     // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);        // HGFE
+	_mm_storeu_si128((__m128i *) &state[0], state0);
+	_mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+/****************************** AVX2 ********************************/
+// Lane i of every vector is word of message i. Blocks are taken from the messages by pointers, so lanes
+// don't have to be in one buffer; last blocks (with padding) are made in a small buffer of every lane.
+#define SHA256_X8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHA256_X8_XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+#define SHA256_X8_ADD3(a, b, c) _mm256_add_epi32(_mm256_add_epi32(a, b), c)
+#define SHA256_X8_EP0(x) SHA256_X8_XOR3(SHA256_X8_ROTR(x, 2), SHA256_X8_ROTR(x, 13), SHA256_X8_ROTR(x, 22))
+#define SHA256_X8_EP1(x) SHA256_X8_XOR3(SHA256_X8_ROTR(x, 6), SHA256_X8_ROTR(x, 11), SHA256_X8_ROTR(x, 25))
+#define SHA256_X8_SIG0(x) SHA256_X8_XOR3(SHA256_X8_ROTR(x, 7), SHA256_X8_ROTR(x, 18), _mm256_srli_epi32(x, 3))
+#define SHA256_X8_SIG1(x) SHA256_X8_XOR3(SHA256_X8_ROTR(x, 17), SHA256_X8_ROTR(x, 19), _mm256_srli_epi32(x, 10))
+#define SHA256_X8_CH(x, y, z) _mm256_xor_si256(_mm256_and_si256(x, y), _mm256_andnot_si256(x, z))
+#define SHA256_X8_MAJ(x, y, z) _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y)))
+
+// r[i] is 8 words of lane i, after that r[j] is word j of all lanes
+__attribute__((target("avx2")))
+static inline void sha256_x8_transpose(__m256i r[8])
+{
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2")))
+static void sha256_x8_block(__m256i s[8], const BYTE *const p[8])
+{
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+	                                      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i w[16], a, b, c, d, e, f, g, h, t1, t2;
+	unsigned i;
+
+	for (i = 0; i < 8; i++) {
+		w[i] = _mm256_loadu_si256((const __m256i *) p[i]);
+		w[i + 8] = _mm256_loadu_si256((const __m256i *) (p[i] + 32));
+	}
+	sha256_x8_transpose(w);
+	sha256_x8_transpose(w + 8);
+	for (i = 0; i < 16; i++)
+		w[i] = _mm256_shuffle_epi8(w[i], bswap);
+
+	a = s[0]; b = s[1]; c = s[2]; d = s[3];
+	e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+	for (i = 0; i < 64; i++) {
+		if (i >= 16)
+			w[i % 16] = _mm256_add_epi32(SHA256_X8_ADD3(SHA256_X8_SIG1(w[(i - 2) % 16]), w[(i - 7) % 16], SHA256_X8_SIG0(w[(i - 15) % 16])), w[i % 16]);
+		t1 = _mm256_add_epi32(SHA256_X8_ADD3(h, SHA256_X8_EP1(e), SHA256_X8_CH(e, f, g)), _mm256_add_epi32(_mm256_set1_epi32(k[i]), w[i % 16]));
+		t2 = _mm256_add_epi32(SHA256_X8_EP0(a), SHA256_X8_MAJ(a, b, c));
+		h = g;
+		g = f;
+		f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm256_add_epi32(t1, t2);
+	}
+
+	s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+	s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+	s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+	s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+}
+
+__attribute__((target("avx2")))
+static void sha256_multi_avx2(const BYTE *const data[], const size_t len[], size_t n, BYTE hash[][SHA256_BLOCK_SIZE])
+{
+	static const BYTE idle[64]; // for lanes which are done or not used at all
+	BYTE tail[8][128];
+	WORD lanes[8][8];
+	size_t full[8], blocks[8], most, b;
+	unsigned used, i, j;
+	SHA256_CTX iv;
+	__m256i s[8];
+
+	sha256_init(&iv);
+	for ( ; n > 0; n -= used, data += used, len += used, hash += used) {
+		used = n < 8 ? n : 8;
+		most = 0;
+		for (i = 0; i < used; i++) {
+			size_t rem = len[i] % 64, padded = rem < 56 ? 64 : 128;
+			unsigned long long bits = (unsigned long long) len[i] * 8;
+
+			full[i] = len[i] / 64;
+			if (rem > 0)
+				memcpy(tail[i], data[i] + full[i] * 64, rem);
+			tail[i][rem] = 0x80;
+			memset(tail[i] + rem + 1, 0, padded - rem - 1 - 8);
+			for (j = 0; j < 8; j++)
+				tail[i][padded - 1 - j] = bits >> (j * 8);
+			blocks[i] = full[i] + padded / 64;
+			if (blocks[i] > most)
+				most = blocks[i];
+		}
+		for (j = 0; j < 8; j++)
+			s[j] = _mm256_set1_epi32(iv.state[j]);
+
+		for (b = 0; b < most; b++) {
+			const BYTE *p[8];
+			bool done = false;
+
+			for (i = 0; i < 8; i++) {
+				if (i >= used || b >= blocks[i])
+					p[i] = idle;
+				else if (b < full[i])
+					p[i] = data[i] + b * 64;
+				else
+					p[i] = tail[i] + (b - full[i]) * 64;
+			}
+			sha256_x8_block(s, p);
+
+			for (i = 0; i < used; i++)
+				if (b + 1 == blocks[i])
+					done = true;
+			if (done == false)
+				continue;
+			for (j = 0; j < 8; j++)
+				_mm256_storeu_si256((__m256i *) lanes[j], s[j]);
+			for (i = 0; i < used; i++) {
+				if (b + 1 != blocks[i])
+					continue;
+				for (j = 0; j < 8; j++) {
+					hash[i][j * 4]     = lanes[j][i] >> 24;
+					hash[i][j * 4 + 1] = lanes[j][i] >> 16;
+					hash[i][j * 4 + 2] = lanes[j][i] >> 8;
+					hash[i][j * 4 + 3] = lanes[j][i];
+				}
+			}
+		}
+	}
+}
+
+#endif
+#endif // GUARD_SHA256_X86_C
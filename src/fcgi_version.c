@@ -1,10 +1,15 @@
 // You may use the config below for this fastcgi application
 //
+// upstream cblog {
+//     server unix:/tmp/cblog.sock;
+//     keepalive 8;
+// }
 // server {
 //     listen 8080;
 //     location / {
 //         include /etc/nginx/fastcgi_params;
-//         fastcgi_pass unix:/tmp/cblog.sock;
+//         fastcgi_pass cblog;
+//         fastcgi_keep_conn on;
 //     }
 //     location /static/ {
 //         autoindex off;
@@ -13,154 +18,517 @@
 //     }
 // }
 
-#define _BSD_SOURCE
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <signal.h>
 #include <pthread.h>
-#include <sys/stat.h>
-#include <fcgiapp.h>
 #include <limits.h>
-#include <fcgios.h>
 #include <time.h>
 
 #include "app.c"
 #include "common.c"
+#include "epoll_loop.c"
+#include "reload.c"
+#include "prefork.c"
+#include "affinity.c"
 
 const char * const sockpath = "/tmp/cblog.sock";
 
-static int s_signo = 0;
-static void signal_handler(int signo) {
-	FCGX_ShutdownPending();
-	s_signo = signo;
+// FastCGI is implemented here over epoll_loop.c, without libfcgi. Connections from web server are
+// persistent (FCGI_KEEP_CONN) and may carry many requests at once, records of different requests
+// are interleaved. Records are parsed straight from connection buffer, and when request becomes complete
+// within the same read, PARAMS and STDIN are used right from there. Otherwise they are copied to request's
+// own buffers until the rest arrives. Requests are handled one by one as soon as they are complete.
+
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_DATA 8
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE 11
+
+#define FCGI_KEEP_CONN 1
+#define FCGI_RESPONDER 1
+
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_OVERLOADED 2
+#define FCGI_UNKNOWN_ROLE 3
+
+#ifndef FCGI_MAX_REQS
+#define FCGI_MAX_REQS 64 // per connection
+#endif
+#ifndef FCGI_BODY_MEMORY
+#define FCGI_BODY_MEMORY 65536 // bigger body goes to spool file as STDIN records come
+#endif
+
+// Content of PARAMS or STDIN stream. It's either a view into connection buffer, or a copy
+struct fcgi_stream {
+	const char *view;
+	size_t viewlen;
+	struct ebuf copy;
+};
+
+struct fcgi_req {
+	uint16_t id;
+	bool keep_conn;
+	bool params_done;
+	unsigned short refused; // body is dropped with this status, but request is still answered when stdin ends
+	struct fcgi_stream params;
+	struct fcgi_stream body;
+	int spool; // body is there instead of q->body when it's not -1
+	size_t spooled;
+	struct fcgi_req *next;
+};
+
+// Per loop, for the request being handled right now
+struct fcgi_request {
+	struct conn *c;
+	struct worker_generation *gen;
+	void *workerbuffer;
+	struct arena arena;
+	uint16_t id;
+	bool headers_sent;
+	size_t record_at; // offset of STDOUT record header which is being filled, SIZE_MAX if none
+	const char *body;
+	int spool; // body is read from there if it's not -1
+	size_t bodylen;
+	size_t bodyread;
+	struct header_index headers;
+	const char *uri, *method, *query, *remote;
+	size_t urilen, methodlen, querylen, remotelen;
+};
+
+static void fcgi_stream_add(struct fcgi_stream *s, const char *data, size_t len, struct conn *c) {
+	if (s->view == NULL and s->copy.len == 0) {
+		s->view = data;
+		s->viewlen = len;
+		return;
+	}
+	if (s->view) {
+		if (ebuf_append(&s->copy, s->view, s->viewlen) == false) c->broken = true;
+		s->view = NULL;
+	}
+	if (ebuf_append(&s->copy, data, len) == false) c->broken = true;
 }
 
-static void write_fun(const void *addr, unsigned long amount, void *context) {
-	if (amount == 0) return;
-	FCGX_Request *request = context;
-	if (amount > INT_MAX) amount = INT_MAX;
-	FCGX_PutStr(addr, (int) amount, request->out);
+static void fcgi_stream_spill(struct fcgi_stream *s, struct conn *c) {
+	if (s->view == NULL) return;
+	if (ebuf_append(&s->copy, s->view, s->viewlen) == false) c->broken = true;
+	s->view = NULL;
 }
 
-static void read_fun(void *addr, unsigned long *amount, void *context) {
-	if (amount == NULL or *amount == 0) return;
-	FCGX_Request *request = context;
-	if (*amount > INT_MAX) *amount = INT_MAX;
+static const char *fcgi_stream_data(const struct fcgi_stream *s, size_t *len) {
+	if (s->view) {
+		*len = s->viewlen;
+		return s->view;
+	}
+	*len = s->copy.len;
+	return s->copy.data;
+}
+
+static void fcgi_header(unsigned char *h, unsigned type, unsigned id, size_t len) {
+	h[0] = FCGI_VERSION_1;
+	h[1] = (unsigned char) type;
+	h[2] = (unsigned char) (id >> 8);
+	h[3] = (unsigned char) id;
+	h[4] = (unsigned char) (len >> 8);
+	h[5] = (unsigned char) len;
+	h[6] = 0; // no padding
+	h[7] = 0;
+}
 
-	int got = FCGX_GetStr(addr, (int) *amount, request->in);
-	if (got < 0) *amount = 0;
-	*amount = (unsigned long) got;
+static void fcgi_record(struct conn *c, unsigned type, unsigned id, const void *content, size_t len) {
+	unsigned char h[FCGI_HEADER_LEN];
+	fcgi_header(h, type, id, len);
+	if (ebuf_append(&c->out, h, sizeof(h)) == false or ebuf_append(&c->out, content, len) == false) c->broken = true;
 }
 
-static void set_http_status_and_hdr_fun_stub(unsigned short status, const char * const *headers, void *context) {}
+static void fcgi_end_request(struct conn *c, unsigned id, unsigned char protocol_status) {
+	unsigned char body[8] = {0, 0, 0, 0, protocol_status};
+	fcgi_record(c, FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+// STDOUT records are filled in place in c->out, header is written when record is full or response is done
+static void fcgi_stdout_close(struct fcgi_request *r) {
+	if (r->record_at == SIZE_MAX) return;
+	struct ebuf *out = &r->c->out;
+	size_t len = out->len - r->record_at - FCGI_HEADER_LEN;
+	if (len == 0) out->len = r->record_at;
+	else fcgi_header((unsigned char *) out->data + r->record_at, FCGI_STDOUT, r->id, len);
+	r->record_at = SIZE_MAX;
+}
+
+static void fcgi_stdout(struct fcgi_request *r, const void *data, size_t len) {
+	struct ebuf *out = &r->c->out;
+	const char *p = data;
+	while(len > 0) {
+		if (r->record_at == SIZE_MAX) {
+			if (ebuf_reserve(out, FCGI_HEADER_LEN) == false) goto fail;
+			r->record_at = out->len;
+			out->len += FCGI_HEADER_LEN;
+		}
+		size_t room = FCGI_MAX_CONTENT - (out->len - r->record_at - FCGI_HEADER_LEN);
+		if (room == 0) {
+			fcgi_stdout_close(r);
+			continue;
+		}
+		size_t chunk = len < room ? len : room;
+		if (ebuf_append(out, p, chunk) == false) goto fail;
+		p += chunk;
+		len -= chunk;
+	}
+	return;
+
+	fail:
+	r->c->broken = true;
+}
+
+#define fcgi_stdoutcs(r, s) fcgi_stdout(r, s, strizeof(s))
 
 static void set_http_status_and_hdr_fun(unsigned short status, const char * const *headers, void *context) {
-	FCGX_Request *request = context;
+	struct fcgi_request *r = context;
+	if (r->headers_sent) return;
+	r->headers_sent = true;
+
 	if (status > 999 or status < 100) status = 503;
-	FCGX_FPrintF(request->out, "Status: %u\r\n", status);
+	char line[32];
+	int len = snprintf(line, sizeof(line), "Status: %u\r\n", status);
+	fcgi_stdout(r, line, (size_t) len);
 
 	if (headers != NULL) {
 		for (unsigned i = 0; headers[i] != NULL; i++) {
-			FCGX_FPrintF(request->out, "%s\r\n", headers[i]);
+			fcgi_stdout(r, headers[i], strlen(headers[i]));
+			fcgi_stdoutcs(r, "\r\n");
+		}
+	}
+	fcgi_stdoutcs(r, "\r\n");
+}
+
+static void write_fun(const void *addr, unsigned long amount, void *context) {
+	struct fcgi_request *r = context;
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, context);
+	if (amount == 0) return;
+	fcgi_stdout(r, addr, amount);
+}
+
+// Complete records go to web server as much as it takes right now, the rest is sent on EPOLLOUT
+static void flush_fun(void *context) {
+	struct fcgi_request *r = context;
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, context);
+	if (r->c->broken) return;
+	fcgi_stdout_close(r);
+	if (eloop_flush(r->c) == false) r->c->broken = true;
+}
+
+// Part of file goes in STDOUT records of it's own, only their headers are in c->out and content is sent from
+// file by eloop_flush() (see eloop_add_file())
+static bool write_fd_fun(int fd, unsigned long offset, unsigned long len, void *context) {
+	struct fcgi_request *r = context;
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, context);
+	struct conn *c = r->c;
+	fcgi_stdout_close(r);
+	bool first = true;
+	while(len > 0 and c->broken == false) {
+		size_t piece = len < FCGI_MAX_CONTENT ? len : FCGI_MAX_CONTENT;
+		unsigned char h[FCGI_HEADER_LEN];
+		fcgi_header(h, FCGI_STDOUT, r->id, piece);
+		if (ebuf_append(&c->out, h, sizeof(h)) == false) c->broken = true;
+		else if (eloop_add_file(c, fd, (off_t) offset, piece) == false) {
+			c->out.len -= sizeof(h);
+			if (first) return false; // nothing is taken, app writes it by itself
+			c->broken = true;
 		}
+		first = false;
+		offset += piece;
+		len -= piece;
 	}
-	FCGX_PutStr("\r\n", 2, request->out);
+	return true;
+}
 
-	app_write = write_fun;
-	set_http_status_and_hdr = set_http_status_and_hdr_fun_stub;
+static void read_fun(void *addr, unsigned long *amount, void *context) {
+	struct fcgi_request *r = context;
+	size_t left = r->bodylen - r->bodyread;
+	if (*amount > left) *amount = left;
+	if (*amount > 0 and r->spool >= 0) {
+		ssize_t got;
+		do got = pread(r->spool, addr, *amount, (off_t) r->bodyread); while(got < 0 and errno == EINTR);
+		*amount = got > 0 ? (unsigned long) got : 0;
+	} else if (*amount > 0) memcpy(addr, r->body + r->bodyread, *amount);
+	r->bodyread += *amount;
 }
 
-static void write_fun_stub(const void *addr, unsigned long amount, void *context) {
-	set_http_status_and_hdr_fun(200, NULL, context);
-	write_fun(addr, amount, context);
+static bool fcgi_nv_length(const unsigned char **p, const unsigned char *end, size_t *len) {
+	if (*p >= end) return false;
+	if ((**p & 0x80) == 0) {
+		*len = *(*p)++;
+		return true;
+	}
+	if (end - *p < 4) return false;
+	*len = ((size_t) ((*p)[0] & 0x7f) << 24) | ((size_t) (*p)[1] << 16) | ((size_t) (*p)[2] << 8) | (*p)[3];
+	*p += 4;
+	return true;
 }
 
+// Unfortunately, NGINX passes http headers as params with HTTP_ prefix and in upper case, for example
+// User-Agent would be HTTP_USER_AGENT, while Content-Type and Content-Length are going without prefix.
+// So the prefix is stripped here, and header index ignores case and treats '-' and '_' the same way,
+// hence the app is able to look for "User-Agent" as usual. Other params aren't headers and they are not
+// indexed, otherwise client would be able to pass "Document-Uri" header. Unless NO_NGINX_KLUDGE is defined,
+// then everything is indexed as is.
+static void index_params(struct fcgi_request *r, const char *params, size_t len) {
+	header_index_reset(&r->headers);
+	r->uri = r->method = r->query = r->remote = NULL;
+	r->urilen = r->methodlen = r->querylen = r->remotelen = 0;
+
+	const unsigned char *p = (const unsigned char *) params, *end = p + len;
+	while(p < end) {
+		size_t namelen, valuelen;
+		if (fcgi_nv_length(&p, end, &namelen) == false or fcgi_nv_length(&p, end, &valuelen) == false) return;
+		if (namelen > (size_t) (end - p) or valuelen > (size_t) (end - p) - namelen) return;
+		const char *name = (const char *) p;
+		const char *value = name + namelen;
+		p += namelen + valuelen;
+
+#define PARAM_IS(str) (namelen == strizeof(str) and memcmp(name, str, strizeof(str)) == 0)
+		if (PARAM_IS("DOCUMENT_URI")) r->uri = value, r->urilen = valuelen;
+		else if (PARAM_IS("REQUEST_METHOD")) r->method = value, r->methodlen = valuelen;
+		else if (PARAM_IS("QUERY_STRING")) r->query = value, r->querylen = valuelen;
+		else if (PARAM_IS("REMOTE_ADDR")) r->remote = value, r->remotelen = valuelen;
 #ifndef NO_NGINX_KLUDGE
-const char * const nginx_headers_table[] = {
-	"Host", "HTTP_HOST",
-	"Content-Type", "CONTENT_TYPE",
-	"Content-Length", "CONTENT_LENGTH",
-	"User-Agent", "HTTP_USER_AGENT",
-	"Accept", "HTTP_ACCEPT",
-	"Accept-Language", "HTTP_ACCEPT_LANGUAGE",
-	"Accept-Encoding", "HTTP_ACCEPT_ENCODING",
-	"Connection", "HTTP_CONNECTION",
-	"Upgrade-Insecure-Requests", "HTTP_UPGRADE_INSECURE_REQUESTS",
-	"Cookie", "HTTP_COOKIE",
-	NULL, NULL
-};
-// Unfortunately, NGINX can't pass all http headers, only predefined.
-// Also, even if you are going to use them, defaults aren't looks the same
-// as headers. For example, you may look for a "User-Agent", but under nginx that
-// would be HTTP_USER_AGENT. Currently, I would like to know what would be the
-// best solution to unify it's usage... Well, currently I can see only few options here:
-// 1. Edit nginx configuration and change these variables names to the names that matches
-//    header. For example, in /etc/nginx/fastcgi_params you can change CONTENT_TYPE
-//    to Content-Type
-// 2. Make a patch in nginx to allow pass headers as is, LOL
-// 3. Make a kludge in this software, like, correspondence default_headers_table, that silently changes
-//    string from User-Agent to HTTP_USER_AGENT just because of nginx
-// 4. Ask a application developer to support both (no, I definitely don't like it)
+		if (namelen > strizeof("HTTP_") and memcmp(name, "HTTP_", strizeof("HTTP_")) == 0) {
+			name += strizeof("HTTP_");
+			namelen -= strizeof("HTTP_");
+		} else if (PARAM_IS("CONTENT_TYPE") == false and PARAM_IS("CONTENT_LENGTH") == false) continue;
+#endif
+#undef PARAM_IS
+		header_index_add(&r->headers, name, namelen, value, valuelen);
+	}
+}
+
 static const char *locate_header_fun(const char *hdr, size_t *len, void *context) {
-	const char *looking_for = NULL;
-	for (unsigned i = 0; nginx_headers_table[i] != NULL; i+=2) {
-		if (strcmp(nginx_headers_table[i], hdr) == 0) {
-			looking_for = nginx_headers_table[i + 1];
+	struct fcgi_request *r = context;
+	return header_index_find(&r->headers, hdr, len);
+}
+
+static const struct reqio fcgi_io = {
+	.write = write_fun,
+	.read = read_fun,
+	.set_http_status_and_hdr = set_http_status_and_hdr_fun,
+	.locate_header = locate_header_fun,
+	.flush = flush_fun,
+	.write_fd = write_fd_fun,
+};
+
+static struct fcgi_req *fcgi_find(struct conn *c, unsigned id) {
+	for (struct fcgi_req *q = c->state; q; q = q->next) if (q->id == id) return q;
+	return NULL;
+}
+
+static void fcgi_req_free(struct conn *c, struct fcgi_req *q) {
+	for (struct fcgi_req **p = (struct fcgi_req **) &c->state; *p; p = &(*p)->next) {
+		if (*p == q) {
+			*p = q->next;
 			break;
 		}
 	}
-	if (looking_for == NULL) return NULL;
-	hdr = looking_for;
-#else
-static const char *locate_header_fun(const char *hdr, size_t *len, void *context) {
-#endif // NO_NGINX_KLUDGE
-	FCGX_Request *r = context;
-	char *result = FCGX_GetParam(hdr, r->envp);
-	if (result == NULL) return NULL;
-	*len = strlen(result);
-	return result;
+	ebuf_free(&q->params.copy);
+	ebuf_free(&q->body.copy);
+	if (q->spool >= 0) close(q->spool);
+	free(q);
 }
 
-int fd;
-void *worker(void *arg) {
-	FCGX_Request request;
-	FCGX_InitRequest(&request, fd, 0);
-	char workerbuffer[CONTEXTAPPBUFFERSIZE];
-	memcpy(workerbuffer, arg, sizeof(struct appcontext));
-
-	while (1) {
-		if (FCGX_Accept_r(&request) == -1) break;
-		app_write = write_fun_stub;
-		app_read = read_fun;
-		set_http_status_and_hdr = set_http_status_and_hdr_fun;
-//		char **ptr = request.envp;
-//		putchar('\n');
-//		while(*ptr != NULL) {
-//			puts(*ptr);
-//			ptr++;
-//		}
-
-		const char *req = FCGX_GetParam("DOCUMENT_URI", request.envp);
-		const char *method = FCGX_GetParam("REQUEST_METHOD", request.envp);
-		const char *query = FCGX_GetParam("QUERY_STRING", request.envp);
-
-		reqargs a = {.servercontext1 = &request,
-					 .servercontext2 = &request,
-					 .request = req,
-					 .request_len = strlen(req),
-					 .query = query,
-					 .query_len = query != NULL ? strlen(query) : 0,
-					 .appcontext = workerbuffer,
-					 .method = http_determine_method(method, strlen(method))
+static void fcgi_finish_req(struct conn *c, struct fcgi_req *q, unsigned char protocol_status) {
+	fcgi_end_request(c, q->id, protocol_status);
+	if (q->keep_conn == false) c->closing = true;
+	fcgi_req_free(c, q);
+}
+
+static void fcgi_handle(struct fcgi_request *r, struct conn *c, struct fcgi_req *q) {
+	size_t paramslen;
+	const char *params = fcgi_stream_data(&q->params, &paramslen);
+	index_params(r, params, paramslen);
+	r->c = c;
+	r->id = q->id;
+	r->headers_sent = false;
+	r->record_at = SIZE_MAX;
+	r->body = fcgi_stream_data(&q->body, &r->bodylen);
+	r->spool = q->spool;
+	if (q->spool >= 0) r->bodylen = q->spooled;
+	r->bodyread = 0;
+
+	if (r->uri == NULL or r->method == NULL) {
+		// not a request from http server, nothing to do with it
+	} else if (q->refused) {
+		set_http_status_and_hdr_fun(q->refused, NULL, r);
+	} else {
+		reqargs a = {.io = &fcgi_io,
+					 .servercontext1 = r,
+					 .servercontext2 = r,
+					 .request = r->uri,
+					 .request_len = r->urilen,
+					 .query = r->query,
+					 .query_len = r->querylen,
+					 .appcontext = generation_acquire(r->gen, r->workerbuffer),
+					 .method = http_determine_method(r->method, r->methodlen),
+					 .arena = &r->arena
 		};
+		client_address_parse(&a.client, r->remote, r->remotelen);
 		app_request(a);
-		FCGX_Finish_r(&request);
-		if (s_signo) break;
+		arena_reset(&r->arena);
+		generation_release(r->gen);
+		if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, r);
 	}
-	return NULL;
+	fcgi_stdout_close(r);
+	fcgi_record(c, FCGI_STDOUT, q->id, NULL, 0); // end of stream
+	fcgi_finish_req(c, q, FCGI_REQUEST_COMPLETE);
+}
+
+static void fcgi_get_values(struct conn *c, const char *content, size_t len) {
+	char result[256];
+	size_t resultlen = 0;
+	const unsigned char *p = (const unsigned char *) content, *end = p + len;
+	while(p < end) {
+		size_t namelen, valuelen;
+		if (fcgi_nv_length(&p, end, &namelen) == false or fcgi_nv_length(&p, end, &valuelen) == false) break;
+		if (namelen > (size_t) (end - p) or valuelen > (size_t) (end - p) - namelen) break;
+		const char *name = (const char *) p;
+		p += namelen + valuelen;
+
+		const char *value;
+		if (namelen == strizeof("FCGI_MAX_CONNS") and memcmp(name, "FCGI_MAX_CONNS", namelen) == 0) value = "1024";
+		else if (namelen == strizeof("FCGI_MAX_REQS") and memcmp(name, "FCGI_MAX_REQS", namelen) == 0) value = CBL_STRINGIZE_VALUE(FCGI_MAX_REQS);
+		else if (namelen == strizeof("FCGI_MPXS_CONNS") and memcmp(name, "FCGI_MPXS_CONNS", namelen) == 0) value = "1";
+		else continue;
+		size_t vlen = strlen(value);
+		if (namelen > 127 or resultlen + 2 + namelen + vlen > sizeof(result)) break;
+		result[resultlen++] = (char) namelen;
+		result[resultlen++] = (char) vlen;
+		memcpy(result + resultlen, name, namelen);
+		memcpy(result + resultlen + namelen, value, vlen);
+		resultlen += namelen + vlen;
+	}
+	fcgi_record(c, FCGI_GET_VALUES_RESULT, 0, result, resultlen);
+}
+
+static void fcgi_dispatch(struct fcgi_request *r, struct conn *c, unsigned type, unsigned id, const char *content, size_t len) {
+	if (id == 0) { // management records
+		if (type == FCGI_GET_VALUES) fcgi_get_values(c, content, len);
+		else {
+			unsigned char body[8] = {(unsigned char) type};
+			fcgi_record(c, FCGI_UNKNOWN_TYPE, 0, body, sizeof(body));
+		}
+		return;
+	}
+
+	struct fcgi_req *q = fcgi_find(c, id);
+	switch (type) {
+	case FCGI_BEGIN_REQUEST: {
+		if (q != NULL or len < 8) {
+			c->broken = true;
+			return;
+		}
+		unsigned role = (unsigned) ((unsigned char) content[0] << 8 | (unsigned char) content[1]);
+		bool keep_conn = (content[2] & FCGI_KEEP_CONN) != 0;
+		unsigned amount = 0;
+		for (struct fcgi_req *i = c->state; i; i = i->next) amount++;
+		if (role != FCGI_RESPONDER or amount >= FCGI_MAX_REQS) {
+			fcgi_end_request(c, id, role != FCGI_RESPONDER ? FCGI_UNKNOWN_ROLE : FCGI_OVERLOADED);
+			if (keep_conn == false) c->closing = true;
+			return;
+		}
+		q = calloc(1, sizeof(struct fcgi_req));
+		if (q == NULL) {
+			c->broken = true;
+			return;
+		}
+		q->id = (uint16_t) id;
+		q->keep_conn = keep_conn;
+		q->spool = -1;
+		q->next = c->state;
+		c->state = q;
+		return;
+	}
+	case FCGI_ABORT_REQUEST:
+		if (q) fcgi_finish_req(c, q, FCGI_REQUEST_COMPLETE);
+		return;
+	case FCGI_PARAMS:
+		if (q == NULL or q->params_done) return;
+		if (len == 0) q->params_done = true;
+		else fcgi_stream_add(&q->params, content, len, c);
+		return;
+	case FCGI_STDIN:
+		if (q == NULL) return;
+		if (len == 0) {
+			fcgi_handle(r, c, q);
+			return;
+		}
+		size_t have;
+		const char *body = fcgi_stream_data(&q->body, &have);
+		if (q->spool >= 0) have = q->spooled;
+		if (q->refused == 0 and have + len > generation_max_body()) q->refused = 413;
+		if (q->refused) return;
+		if (q->spool < 0 and have + len > FCGI_BODY_MEMORY) {
+			// what has been kept so far goes to spool first, it's the only copy of body from now on
+			q->spool = eloop_spool_open();
+			if (q->spool < 0 or eloop_write_whole(q->spool, body, have) == false) {
+				q->refused = 500;
+				return;
+			}
+			q->spooled = have;
+			ebuf_free(&q->body.copy);
+			q->body.view = NULL;
+		}
+		if (q->spool < 0) fcgi_stream_add(&q->body, content, len, c);
+		else if (eloop_write_whole(q->spool, content, len)) q->spooled += len;
+		else q->refused = 500;
+		return;
+	default: // FCGI_DATA is for filter role only
+		return;
+	}
+}
+
+static size_t fcgi_on_data(struct conn *c, struct eloop *l) {
+	struct fcgi_request *r = l->userdata;
+	size_t consumed = 0;
+	while(c->in.len - consumed >= FCGI_HEADER_LEN and c->closing == false and c->broken == false and eloop_congested(c) == false) {
+		const unsigned char *h = (const unsigned char *) c->in.data + consumed;
+		size_t contentlen = (size_t) h[4] << 8 | h[5];
+		size_t total = FCGI_HEADER_LEN + contentlen + h[6];
+		if (h[0] != FCGI_VERSION_1) {
+			c->broken = true;
+			break;
+		}
+		if (c->in.len - consumed < total) break;
+		fcgi_dispatch(r, c, h[1], (unsigned) h[2] << 8 | h[3], (const char *) h + FCGI_HEADER_LEN, contentlen);
+		consumed += total;
+	}
+	// connection buffer is going to be moved, requests which aren't complete yet need their own copy
+	for (struct fcgi_req *q = c->state; q; q = q->next) {
+		fcgi_stream_spill(&q->params, c);
+		fcgi_stream_spill(&q->body, c);
+	}
+	return consumed;
+}
+
+static void fcgi_on_close(struct conn *c, struct eloop *l) {
+	while(c->state) fcgi_req_free(c, c->state);
 }
 
+static const struct eloop_protocol fcgi_protocol = {
+	.on_data = fcgi_on_data,
+	.on_close = fcgi_on_close,
+};
+
 int randfd;
 void rfill(void *ptr, size_t size) {
 	ssize_t got = read(randfd, ptr, size);
@@ -178,50 +546,99 @@ void get_time(struct unix_epoch_with_ms *epoch) {
 	}
 }
 
+struct fcgi_loop {
+	pthread_t thread;
+	struct eloop loop;
+	int listenfd;
+	unsigned index;
+	struct worker_generation *gen;
+};
+
+void *worker(void *arg) {
+	struct fcgi_loop *f = arg;
+	affinity_pin(f->index); // before anything is allocated, see affinity.c
+	struct fcgi_request r = {.gen = f->gen, .workerbuffer = malloc(CONTEXTAPPBUFFERSIZE)};
+	if (r.workerbuffer == NULL or arena_init(&r.arena, SIZE_MAX) == false) { // limit is set by app_request()
+		perror("Unable to allocate worker buffer");
+		free(r.workerbuffer);
+		return NULL;
+	}
+
+	if (eloop_init(&f->loop, f->listenfd, &fcgi_protocol, &r) == false) {
+		perror("Unable to create event loop");
+		arena_free(&r.arena);
+		free(r.workerbuffer);
+		return NULL;
+	}
+	eloop_run(&f->loop);
+	eloop_free(&f->loop);
+	arena_print_stats(&r.arena, f->index);
+	arena_free(&r.arena);
+	free(r.workerbuffer);
+	return NULL;
+}
+
+// every loop is waiting on the same socket, EPOLLEXCLUSIVE wakes up only one of them
+static int serve(unsigned first, unsigned n_threads, int fd, const char *configfile) {
+	if (generation_slots_init(n_threads) == false) return EXIT_FAILURE;
+	struct fcgi_loop loops[n_threads];
+	unsigned started = 0;
+	for (; started < n_threads; started++) {
+		loops[started] = (struct fcgi_loop) {.listenfd = fd, .index = first + started, .gen = generation_slot(started)};
+		if (pthread_create(&loops[started].thread, NULL, worker, &loops[started]) != 0) break;
+	}
+	// requests which are being handled are finished, but connections are closed right after
+	eloop_stop = started < n_threads ? SIGTERM : generation_wait(configfile, rfill, get_time);
+
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(loops[i].thread, NULL);
+	}
+	return started == n_threads ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct prefork_args {
+	int fd;
+	const char *configfile;
+};
+
+static int prefork_serve(unsigned index, void *arg) {
+	struct prefork_args *p = arg;
+	int ret = serve(index, 1, p->fd, p->configfile);
+	generation_finish();
+	return ret;
+}
+
 int main(int argc, char **argv) {
-	fd = FCGX_OpenSocket(sockpath, 128);
+	int fd = eloop_listen_unix(sockpath);
 	randfd = open("/dev/urandom", O_RDONLY);
-	FCGX_Init();
 	if (fd < 0 or randfd < 0) return EXIT_FAILURE;
-	chmod(sockpath, 0777);
-	signal(SIGINT, signal_handler);  // threads WILL NOT exit unless they finish request,
-	signal(SIGTERM, signal_handler); // even if it's still received. That's a todo.
-	locate_header = locate_header_fun;
-
-	struct appconfig config = {.r = rfill, .t = get_time};
-	set_config_defaults(&config);
-	if (argc > 1) {
-		const char *error;
-		bool ret = parse_config(&config, argv[1], &error);
-		if (ret == false) {
-			printf("%s\n", error);
-			return ret;
-		}
-	}
+	signal(SIGPIPE, SIG_IGN);
+	generation_block_signals(); // SIGHUP reloads config, see reload.c
 
-	char contextbuffer[sizeof(struct appcontext)];
-	void *appcontext = contextbuffer;
-	if (app_prepare(&appcontext, &config) == false) {
-		printf("Unable to initialize app, reason: %s\n", contextbuffer);
-		parse_config_erase(&config);
+	const char *configfile = argc > 1 ? argv[1] : NULL;
+	const char *error;
+	struct generation *g = generation_create(configfile, rfill, get_time, &error);
+	if (g == NULL or affinity_init(g->config.cpu_affinity, &error) == false or app_caches_create(&error) == false) {
+		printf("%s\n", error);
+		unlink(sockpath);
 		return EXIT_FAILURE;
 	}
+	generation_publish(g);
 
-	const unsigned n_threads = 4;
-	pthread_t threads[n_threads];
-	for (unsigned i = 0; i < n_threads; i++ ) {
-		pthread_create(&threads[i], NULL, worker, appcontext);
-	}
-
-	for (unsigned i = 0; i < n_threads; i++ ) {
-		pthread_join(threads[i], NULL);
+	// socket is opened already, so workers in pre-fork mode are just inheriting it
+	const unsigned n_workers = config_workers(&g->config);
+	int ret;
+	if (g->config.prefork) {
+		struct prefork_args p = {.fd = fd, .configfile = configfile};
+		ret = prefork_run(n_workers, prefork_serve, &p, configfile, rfill, get_time);
+	} else {
+		ret = serve(0, n_workers, fd, configfile);
 	}
-	app_finish(appcontext);
+	generation_finish();
+	app_caches_destroy();
 	unlink(sockpath);
-	parse_config_erase(&config);
 	close(fd);
 	close(randfd);
-	OS_LibShutdown(); // IMO function should be exported.
 
-	return EXIT_SUCCESS;
+	return ret;
 }
@@ -0,0 +1,112 @@
+#ifndef GUARD_HASH_POOL_C
+#define GUARD_HASH_POOL_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.c"
+
+// Password hashing is slow by design, so it runs on a few dedicated threads. Request thread puts a job to
+// the queue and sleeps until it's done. Queue is bounded: when it's full, job is refused right away and
+// request gets 503, so burst of logins occupies at most threads + queue request threads, others keep
+// rendering pages. Threads are started by the first job in every process (prefork workers are forked
+// before any job is there, and threads don't survive fork anyway).
+
+struct hash_job {
+	void (*fun)(void *);
+	void *arg;
+	bool done;
+	struct hash_job *next;
+};
+
+struct hash_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t finished;
+	struct hash_job *head;
+	struct hash_job *tail;
+	unsigned queued; // including ones which are being done
+	unsigned threads;
+	unsigned limit;
+	pid_t owner; // process which has started threads
+
+	// statistics
+	unsigned long jobs;
+	unsigned long refused;
+};
+
+#define HASH_POOL_INITIALIZER {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER}
+
+static void *hash_pool_thread(void *arg) {
+	struct hash_pool *p = arg;
+	pthread_mutex_lock(&p->lock);
+	while(1) {
+		while(p->head == NULL) pthread_cond_wait(&p->work, &p->lock);
+		struct hash_job *j = p->head;
+		p->head = j->next;
+		if (p->head == NULL) p->tail = NULL;
+		pthread_mutex_unlock(&p->lock);
+
+		j->fun(j->arg);
+
+		pthread_mutex_lock(&p->lock);
+		j->done = true;
+		p->queued--;
+		pthread_cond_broadcast(&p->finished);
+	}
+	return NULL;
+}
+
+// threads == 0 means half of CPUs. Called with lock held
+static bool hash_pool_start(struct hash_pool *p, unsigned threads, unsigned queue) {
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 1 ? (unsigned) cpus / 2 : 1;
+	}
+	p->head = p->tail = NULL;
+	p->queued = 0;
+	p->threads = 0;
+	p->limit = threads + queue;
+	for (unsigned i = 0; i < threads; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, hash_pool_thread, p) != 0) break;
+		pthread_detach(t);
+		p->threads++;
+	}
+	p->owner = getpid();
+	return p->threads > 0;
+}
+
+// Returns false if queue is full (or threads can't be started), fun isn't called then
+bool hash_pool_run(struct hash_pool *p, unsigned threads, unsigned queue, void (*fun)(void *), void *arg) {
+	struct hash_job j = {.fun = fun, .arg = arg};
+
+	pthread_mutex_lock(&p->lock);
+	if (p->owner != getpid() and hash_pool_start(p, threads, queue) == false) {
+		pthread_mutex_unlock(&p->lock);
+		return false;
+	}
+	if (p->queued == p->limit) {
+		p->refused++;
+		pthread_mutex_unlock(&p->lock);
+		return false;
+	}
+	p->queued++;
+	p->jobs++;
+	if (p->tail) p->tail->next = &j;
+	else p->head = &j;
+	p->tail = &j;
+	pthread_cond_signal(&p->work);
+	while(j.done == false) pthread_cond_wait(&p->finished, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	return true;
+}
+
+void hash_pool_print_stats(struct hash_pool *p) {
+	if (p->owner != getpid()) return;
+	printf("Hashing pool: %u threads, %lu jobs, %lu refused because queue was full\n", p->threads, p->jobs, p->refused);
+}
+
+#endif // GUARD_HASH_POOL_C
@@ -0,0 +1,91 @@
+#ifndef GUARD_KDF_C
+#define GUARD_KDF_C
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.c"
+#include "external/sha256.c"
+
+// PBKDF2-HMAC-SHA256 (RFC 8018) for passwords. Inner and outer HMAC states are computed once, every
+// iteration is just two SHA-256 blocks then. Cost is an amount of iterations, it's stored with every
+// user, so it might be changed in config at any time: users are rehashed with new cost when they log in.
+
+#define SHA256_CHUNK 64
+
+struct hmac_sha256 {
+	SHA256_CTX inner;
+	SHA256_CTX outer;
+};
+
+void hmac_sha256_init(struct hmac_sha256 *h, const void *key, size_t keylen) {
+	BYTE block[SHA256_CHUNK] = {0};
+	if (keylen > SHA256_CHUNK) {
+		SHA256_CTX ctx;
+		sha256_init(&ctx);
+		sha256_update(&ctx, key, keylen);
+		sha256_final(&ctx, block);
+	} else {
+		memcpy(block, key, keylen);
+	}
+
+	BYTE pad[SHA256_CHUNK];
+	for (unsigned i = 0; i < SHA256_CHUNK; i++) pad[i] = block[i] ^ 0x36;
+	sha256_init(&h->inner);
+	sha256_update(&h->inner, pad, SHA256_CHUNK);
+	for (unsigned i = 0; i < SHA256_CHUNK; i++) pad[i] = block[i] ^ 0x5c;
+	sha256_init(&h->outer);
+	sha256_update(&h->outer, pad, SHA256_CHUNK);
+}
+
+// h is left as it was, so it can be used for next message with the same key
+void hmac_sha256(const struct hmac_sha256 *h, const void *message, size_t len, BYTE out[SHA256_BLOCK_SIZE]) {
+	SHA256_CTX ctx = h->inner;
+	sha256_update(&ctx, message, len);
+	sha256_final(&ctx, out);
+	ctx = h->outer;
+	sha256_update(&ctx, out, SHA256_BLOCK_SIZE);
+	sha256_final(&ctx, out);
+}
+
+void pbkdf2_hmac_sha256(const void *password, size_t passwordlen, const void *salt, size_t saltlen, uint32_t iterations, void *out, size_t outlen) {
+	struct hmac_sha256 h;
+	hmac_sha256_init(&h, password, passwordlen);
+
+	BYTE *dst = out;
+	for (uint32_t block = 1; outlen > 0; block++) {
+		BYTE u[SHA256_BLOCK_SIZE];
+		BYTE t[SHA256_BLOCK_SIZE];
+		BYTE index[4] = {(BYTE) (block >> 24), (BYTE) (block >> 16), (BYTE) (block >> 8), (BYTE) block};
+
+		SHA256_CTX ctx = h.inner; // U1 = HMAC(password, salt || INT(block))
+		sha256_update(&ctx, salt, saltlen);
+		sha256_update(&ctx, index, sizeof(index));
+		sha256_final(&ctx, u);
+		ctx = h.outer;
+		sha256_update(&ctx, u, SHA256_BLOCK_SIZE);
+		sha256_final(&ctx, u);
+		memcpy(t, u, SHA256_BLOCK_SIZE);
+
+		for (uint32_t i = 1; i < iterations; i++) {
+			hmac_sha256(&h, u, SHA256_BLOCK_SIZE, u);
+			for (unsigned j = 0; j < SHA256_BLOCK_SIZE; j++) t[j] ^= u[j];
+		}
+
+		size_t len = CBL_MIN(outlen, (size_t) SHA256_BLOCK_SIZE);
+		memcpy(dst, t, len);
+		dst += len;
+		outlen -= len;
+	}
+}
+
+// Comparison of hashes which doesn't stop on first difference
+bool kdf_equal(const void *a, const void *b, size_t len) {
+	const BYTE *x = a;
+	const BYTE *y = b;
+	BYTE diff = 0;
+	for (size_t i = 0; i < len; i++) diff |= x[i] ^ y[i];
+	return diff == 0;
+}
+
+#endif // GUARD_KDF_C
@@ -0,0 +1,212 @@
+#ifndef GUARD_LOGIN_THROTTLE_C
+#define GUARD_LOGIN_THROTTLE_C
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "util.c"
+#include "shm_lock.c"
+
+// Failed logins are counted here, so attempts which are coming too often are refused before user is read
+// from storage and before password is hashed. Workers are counting together in one table (see shm_lock.c),
+// which has fixed size: key hash chooses a stripe, stripe has it's own lock and LOGIN_THROTTLE_WAYS entries.
+// When stripe is full, the entry which doesn't ban anyone and has failed the longest time ago is replaced.
+//
+// Every attempt is counted under three keys: name with address (somebody is guessing a password), address
+// alone (one host is trying many names) and name alone (one account is attacked from many hosts). Every kind
+// has it's amount of failures which are free, after that every failure doubles the time when next attempt
+// is refused, up to a maximum. Counter is forgotten when there were no failures for LOGIN_THROTTLE_FORGET.
+// Long bans are those of name with address only: name alone is known to anybody, so it's ban is kept short,
+// otherwise anyone would be able to lock the owner out of the account. Nothing is stored, restart forgets it all.
+
+#define LOGIN_THROTTLE_WAYS 8
+#define LOGIN_THROTTLE_ALIGN 64
+#define LOGIN_THROTTLE_FORGET 86400
+#define LOGIN_THROTTLE_ADDRESS_SIZE 16
+
+enum login_throttle_kind {LOGIN_THROTTLE_PAIR, LOGIN_THROTTLE_ADDRESS, LOGIN_THROTTLE_NAME, LOGIN_THROTTLE_KINDS};
+
+static const struct {
+	uint32_t free; // failures before the first delay
+	time_t max; // seconds
+} login_throttle_policy[LOGIN_THROTTLE_KINDS] = {
+	[LOGIN_THROTTLE_PAIR]    = {.free = 5,  .max = 86400},
+	[LOGIN_THROTTLE_ADDRESS] = {.free = 30, .max = 900},
+	[LOGIN_THROTTLE_NAME]    = {.free = 50, .max = 60},
+};
+
+struct login_throttle_entry {
+	uint64_t hash; // 0 means empty
+	time_t until; // attempts are refused before that
+	time_t last; // the last failure
+	uint32_t failures;
+};
+
+struct login_throttle_stripe {
+	pthread_mutex_t lock;
+	struct login_throttle_entry entries[LOGIN_THROTTLE_WAYS];
+};
+
+struct login_throttle {
+	size_t stripes; // power of two
+	size_t stripesize;
+	size_t mapped;
+};
+
+const char login_throttle_error_size[] = "Login throttle size is invalid";
+
+#define LOGIN_THROTTLE_ROUND(a) (((a) + LOGIN_THROTTLE_ALIGN - 1) & ~((size_t) LOGIN_THROTTLE_ALIGN - 1))
+
+static inline struct login_throttle_stripe *login_throttle_stripe_at(struct login_throttle *t, size_t i) {
+	return (struct login_throttle_stripe *) ((char *) t + LOGIN_THROTTLE_ROUND(sizeof(struct login_throttle)) + i * t->stripesize);
+}
+
+static uint64_t login_throttle_hash(enum login_throttle_kind kind, const char *name, size_t namelen, const unsigned char *address) {
+	uint64_t h = 14695981039346656037ull; // FNV-1a
+	h = (h ^ (unsigned char) kind) * 1099511628211ull;
+	if (kind != LOGIN_THROTTLE_ADDRESS) {
+		for (size_t i = 0; i < namelen; i++) h = (h ^ (unsigned char) name[i]) * 1099511628211ull;
+	}
+	if (kind != LOGIN_THROTTLE_NAME) {
+		for (size_t i = 0; i < LOGIN_THROTTLE_ADDRESS_SIZE; i++) h = (h ^ address[i]) * 1099511628211ull;
+	}
+	return h ? h : 1;
+}
+
+struct login_throttle *login_throttle_create(size_t entries, const char **error) {
+	if (entries == 0) OUCH_ERROR(login_throttle_error_size, return NULL);
+	size_t stripes = 1;
+	while(stripes * LOGIN_THROTTLE_WAYS < entries) stripes <<= 1;
+	size_t stripesize = LOGIN_THROTTLE_ROUND(sizeof(struct login_throttle_stripe));
+	size_t mapped = LOGIN_THROTTLE_ROUND(sizeof(struct login_throttle)) + stripes * stripesize;
+
+	struct login_throttle *t = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED) OUCH_ERROR(strerror(errno), return NULL);
+	*t = (struct login_throttle) {.stripes = stripes, .stripesize = stripesize, .mapped = mapped};
+
+	for (size_t i = 0; i < stripes; i++) {
+		shm_lock_init(&login_throttle_stripe_at(t, i)->lock); // mapping is zeroed, so entries are empty
+	}
+	return t;
+}
+
+void login_throttle_destroy(struct login_throttle *t) {
+	if (t == NULL) return;
+	for (size_t i = 0; i < t->stripes; i++) {
+		pthread_mutex_destroy(&login_throttle_stripe_at(t, i)->lock);
+	}
+	munmap(t, t->mapped);
+}
+
+// Entries are just few numbers which are written at once, so stripe of dead process is kept as is
+static struct login_throttle_stripe *login_throttle_lock(struct login_throttle *t, uint64_t hash) {
+	struct login_throttle_stripe *s = login_throttle_stripe_at(t, hash & (t->stripes - 1));
+	return shm_lock(&s->lock, NULL, NULL) ? s : NULL;
+}
+
+static struct login_throttle_entry *login_throttle_find(struct login_throttle_stripe *s, uint64_t hash, time_t now) {
+	for (unsigned i = 0; i < LOGIN_THROTTLE_WAYS; i++) {
+		struct login_throttle_entry *e = &s->entries[i];
+		if (e->hash != hash) continue;
+		if (e->until <= now and now - e->last > LOGIN_THROTTLE_FORGET) {
+			e->hash = 0;
+			return NULL;
+		}
+		return e;
+	}
+	return NULL;
+}
+
+static struct login_throttle_entry *login_throttle_take(struct login_throttle_stripe *s, uint64_t hash, time_t now) {
+	struct login_throttle_entry *e = login_throttle_find(s, hash, now);
+	if (e) return e;
+
+	struct login_throttle_entry *victim = &s->entries[0];
+	for (unsigned i = 0; i < LOGIN_THROTTLE_WAYS; i++) {
+		e = &s->entries[i];
+		if (e->hash == 0) {
+			victim = e;
+			break;
+		}
+		bool banned = e->until > now, victim_banned = victim->until > now;
+		if (banned != victim_banned) {
+			if (victim_banned) victim = e;
+		} else if (banned ? e->until < victim->until : e->last < victim->last) {
+			victim = e;
+		}
+	}
+	*victim = (struct login_throttle_entry) {.hash = hash};
+	return victim;
+}
+
+static bool login_throttle_applies(enum login_throttle_kind kind, const unsigned char *address) {
+	if (kind == LOGIN_THROTTLE_NAME) return true;
+	// without address everybody would be counted as the same host
+	for (unsigned i = 0; i < LOGIN_THROTTLE_ADDRESS_SIZE; i++) if (address[i]) return true;
+	return false;
+}
+
+// Returns 0 if attempt might go on, otherwise amount of seconds before the next one is allowed
+unsigned long login_throttle_check(struct login_throttle *t, const char *name, size_t namelen, const unsigned char *address) {
+	time_t now = time(NULL), until = now;
+	for (enum login_throttle_kind kind = 0; kind < LOGIN_THROTTLE_KINDS; kind++) {
+		if (login_throttle_applies(kind, address) == false) continue;
+		uint64_t hash = login_throttle_hash(kind, name, namelen, address);
+		struct login_throttle_stripe *s = login_throttle_lock(t, hash);
+		if (s == NULL) continue;
+		struct login_throttle_entry *e = login_throttle_find(s, hash, now);
+		if (e and e->until > until) until = e->until;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return (unsigned long) (until - now);
+}
+
+void login_throttle_failed(struct login_throttle *t, const char *name, size_t namelen, const unsigned char *address) {
+	time_t now = time(NULL);
+	for (enum login_throttle_kind kind = 0; kind < LOGIN_THROTTLE_KINDS; kind++) {
+		if (login_throttle_applies(kind, address) == false) continue;
+		uint64_t hash = login_throttle_hash(kind, name, namelen, address);
+		struct login_throttle_stripe *s = login_throttle_lock(t, hash);
+		if (s == NULL) continue;
+		struct login_throttle_entry *e = login_throttle_take(s, hash, now);
+		if (e->failures < UINT32_MAX) e->failures++;
+		e->last = now;
+		uint32_t over = e->failures > login_throttle_policy[kind].free ? e->failures - login_throttle_policy[kind].free : 0;
+		if (over > 0) {
+			time_t delay = over > 31 ? login_throttle_policy[kind].max : (time_t) 1 << (over - 1);
+			if (delay > login_throttle_policy[kind].max) delay = login_throttle_policy[kind].max;
+			if (now + delay > e->until) e->until = now + delay;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+// Right password: name is not under attack (or it has been guessed already), and it's host is known now
+void login_throttle_succeeded(struct login_throttle *t, const char *name, size_t namelen, const unsigned char *address) {
+	time_t now = time(NULL);
+	enum login_throttle_kind kinds[] = {LOGIN_THROTTLE_PAIR, LOGIN_THROTTLE_NAME};
+	for (unsigned i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+		if (login_throttle_applies(kinds[i], address) == false) continue;
+		uint64_t hash = login_throttle_hash(kinds[i], name, namelen, address);
+		struct login_throttle_stripe *s = login_throttle_lock(t, hash);
+		if (s == NULL) continue;
+		struct login_throttle_entry *e = login_throttle_find(s, hash, now);
+		if (e) e->hash = 0;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+void login_throttle_clear(struct login_throttle *t) {
+	for (size_t i = 0; i < t->stripes; i++) {
+		struct login_throttle_stripe *s = login_throttle_stripe_at(t, i);
+		if (login_throttle_lock(t, i) == NULL) continue;
+		memset(s->entries, 0, sizeof(s->entries));
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+#endif // GUARD_LOGIN_THROTTLE_C
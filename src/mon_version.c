@@ -1,14 +1,28 @@
+#define _GNU_SOURCE
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 
 #include <signal.h>
 #include <iso646.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "mongoose.h"
 
+// Mongoose gives the request to handler when it's in it's buffer as a whole, body included
+#ifndef MG_MAX_RECV_SIZE
+#define MG_MAX_RECV_SIZE (3UL * 1024UL * 1024UL)
+#endif
+#define GENERATION_BODY_MAX (MG_MAX_RECV_SIZE / 3 * 2) // the rest is for the head
+
 int debugfd = STDOUT_FILENO;
 
 #include "app.c"
 #include "common.c"
+#include "reload.c"
+#include "affinity.c"
 
 void weird_debug() {
 	debugfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -17,52 +31,83 @@ void weird_debug() {
 	dprintf(debugfd, "HELLLLOOOOUUU!\n");
 }
 
-static int s_signo = 0;
-static void signal_handler(int signo) {
-	s_signo = signo;
-}
-
-static void write_fun(const void *addr, unsigned long amount, void *context) {
-	if (amount == 0) return;
-	mg_http_write_chunk(context, addr, amount);
-}
+static volatile sig_atomic_t s_signo = 0;
+static volatile sig_atomic_t s_failed = 0; // event loop wasn't able to start, so the whole server is stopped
 
-static void set_http_status_and_hdr_fun_stub(unsigned short status, const char * const *headers, void *context) {}
+struct mon_request {
+	struct mg_connection *c;
+	struct mg_http_message *hm;
+	bool headers_sent;
+	size_t bodyread;
+	struct header_index headers;
+};
 
 static void set_http_status_and_hdr_fun(unsigned short status, const char * const *headers, void *context) {
+	struct mon_request *r = context;
+	if (r->headers_sent) return;
+	r->headers_sent = true;
+
 	if (status > 999 or status < 100) status = 503;
-	mg_printf(context, "HTTP/1.1 %u\r\nTransfer-Encoding: chunked\r\n", status);
+	mg_printf(r->c, "HTTP/1.1 %u\r\nTransfer-Encoding: chunked\r\n", status);
 	if (headers != NULL) {
 		for (unsigned i = 0; headers[i] != NULL; i++) {
-			mg_send(context, headers[i], strlen(headers[i]));
-			mg_send(context, "\r\n", 2);
+			mg_send(r->c, headers[i], strlen(headers[i]));
+			mg_send(r->c, "\r\n", 2);
 		}
 	}
-	mg_send(context, "\r\n", 2);
-
-	app_write = write_fun;
-	set_http_status_and_hdr = set_http_status_and_hdr_fun_stub;
+	mg_send(r->c, "\r\n", 2);
 }
 
-static void write_fun_stub(const void *addr, unsigned long amount, void *context) {
-	set_http_status_and_hdr_fun(200, NULL, context);
-	write_fun(addr, amount, context);
+static void write_fun(const void *addr, unsigned long amount, void *context) {
+	struct mon_request *r = context;
+	if (r->headers_sent == false) set_http_status_and_hdr_fun(200, NULL, context);
+	if (amount == 0) return;
+	mg_http_write_chunk(r->c, addr, amount);
 }
 
 static void read_fun(void *addr, unsigned long *amount, void *context) {
-	struct mg_http_message *hm = context;
-	if (*amount > INT_MAX) *amount = INT_MAX;
-	*amount = (unsigned long) hm->body.len;
-	if (*amount > 0) memcpy(addr, hm->body.ptr, *amount);
+	struct mon_request *r = context;
+	size_t left = r->hm->body.len - r->bodyread;
+	if (*amount > left) *amount = left;
+	if (*amount > 0) memcpy(addr, r->hm->body.ptr + r->bodyread, *amount);
+	r->bodyread += *amount;
 }
 
 static const char *locate_header_fun(const char *hdr, size_t *len, void *context) {
-	struct mg_str *m = mg_http_get_header(context, hdr);
-	if (m == NULL) return NULL;
-	*len = m->len;
-	return m->ptr;
+	struct mon_request *r = context;
+	return header_index_find(&r->headers, hdr, len);
 }
 
+static const struct reqio mon_io = {
+	.write = write_fun,
+	.read = read_fun,
+	.set_http_status_and_hdr = set_http_status_and_hdr_fun,
+	.locate_header = locate_header_fun,
+};
+
+// Every event loop has it's own mg_mgr, copy of appcontext and listening socket with SO_REUSEPORT,
+// so kernel spreads incoming connections between loops and one blocking request won't stall the rest.
+// Mongoose has no option for SO_REUSEPORT, so the socket is created here and swapped with the one
+// which mg_http_listen() has opened on a random port of loopback. Everything else about listener stays
+// mongoose's. That's not mongoose's API, it works because of what mongoose 7.x does:
+// - c->fd of listener is it's socket, casted to pointer. It's checked by mon_listener_is() before the swap,
+//   so mongoose which keeps something else there fails at startup instead of listening to nothing.
+// - Listener is polled and accept()ed via c->fd on every mg_mgr_poll(), it isn't registered anywhere
+//   when it's opened. Mongoose with MG_ENABLE_EPOLL does register it, so such build is refused below.
+// - c->loc still says 127.0.0.1 with random port, mongoose uses it for logs only.
+// - Socket is non-blocking, like those of mongoose.
+#if defined(MG_ENABLE_EPOLL) and MG_ENABLE_EPOLL
+#error Listening sockets are swapped (see event_loop()), they can not be registered in epoll of mongoose
+#endif
+struct event_loop {
+	pthread_t thread;
+	int fd;
+	unsigned index;
+	struct worker_generation *gen;
+	void *workerbuffer;
+	struct arena arena;
+};
+
 static void cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 	if (ev != MG_EV_HTTP_MSG) return;
 	struct mg_http_message *hm = (struct mg_http_message *) ev_data;
@@ -78,18 +123,30 @@ static void cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 		return;
 	}
 
-	app_write = write_fun_stub;
-	app_read = read_fun;
-	set_http_status_and_hdr = set_http_status_and_hdr_fun;
-	reqargs a = {.servercontext1 = c,
-				 .servercontext2 = hm,
+	struct event_loop *l = fn_data;
+	struct mon_request r = {.c = c, .hm = hm};
+	header_index_reset(&r.headers);
+	size_t max = sizeof(hm->headers) / sizeof(hm->headers[0]);
+	for (size_t i = 0; i < max and hm->headers[i].name.len > 0; i++) {
+		header_index_add(&r.headers, hm->headers[i].name.ptr, hm->headers[i].name.len, hm->headers[i].value.ptr, hm->headers[i].value.len);
+	}
+
+	reqargs a = {.io = &mon_io,
+				 .servercontext1 = &r,
+				 .servercontext2 = &r,
 				 .request = hm->uri.ptr,
 				 .request_len = hm->uri.len,
 				 .query = hm->query.ptr,
 				 .query_len = hm->query.len,
-				 .appcontext = fn_data,
-				 .method = http_determine_method(hm->method.ptr, hm->method.len)
+				 .appcontext = generation_acquire(l->gen, l->workerbuffer),
+				 .method = http_determine_method(hm->method.ptr, hm->method.len),
+				 .arena = &l->arena
 	};
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	if (getpeername((int) (size_t) c->fd, (struct sockaddr *) &peer, &peerlen) == 0 and peerlen <= sizeof(peer)) {
+		client_address_from_sockaddr(&a.client, (const struct sockaddr *) &peer);
+	}
 
 //	size_t i, max = sizeof(hm->headers) / sizeof(hm->headers[0]);
 //	printf("Request headers:\n");
@@ -100,6 +157,9 @@ static void cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 //	}
 
 	app_request(a);
+	arena_reset(&l->arena);
+	generation_release(l->gen);
+	if (r.headers_sent == false) set_http_status_and_hdr_fun(200, NULL, &r);
 	mg_http_write_chunk(c, "", 0);
 }
 
@@ -120,43 +180,107 @@ void get_time(struct unix_epoch_with_ms *epoch) {
 	}
 }
 
+static int reuseport_listener(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	int on = 1;
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t) port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) goto fail;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) goto fail;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) goto fail;
+	if (listen(fd, SOMAXCONN) < 0) goto fail;
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) goto fail;
+	return fd;
+
+	fail:
+	close(fd);
+	return -1;
+}
+
+// Listener which mongoose has opened is found in c->fd: listening socket on loopback
+static bool mon_listener_is(struct mg_connection *c) {
+	int fd = (int) (size_t) c->fd;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listening = 0;
+	socklen_t len = sizeof(listening);
+	if (getsockname(fd, (struct sockaddr *) &addr, &addrlen) != 0 or addrlen != sizeof(addr)) return false;
+	if (addr.sin_family != AF_INET or addr.sin_addr.s_addr != htonl(INADDR_LOOPBACK) or addr.sin_port == 0) return false;
+	return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 and listening != 0;
+}
+
+static void *event_loop(void *arg) {
+	struct event_loop *l = arg;
+	affinity_pin(l->index); // before anything is allocated, see affinity.c
+	l->workerbuffer = malloc(CONTEXTAPPBUFFERSIZE);
+	if (l->workerbuffer == NULL or arena_init(&l->arena, SIZE_MAX) == false) { // limit is set by app_request()
+		MG_ERROR(("Unable to allocate worker buffer"));
+		free(l->workerbuffer);
+		close(l->fd);
+		return NULL;
+	}
+
+	struct mg_mgr mgr;
+	mg_mgr_init(&mgr);
+	struct mg_connection *c = mg_http_listen(&mgr, "http://127.0.0.1:0", cb, l);
+	if (c == NULL or mon_listener_is(c) == false) {
+		MG_ERROR((c ? "Listener of this mongoose version can't be swapped, see event_loop()" : "Cannot listen!"));
+		s_failed = 1;
+		kill(getpid(), SIGTERM); // it's waited by generation_wait()
+		close(l->fd);
+		mg_mgr_free(&mgr);
+		arena_free(&l->arena);
+		free(l->workerbuffer);
+		return NULL;
+	}
+	close((int) (size_t) c->fd);
+	c->fd = (void *) (size_t) l->fd;
+
+	while (s_signo == 0) mg_mgr_poll(&mgr, 1000);
+	mg_mgr_free(&mgr);
+	arena_print_stats(&l->arena, l->index);
+	arena_free(&l->arena);
+	free(l->workerbuffer);
+	return NULL;
+}
+
 int main(int argc, char **argv) {
-	signal(SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);
-	locate_header = locate_header_fun;
+	generation_block_signals(); // SIGHUP reloads config, see reload.c
 	randfd = open("/dev/urandom", O_RDONLY); //weird_debug();
 	if (randfd < 0) return EXIT_FAILURE;
-	struct appconfig config = {.r = rfill, .t = get_time};
-	set_config_defaults(&config);
-	if (argc > 1) {
-		const char *error;
-		bool ret = parse_config(&config, argv[1], &error);
-		if (ret == false) {
-			printf("%s\n", error);
-			return ret;
-		}
+	const char *configfile = argc > 1 ? argv[1] : NULL;
+	const char *error;
+	struct generation *g = generation_create(configfile, rfill, get_time, &error);
+	if (g == NULL or affinity_init(g->config.cpu_affinity, &error) == false or app_caches_create(&error) == false) {
+		MG_ERROR(("%s\n", error));
+		return EXIT_FAILURE;
 	}
+	generation_publish(g);
+	if (g->config.prefork) MG_ERROR(("Pre-fork mode is supported by epoll and fastcgi versions only, using threads\n"));
 
-	struct mg_mgr mgr;
-	mg_mgr_init(&mgr);
 	mg_log_set(MG_LL_INFO);
 //	mg_log_set(MG_LL_VERBOSE);
-	char contextbuffer[CONTEXTAPPBUFFERSIZE];
-	void *appcontext = contextbuffer;
-	if (app_prepare(&appcontext, &config) == false) {
-		parse_config_erase(&config);
-		MG_ERROR(("Unable to initialize app, reason: %s\n", contextbuffer));
-		return EXIT_FAILURE;
-	}
-	if ((mg_http_listen(&mgr, "http://0.0.0.0:8000", cb, appcontext)) == NULL) {
-		parse_config_erase(&config);
-		MG_ERROR(("Cannot listen!"));
-		return EXIT_FAILURE;
+	const unsigned n_loops = config_workers(&g->config);
+	const int port = g->config.http_port;
+	if (generation_slots_init(n_loops) == false) return EXIT_FAILURE;
+	struct event_loop loops[n_loops];
+	unsigned started = 0;
+	for (; started < n_loops; started++) {
+		loops[started] = (struct event_loop) {.fd = reuseport_listener(port), .index = started, .gen = generation_slot(started)};
+		if (loops[started].fd < 0) {
+			MG_ERROR(("Cannot listen on port %d: %s\n", port, strerror(errno)));
+			break;
+		}
+		if (pthread_create(&loops[started].thread, NULL, event_loop, &loops[started]) != 0) {
+			close(loops[started].fd);
+			break;
+		}
 	}
+	s_signo = started < n_loops ? SIGTERM : generation_wait(configfile, rfill, get_time);
 
-	while (s_signo == 0) mg_mgr_poll(&mgr, 1000);
-	mg_mgr_free(&mgr);
-	app_finish(appcontext);
-	parse_config_erase(&config);
-	return EXIT_SUCCESS;
+	for (unsigned i = 0; i < started; i++) pthread_join(loops[i].thread, NULL);
+	generation_finish();
+	app_caches_destroy();
+	close(randfd);
+	return started == n_loops and s_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
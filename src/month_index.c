@@ -0,0 +1,171 @@
+#ifndef GUARD_MONTH_INDEX_C
+#define GUARD_MONTH_INDEX_C
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "util.c"
+#include "shm_lock.c"
+
+// Records are bucketed by month when they have been created (UTC): how many of them every month has, and the range
+// of their numbers (see /archive of app.c). Storage keeps the buckets itself (see archive_months()), and workers
+// are sharing this copy (see shm_lock.c), so archive navigation is rendered without reading anything. It's filled
+// from data layer by the first worker which needs it, then app adds new records itself.
+
+#define MONTH_INDEX_MAX 2400 // 200 years of months which have records
+
+struct month_bucket {
+	uint16_t year;
+	uint8_t month; // 1-12
+	uint32_t records;
+	uint32_t first; // the smallest and the biggest number of record which has been created this month
+	uint32_t last;
+};
+
+struct month_index {
+	pthread_mutex_t lock;
+	bool filled;
+	size_t amount;
+	struct month_bucket months[MONTH_INDEX_MAX]; // older ones first
+};
+
+// Days since 1970-01-01 and back, for the proleptic Gregorian calendar. gmtime_r() is fine too, but timegm()
+// isn't portable, so both ways are done the same way
+static inline int64_t month_days_from_civil(int64_t y, unsigned m, unsigned d) {
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	unsigned yoe = (unsigned) (y - era * 400);
+	unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t) doe - 719468;
+}
+
+static inline void month_of(time_t t, uint16_t *year, uint8_t *month) {
+	int64_t z = (int64_t) (t >= 0 ? t / 86400 : (t - 86399) / 86400) + 719468;
+	int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	unsigned doe = (unsigned) (z - era * 146097);
+	unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned mp = (5 * doy + 2) / 153;
+	unsigned m = mp < 10 ? mp + 3 : mp - 9;
+	int64_t y = (int64_t) yoe + era * 400 + (m <= 2);
+	*year = (uint16_t) CBL_MAX(CBL_MIN(y, 9999), 0);
+	*month = (uint8_t) m;
+}
+
+// The first second of month, month 13 is January of the next year
+static inline time_t month_start(uint16_t year, unsigned month) {
+	if (month > 12) {
+		year += (uint16_t) ((month - 1) / 12);
+		month = (month - 1) % 12 + 1;
+	}
+	return (time_t) (month_days_from_civil(year, month, 1) * 86400);
+}
+
+static inline int month_bucket_compare(const struct month_bucket *b, uint16_t year, uint8_t month) {
+	if (b->year != year) return b->year < year ? -1 : 1;
+	if (b->month != month) return b->month < month ? -1 : 1;
+	return 0;
+}
+
+// Index of the bucket of this month, or where it should be inserted
+static size_t month_bucket_find(const struct month_bucket *months, size_t amount, uint16_t year, uint8_t month) {
+	size_t lo = 0, hi = amount;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (month_bucket_compare(&months[mid], year, month) < 0) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+// Record is counted in it's month. False if there's no space for one more month
+static bool month_bucket_add(struct month_bucket *months, size_t *amount, size_t max, time_t created, uint32_t record) {
+	uint16_t year;
+	uint8_t month;
+	month_of(created, &year, &month);
+	size_t i = month_bucket_find(months, *amount, year, month);
+	if (i < *amount and month_bucket_compare(&months[i], year, month) == 0) {
+		months[i].records++;
+		months[i].first = CBL_MIN(months[i].first, record);
+		months[i].last = CBL_MAX(months[i].last, record);
+		return true;
+	}
+	if (*amount == max) return false;
+	memmove(&months[i + 1], &months[i], (*amount - i) * sizeof(struct month_bucket));
+	months[i] = (struct month_bucket) {.year = year, .month = month, .records = 1, .first = record, .last = record};
+	++*amount;
+	return true;
+}
+
+struct month_index *month_index_create(const char **error) {
+	struct month_index *m = mmap(NULL, sizeof(struct month_index), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) OUCH_ERROR(strerror(errno), return NULL);
+	m->filled = false;
+	m->amount = 0;
+
+	shm_lock_init(&m->lock);
+	return m;
+}
+
+void month_index_destroy(struct month_index *m) {
+	if (m == NULL) return;
+	pthread_mutex_destroy(&m->lock);
+	munmap(m, sizeof(struct month_index));
+}
+
+static void month_index_forget(void *index) {
+	struct month_index *m = index;
+	m->filled = false;
+	m->amount = 0;
+}
+
+static bool month_index_lock(struct month_index *m) {
+	return shm_lock(&m->lock, month_index_forget, m); // buckets are counted from storage again
+}
+
+// Returns buckets which should be filled by caller if index isn't filled yet: it's locked then, and caller
+// calls month_index_end_fill() with amount of buckets. Returns NULL if it's filled already
+struct month_bucket *month_index_begin_fill(struct month_index *m) {
+	if (month_index_lock(m) == false) return NULL;
+	if (m->filled) {
+		pthread_mutex_unlock(&m->lock);
+		return NULL;
+	}
+	return m->months;
+}
+
+void month_index_end_fill(struct month_index *m, size_t amount, bool filled) {
+	m->amount = filled ? CBL_MIN(amount, (size_t) MONTH_INDEX_MAX) : 0;
+	m->filled = filled;
+	pthread_mutex_unlock(&m->lock);
+}
+
+// New record. Index which isn't filled yet is left as is, it's filled from storage, which has this record already
+void month_index_add(struct month_index *m, time_t created, uint32_t record) {
+	if (month_index_lock(m) == false) return;
+	if (m->filled) month_bucket_add(m->months, &m->amount, MONTH_INDEX_MAX, created, record);
+	pthread_mutex_unlock(&m->lock);
+}
+
+// Buckets from year "from" to year "to", up to max of them, older ones first
+size_t month_index_copy(struct month_index *m, uint16_t from, uint16_t to, struct month_bucket *months, size_t max) {
+	if (month_index_lock(m) == false) return 0;
+	size_t amount = 0;
+	for (size_t i = month_bucket_find(m->months, m->amount, from, 1); i < m->amount and m->months[i].year <= to and amount < max; i++) {
+		months[amount++] = m->months[i];
+	}
+	pthread_mutex_unlock(&m->lock);
+	return amount;
+}
+
+void month_index_clear(struct month_index *m) {
+	if (month_index_lock(m) == false) return;
+	month_index_forget(m);
+	pthread_mutex_unlock(&m->lock);
+}
+
+#endif // GUARD_MONTH_INDEX_C
@@ -0,0 +1,261 @@
+#ifndef GUARD_PREFIX_INDEX_C
+#define GUARD_PREFIX_INDEX_C
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "util.c"
+#include "shm_lock.c"
+
+// Titles of records and tags are kept here sorted, so names which are starting with a prefix are found by binary
+// search (see /suggest of app.c). Workers are sharing one index (see shm_lock.c), so names which have been added
+// by one of them are seen by the others. It's filled from data layer once, by the first worker which needs it
+// (see record_names()), then app adds names of new records itself, so storage is never read for it again.
+// Names are compared lowercased (see utf8_lower()).
+//
+// Every kind of names has it's array of entries which is sorted by lowercased name. Names are in pool: lowercased
+// one, then the original one. Pool is only growing, title which has been replaced is left there, so when pool
+// or array is full new names aren't added anymore, until index is cleared and filled again. Mapping is big,
+// but only pages which have been written to are taking memory.
+
+#define PREFIX_INDEX_ALIGN 64
+
+enum prefix_kind {PREFIX_TITLES, PREFIX_TAGS, PREFIX_KINDS};
+
+struct prefix_entry {
+	uint32_t name; // offset in pool
+	uint32_t len;
+	uint32_t value; // titles: record, tags: amount of records
+};
+
+struct prefix_index {
+	pthread_mutex_t lock;
+	size_t mapped;
+	size_t capacity; // entries of every kind
+	size_t poolsize;
+	size_t poolused;
+	size_t amount[PREFIX_KINDS];
+	bool filled;
+};
+
+struct prefix_match {
+	const char *name; // original one, not lowercased
+	size_t len;
+	uint32_t value;
+};
+
+const char prefix_index_error_size[] = "Prefix index size is invalid";
+
+#define PREFIX_INDEX_ROUND(a) (((a) + PREFIX_INDEX_ALIGN - 1) & ~((size_t) PREFIX_INDEX_ALIGN - 1))
+
+static inline struct prefix_entry *prefix_index_entries(struct prefix_index *p, enum prefix_kind kind) {
+	return (struct prefix_entry *) ((char *) p + PREFIX_INDEX_ROUND(sizeof(struct prefix_index))) + kind * p->capacity;
+}
+
+static inline char *prefix_index_pool(struct prefix_index *p) {
+	return (char *) p + PREFIX_INDEX_ROUND(sizeof(struct prefix_index)) + PREFIX_INDEX_ROUND(PREFIX_KINDS * p->capacity * sizeof(struct prefix_entry));
+}
+
+struct prefix_index *prefix_index_create(size_t capacity, size_t poolsize, const char **error) {
+	if (capacity == 0 or capacity > UINT32_MAX or poolsize == 0 or poolsize > UINT32_MAX) OUCH_ERROR(prefix_index_error_size, return NULL);
+	size_t mapped = PREFIX_INDEX_ROUND(sizeof(struct prefix_index)) + PREFIX_INDEX_ROUND(PREFIX_KINDS * capacity * sizeof(struct prefix_entry)) + poolsize;
+
+	struct prefix_index *p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) OUCH_ERROR(strerror(errno), return NULL);
+	*p = (struct prefix_index) {.mapped = mapped, .capacity = capacity, .poolsize = poolsize};
+
+	shm_lock_init(&p->lock);
+	return p;
+}
+
+void prefix_index_destroy(struct prefix_index *p) {
+	if (p == NULL) return;
+	pthread_mutex_destroy(&p->lock);
+	munmap(p, p->mapped);
+}
+
+static void prefix_index_reset(void *index) {
+	struct prefix_index *p = index;
+	p->filled = false;
+	p->poolused = 0;
+	for (unsigned i = 0; i < PREFIX_KINDS; i++) p->amount[i] = 0;
+}
+
+static bool prefix_index_lock(struct prefix_index *p) {
+	return shm_lock(&p->lock, prefix_index_reset, p); // arrays are shifted on insertion, so they are filled again
+}
+
+static int prefix_index_compare(const char *pool, const struct prefix_entry *e, const char *key, size_t keylen) {
+	int r = memcmp(pool + e->name, key, CBL_MIN((size_t) e->len, keylen));
+	if (r != 0) return r;
+	return e->len < keylen ? -1 : e->len > keylen;
+}
+
+// The first entry which isn't less than key
+static size_t prefix_index_lower_bound(struct prefix_index *p, enum prefix_kind kind, const char *key, size_t keylen) {
+	struct prefix_entry *entries = prefix_index_entries(p, kind);
+	const char *pool = prefix_index_pool(p);
+	size_t lo = 0, hi = p->amount[kind];
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (prefix_index_compare(pool, &entries[mid], key, keylen) < 0) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+// Name is written to pool twice, lowercased and as is
+static bool prefix_index_entry(struct prefix_index *p, const char *name, size_t len, uint32_t value, struct prefix_entry *e) {
+	if (len == 0 or len * 2 > p->poolsize - p->poolused) return false;
+	char *pool = prefix_index_pool(p);
+	*e = (struct prefix_entry) {.name = (uint32_t) p->poolused, .len = (uint32_t) len, .value = value};
+	memcpy(pool + p->poolused, name, len);
+	utf8_lower(pool + p->poolused, len);
+	memcpy(pool + p->poolused + len, name, len);
+	p->poolused += len * 2;
+	return true;
+}
+
+static void prefix_index_insert(struct prefix_index *p, enum prefix_kind kind, const char *name, size_t len, uint32_t value) {
+	if (len == 0 or len > NAME_MAX) return;
+	char key[NAME_MAX];
+	memcpy(key, name, len);
+	utf8_lower(key, len);
+
+	struct prefix_entry *entries = prefix_index_entries(p, kind);
+	size_t at = prefix_index_lower_bound(p, kind, key, len);
+	if (kind == PREFIX_TAGS and at < p->amount[kind] and prefix_index_compare(prefix_index_pool(p), &entries[at], key, len) == 0) {
+		entries[at].value++;
+		return;
+	}
+	struct prefix_entry e;
+	if (p->amount[kind] == p->capacity or prefix_index_entry(p, name, len, value, &e) == false) return;
+	memmove(&entries[at + 1], &entries[at], (p->amount[kind] - at) * sizeof(struct prefix_entry));
+	entries[at] = e;
+	p->amount[kind]++;
+}
+
+// Index is filled only once, so there's no reason to keep qsort()'s comparator with pool somewhere global
+static void prefix_index_sift(const char *pool, struct prefix_entry *entries, size_t root, size_t amount) {
+	while(root * 2 + 1 < amount) {
+		size_t child = root * 2 + 1;
+		if (child + 1 < amount and prefix_index_compare(pool, &entries[child], pool + entries[child + 1].name, entries[child + 1].len) < 0) child++;
+		if (prefix_index_compare(pool, &entries[root], pool + entries[child].name, entries[child].len) >= 0) return;
+		struct prefix_entry t = entries[root];
+		entries[root] = entries[child];
+		entries[child] = t;
+		root = child;
+	}
+}
+
+static void prefix_index_sort(struct prefix_index *p, enum prefix_kind kind) {
+	struct prefix_entry *entries = prefix_index_entries(p, kind);
+	const char *pool = prefix_index_pool(p);
+	size_t amount = p->amount[kind];
+	for (size_t i = amount / 2; i > 0; i--) prefix_index_sift(pool, entries, i - 1, amount);
+	for (size_t end = amount; end > 1; end--) {
+		struct prefix_entry t = entries[0];
+		entries[0] = entries[end - 1];
+		entries[end - 1] = t;
+		prefix_index_sift(pool, entries, 0, end - 1);
+	}
+}
+
+// Returns true if caller should fill the index: it's locked then, caller gives every name to prefix_index_append()
+// and calls prefix_index_end_fill(). Returns false if it's filled already
+bool prefix_index_begin_fill(struct prefix_index *p) {
+	if (prefix_index_lock(p) == false) return false;
+	if (p->filled) {
+		pthread_mutex_unlock(&p->lock);
+		return false;
+	}
+	prefix_index_reset(p);
+	return true;
+}
+
+void prefix_index_append(struct prefix_index *p, enum prefix_kind kind, const char *name, size_t len, uint32_t value) {
+	if (len > NAME_MAX or p->amount[kind] == p->capacity) return;
+	if (kind == PREFIX_TAGS) value = 1; // it's a tag of one record, amounts are summed by prefix_index_end_fill()
+	struct prefix_entry *entries = prefix_index_entries(p, kind);
+	if (prefix_index_entry(p, name, len, value, &entries[p->amount[kind]])) p->amount[kind]++;
+}
+
+void prefix_index_end_fill(struct prefix_index *p, bool filled) {
+	if (filled) {
+		for (enum prefix_kind kind = 0; kind < PREFIX_KINDS; kind++) prefix_index_sort(p, kind);
+		struct prefix_entry *tags = prefix_index_entries(p, PREFIX_TAGS);
+		const char *pool = prefix_index_pool(p);
+		size_t amount = 0;
+		for (size_t i = 0; i < p->amount[PREFIX_TAGS]; i++) {
+			if (amount > 0 and prefix_index_compare(pool, &tags[amount - 1], pool + tags[i].name, tags[i].len) == 0) {
+				tags[amount - 1].value += tags[i].value;
+			} else {
+				tags[amount++] = tags[i];
+			}
+		}
+		p->amount[PREFIX_TAGS] = amount;
+		p->filled = true;
+	} else {
+		prefix_index_reset(p);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Title of record is new or it has been changed. Index which isn't filled yet is left as is, it's filled from
+// storage, which has this title already
+void prefix_index_title(struct prefix_index *p, uint32_t record, const char *title, size_t len) {
+	if (prefix_index_lock(p) == false) return;
+	if (p->filled) {
+		struct prefix_entry *entries = prefix_index_entries(p, PREFIX_TITLES);
+		for (size_t i = 0; i < p->amount[PREFIX_TITLES]; i++) {
+			if (entries[i].value != record) continue;
+			memmove(&entries[i], &entries[i + 1], (p->amount[PREFIX_TITLES] - i - 1) * sizeof(struct prefix_entry));
+			p->amount[PREFIX_TITLES]--;
+			break;
+		}
+		prefix_index_insert(p, PREFIX_TITLES, title, len, record);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+// One more record has this tag
+void prefix_index_tag(struct prefix_index *p, const char *tag, size_t len) {
+	if (prefix_index_lock(p) == false) return;
+	if (p->filled) prefix_index_insert(p, PREFIX_TAGS, tag, len, 1);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Up to max names which are starting with prefix, in order of their lowercased names. Names are copied to buffer
+// (they might be moved by others right after the lock is released), names which don't fit there aren't given
+size_t prefix_index_find(struct prefix_index *p, enum prefix_kind kind, const char *prefix, size_t len, struct prefix_match *matches, size_t max, char *buffer, size_t space) {
+	if (len > NAME_MAX) return 0;
+	char key[NAME_MAX];
+	memcpy(key, prefix, len);
+	utf8_lower(key, len);
+
+	if (prefix_index_lock(p) == false) return 0;
+	struct prefix_entry *entries = prefix_index_entries(p, kind);
+	const char *pool = prefix_index_pool(p);
+	size_t found = 0;
+	for (size_t i = prefix_index_lower_bound(p, kind, key, len); i < p->amount[kind] and found < max; i++) {
+		if (entries[i].len < len or memcmp(pool + entries[i].name, key, len) != 0) break;
+		if (entries[i].len > space) break;
+		memcpy(buffer, pool + entries[i].name + entries[i].len, entries[i].len);
+		matches[found++] = (struct prefix_match) {.name = buffer, .len = entries[i].len, .value = entries[i].value};
+		buffer += entries[i].len;
+		space -= entries[i].len;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return found;
+}
+
+void prefix_index_clear(struct prefix_index *p) {
+	if (prefix_index_lock(p) == false) return;
+	prefix_index_reset(p);
+	pthread_mutex_unlock(&p->lock);
+}
+
+#endif // GUARD_PREFIX_INDEX_C
@@ -0,0 +1,105 @@
+#ifndef GUARD_PREFORK_C
+#define GUARD_PREFORK_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "reload.c"
+
+// Pre-fork mode (prefork: 1 in config). Master process opens listening socket and makes shared caches,
+// then forks workers. Every worker is the same as threaded version with one thread: it waits for signals
+// in generation_wait() and reloads config on it's own. If worker crashes, only requests which it has been
+// serving are lost, master notices that and forks new one. Caches are in shared mapping (see shm_cache.c),
+// so they are not multiplied by amount of workers.
+//
+// Master doesn't serve requests. It's reloading config as well, because new workers are forked from it.
+
+#ifndef PREFORK_RESTART_DELAY
+#define PREFORK_RESTART_DELAY 1 // seconds, worker which dies faster than that is restarted after a pause
+#endif
+
+typedef int (*prefork_worker)(unsigned index, void *arg);
+
+struct prefork_slot {
+	pid_t pid; // 0 if there's no worker
+	time_t started;
+};
+
+static pid_t prefork_spawn(struct prefork_slot *slot, unsigned index, prefork_worker worker, void *arg) {
+	fflush(stdout); // otherwise buffered output is printed by every child again
+	pid_t pid = fork();
+	if (pid == 0) exit(worker(index, arg));
+	if (pid < 0) {
+		printf("Unable to fork worker %u: %s\n", index, strerror(errno));
+		return pid;
+	}
+	slot->pid = pid;
+	slot->started = time(NULL);
+	return pid;
+}
+
+static void prefork_kill(struct prefork_slot *slots, unsigned workers, int signo) {
+	for (unsigned i = 0; i < workers; i++) {
+		if (slots[i].pid > 0) kill(slots[i].pid, signo);
+	}
+}
+
+// Returns when all workers are stopped after SIGINT or SIGTERM
+int prefork_run(unsigned workers, prefork_worker worker, void *arg, const char *configfile, rand_fill r, current_time t) {
+	struct prefork_slot *slots = calloc(workers, sizeof(struct prefork_slot));
+	if (slots == NULL) return EXIT_FAILURE;
+
+	sigset_t signals;
+	generation_signals(&signals);
+	sigaddset(&signals, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	unsigned alive = 0;
+	for (unsigned i = 0; i < workers; i++) {
+		if (prefork_spawn(&slots[i], i, worker, arg) > 0) alive++;
+	}
+
+	bool stopping = false;
+	while(stopping == false or alive > 0) {
+		struct timespec timeout = {.tv_sec = 1};
+		int signo = sigtimedwait(&signals, NULL, &timeout);
+		if (signo == SIGINT or signo == SIGTERM) {
+			stopping = true;
+			prefork_kill(slots, workers, SIGTERM);
+		} else if (signo == SIGHUP and stopping == false) {
+			generation_reload(configfile, r, t);
+			prefork_kill(slots, workers, SIGHUP);
+		}
+
+		int status;
+		pid_t pid;
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (unsigned i = 0; i < workers; i++) {
+				if (slots[i].pid != pid) continue;
+				slots[i].pid = 0;
+				alive--;
+				if (stopping) break;
+				if (WIFSIGNALED(status)) printf("Worker %u (pid %d) has been killed by signal %d\n", i, (int) pid, WTERMSIG(status));
+				else printf("Worker %u (pid %d) has exited with status %d\n", i, (int) pid, WEXITSTATUS(status));
+				break;
+			}
+		}
+		if (stopping) continue;
+
+		time_t now = time(NULL);
+		for (unsigned i = 0; i < workers; i++) {
+			if (slots[i].pid != 0 or now - slots[i].started < PREFORK_RESTART_DELAY) continue;
+			if (prefork_spawn(&slots[i], i, worker, arg) > 0) alive++;
+		}
+	}
+
+	free(slots);
+	return EXIT_SUCCESS;
+}
+
+#endif // GUARD_PREFORK_C
@@ -0,0 +1,222 @@
+#ifndef GUARD_RELOAD_C
+#define GUARD_RELOAD_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "app.c"
+#include "common.c"
+
+// Config and templates are reloaded on SIGHUP without restart. Everything which app_prepare() makes from
+// config is a generation: config itself, parsed templates, data layer and routes. Generation is never
+// changed after it's published, new one is prepared instead and pointer to current generation is swapped
+// atomically. Workers are copying appcontext of current generation to their own buffer (they did it anyway),
+// but only when it differs from what they've copied before.
+//
+// Old generation can't be freed while any worker is still in the middle of request with it, so every worker
+// has hazard slot: pointer to generation which is being used right now, or NULL between requests.
+// Main thread doesn't serve requests, it's waiting for signals in generation_wait() and frees retired
+// generations when no slot points to them anymore. Requests are short, so it doesn't take long.
+
+#ifndef GENERATION_BODY_MAX
+#define GENERATION_BODY_MAX 0 // frontend which has to keep whole request in memory tells how big it may be
+#endif
+
+struct generation {
+	struct appconfig config;
+	void *context; // appcontext
+	unsigned long number;
+	struct generation *retired_next;
+};
+
+struct worker_generation {
+	struct generation *hazard;
+	unsigned long seen; // generation which is in worker's buffer
+	char padding[64 - sizeof(struct generation *) - sizeof(unsigned long)]; // one cache line per worker
+};
+
+static struct generation *generation_current = NULL;
+static struct generation *generation_retired = NULL;
+static unsigned long generation_counter = 0;
+static struct worker_generation *generation_slots = NULL;
+static unsigned generation_slots_amount = 0;
+static char generation_error[256];
+
+const char generation_error_engine[] = "Data layer engine can't be changed without restart";
+const char generation_error_body[] = "max_body is bigger than this frontend is able to take (or it's 0, no limit)";
+
+static void generation_free(struct generation *g) {
+	app_finish(g->context);
+	parse_config_erase(&g->config);
+	free(g->context);
+	free(g);
+}
+
+struct generation *generation_create(const char *configfile, rand_fill r, current_time t, const char **error) {
+	struct generation *g = calloc(1, sizeof(struct generation));
+	if (g == NULL) OUCH_ERROR(strerror(errno), return NULL);
+	g->config = (struct appconfig) {.r = r, .t = t};
+	set_config_defaults(&g->config);
+	if (configfile != NULL and parse_config(&g->config, configfile, error) == false) {
+		free(g);
+		return NULL;
+	}
+	if (generation_current and generation_current->config.datalayer_type != g->config.datalayer_type) {
+		// engine functions are global, see initialize_engine()
+		parse_config_erase(&g->config);
+		free(g);
+		OUCH_ERROR(generation_error_engine, return NULL);
+	}
+	if (GENERATION_BODY_MAX > 0 and (g->config.max_body <= 0 or (size_t) g->config.max_body > (size_t) GENERATION_BODY_MAX)) {
+		parse_config_erase(&g->config);
+		free(g);
+		OUCH_ERROR(generation_error_body, return NULL);
+	}
+
+	g->context = malloc(CONTEXTAPPBUFFERSIZE); // app_prepare() writes errors there
+	if (g->context == NULL) goto fail;
+	void *ptr = g->context;
+	if (app_prepare(&ptr, &g->config) == false) {
+		snprintf(generation_error, sizeof(generation_error), "Unable to initialize app, reason: %s", (char *) g->context);
+		free(g->context);
+		parse_config_erase(&g->config);
+		free(g);
+		OUCH_ERROR(generation_error, return NULL);
+	}
+	return g;
+
+	fail:
+	parse_config_erase(&g->config);
+	free(g);
+	OUCH_ERROR(strerror(errno), return NULL);
+}
+
+bool generation_slots_init(unsigned workers) {
+	generation_slots = calloc(workers, sizeof(struct worker_generation));
+	if (generation_slots == NULL) return false;
+	generation_slots_amount = workers;
+	return true;
+}
+
+struct worker_generation *generation_slot(unsigned worker) {
+	return &generation_slots[worker];
+}
+
+// Frontends are checking body size before request is complete, when there's no generation acquired yet
+static size_t generation_body_max = SIZE_MAX;
+
+size_t generation_max_body(void) {
+	return __atomic_load_n(&generation_body_max, __ATOMIC_RELAXED);
+}
+
+void generation_publish(struct generation *g) {
+	g->number = ++generation_counter;
+	__atomic_store_n(&generation_body_max, g->config.max_body > 0 ? (size_t) g->config.max_body : SIZE_MAX, __ATOMIC_RELAXED);
+	struct generation *old = __atomic_exchange_n(&generation_current, g, __ATOMIC_SEQ_CST);
+	if (old == NULL) return;
+	old->retired_next = generation_retired;
+	generation_retired = old;
+}
+
+// Frees retired generations which aren't used anymore, returns amount of still used ones
+unsigned generation_collect(void) {
+	unsigned left = 0;
+	struct generation **p = &generation_retired;
+	while(*p) {
+		struct generation *g = *p;
+		bool used = false;
+		for (unsigned i = 0; i < generation_slots_amount and used == false; i++) {
+			used = __atomic_load_n(&generation_slots[i].hazard, __ATOMIC_SEQ_CST) == g;
+		}
+		if (used) {
+			left++;
+			p = &g->retired_next;
+			continue;
+		}
+		*p = g->retired_next;
+		generation_free(g);
+	}
+	return left;
+}
+
+// Called by worker before request, returns appcontext to pass to app_request()
+void *generation_acquire(struct worker_generation *w, void *workerbuffer) {
+	struct generation *g;
+	do { // generation might be retired and checked by collector between load and store, so load again
+		g = __atomic_load_n(&generation_current, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&w->hazard, g, __ATOMIC_SEQ_CST);
+	} while(g != __atomic_load_n(&generation_current, __ATOMIC_SEQ_CST));
+
+	if (w->seen != g->number) {
+		memcpy(workerbuffer, g->context, sizeof(struct appcontext));
+		w->seen = g->number;
+	}
+	return workerbuffer;
+}
+
+void generation_release(struct worker_generation *w) {
+	__atomic_store_n(&w->hazard, NULL, __ATOMIC_RELEASE);
+}
+
+static void generation_signals(sigset_t *signals) {
+	sigemptyset(signals);
+	sigaddset(signals, SIGINT);
+	sigaddset(signals, SIGTERM);
+	sigaddset(signals, SIGHUP);
+}
+
+// Before any thread is created, so they inherit the mask and signals are left for generation_wait()
+void generation_block_signals(void) {
+	sigset_t signals;
+	generation_signals(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+// Makes new generation from config file and publishes it, current one is kept if something is wrong
+bool generation_reload(const char *configfile, rand_fill r, current_time t) {
+	const char *error = NULL;
+	struct generation *g = generation_create(configfile, r, t, &error);
+	if (g == NULL) {
+		printf("Reload failed, keeping current config: %s\n", error);
+		return false;
+	}
+	if (g->config.workers != generation_current->config.workers or g->config.http_port != generation_current->config.http_port or
+	    g->config.prefork != generation_current->config.prefork or strcmp(g->config.cpu_affinity, generation_current->config.cpu_affinity) != STREQ) {
+		printf("Amount of workers, http port, prefork mode and CPU affinity are applied only after restart\n");
+	}
+	generation_publish(g);
+	app_caches_clear(); // pages are made from templates, and data layer might be another one
+	printf("Config has been reloaded\n");
+	return true;
+}
+
+// Signals are expected to be blocked in every thread. Returns SIGINT or SIGTERM, reloads on SIGHUP
+int generation_wait(const char *configfile, rand_fill r, current_time t) {
+	sigset_t signals;
+	generation_signals(&signals);
+
+	while(1) {
+		struct timespec timeout = {.tv_sec = generation_retired ? 0 : 1, .tv_nsec = generation_retired ? 50000000 : 0};
+		int signo = sigtimedwait(&signals, NULL, &timeout);
+		generation_collect();
+		if (signo < 0) continue;
+		if (signo != SIGHUP) return signo;
+		generation_reload(configfile, r, t);
+	}
+}
+
+// After workers are stopped
+void generation_finish(void) {
+	generation_collect();
+	if (generation_current) generation_free(generation_current);
+	generation_current = NULL;
+	free(generation_slots);
+	generation_slots = NULL;
+	generation_slots_amount = 0;
+}
+
+#endif // GUARD_RELOAD_C
@@ -0,0 +1,195 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#ifndef  __FreeBSD__
+#define _XOPEN_SOURCE 600
+#endif
+
+// This tool regenerates every html/ file which has been generated from it's data/ markdown. Use it
+// when md4c flags have been changed or md4c itself has been upgraded. Html written by author is kept. The app may keep running meanwhile,
+// because each html file is replaced atomically. Every record is indexed for search again
+// too, so it's also the way to build index/ for records which have been written before it.
+// Records which have been written before "generated" flag of metadata existed are counted and kept as they are,
+// because their html might be written by author. With --legacy their html is rendered from markdown (if it's not
+// empty) and they are flagged, use it once when all of them are known to be written in markdown.
+
+#define DATA_LAYER_FILENO
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.c"
+#include "abstract_data_layer.c"
+
+#define RERENDER_THREADS_MAX 256
+
+int randfd;
+void rfill(void *ptr, size_t size) {
+	ssize_t got = read(randfd, ptr, size);
+	if (got < 0) unsafe_rand(ptr, size);
+}
+
+struct rerender_job {
+	pthread_mutex_t lock;
+	unsigned long *records;
+	size_t amount;
+	size_t next;
+
+	struct layer_context *con;
+	bool legacy;
+
+	size_t rendered;
+	size_t skipped;
+	size_t unflagged;
+	size_t failed;
+	size_t markdown_bytes;
+	size_t html_bytes;
+};
+
+static void *worker(void *arg) {
+	struct rerender_job *j = arg;
+	size_t rendered = 0, skipped = 0, unflagged = 0, failed = 0, markdown_bytes = 0, html_bytes = 0;
+
+	while(1) {
+		pthread_mutex_lock(&j->lock);
+		size_t i = j->next++;
+		pthread_mutex_unlock(&j->lock);
+		if (i >= j->amount) break;
+
+		size_t in, out;
+		bool legacy;
+		const char *error = NULL;
+		if (rerender_record_fileno(j->records[i], j->legacy, &legacy, &in, &out, j->con, &error) == false) {
+			printf("Failed to rerender record %lu: %s\n", j->records[i], error);
+			failed++;
+			continue;
+		}
+		if (index_record_fileno(j->records[i], j->con, &error) == false) {
+			printf("Failed to index record %lu: %s\n", j->records[i], error);
+			failed++;
+			continue;
+		}
+		if (legacy) unflagged++;
+		if (in == 0 and out == 0) {
+			skipped++;
+			continue;
+		}
+		rendered++;
+		markdown_bytes += in;
+		html_bytes += out;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	j->rendered += rendered;
+	j->skipped += skipped;
+	j->unflagged += unflagged;
+	j->failed += failed;
+	j->markdown_bytes += markdown_bytes;
+	j->html_bytes += html_bytes;
+	pthread_mutex_unlock(&j->lock);
+
+	return NULL;
+}
+
+static bool collect_records(const char *addr, unsigned long **records, size_t *amount) {
+	DIR *d = opendir(addr);
+	if (d == NULL) return false;
+
+	size_t size = 0;
+	*records = NULL;
+	*amount = 0;
+	struct dirent *de;
+	while((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '\0' or is_str_unsignedint(de->d_name) == false) continue;
+		if (*amount == size) {
+			size = size ? size * 2 : 1024;
+			unsigned long *tmp = realloc(*records, size * sizeof(unsigned long));
+			if (tmp == NULL) {
+				closedir(d);
+				return false;
+			}
+			*records = tmp;
+		}
+		(*records)[(*amount)++] = strtoul(de->d_name, NULL, 10);
+	}
+
+	closedir(d);
+	return true;
+}
+
+static double elapsed(struct timespec from, struct timespec to) {
+	return (double) (to.tv_sec - from.tv_sec) + (double) (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+	bool legacy = false;
+	if (argc > 1 and strcmp(argv[1], "--legacy") == STREQ) {
+		legacy = true;
+		argc--;
+		argv++;
+	}
+	if (argc < 2) {
+		return printf("You should specify the path to data storage. Optionally, amount of threads. Example:\n./cblog-rerender demo_data 8\n"
+		              "Records without \"generated\" flag (written before it existed) are rendered from markdown too with --legacy:\n"
+		              "./cblog-rerender --legacy demo_data 8\n");
+	}
+
+	randfd = open("/dev/urandom", O_RDONLY);
+	if (randfd < 0) return EXIT_FAILURE;
+
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 2) n_threads = strtol(argv[2], NULL, 10);
+	if (n_threads < 1) n_threads = 1;
+	if (n_threads > RERENDER_THREADS_MAX) n_threads = RERENDER_THREADS_MAX;
+
+	struct layer_context con;
+	const char *error;
+	struct data_layer d = {.e = ENGINE_FILENO, .addr = argv[1], .context = &con, .randfun = rfill};
+	if (initialize_engine(&d, &error) == false) {
+		printf("Failed to initialize engine: %s\n", error);
+		return EXIT_FAILURE;
+	}
+
+	struct rerender_job j = {.con = &con, .legacy = legacy};
+	if (collect_records(argv[1], &j.records, &j.amount) == false) {
+		printf("Failed to list records: %s\n", strerror(errno));
+		deinitialize_engine(ENGINE_FILENO, &con);
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&j.lock, NULL);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t threads[RERENDER_THREADS_MAX];
+	long created = 0;
+	for (; created < n_threads; created++) {
+		int rc = pthread_create(&threads[created], NULL, worker, &j);
+		if (rc == 0) continue;
+		printf("Failed to create thread: %s, %ld threads are working\n", strerror(rc), created);
+		break;
+	}
+	if (created == 0) worker(&j); // records are taken from the same job, so main thread does it alone
+	for (long i = 0; i < created; i++) pthread_join(threads[i], NULL);
+	n_threads = created ? created : 1;
+
+	if (index_compact_fileno(&con, &error) == false) { // segments of every record are merged into posting lists
+		printf("Failed to compact index: %s\n", error);
+		j.failed++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = elapsed(start, end);
+	if (seconds <= 0) seconds = 1e-9;
+
+	printf("Records: %zu rendered, %zu skipped, %zu failed, %ld threads, %.3f s\n", j.rendered, j.skipped, j.failed, n_threads, seconds);
+	if (j.unflagged and legacy) printf("Records without \"generated\" flag: %zu, html of those which have markdown has been rendered from it\n", j.unflagged);
+	if (j.unflagged and legacy == false) printf("Records without \"generated\" flag: %zu, they are skipped because their html might be written by author. Use --legacy to render it from markdown\n", j.unflagged);
+	printf("Throughput: %.1f records/s, %.2f MB/s markdown in, %.2f MB/s html out\n",
+		(double) j.rendered / seconds,
+		(double) j.markdown_bytes / seconds / 1e6,
+		(double) j.html_bytes / seconds / 1e6);
+
+	pthread_mutex_destroy(&j.lock);
+	free(j.records);
+	deinitialize_engine(ENGINE_FILENO, &con);
+
+	return j.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,241 @@
+#ifndef GUARD_ROUTER_C
+#define GUARD_ROUTER_C
+
+#include "util.c"
+
+// Routes are described by patterns like "/tags", "/user/{id}" or "/{slug-id}" and compiled once into a trie
+// of path segments. Children of every node are stored in one hash table keyed by (parent node, segment),
+// so dispatching costs one hash lookup per segment no matter how many routes are there.
+// {id} is a whole segment of digits, {slug-id} is the rest of path which ends with digits, like "/My title-42"
+// (record titles may contain '/' so it can't be a single segment). It must be the last one in pattern.
+// {name} is any last segment, like "/media/photo.jpg", it's given in slug.
+// When several routes are able to match, static segment wins over {id}, {id} wins over {name}, and
+// {name} wins over {slug-id}.
+// Nodes, routes and edges are referenced by indexes, so compiled router can be simply memcpy'ed.
+
+#ifndef ROUTER_MAX_NODES
+#define ROUTER_MAX_NODES 64
+#endif
+#ifndef ROUTER_MAX_ROUTES
+#define ROUTER_MAX_ROUTES 32
+#endif
+#ifndef ROUTER_HASH_SIZE
+#define ROUTER_HASH_SIZE 128 // power of two, must be bigger than ROUTER_MAX_NODES
+#endif
+#define ROUTER_MAX_PARAMS 4
+
+#define ROUTER_ID "{id}"
+#define ROUTER_SLUG_ID "{slug-id}"
+#define ROUTER_NAME "{name}"
+
+enum router_result {ROUTE_NOT_FOUND, ROUTE_METHOD_NOT_ALLOWED, ROUTE_FOUND};
+
+struct router_node {
+	uint16_t id_child;    // node for {id}, 0 if none. Root is never a child
+	uint16_t routes;      // first route which ends here + 1, 0 if none
+	uint16_t tail_routes; // first {slug-id} route + 1, 0 if none
+	uint16_t name_routes; // first {name} route + 1, 0 if none
+};
+
+struct router_edge {
+	const char *segment; // points to pattern, which should live as long as router does
+	uint16_t len;
+	uint16_t parent;
+	uint16_t child;      // 0 is empty slot
+};
+
+struct router_route {
+	unsigned methods;    // bit mask
+	unsigned index;      // user's route number
+	uint16_t next;       // next route for the same node + 1
+};
+
+struct router {
+	struct router_node nodes[ROUTER_MAX_NODES];
+	struct router_edge edges[ROUTER_HASH_SIZE];
+	struct router_route routes[ROUTER_MAX_ROUTES];
+	unsigned nodes_amount;
+	unsigned routes_amount;
+};
+
+struct route_match {
+	unsigned index;
+	uint32_t params[ROUTER_MAX_PARAMS]; // {id} and {slug-id} values, in the order of appearance
+	unsigned params_amount;
+	const char *slug; // {slug-id} without "-id" part, or {name}
+	size_t sluglen;
+	unsigned allowed; // methods of routes which are matching the path, when it's ROUTE_METHOD_NOT_ALLOWED
+};
+
+const char router_error_bad_pattern[] = "Route pattern is invalid";
+const char router_error_too_many[] = "Too many routes";
+const char router_error_duplicate[] = "Route is already defined for the same method";
+
+void router_init(struct router *r) {
+	memset(r, 0, sizeof(struct router));
+	r->nodes_amount = 1; // root
+}
+
+static uint32_t router_hash(unsigned parent, const char *segment, size_t len) {
+	return (form_hash(segment, len) ^ (parent * 2654435761u)) & (ROUTER_HASH_SIZE - 1);
+}
+
+static unsigned router_child(const struct router *r, unsigned parent, const char *segment, size_t len) {
+	uint32_t slot = router_hash(parent, segment, len);
+	while(r->edges[slot].child) {
+		const struct router_edge *e = &r->edges[slot];
+		if (e->parent == parent and e->len == len and memcmp(e->segment, segment, len) == 0) return e->child;
+		slot = (slot + 1) & (ROUTER_HASH_SIZE - 1);
+	}
+	return 0;
+}
+
+static unsigned router_new_node(struct router *r) {
+	if (r->nodes_amount == ROUTER_MAX_NODES) return 0;
+	return r->nodes_amount++;
+}
+
+static bool router_chain(struct router *r, uint16_t *head, unsigned methods, unsigned index, const char **error) {
+	for (uint16_t i = *head; i; i = r->routes[i - 1].next) {
+		if (r->routes[i - 1].methods & methods) OUCH_ERROR(router_error_duplicate, return false);
+	}
+	if (r->routes_amount == ROUTER_MAX_ROUTES) OUCH_ERROR(router_error_too_many, return false);
+
+	r->routes[r->routes_amount] = (struct router_route) {.methods = methods, .index = index, .next = *head};
+	*head = (uint16_t) ++r->routes_amount;
+	return true;
+}
+
+bool router_add(struct router *r, const char *pattern, unsigned methods, unsigned index, const char **error) {
+	if (pattern == NULL or pattern[0] != '/' or methods == 0) OUCH_ERROR(router_error_bad_pattern, return false);
+
+	unsigned node = 0;
+	const char *seg = pattern + 1;
+	if (*seg == '\0') return router_chain(r, &r->nodes[0].routes, methods, index, error);
+
+	while(1) {
+		const char *slash = strchr(seg, '/');
+		size_t len = slash ? (size_t) (slash - seg) : strlen(seg);
+		if (len == 0 or len > UINT16_MAX) OUCH_ERROR(router_error_bad_pattern, return false);
+
+		if (len == strizeof(ROUTER_SLUG_ID) and memcmp(seg, ROUTER_SLUG_ID, len) == 0) {
+			if (slash) OUCH_ERROR(router_error_bad_pattern, return false);
+			return router_chain(r, &r->nodes[node].tail_routes, methods, index, error);
+		}
+		if (len == strizeof(ROUTER_NAME) and memcmp(seg, ROUTER_NAME, len) == 0) {
+			if (slash) OUCH_ERROR(router_error_bad_pattern, return false);
+			return router_chain(r, &r->nodes[node].name_routes, methods, index, error);
+		}
+
+		unsigned next;
+		if (len == strizeof(ROUTER_ID) and memcmp(seg, ROUTER_ID, len) == 0) {
+			next = r->nodes[node].id_child;
+			if (next == 0) {
+				next = router_new_node(r);
+				if (next == 0) OUCH_ERROR(router_error_too_many, return false);
+				r->nodes[node].id_child = (uint16_t) next;
+			}
+		} else if (memchr(seg, '{', len) != NULL) {
+			OUCH_ERROR(router_error_bad_pattern, return false);
+		} else {
+			next = router_child(r, node, seg, len);
+			if (next == 0) {
+				next = router_new_node(r);
+				if (next == 0) OUCH_ERROR(router_error_too_many, return false);
+				uint32_t slot = router_hash(node, seg, len);
+				while(r->edges[slot].child) slot = (slot + 1) & (ROUTER_HASH_SIZE - 1);
+				r->edges[slot] = (struct router_edge) {.segment = seg, .len = (uint16_t) len, .parent = (uint16_t) node, .child = (uint16_t) next};
+			}
+		}
+
+		node = next;
+		if (slash == NULL) return router_chain(r, &r->nodes[node].routes, methods, index, error);
+		seg = slash + 1;
+	}
+}
+
+static bool router_u32(const char *digits, const char *end, uint32_t *result) {
+	// UINT32_MAX itself is not accepted, it's "not found" value for records
+	if (digits == end or end - digits > (ptrdiff_t) strizeof("4294967295")) return false;
+	uint64_t v = 0;
+	for (const char *c = digits; c < end; c++) {
+		if (*c < '0' or *c > '9') return false;
+		v = v * 10 + (uint64_t) (*c - '0');
+	}
+	if (v >= UINT32_MAX) return false;
+	*result = (uint32_t) v;
+	return true;
+}
+
+static enum router_result router_pick(const struct router *r, uint16_t head, unsigned method, struct route_match *m) {
+	if (head == 0) return ROUTE_NOT_FOUND;
+	unsigned allowed = 0;
+	for (uint16_t i = head; i; i = r->routes[i - 1].next) {
+		if (r->routes[i - 1].methods & method) {
+			m->index = r->routes[i - 1].index;
+			return ROUTE_FOUND;
+		}
+		allowed |= r->routes[i - 1].methods;
+	}
+	m->allowed |= allowed;
+	return ROUTE_METHOD_NOT_ALLOWED;
+}
+
+static enum router_result router_walk(const struct router *r, unsigned node, const char *seg, const char *end, unsigned method, struct route_match *m) {
+	const char *slash = memchr(seg, '/', (size_t) (end - seg));
+	const char *segend = slash ? slash : end;
+	enum router_result best = ROUTE_NOT_FOUND, res;
+
+	unsigned child = router_child(r, node, seg, (size_t) (segend - seg));
+	if (child) {
+		res = slash ? router_walk(r, child, slash + 1, end, method, m) : router_pick(r, r->nodes[child].routes, method, m);
+		if (res == ROUTE_FOUND) return res;
+		if (res > best) best = res;
+	}
+
+	uint32_t v;
+	if (r->nodes[node].id_child and m->params_amount < ROUTER_MAX_PARAMS and router_u32(seg, segend, &v)) {
+		m->params[m->params_amount++] = v;
+		child = r->nodes[node].id_child;
+		res = slash ? router_walk(r, child, slash + 1, end, method, m) : router_pick(r, r->nodes[child].routes, method, m);
+		if (res == ROUTE_FOUND) return res;
+		if (res > best) best = res;
+		m->params_amount--;
+	}
+
+	if (r->nodes[node].name_routes and slash == NULL and seg < end) {
+		m->slug = seg;
+		m->sluglen = (size_t) (end - seg);
+		res = router_pick(r, r->nodes[node].name_routes, method, m);
+		if (res == ROUTE_FOUND) return res;
+		if (res > best) best = res;
+		m->slug = NULL;
+		m->sluglen = 0;
+	}
+
+	if (r->nodes[node].tail_routes and m->params_amount < ROUTER_MAX_PARAMS) {
+		const char *digits = end;
+		while(digits > seg and digits[-1] >= '0' and digits[-1] <= '9') digits--;
+		if (router_u32(digits, end, &v)) {
+			m->params[m->params_amount++] = v;
+			m->slug = seg;
+			m->sluglen = (size_t) (digits - seg);
+			if (m->sluglen and m->slug[m->sluglen - 1] == '-') m->sluglen--;
+			res = router_pick(r, r->nodes[node].tail_routes, method, m);
+			if (res == ROUTE_FOUND) return res;
+			if (res > best) best = res;
+			m->params_amount--;
+		}
+	}
+
+	return best;
+}
+
+enum router_result router_match(const struct router *r, const char *path, size_t len, unsigned method, struct route_match *m) {
+	memset(m, 0, sizeof(struct route_match));
+	if (len == 0 or path[0] != '/') return ROUTE_NOT_FOUND;
+	if (len == 1) return router_pick(r, r->nodes[0].routes, method, m);
+	return router_walk(r, 0, path + 1, path + len, method, m);
+}
+
+#endif // GUARD_ROUTER_C
@@ -0,0 +1,552 @@
+#ifndef GUARD_SEARCH_C
+#define GUARD_SEARCH_C
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.c"
+
+// Full-text search: words of records, their positions, postings and BM25. Where postings are kept is up to
+// data layer engine (see search_records_fileno()), everything here works with memory only.
+//
+// Word is a sequence of ASCII letters and digits, and of any non-ASCII characters except punctuation and
+// spaces of Latin-1 and "General Punctuation" blocks. ASCII, Latin-1 and Cyrillic letters are lowercased,
+// others are taken as is. Words longer than SEARCH_TERM_MAX bytes are cut.
+//
+// Posting list of a word is sorted by record, every entry is varints of:
+//   record - previous record, length of record (in words), tf, tf positions (each one - previous one)
+// Length of record is in every entry, so BM25 doesn't have to look for records anywhere else.
+
+#define SEARCH_TERM_MAX 64
+#define SEARCH_QUERY_TERMS 16
+#define SEARCH_VARINT_MAX 5
+#define SEARCH_BM25_K1 1.2
+#define SEARCH_BM25_B 0.75
+
+static size_t search_varint_put(uint8_t *p, uint32_t v) {
+	size_t i = 0;
+	while(v >= 0x80) {
+		p[i++] = (uint8_t) (v | 0x80);
+		v >>= 7;
+	}
+	p[i++] = (uint8_t) v;
+	return i;
+}
+
+static bool search_varint_get(const uint8_t **p, const uint8_t *end, uint32_t *v) {
+	uint32_t result = 0;
+	for (unsigned shift = 0; shift < 35 and *p < end; shift += 7) {
+		uint8_t byte = *(*p)++;
+		result |= (uint32_t) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			*v = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns width of character which belongs to a word (lowercasing it in place), 0 if it's a separator
+static unsigned search_word_char(unsigned char *s, const unsigned char *end) {
+	unsigned char c = s[0];
+	if (c < 0x80) {
+		if (c >= 'A' and c <= 'Z') s[0] = c + ('a' - 'A');
+		return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or (c >= '0' and c <= '9');
+	}
+	unsigned width = utf8_byte_width((const char *) s);
+	if (width > (size_t) (end - s)) return 0;
+	if (c == 0xc2 and s[1] >= 0x80) return 0; // C1 controls, nbsp, «», °, ...
+	if (c == 0xc3 and (s[1] == 0x97 or s[1] == 0xb7)) return 0; // × and ÷
+	if (c == 0xe2 and (s[1] == 0x80 or s[1] == 0x81)) return 0; // General Punctuation: dashes, quotes, ...
+	utf8_lower_char(s, width);
+	return width;
+}
+
+static int search_term_compare(const char *a, size_t alen, const char *b, size_t blen) {
+	int r = memcmp(a, b, CBL_MIN(alen, blen));
+	if (r != 0) return r;
+	return alen < blen ? -1 : alen > blen;
+}
+
+struct search_token {
+	const char *term;
+	uint32_t len;
+	uint32_t pos;
+};
+
+struct search_doc {
+	char *text; // lowercased copy of title and body
+	struct search_token *tokens; // sorted by term, then by position
+	size_t amount;
+	uint32_t length; // words
+};
+
+static bool search_token_push(struct search_doc *d, size_t *space, const char *term, uint32_t len, uint32_t pos) {
+	if (d->amount == *space) {
+		size_t more = *space ? *space * 2 : 256;
+		struct search_token *tokens = realloc(d->tokens, more * sizeof(struct search_token));
+		if (tokens == NULL) return false;
+		d->tokens = tokens;
+		*space = more;
+	}
+	d->tokens[d->amount++] = (struct search_token) {.term = term, .len = len, .pos = pos};
+	return true;
+}
+
+// Tokens of text which is lowercased in place. Markup of html (tags and entities) is skipped
+static bool search_tokenize(struct search_doc *d, size_t *space, char *text, size_t len, bool html, uint32_t *pos) {
+	unsigned char *s = (unsigned char *) text, *end = s + len;
+	while(s < end) {
+		if (html and (*s == '<' or *s == '&')) {
+			unsigned char *close = memchr(s, *s == '<' ? '>' : ';', (size_t) (end - s));
+			if (close and (*s == '<' or close - s <= 10)) {
+				s = close + 1;
+				continue;
+			}
+		}
+		unsigned width = search_word_char(s, end);
+		if (width == 0) {
+			s++;
+			continue;
+		}
+		unsigned char *word = s;
+		size_t wordlen = 0;
+		while(s < end and (width = search_word_char(s, end)) > 0) {
+			if (wordlen + width <= SEARCH_TERM_MAX) wordlen += width;
+			s += width;
+		}
+		if (search_token_push(d, space, (const char *) word, (uint32_t) wordlen, (*pos)++) == false) return false;
+	}
+	return true;
+}
+
+static int search_token_compare(const void *a, const void *b) {
+	const struct search_token *x = a, *y = b;
+	int r = search_term_compare(x->term, x->len, y->term, y->len);
+	if (r != 0) return r;
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+// Title goes first, there's a gap between it and body, so phrase doesn't match across them
+bool search_doc_build(struct search_doc *d, const char *title, size_t titlelen, const char *body, size_t bodylen, bool html) {
+	*d = (struct search_doc) {.text = malloc(titlelen + bodylen + 1)};
+	if (d->text == NULL) return false;
+	memcpy(d->text, title, titlelen);
+	if (bodylen > 0) memcpy(d->text + titlelen, body, bodylen);
+
+	size_t space = 0;
+	uint32_t pos = 0;
+	if (search_tokenize(d, &space, d->text, titlelen, false, &pos) == false) goto fail;
+	pos++;
+	if (search_tokenize(d, &space, d->text + titlelen, bodylen, html, &pos) == false) goto fail;
+	d->length = (uint32_t) d->amount;
+	if (d->amount > 0) qsort(d->tokens, d->amount, sizeof(struct search_token), search_token_compare);
+	return true;
+
+	fail:
+	free(d->text);
+	free(d->tokens);
+	return false;
+}
+
+void search_doc_free(struct search_doc *d) {
+	free(d->text);
+	free(d->tokens);
+	*d = (struct search_doc) {0};
+}
+
+// Every term of the document, one by one: returns index of the first token of next term, *tf is how many
+static size_t search_doc_next_term(const struct search_doc *d, size_t i, uint32_t *tf) {
+	size_t j = i + 1;
+	while(j < d->amount and d->tokens[j].len == d->tokens[i].len and memcmp(d->tokens[j].term, d->tokens[i].term, d->tokens[i].len) == 0) j++;
+	*tf = (uint32_t) (j - i);
+	return j;
+}
+
+struct search_posting {
+	uint32_t record;
+	uint32_t length;
+	uint32_t tf;
+	const uint8_t *entry; // everything after record delta, it's copied as is when list is rewritten
+	const uint8_t *positions;
+	const uint8_t *end;
+};
+
+struct search_postings {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint32_t record;
+};
+
+// Returns false at the end of list, or if it's broken
+static bool search_postings_next(struct search_postings *it, struct search_posting *out) {
+	uint32_t delta, skip;
+	if (it->p >= it->end or search_varint_get(&it->p, it->end, &delta) == false) return false;
+	out->entry = it->p;
+	if (search_varint_get(&it->p, it->end, &out->length) == false or search_varint_get(&it->p, it->end, &out->tf) == false) return false;
+	out->positions = it->p;
+	for (uint32_t i = 0; i < out->tf; i++) if (search_varint_get(&it->p, it->end, &skip) == false) return false;
+	out->end = it->p;
+	it->record += delta;
+	out->record = it->record;
+	return true;
+}
+
+// Entry of document d for it's term which starts at token i, without record delta (it depends on the list
+// where entry is put). Returns it's size, dst should have SEARCH_VARINT_MAX * (2 + tf) bytes
+static size_t search_posting_entry(uint8_t *dst, const struct search_doc *d, size_t i, uint32_t tf) {
+	size_t len = search_varint_put(dst, d->length);
+	len += search_varint_put(dst + len, tf);
+	uint32_t prev = 0;
+	for (size_t j = i; j < i + tf; j++) {
+		len += search_varint_put(dst + len, d->tokens[j].pos - prev);
+		prev = d->tokens[j].pos;
+	}
+	return len;
+}
+
+// Changes of posting lists are appended as segments, one per (re)indexed record, and lists themselves are
+// rewritten only when segments are merged into them. Segment is varints of record and size of the rest, then
+// of every word which record has now or has had before: length of word, word, size of entry, entry (see
+// search_posting_entry()). Size 0 means record doesn't have the word anymore, so does a word which isn't there.
+
+// Word of segment, returns it's size. dst should have 2 * SEARCH_VARINT_MAX + termlen + entrylen bytes
+static size_t search_segment_put(uint8_t *dst, const char *term, size_t termlen, const uint8_t *entry, size_t entrylen) {
+	size_t len = search_varint_put(dst, (uint32_t) termlen);
+	memcpy(dst + len, term, termlen);
+	len += termlen;
+	len += search_varint_put(dst + len, (uint32_t) entrylen);
+	if (entrylen) memcpy(dst + len, entry, entrylen);
+	return len + entrylen;
+}
+
+struct search_segment {
+	uint32_t record;
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+// Segments one by one. Returns false at the end, or where segment is half-written
+static bool search_segments_next(const uint8_t **p, const uint8_t *end, struct search_segment *out) {
+	uint32_t size;
+	if (*p >= end or search_varint_get(p, end, &out->record) == false or search_varint_get(p, end, &size) == false) return false;
+	if ((size_t) (end - *p) < size) return false;
+	out->p = *p;
+	out->end = *p + size;
+	*p = out->end;
+	return true;
+}
+
+// Words of segment one by one, entry is NULL if record doesn't have the word anymore
+static bool search_segment_next(struct search_segment *s, const char **term, size_t *termlen, const uint8_t **entry, size_t *entrylen) {
+	uint32_t tlen, elen;
+	if (s->p >= s->end or search_varint_get(&s->p, s->end, &tlen) == false or tlen > SEARCH_TERM_MAX or (size_t) (s->end - s->p) < tlen) return false;
+	*term = (const char *) s->p;
+	*termlen = tlen;
+	s->p += tlen;
+	if (search_varint_get(&s->p, s->end, &elen) == false or (size_t) (s->end - s->p) < elen) return false;
+	*entry = elen ? s->p : NULL;
+	*entrylen = elen;
+	s->p += elen;
+	return true;
+}
+
+// Entry of one record for one word, which is put instead of what posting list has
+struct search_delta {
+	uint32_t record;
+	uint32_t order; // the later segment wins
+	const uint8_t *entry; // NULL if record doesn't have the word anymore
+	size_t entrylen;
+};
+
+static int search_delta_compare(const void *a, const void *b) {
+	const struct search_delta *x = a, *y = b;
+	if (x->record != y->record) return x->record < y->record ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Deltas of word which are found in segments, sorted by record, one per record. *deltas are malloc()'ed (NULL if
+// there are none), *extra is how many bytes they can add to posting list
+static bool search_deltas_collect(const uint8_t *segments, size_t len, const char *term, size_t termlen, struct search_delta **deltas, size_t *amount, size_t *extra) {
+	*deltas = NULL;
+	*amount = 0;
+	*extra = 0;
+	size_t space = 0;
+	const uint8_t *p = segments;
+	struct search_segment s;
+	for (uint32_t order = 0; search_segments_next(&p, segments + len, &s); order++) {
+		struct search_delta d = {.record = s.record, .order = order, .entry = NULL};
+		const char *t;
+		size_t tlen;
+		const uint8_t *entry;
+		size_t entrylen;
+		while(search_segment_next(&s, &t, &tlen, &entry, &entrylen)) {
+			if (search_term_compare(t, tlen, term, termlen) != 0) continue;
+			d.entry = entry;
+			d.entrylen = entrylen;
+			break;
+		}
+		if (*amount == space) {
+			space = space ? space * 2 : 16;
+			struct search_delta *more = realloc(*deltas, space * sizeof(struct search_delta));
+			if (more == NULL) {
+				free(*deltas);
+				*deltas = NULL;
+				*amount = 0;
+				return false;
+			}
+			*deltas = more;
+		}
+		(*deltas)[(*amount)++] = d;
+		*extra += d.entrylen + SEARCH_VARINT_MAX;
+	}
+	if (*amount < 2) return true;
+	qsort(*deltas, *amount, sizeof(struct search_delta), search_delta_compare);
+	size_t kept = 0;
+	for (size_t i = 0; i < *amount; i++) {
+		if (i + 1 < *amount and (*deltas)[i + 1].record == (*deltas)[i].record) continue;
+		(*deltas)[kept++] = (*deltas)[i];
+	}
+	*amount = kept;
+	return true;
+}
+
+// Posting list with deltas put instead of entries of their records. out should have listlen + extra bytes
+// (see search_deltas_collect()), returns amount of them which are used
+static size_t search_postings_merge(uint8_t *out, const uint8_t *list, size_t listlen, const struct search_delta *deltas, size_t amount) {
+	struct search_postings it = {.p = list, .end = list + listlen};
+	struct search_posting p;
+	bool more = search_postings_next(&it, &p);
+	size_t len = 0, i = 0;
+	uint32_t prev = 0;
+	while(more or i < amount) {
+		if (i < amount and (more == false or deltas[i].record <= p.record)) {
+			if (more and deltas[i].record == p.record) more = search_postings_next(&it, &p);
+			if (deltas[i].entry) {
+				len += search_varint_put(out + len, deltas[i].record - prev);
+				memcpy(out + len, deltas[i].entry, deltas[i].entrylen);
+				len += deltas[i].entrylen;
+				prev = deltas[i].record;
+			}
+			i++;
+			continue;
+		}
+		len += search_varint_put(out + len, p.record - prev);
+		memcpy(out + len, p.entry, (size_t) (p.end - p.entry));
+		len += (size_t) (p.end - p.entry);
+		prev = p.record;
+		more = search_postings_next(&it, &p);
+	}
+	return len;
+}
+
+// There's no libm in the build, and idf needs only a logarithm of numbers >= 1
+static double search_ln(double x) {
+	double result = 0.0;
+	while(x > 2.0) {
+		x /= 2.0;
+		result += 0.6931471805599453;
+	}
+	double y = (x - 1.0) / (x + 1.0), y2 = y * y, term = y, sum = 0.0; // 2 * atanh(y)
+	for (unsigned k = 1; k < 40; k += 2) {
+		sum += term / k;
+		term *= y2;
+	}
+	return result + 2.0 * sum;
+}
+
+static double search_bm25(uint32_t tf, uint32_t length, double avglength, uint32_t df, uint32_t documents) {
+	double idf = search_ln(1.0 + ((double) documents - df + 0.5) / (df + 0.5));
+	double norm = SEARCH_BM25_K1 * (1.0 - SEARCH_BM25_B + SEARCH_BM25_B * (avglength > 0 ? length / avglength : 1.0));
+	return idf * (tf * (SEARCH_BM25_K1 + 1.0)) / (tf + norm);
+}
+
+// Query is words, "words in quotes" are phrase: they have to be next to each other, in that order
+struct search_query {
+	char text[SEARCH_TERM_MAX * SEARCH_QUERY_TERMS];
+	struct {
+		const char *term;
+		uint32_t len;
+		unsigned phrase; // 0 if it's not in a phrase, otherwise words of the same phrase have the same one
+	} terms[SEARCH_QUERY_TERMS];
+	unsigned amount;
+};
+
+static void search_query_parse(struct search_query *q, const char *query, size_t len) {
+	q->amount = 0;
+	if (len > sizeof(q->text)) len = sizeof(q->text);
+	memcpy(q->text, query, len);
+	unsigned char *s = (unsigned char *) q->text, *end = s + len;
+	unsigned phrase = 0, phrases = 0, inphrase = 0;
+	while(s < end and q->amount < SEARCH_QUERY_TERMS) {
+		if (*s == '"') {
+			if (phrase) {
+				if (inphrase < 2) { // single word in quotes is just a word
+					for (unsigned i = 0; i < q->amount; i++) if (q->terms[i].phrase == phrase) q->terms[i].phrase = 0;
+				}
+				phrase = 0;
+			} else {
+				phrase = ++phrases;
+				inphrase = 0;
+			}
+			s++;
+			continue;
+		}
+		unsigned width = search_word_char(s, end);
+		if (width == 0) {
+			s++;
+			continue;
+		}
+		unsigned char *word = s;
+		size_t wordlen = 0;
+		while(s < end and (width = search_word_char(s, end)) > 0) {
+			if (wordlen + width <= SEARCH_TERM_MAX) wordlen += width;
+			s += width;
+		}
+		q->terms[q->amount].term = (const char *) word;
+		q->terms[q->amount].len = (uint32_t) wordlen;
+		q->terms[q->amount].phrase = phrase;
+		q->amount++;
+		if (phrase) inphrase++;
+	}
+	if (phrase and inphrase < 2) {
+		for (unsigned i = 0; i < q->amount; i++) if (q->terms[i].phrase == phrase) q->terms[i].phrase = 0;
+	}
+}
+
+struct search_hit {
+	unsigned long record;
+	double score;
+};
+
+struct search_list {
+	const uint8_t *p;
+	size_t len;
+};
+
+static size_t search_positions(const struct search_posting *p, uint32_t *out) {
+	const uint8_t *it = p->positions;
+	uint32_t pos = 0, delta;
+	for (uint32_t i = 0; i < p->tf; i++) {
+		if (search_varint_get(&it, p->end, &delta) == false) return i;
+		pos += delta;
+		out[i] = pos;
+	}
+	return p->tf;
+}
+
+static bool search_has_position(const uint32_t *positions, size_t amount, uint32_t pos) {
+	size_t lo = 0, hi = amount;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (positions[mid] == pos) return true;
+		if (positions[mid] < pos) lo = mid + 1; else hi = mid;
+	}
+	return false;
+}
+
+// Words of phrase are next to each other in the query too, so phrase is terms[first..last]
+static bool search_phrase_matches(const struct search_query *q, unsigned first, unsigned last, const struct search_posting *cur, uint32_t **scratch, size_t *space) {
+	size_t need = 0;
+	for (unsigned i = first; i <= last; i++) need += cur[i].tf;
+	if (need > *space) {
+		uint32_t *more = realloc(*scratch, need * sizeof(uint32_t));
+		if (more == NULL) return false;
+		*scratch = more;
+		*space = need;
+	}
+	uint32_t *positions[SEARCH_QUERY_TERMS];
+	size_t amount[SEARCH_QUERY_TERMS], used = 0;
+	for (unsigned i = first; i <= last; i++) {
+		positions[i] = *scratch + used;
+		amount[i] = search_positions(&cur[i], positions[i]);
+		used += amount[i];
+	}
+	for (size_t k = 0; k < amount[first]; k++) {
+		unsigned i = first + 1;
+		while(i <= last and search_has_position(positions[i], amount[i], positions[first][k] + (i - first))) i++;
+		if (i > last) return true;
+	}
+	return false;
+}
+
+static int search_hit_compare(const void *a, const void *b) {
+	const struct search_hit *x = a, *y = b;
+	if (x->score != y->score) return x->score < y->score ? 1 : -1;
+	return x->record < y->record ? 1 : x->record > y->record ? -1 : 0;
+}
+
+// Records which have every word of query (and every phrase), best ones first. lists[i] is posting list of
+// q->terms[i], documents and length are amount of indexed records and their total length. *hits is malloc()'ed
+bool search_rank(const struct search_query *q, const struct search_list lists[], uint32_t documents, uint64_t length, struct search_hit **hits, size_t *found) {
+	*hits = NULL;
+	*found = 0;
+	if (q->amount == 0) return true;
+
+	struct search_postings it[SEARCH_QUERY_TERMS];
+	struct search_posting cur[SEARCH_QUERY_TERMS];
+	uint32_t df[SEARCH_QUERY_TERMS];
+	bool counted[SEARCH_QUERY_TERMS]; // the same word twice in query isn't counted twice
+	for (unsigned i = 0; i < q->amount; i++) {
+		counted[i] = true;
+		for (unsigned j = 0; j < i; j++) {
+			if (search_term_compare(q->terms[i].term, q->terms[i].len, q->terms[j].term, q->terms[j].len) == 0) counted[i] = false;
+		}
+		df[i] = 0;
+		it[i] = (struct search_postings) {.p = lists[i].p, .end = lists[i].p + lists[i].len};
+		while(search_postings_next(&it[i], &cur[i])) df[i]++;
+		if (df[i] > documents) documents = df[i];
+		it[i] = (struct search_postings) {.p = lists[i].p, .end = lists[i].p + lists[i].len};
+		if (search_postings_next(&it[i], &cur[i]) == false) return true;
+	}
+	double avglength = documents ? (double) length / documents : 0.0;
+
+	size_t space = 0, scratchspace = 0;
+	uint32_t *scratch = NULL;
+	while(1) {
+		uint32_t target = 0;
+		for (unsigned i = 0; i < q->amount; i++) if (cur[i].record > target) target = cur[i].record;
+		bool same = true;
+		for (unsigned i = 0; i < q->amount; i++) {
+			while(cur[i].record < target) if (search_postings_next(&it[i], &cur[i]) == false) goto done;
+			if (cur[i].record != target) same = false;
+		}
+		if (same == false) continue;
+
+		bool matches = true;
+		for (unsigned i = 0; i < q->amount and matches; i++) {
+			if (q->terms[i].phrase == 0 or (i > 0 and q->terms[i - 1].phrase == q->terms[i].phrase)) continue;
+			unsigned last = i;
+			while(last + 1 < q->amount and q->terms[last + 1].phrase == q->terms[i].phrase) last++;
+			matches = search_phrase_matches(q, i, last, cur, &scratch, &scratchspace);
+		}
+		if (matches) {
+			if (*found == space) {
+				space = space ? space * 2 : 64;
+				struct search_hit *more = realloc(*hits, space * sizeof(struct search_hit));
+				if (more == NULL) {
+					free(scratch);
+					free(*hits);
+					*hits = NULL;
+					*found = 0;
+					return false;
+				}
+				*hits = more;
+			}
+			double score = 0.0;
+			for (unsigned i = 0; i < q->amount; i++) {
+				if (counted[i]) score += search_bm25(cur[i].tf, cur[i].length, avglength, df[i], documents);
+			}
+			(*hits)[(*found)++] = (struct search_hit) {.record = target, .score = score};
+		}
+		for (unsigned i = 0; i < q->amount; i++) if (search_postings_next(&it[i], &cur[i]) == false) goto done;
+	}
+
+	done:
+	free(scratch);
+	if (*found > 1) qsort(*hits, *found, sizeof(struct search_hit), search_hit_compare);
+	return true;
+}
+
+#endif // GUARD_SEARCH_C
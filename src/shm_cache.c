@@ -0,0 +1,185 @@
+#ifndef GUARD_SHM_CACHE_C
+#define GUARD_SHM_CACHE_C
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "util.c"
+#include "shm_lock.c"
+
+// Cache which is shared by workers (see shm_lock.c), so memory isn't multiplied by amount of workers.
+//
+// It's set-associative: key hash chooses a set, entry might be in any of SHM_CACHE_WAYS ways of that set,
+// least recently used way is evicted. Every set has it's own lock, so workers are rarely waiting for each
+// other. Entries are fixed-size slots, value which doesn't fit is just not cached.
+// If process dies while holding a lock, next one who takes the lock wipes the set, because half-written
+// entry can't be trusted.
+
+#define SHM_CACHE_WAYS 8
+#define SHM_CACHE_ALIGN 64
+
+struct shm_cache_way {
+	uint64_t hash; // 0 means empty
+	uint64_t used; // set's tick of last access
+	time_t expires;
+	uint32_t keylen;
+	uint32_t valuelen;
+};
+
+struct shm_cache_set {
+	pthread_mutex_t lock;
+	uint64_t tick;
+	struct shm_cache_way ways[SHM_CACHE_WAYS];
+};
+
+struct shm_cache {
+	size_t sets; // power of two
+	size_t slot; // bytes for key and value of every way
+	size_t setsize; // set header and it's slots
+	size_t mapped;
+	unsigned ttl; // seconds
+};
+
+const char shm_cache_error_size[] = "Cache size is invalid";
+
+#define SHM_CACHE_ROUND(a) (((a) + SHM_CACHE_ALIGN - 1) & ~((size_t) SHM_CACHE_ALIGN - 1))
+
+static inline struct shm_cache_set *shm_cache_set_at(struct shm_cache *c, size_t i) {
+	return (struct shm_cache_set *) ((char *) c + SHM_CACHE_ROUND(sizeof(struct shm_cache)) + i * c->setsize);
+}
+
+static inline char *shm_cache_slot(struct shm_cache *c, struct shm_cache_set *s, unsigned way) {
+	return (char *) s + SHM_CACHE_ROUND(sizeof(struct shm_cache_set)) + way * c->slot;
+}
+
+static uint64_t shm_cache_hash(const void *key, size_t keylen) {
+	const unsigned char *k = key;
+	uint64_t h = 14695981039346656037ull; // FNV-1a
+	for (size_t i = 0; i < keylen; i++) {
+		h ^= k[i];
+		h *= 1099511628211ull;
+	}
+	return h ? h : 1;
+}
+
+struct shm_cache *shm_cache_create(size_t entries, size_t slot, unsigned ttl, const char **error) {
+	if (entries == 0 or slot == 0) OUCH_ERROR(shm_cache_error_size, return NULL);
+	size_t sets = 1;
+	while(sets * SHM_CACHE_WAYS < entries) sets <<= 1;
+	slot = SHM_CACHE_ROUND(slot);
+	size_t setsize = SHM_CACHE_ROUND(sizeof(struct shm_cache_set)) + SHM_CACHE_WAYS * slot;
+	size_t mapped = SHM_CACHE_ROUND(sizeof(struct shm_cache)) + sets * setsize;
+
+	struct shm_cache *c = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED) OUCH_ERROR(strerror(errno), return NULL);
+	*c = (struct shm_cache) {.sets = sets, .slot = slot, .setsize = setsize, .mapped = mapped, .ttl = ttl};
+
+	for (size_t i = 0; i < sets; i++) {
+		shm_lock_init(&shm_cache_set_at(c, i)->lock); // mapping is zeroed, so ways are empty
+	}
+	return c;
+}
+
+void shm_cache_destroy(struct shm_cache *c) {
+	if (c == NULL) return;
+	for (size_t i = 0; i < c->sets; i++) {
+		pthread_mutex_destroy(&shm_cache_set_at(c, i)->lock);
+	}
+	munmap(c, c->mapped);
+}
+
+static void shm_cache_wipe(void *set) {
+	struct shm_cache_set *s = set;
+	memset(s->ways, 0, sizeof(s->ways));
+}
+
+static struct shm_cache_set *shm_cache_lock(struct shm_cache *c, uint64_t hash) {
+	struct shm_cache_set *s = shm_cache_set_at(c, hash & (c->sets - 1));
+	return shm_lock(&s->lock, shm_cache_wipe, s) ? s : NULL;
+}
+
+static int shm_cache_find(struct shm_cache *c, struct shm_cache_set *s, uint64_t hash, const void *key, size_t keylen) {
+	for (unsigned i = 0; i < SHM_CACHE_WAYS; i++) {
+		struct shm_cache_way *w = &s->ways[i];
+		if (w->hash != hash or w->keylen != keylen) continue;
+		if (memcmp(shm_cache_slot(c, s, i), key, keylen) == STREQ) return (int) i;
+	}
+	return -1;
+}
+
+// valuelen is the size of value buffer, it's replaced by length of cached value.
+// Returns false if key isn't found, it has been expired or it doesn't fit into buffer
+bool shm_cache_get(struct shm_cache *c, const void *key, size_t keylen, void *value, size_t *valuelen) {
+	uint64_t hash = shm_cache_hash(key, keylen);
+	struct shm_cache_set *s = shm_cache_lock(c, hash);
+	if (s == NULL) return false;
+
+	bool found = false;
+	int i = shm_cache_find(c, s, hash, key, keylen);
+	if (i >= 0) {
+		struct shm_cache_way *w = &s->ways[i];
+		if (w->expires <= time(NULL)) {
+			w->hash = 0;
+		} else if (w->valuelen <= *valuelen) {
+			memcpy(value, shm_cache_slot(c, s, i) + keylen, w->valuelen);
+			*valuelen = w->valuelen;
+			w->used = ++s->tick;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return found;
+}
+
+bool shm_cache_put(struct shm_cache *c, const void *key, size_t keylen, const void *value, size_t valuelen) {
+	if (keylen + valuelen > c->slot) return false;
+	uint64_t hash = shm_cache_hash(key, keylen);
+	struct shm_cache_set *s = shm_cache_lock(c, hash);
+	if (s == NULL) return false;
+
+	time_t now = time(NULL);
+	int i = shm_cache_find(c, s, hash, key, keylen);
+	if (i < 0) {
+		i = 0;
+		for (unsigned j = 0; j < SHM_CACHE_WAYS; j++) {
+			struct shm_cache_way *w = &s->ways[j];
+			if (w->hash == 0 or w->expires <= now) {
+				i = (int) j;
+				break;
+			}
+			if (w->used < s->ways[i].used) i = (int) j;
+		}
+	}
+
+	struct shm_cache_way *w = &s->ways[i];
+	char *slot = shm_cache_slot(c, s, i);
+	memcpy(slot, key, keylen);
+	memcpy(slot + keylen, value, valuelen);
+	*w = (struct shm_cache_way) {.hash = hash, .used = ++s->tick, .expires = now + c->ttl, .keylen = keylen, .valuelen = valuelen};
+	pthread_mutex_unlock(&s->lock);
+	return true;
+}
+
+void shm_cache_remove(struct shm_cache *c, const void *key, size_t keylen) {
+	uint64_t hash = shm_cache_hash(key, keylen);
+	struct shm_cache_set *s = shm_cache_lock(c, hash);
+	if (s == NULL) return;
+	int i = shm_cache_find(c, s, hash, key, keylen);
+	if (i >= 0) s->ways[i].hash = 0;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void shm_cache_clear(struct shm_cache *c) {
+	for (size_t i = 0; i < c->sets; i++) {
+		struct shm_cache_set *s = shm_cache_set_at(c, i);
+		if (shm_cache_lock(c, i) == NULL) continue;
+		memset(s->ways, 0, sizeof(s->ways));
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+#endif // GUARD_SHM_CACHE_C
@@ -0,0 +1,35 @@
+#ifndef GUARD_SHM_LOCK_C
+#define GUARD_SHM_LOCK_C
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "util.c"
+
+// Tables which are shared by workers (shm_cache.c, login_throttle.c, prefix_index.c, month_index.c) are made in
+// anonymous MAP_SHARED mapping before workers are started, so it's the same memory no matter if workers are
+// threads or forked processes. Their locks are process-shared and robust: when a process dies while holding
+// one, the next one gets it anyway, and recover() of the table decides what can't be trusted after that.
+
+typedef void (*shm_lock_recover)(void *context);
+
+void shm_lock_init(pthread_mutex_t *lock) {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+bool shm_lock(pthread_mutex_t *lock, shm_lock_recover recover, void *context) {
+	int rc = pthread_mutex_lock(lock);
+	if (rc == EOWNERDEAD) {
+		if (recover) recover(context);
+		pthread_mutex_consistent(lock);
+		return true;
+	}
+	return rc == 0;
+}
+
+#endif // GUARD_SHM_LOCK_C
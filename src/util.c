@@ -13,8 +13,10 @@
 #endif
 
 #define CBL_STRINGIZE(a) #a
+#define CBL_STRINGIZE_VALUE(a) CBL_STRINGIZE(a)
 
 #define CBL_MAX(a,b) (((a)>(b))?(a):(b))
+#define CBL_MIN(a,b) (((a)<(b))?(a):(b))
 
 #if !defined UNUSED
 #define UNUSED(x) (void)(x)
@@ -28,6 +30,11 @@
 #define STRNEQ (1)
 #endif
 
+// bool functions are returning false and leaving the reason in *error, if caller wants to know it
+#ifndef OUCH_ERROR
+#define OUCH_ERROR(errmsg, action) do {if (error) *error = errmsg; action;} while(0)
+#endif
+
 // the maximum amount of bytes that's required to express integers as string
 #define CBL_UINT8_STR_MAX   strizeof("255")
 #define CBL_UINT16_STR_MAX  strizeof("65535")
@@ -178,24 +185,29 @@ char strpartcmp(char *str, char *part) {
 	}
 }
 
-const unsigned char *utf8_check(const void *a, size_t len){
+// Returns pointer to the first invalid sequence, or NULL when string is fine. It also stops at '\0'. Reads no more than len bytes.
+// Portable version, SIMD ones are below and they are falling back to this one in order to locate exact position of an error.
+const unsigned char *utf8_check_generic(const void *a, size_t len){
 	const unsigned char *s = a;
-//	while(*s) {
-	for (size_t i = 0; i < len; len++) {
+	const unsigned char *end = s + len;
+	while(s < end) {
 		if (*s == '\0') break;
+		size_t left = (size_t) (end - s);
 		if (*s < 0x80)
 			/* 0xxxxxxx */
 			s++;
 		else if ((s[0] & 0xe0) == 0xc0) {
 			/* 110XXXXx 10xxxxxx */
-			if ((s[1] & 0xc0) != 0x80 ||
+			if (left < 2 ||
+				(s[1] & 0xc0) != 0x80 ||
 				(s[0] & 0xfe) == 0xc0)                        /* overlong? */
 				return s;
 			else
 				s += 2;
 		} else if ((s[0] & 0xf0) == 0xe0) {
 			/* 1110XXXX 10Xxxxxx 10xxxxxx */
-			if ((s[1] & 0xc0) != 0x80 ||
+			if (left < 3 ||
+				(s[1] & 0xc0) != 0x80 ||
 				(s[2] & 0xc0) != 0x80 ||
 				(s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||    /* overlong? */
 				(s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||    /* surrogate? */
@@ -206,7 +218,8 @@ const unsigned char *utf8_check(const void *a, size_t len){
 				s += 3;
 		} else if ((s[0] & 0xf8) == 0xf0) {
 			/* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
-			if ((s[1] & 0xc0) != 0x80 ||
+			if (left < 4 ||
+				(s[1] & 0xc0) != 0x80 ||
 				(s[2] & 0xc0) != 0x80 ||
 				(s[3] & 0xc0) != 0x80 ||
 				(s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||    /* overlong? */
@@ -244,6 +257,29 @@ unsigned char utf8_byte_width(const void *ptr) {
 	return 1;
 }
 
+// Lowercases ASCII, Latin-1 and Cyrillic letter which starts at s, it keeps it's width. Other characters are kept
+static inline void utf8_lower_char(unsigned char *s, size_t width) {
+	if (width == 1) {
+		if (s[0] >= 'A' and s[0] <= 'Z') s[0] += 'a' - 'A';
+	} else if (width == 2) {
+		if (s[0] == 0xc3 and s[1] >= 0x80 and s[1] <= 0x9e and s[1] != 0x97) s[1] += 0x20; // À..Þ, except ×
+		else if (s[0] == 0xd0 and s[1] >= 0x90 and s[1] <= 0x9f) s[1] += 0x20; // А..П
+		else if (s[0] == 0xd0 and s[1] >= 0xa0 and s[1] <= 0xaf) s[0] = 0xd1, s[1] -= 0x20; // Р..Я
+		else if (s[0] == 0xd0 and s[1] >= 0x80 and s[1] <= 0x8f) s[0] = 0xd1, s[1] += 0x10; // Ѐ..Џ, including Є, І, Ї
+		else if (s[0] == 0xd2 and s[1] == 0x90) s[1] = 0x91; // Ґ
+	}
+}
+
+void utf8_lower(char *str, size_t len) {
+	unsigned char *s = (unsigned char *) str, *end = s + len;
+	while(s < end) {
+		size_t width = utf8_byte_width(s);
+		if (width > (size_t) (end - s)) break;
+		utf8_lower_char(s, width);
+		s += width;
+	}
+}
+
 unsigned char_occurences(const char *str, char lf) {
 	const char *temp = str;
 	unsigned count = 0;
@@ -260,25 +296,322 @@ static char *skip_spaces(char *ptr) {
 	return ptr;
 }
 
-void *util_memmem(const void *l, size_t l_len, const void *s, size_t s_len) {
-	// TODO: replace with freebsd memmem https://github.com/freebsd/freebsd-src/blob/main/lib/libc/string/memmem.c
+void *util_memmem_generic(const void *l, size_t l_len, const void *s, size_t s_len) {
+	// Portable version, which is also used by SIMD versions for tails. Keep it for MCUs.
 	register char *cur, *last;
 	const char *cl = (const char *)l;
 	const char *cs = (const char *)s;
 
-	if (l_len == 0 || s_len == 0) return NULL;
+	if (l_len == 0 or s_len == 0) return NULL;
 	if (l_len < s_len) return NULL;
 	if (s_len == 1) return memchr(l, (int) *cs, l_len);
 
 	last = (char *)cl + l_len - s_len;
 
 	for (cur = (char *)cl; cur <= last; cur++) {
-		if (cur[0] == cs[0] && memcmp(cur, cs, s_len) == 0) return cur;
+		if (cur[0] == cs[0] and memcmp(cur, cs, s_len) == 0) return cur;
 	}
 
 	return NULL;
 }
 
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__)) and not defined(CBL_NO_SIMD)
+#define CBL_X86_SIMD
+#include <immintrin.h>
+
+// SIMD versions are comparing first and last bytes of needle with whole block of haystack at once,
+// so memcmp() is called only for positions where both of them are matched. s_len should be >= 2.
+
+__attribute__((target("sse2")))
+static void *util_memmem_sse2(const void *l, size_t l_len, const void *s, size_t s_len) {
+	const char *h = l;
+	const char *n = s;
+	const __m128i first = _mm_set1_epi8(n[0]);
+	const __m128i last = _mm_set1_epi8(n[s_len - 1]);
+
+	size_t i = 0;
+	for (; i + s_len + 15 <= l_len; i += 16) {
+		__m128i block_first = _mm_loadu_si128((const __m128i *) (h + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *) (h + i + s_len - 1));
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+		while(mask) {
+			unsigned bit = (unsigned) __builtin_ctz(mask);
+			if (memcmp(h + i + bit + 1, n + 1, s_len - 2) == 0) return (char *) h + i + bit;
+			mask &= mask - 1;
+		}
+	}
+
+	return util_memmem_generic(h + i, l_len - i, s, s_len);
+}
+
+__attribute__((target("avx2")))
+static void *util_memmem_avx2(const void *l, size_t l_len, const void *s, size_t s_len) {
+	const char *h = l;
+	const char *n = s;
+	const __m256i first = _mm256_set1_epi8(n[0]);
+	const __m256i last = _mm256_set1_epi8(n[s_len - 1]);
+
+	size_t i = 0;
+	for (; i + s_len + 31 <= l_len; i += 32) {
+		__m256i block_first = _mm256_loadu_si256((const __m256i *) (h + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i *) (h + i + s_len - 1));
+		uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last)));
+		while(mask) {
+			unsigned bit = (unsigned) __builtin_ctz(mask);
+			if (memcmp(h + i + bit + 1, n + 1, s_len - 2) == 0) return (char *) h + i + bit;
+			mask &= mask - 1;
+		}
+	}
+
+	return util_memmem_sse2(h + i, l_len - i, s, s_len);
+}
+
+typedef void *(*memmem_fun)(const void *, size_t, const void *, size_t);
+static void *util_memmem_resolve(const void *l, size_t l_len, const void *s, size_t s_len);
+static memmem_fun util_memmem_impl = util_memmem_resolve;
+
+static void *util_memmem_resolve(const void *l, size_t l_len, const void *s, size_t s_len) {
+	// CPU is checked only once, during first call. Every thread would resolve the same value, so the race is harmless.
+	memmem_fun f = util_memmem_generic;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) f = util_memmem_sse2;
+	if (__builtin_cpu_supports("avx2")) f = util_memmem_avx2;
+	__atomic_store_n(&util_memmem_impl, f, __ATOMIC_RELAXED);
+	return f(l, l_len, s, s_len);
+}
+#endif // CBL_X86_SIMD
+
+void *util_memmem(const void *l, size_t l_len, const void *s, size_t s_len) {
+	if (l_len == 0 or s_len == 0) return NULL;
+	if (l_len < s_len) return NULL;
+	if (s_len == 1) return memchr(l, (int) *(const char *) s, l_len);
+
+#ifdef CBL_X86_SIMD
+	return __atomic_load_n(&util_memmem_impl, __ATOMIC_RELAXED)(l, l_len, s, s_len);
+#else
+	return util_memmem_generic(l, l_len, s, s_len);
+#endif
+}
+
+#ifdef CBL_X86_SIMD
+// UTF-8 validation with lookup tables (John Keiser, Daniel Lemire, "Validating UTF-8 In Less Than One Instruction
+// Per Byte"). For each byte: high nibble of previous byte, low nibble of previous byte and high nibble of current
+// one are looked up in three 16-entry tables with pshufb. Results are AND'ed, any bit which survived is an error.
+// Then 3 and 4 byte sequences are checked for the right amount of continuation bytes. Additionally we're rejecting
+// U+FFFE and U+FFFF just like utf8_check_generic() does.
+// Blocks are 64 bytes long. If a block contains an error or '\0', scalar version is called from the beginning
+// of the character which is crossing block border, so it returns exact position (or stops on '\0').
+
+#define UTF8_TOO_SHORT      (1 << 0)
+#define UTF8_TOO_LONG       (1 << 1)
+#define UTF8_OVERLONG_3     (1 << 2)
+#define UTF8_TOO_LARGE      (1 << 3)
+#define UTF8_SURROGATE      (1 << 4)
+#define UTF8_OVERLONG_2     (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4     (1 << 6)
+#define UTF8_TWO_CONTS      (1 << 7)
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const unsigned char utf8_byte_1_high[16] = {
+	// 0_______ ________ <ASCII in byte 1>
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	// 10______ ________ <continuation in byte 1>
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	// 1100____ ________ <two byte lead in byte 1>
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	// 1101____ ________ <two byte lead in byte 1>
+	UTF8_TOO_SHORT,
+	// 1110____ ________ <three byte lead in byte 1>
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	// 1111____ ________ <four+ byte lead in byte 1>
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+static const unsigned char utf8_byte_1_low[16] = {
+	// ____0000 ________
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	// ____0001 ________
+	UTF8_CARRY | UTF8_OVERLONG_2,
+	// ____001_ ________
+	UTF8_CARRY,
+	UTF8_CARRY,
+	// ____0100 ________
+	UTF8_CARRY | UTF8_TOO_LARGE,
+	// ____0101 ________ and up to ____1111, except ____1101
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	// ____1101 ________
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+static const unsigned char utf8_byte_2_high[16] = {
+	// ________ 0_______ <ASCII in byte 2>
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	// ________ 1000____
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	// ________ 1001____
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+	// ________ 101_____
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	// ________ 11______
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+static const unsigned char *utf8_char_start(const unsigned char *begin, const unsigned char *s) {
+	// Beginning of a character which contains the byte before s. Everything before s is already validated.
+	if (s == begin) return s;
+	s--;
+	for (int i = 0; i < 3 and s > begin and (*s & 0xc0) == 0x80; i++) s--;
+	return s;
+}
+
+__attribute__((target("ssse3")))
+static __m128i utf8_errors_ssse3(__m128i input, __m128i prev_input) {
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+	__m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+	__m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+	__m128i byte_1_high = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) utf8_byte_1_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+	__m128i byte_1_low = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) utf8_byte_1_low), _mm_and_si128(prev1, nibble));
+	__m128i byte_2_high = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) utf8_byte_2_high), _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+	__m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+	// Third and fourth bytes of 3 and 4 byte sequences must be continuations (have high bit after subtraction)
+	__m128i is_third = _mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xe0 - 0x80)));
+	__m128i is_fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xf0 - 0x80)));
+	__m128i must23_80 = _mm_and_si128(_mm_or_si128(is_third, is_fourth), _mm_set1_epi8((char) 0x80));
+
+	// ef bf be and ef bf bf
+	__m128i nonchar = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(prev2, _mm_set1_epi8((char) 0xef)), _mm_cmpeq_epi8(prev1, _mm_set1_epi8((char) 0xbf))),
+	                                _mm_cmpeq_epi8(_mm_or_si128(input, _mm_set1_epi8(1)), _mm_set1_epi8((char) 0xbf)));
+
+	return _mm_or_si128(_mm_xor_si128(must23_80, special), nonchar);
+}
+
+__attribute__((target("ssse3")))
+static const unsigned char *utf8_check_ssse3(const void *a, size_t len) {
+	const unsigned char *s = a;
+	const __m128i zero = _mm_setzero_si128();
+	// non-zero in last 3 bytes if block is ending in the middle of a character
+	const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+	__m128i prev = zero;
+	__m128i prev_incomplete = zero;
+
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		__m128i in0 = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i in1 = _mm_loadu_si128((const __m128i *) (s + i + 16));
+		__m128i in2 = _mm_loadu_si128((const __m128i *) (s + i + 32));
+		__m128i in3 = _mm_loadu_si128((const __m128i *) (s + i + 48));
+		__m128i error = _mm_cmpeq_epi8(_mm_min_epu8(_mm_min_epu8(in0, in1), _mm_min_epu8(in2, in3)), zero);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(in0, in1), _mm_or_si128(in2, in3))) == 0) {
+			error = _mm_or_si128(error, prev_incomplete);
+			prev_incomplete = zero;
+		} else {
+			error = _mm_or_si128(error, utf8_errors_ssse3(in0, prev));
+			error = _mm_or_si128(error, utf8_errors_ssse3(in1, in0));
+			error = _mm_or_si128(error, utf8_errors_ssse3(in2, in1));
+			error = _mm_or_si128(error, utf8_errors_ssse3(in3, in2));
+			prev_incomplete = _mm_subs_epu8(in3, max);
+		}
+		prev = in3;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xffff) break;
+	}
+
+	const unsigned char *from = utf8_char_start(s, s + i);
+	return utf8_check_generic(from, len - (size_t) (from - s));
+}
+
+__attribute__((target("avx2")))
+static __m256i utf8_errors_avx2(__m256i input, __m256i prev_input) {
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+	__m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+	__m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+	__m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+	__m256i byte_1_high = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) utf8_byte_1_high)), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+	__m256i byte_1_low = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) utf8_byte_1_low)), _mm256_and_si256(prev1, nibble));
+	__m256i byte_2_high = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) utf8_byte_2_high)), _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+	__m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+	__m256i is_third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xe0 - 0x80)));
+	__m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xf0 - 0x80)));
+	__m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char) 0x80));
+
+	__m256i nonchar = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(prev2, _mm256_set1_epi8((char) 0xef)), _mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char) 0xbf))),
+	                                   _mm256_cmpeq_epi8(_mm256_or_si256(input, _mm256_set1_epi8(1)), _mm256_set1_epi8((char) 0xbf)));
+
+	return _mm256_or_si256(_mm256_xor_si256(must23_80, special), nonchar);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *utf8_check_avx2(const void *a, size_t len) {
+	const unsigned char *s = a;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	                                     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+	__m256i prev = zero;
+	__m256i prev_incomplete = zero;
+
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		__m256i in0 = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i in1 = _mm256_loadu_si256((const __m256i *) (s + i + 32));
+		__m256i error = _mm256_cmpeq_epi8(_mm256_min_epu8(in0, in1), zero);
+		if (_mm256_movemask_epi8(_mm256_or_si256(in0, in1)) == 0) {
+			error = _mm256_or_si256(error, prev_incomplete);
+			prev_incomplete = zero;
+		} else {
+			error = _mm256_or_si256(error, utf8_errors_avx2(in0, prev));
+			error = _mm256_or_si256(error, utf8_errors_avx2(in1, in0));
+			prev_incomplete = _mm256_subs_epu8(in1, max);
+		}
+		prev = in1;
+		if (_mm256_testz_si256(error, error) == 0) break;
+	}
+
+	const unsigned char *from = utf8_char_start(s, s + i);
+	return utf8_check_generic(from, len - (size_t) (from - s));
+}
+
+typedef const unsigned char *(*utf8_check_fun)(const void *, size_t);
+
+static const unsigned char *utf8_check_resolve(const void *a, size_t len);
+static utf8_check_fun utf8_check_impl = utf8_check_resolve;
+
+static const unsigned char *utf8_check_resolve(const void *a, size_t len) {
+	utf8_check_fun f = utf8_check_generic;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) f = utf8_check_ssse3;
+	if (__builtin_cpu_supports("avx2")) f = utf8_check_avx2;
+	__atomic_store_n(&utf8_check_impl, f, __ATOMIC_RELAXED);
+	return f(a, len);
+}
+#endif // CBL_X86_SIMD
+
+const unsigned char *utf8_check(const void *a, size_t len) {
+	// Short strings like titles and passwords are not worth it
+	if (len < 64) return utf8_check_generic(a, len);
+
+#ifdef CBL_X86_SIMD
+	return __atomic_load_n(&utf8_check_impl, __ATOMIC_RELAXED)(a, len);
+#else
+	return utf8_check_generic(a, len);
+#endif
+}
+
 static bool abiggerb_timespec(struct timespec a, struct timespec b) {
 	if (a.tv_sec == b.tv_sec) {
 		if (a.tv_nsec > b.tv_nsec) return true;
@@ -407,6 +740,563 @@ char *urldecode2(char *dst, const char *src)
 	return dst;
 }
 
+// Single pass parser for application/x-www-form-urlencoded bodies and query strings: key=value&onemorekey=value
+// Keys and values are urldecoded in place and every one of them gets '\0' after it, so data has to be writable
+// and must have space for len + 1 bytes. Then fields are available by key from small hash table.
+// Fields are split before decoding, hence "%26" inside of a value is just '&' and does not start a new field.
+// If key appears more than once, first one wins. Fields without '=' are ignored.
+
+#define FORM_MAX_FIELDS 32
+#define FORM_INDEX_SIZE 64 // power of two, must be bigger than FORM_MAX_FIELDS
+
+struct form_field {
+	const char *key;
+	size_t keylen;
+	char *value;
+	size_t valuelen;
+};
+
+struct form_index {
+	struct form_field fields[FORM_MAX_FIELDS];
+	unsigned char slots[FORM_INDEX_SIZE]; // 0 is empty slot, otherwise it's field number + 1
+	unsigned amount;
+};
+
+static uint32_t form_hash(const char *key, size_t keylen) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for (size_t i = 0; i < keylen; i++) {
+		h ^= (unsigned char) key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static unsigned char hexdigit(char c) {
+	if (c >= 'a') return (unsigned char) (c - 'a' + 10);
+	if (c >= 'A') return (unsigned char) (c - 'A' + 10);
+	return (unsigned char) (c - '0');
+}
+
+static size_t form_span(const char *s, size_t len) {
+	// Amount of bytes before first '%', '+', '=' or '&'. Those could be simply copied.
+	size_t i = 0;
+#if defined(CBL_X86_SIMD) and defined(__SSE2__)
+	const __m128i percent = _mm_set1_epi8('%');
+	const __m128i plus = _mm_set1_epi8('+');
+	const __m128i equal = _mm_set1_epi8('=');
+	const __m128i amp = _mm_set1_epi8('&');
+	for (; i + 16 <= len; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, percent), _mm_cmpeq_epi8(b, plus)),
+		                         _mm_or_si128(_mm_cmpeq_epi8(b, equal), _mm_cmpeq_epi8(b, amp)));
+		unsigned mask = (unsigned) _mm_movemask_epi8(m);
+		if (mask) return i + (unsigned) __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len; i++) {
+		if (s[i] == '%' or s[i] == '+' or s[i] == '=' or s[i] == '&') break;
+	}
+	return i;
+}
+
+static void form_index_add(struct form_index *f, const char *key, size_t keylen, char *value, size_t valuelen) {
+	if (keylen == 0 or f->amount == FORM_MAX_FIELDS) return;
+	uint32_t slot = form_hash(key, keylen) & (FORM_INDEX_SIZE - 1);
+	while(f->slots[slot]) {
+		struct form_field *field = &f->fields[f->slots[slot] - 1];
+		if (field->keylen == keylen and memcmp(field->key, key, keylen) == 0) return;
+		slot = (slot + 1) & (FORM_INDEX_SIZE - 1);
+	}
+	f->fields[f->amount] = (struct form_field) {.key = key, .keylen = keylen, .value = value, .valuelen = valuelen};
+	f->slots[slot] = (unsigned char) ++f->amount;
+}
+
+unsigned form_parse(struct form_index *f, char *data, size_t len) {
+	memset(f->slots, 0, sizeof(f->slots));
+	f->amount = 0;
+
+	char *src = data;
+	char *end = data + len;
+	char *dst = data;
+	char *key = data;
+	char *value = NULL;
+	while(1) {
+		size_t span = form_span(src, (size_t) (end - src));
+		if (dst != src) memmove(dst, src, span);
+		dst += span;
+		src += span;
+
+		if (src == end or *src == '&') {
+			if (value) form_index_add(f, key, (size_t) (value - 1 - key), value, (size_t) (dst - value));
+			*dst++ = '\0';
+			if (src == end) break;
+			src++;
+			key = dst;
+			value = NULL;
+		} else if (*src == '=') {
+			src++;
+			*dst++ = value ? '=' : '\0';
+			if (value == NULL) value = dst;
+		} else if (*src == '+') {
+			src++;
+			*dst++ = ' ';
+		} else if (end - src > 2 and emb_is_hexadecimal(src[1]) and emb_is_hexadecimal(src[2])) {
+			*dst++ = (char) (hexdigit(src[1]) << 4 | hexdigit(src[2]));
+			src += 3;
+		} else {
+			*dst++ = *src++; // lonely '%'
+		}
+	}
+
+	return f->amount;
+}
+
+char *form_get(const struct form_index *f, const char *key, size_t *valuelen) {
+	size_t keylen = strlen(key);
+	uint32_t slot = form_hash(key, keylen) & (FORM_INDEX_SIZE - 1);
+	while(f->slots[slot]) {
+		const struct form_field *field = &f->fields[f->slots[slot] - 1];
+		if (field->keylen == keylen and memcmp(field->key, key, keylen) == 0) {
+			*valuelen = field->valuelen;
+			return field->value;
+		}
+		slot = (slot + 1) & (FORM_INDEX_SIZE - 1);
+	}
+	return NULL;
+}
+
+// The same format, but for bodies which are read by chunks and might be too big to be kept in memory.
+// Chunks are decoded in place. Keys are collected (longer than FORM_STREAM_KEY_MAX are skipped with their
+// values), values are given to callback piece by piece as they are decoded, and then once more with
+// last = true when value ends. "%XY" might be split between chunks, it's held until next one comes.
+// Every field is given to callback, so it's up to callback to ignore repeated keys.
+
+#ifndef FORM_STREAM_KEY_MAX
+#define FORM_STREAM_KEY_MAX 64
+#endif
+
+typedef bool (*form_value_cb)(const char *key, size_t keylen, const char *piece, size_t len, bool last, void *context);
+
+struct form_stream {
+	form_value_cb value;
+	void *context;
+	size_t keylen; // SIZE_MAX if key is too long
+	bool in_value;
+	unsigned char escaped; // amount of "%X" bytes which are waiting for the rest
+	char escape;
+	char key[FORM_STREAM_KEY_MAX];
+};
+
+void form_stream_init(struct form_stream *s, form_value_cb value, void *context) {
+	*s = (struct form_stream) {.value = value, .context = context};
+}
+
+static bool form_stream_out(struct form_stream *s, const char *piece, size_t len) {
+	if (len == 0 or s->keylen == SIZE_MAX) return true;
+	if (s->in_value) return s->keylen == 0 or s->value(s->key, s->keylen, piece, len, false, s->context);
+	if (len > sizeof(s->key) - s->keylen) {
+		s->keylen = SIZE_MAX;
+		return true;
+	}
+	memcpy(s->key + s->keylen, piece, len);
+	s->keylen += len;
+	return true;
+}
+
+// '%' wasn't an escape after all, it's given as is with whatever has been held after it
+static bool form_stream_lonely(struct form_stream *s) {
+	const char lonely[2] = {'%', s->escape};
+	size_t len = s->escaped;
+	s->escaped = 0;
+	return form_stream_out(s, lonely, len);
+}
+
+static bool form_stream_field_end(struct form_stream *s) {
+	bool result = s->escaped == 0 or form_stream_lonely(s);
+	if (result and s->in_value and s->keylen != SIZE_MAX and s->keylen > 0) result = s->value(s->key, s->keylen, NULL, 0, true, s->context);
+	s->keylen = 0;
+	s->in_value = false;
+	return result;
+}
+
+// Returns false if callback has returned false
+bool form_stream_feed(struct form_stream *s, char *data, size_t len) {
+	char *src = data;
+	char *end = data + len;
+	while(src < end) {
+		if (s->escaped) {
+			if (emb_is_hexadecimal(*src) == false) {
+				if (form_stream_lonely(s) == false) return false;
+				continue;
+			}
+			if (s->escaped == 1) {
+				s->escape = *src++;
+				s->escaped = 2;
+				continue;
+			}
+			char decoded = (char) (hexdigit(s->escape) << 4 | hexdigit(*src++));
+			s->escaped = 0;
+			if (form_stream_out(s, &decoded, sizeof(char)) == false) return false;
+			continue;
+		}
+
+		char *piece = src;
+		char *dst = src;
+		while(src < end) {
+			size_t span = form_span(src, (size_t) (end - src));
+			if (dst != src) memmove(dst, src, span);
+			dst += span;
+			src += span;
+			if (src == end) break;
+			if (*src == '+') {
+				src++;
+				*dst++ = ' ';
+			} else if (*src == '%' and end - src > 2) {
+				if (emb_is_hexadecimal(src[1]) and emb_is_hexadecimal(src[2])) {
+					*dst++ = (char) (hexdigit(src[1]) << 4 | hexdigit(src[2]));
+					src += 3;
+				} else {
+					*dst++ = *src++; // lonely '%'
+				}
+			} else {
+				break; // '=', '&' or '%' which might be continued in next chunk
+			}
+		}
+		if (form_stream_out(s, piece, (size_t) (dst - piece)) == false) return false;
+		if (src == end) break;
+
+		char c = *src++;
+		if (c == '%') {
+			s->escaped = 1;
+		} else if (c == '=') {
+			if (s->in_value and form_stream_out(s, "=", sizeof(char)) == false) return false;
+			s->in_value = true;
+		} else if (form_stream_field_end(s) == false) { // '&'
+			return false;
+		}
+	}
+	return true;
+}
+
+// When body ends
+bool form_stream_finish(struct form_stream *s) {
+	return form_stream_field_end(s);
+}
+
+// Request headers and cookies index. Frontend builds it once per request and then every lookup is O(1).
+// Header names are compared case-insensitively and '-' is equal to '_', so "User-Agent" is found by
+// "HTTP_USER_AGENT" (after stripping "HTTP_" prefix of fastcgi params) and vice versa.
+// Cookie header is split to separate cookies right away, they are available under "Cookie:name" key
+// (colon can't appear in header name). Neither names nor values are copied, index only points to them.
+
+#define HEADERS_MAX 64
+#define HEADERS_INDEX_SIZE 128 // power of two, must be bigger than HEADERS_MAX
+#define COOKIES_MAX 32
+#define COOKIES_INDEX_SIZE 64
+#define COOKIE_PREFIX "Cookie:"
+
+struct header_field {
+	const char *name;
+	size_t namelen;
+	const char *value;
+	size_t valuelen;
+};
+
+struct header_index {
+	struct header_field headers[HEADERS_MAX];
+	struct header_field cookies[COOKIES_MAX];
+	unsigned char header_slots[HEADERS_INDEX_SIZE];
+	unsigned char cookie_slots[COOKIES_INDEX_SIZE];
+	unsigned headers_amount;
+	unsigned cookies_amount;
+};
+
+static inline char header_char(char c) {
+	if (c >= 'A' and c <= 'Z') return (char) (c + 'a' - 'A');
+	if (c == '_') return '-';
+	return c;
+}
+
+static uint32_t header_hash(const char *name, size_t namelen) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < namelen; i++) {
+		h ^= (unsigned char) header_char(name[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static bool header_name_eq(const char *a, const char *b, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (header_char(a[i]) != header_char(b[i])) return false;
+	}
+	return true;
+}
+
+void header_index_reset(struct header_index *h) {
+	memset(h->header_slots, 0, sizeof(h->header_slots));
+	memset(h->cookie_slots, 0, sizeof(h->cookie_slots));
+	h->headers_amount = 0;
+	h->cookies_amount = 0;
+}
+
+static void cookie_index_add(struct header_index *h, const char *name, size_t namelen, const char *value, size_t valuelen) {
+	if (namelen == 0 or h->cookies_amount == COOKIES_MAX) return;
+	uint32_t slot = form_hash(name, namelen) & (COOKIES_INDEX_SIZE - 1);
+	while(h->cookie_slots[slot]) {
+		struct header_field *f = &h->cookies[h->cookie_slots[slot] - 1];
+		if (f->namelen == namelen and memcmp(f->name, name, namelen) == 0) return; // first one wins
+		slot = (slot + 1) & (COOKIES_INDEX_SIZE - 1);
+	}
+	h->cookies[h->cookies_amount] = (struct header_field) {.name = name, .namelen = namelen, .value = value, .valuelen = valuelen};
+	h->cookie_slots[slot] = (unsigned char) ++h->cookies_amount;
+}
+
+static void cookie_index_parse(struct header_index *h, const char *cookie, size_t len) {
+	// Cookie: key=value; onemorekey=value
+	const char *end = cookie + len;
+	while(cookie < end) {
+		while(cookie < end and (*cookie == ' ' or *cookie == ';')) cookie++;
+		const char *delimiter = memchr(cookie, ';', (size_t) (end - cookie));
+		if (delimiter == NULL) delimiter = end;
+		const char *equal = memchr(cookie, '=', (size_t) (delimiter - cookie));
+		if (equal) cookie_index_add(h, cookie, (size_t) (equal - cookie), equal + 1, (size_t) (delimiter - equal - 1));
+		cookie = delimiter;
+	}
+}
+
+void header_index_add(struct header_index *h, const char *name, size_t namelen, const char *value, size_t valuelen) {
+	if (namelen == 0 or h->headers_amount == HEADERS_MAX) return;
+	uint32_t slot = header_hash(name, namelen) & (HEADERS_INDEX_SIZE - 1);
+	while(h->header_slots[slot]) {
+		struct header_field *f = &h->headers[h->header_slots[slot] - 1];
+		if (f->namelen == namelen and header_name_eq(f->name, name, namelen)) return;
+		slot = (slot + 1) & (HEADERS_INDEX_SIZE - 1);
+	}
+	h->headers[h->headers_amount] = (struct header_field) {.name = name, .namelen = namelen, .value = value, .valuelen = valuelen};
+	h->header_slots[slot] = (unsigned char) ++h->headers_amount;
+
+	if (namelen == strizeof("Cookie") and header_name_eq(name, "Cookie", namelen)) cookie_index_parse(h, value, valuelen);
+}
+
+const char *header_index_find(const struct header_index *h, const char *name, size_t *valuelen) {
+	size_t namelen = strlen(name);
+	if (namelen > strizeof(COOKIE_PREFIX) and memcmp(name, COOKIE_PREFIX, strizeof(COOKIE_PREFIX)) == 0) {
+		name += strizeof(COOKIE_PREFIX);
+		namelen -= strizeof(COOKIE_PREFIX);
+		uint32_t slot = form_hash(name, namelen) & (COOKIES_INDEX_SIZE - 1);
+		while(h->cookie_slots[slot]) {
+			const struct header_field *f = &h->cookies[h->cookie_slots[slot] - 1];
+			if (f->namelen == namelen and memcmp(f->name, name, namelen) == 0) {
+				*valuelen = f->valuelen;
+				return f->value;
+			}
+			slot = (slot + 1) & (COOKIES_INDEX_SIZE - 1);
+		}
+		return NULL;
+	}
+
+	uint32_t slot = header_hash(name, namelen) & (HEADERS_INDEX_SIZE - 1);
+	while(h->header_slots[slot]) {
+		const struct header_field *f = &h->headers[h->header_slots[slot] - 1];
+		if (f->namelen == namelen and header_name_eq(f->name, name, namelen)) {
+			*valuelen = f->valuelen;
+			return f->value;
+		}
+		slot = (slot + 1) & (HEADERS_INDEX_SIZE - 1);
+	}
+	return NULL;
+}
+
+// Finds parameter of header value, like boundary in "multipart/form-data; boundary=abc" or filename in
+// "form-data; name="file"; filename="a.png"". Quotes are not included, escapes inside of them are left as is
+const char *header_param(const char *value, size_t len, const char *param, size_t *paramlen) {
+	size_t plen = strlen(param);
+	const char *end = value + len;
+	const char *p = memchr(value, ';', len); // value itself is skipped
+	while(p) {
+		p++;
+		while(p < end and (*p == ' ' or *p == '\t')) p++;
+		const char *name = p;
+		while(p < end and *p != '=' and *p != ';') p++;
+		size_t namelen = (size_t) (p - name);
+		const char *v = NULL;
+		size_t vlen = 0;
+		if (p < end and *p == '=') {
+			p++;
+			if (p < end and *p == '"') {
+				v = ++p;
+				while(p < end and *p != '"') p += (*p == '\\' and end - p > 1) ? 2 : 1;
+				vlen = (size_t) (p - v);
+			} else {
+				v = p;
+				while(p < end and *p != ';' and *p != ' ') p++;
+				vlen = (size_t) (p - v);
+			}
+		}
+		if (v and namelen == plen and header_name_eq(name, param, plen)) {
+			*paramlen = vlen;
+			return v;
+		}
+		p = memchr(p, ';', (size_t) (end - p));
+	}
+	return NULL;
+}
+
+// multipart/form-data by chunks, for file uploads. Parts are delimited by "\r\n--boundary". Headers of every
+// part are collected (up to MULTIPART_HEADERS_MAX bytes), and it's body is given to callback right from the
+// chunks, piece by piece. Callback is called with piece == NULL and last = false when part begins (it's
+// name, filename and type are known at that time), then with pieces, and then with last = true when it ends.
+// Only '\r' might start delimiter (boundary can't have it), so bytes which are not after '\r' are never held.
+
+#define MULTIPART_BOUNDARY_MAX 70 // RFC 2046
+#define MULTIPART_HEADERS_MAX 1024
+
+struct multipart_part {
+	char name[FORM_STREAM_KEY_MAX];
+	size_t namelen; // 0 if there's no name, or it's too long
+	char filename[256];
+	size_t filenamelen; // filename is cut if it's longer
+	char type[128];
+	size_t typelen;
+};
+
+typedef bool (*multipart_cb)(const struct multipart_part *part, const char *piece, size_t len, bool last, void *context);
+
+enum multipart_state {MULTIPART_PREAMBLE, MULTIPART_DELIMITER_END, MULTIPART_HEADERS, MULTIPART_BODY, MULTIPART_DONE};
+
+struct multipart_stream {
+	multipart_cb value;
+	void *context;
+	enum multipart_state state;
+	size_t matched; // bytes of delimiter which have been matched so far, some of them might be in previous chunk
+	size_t delimiterlen;
+	size_t headerslen;
+	struct multipart_part part;
+	char delimiter[sizeof("\r\n--") + MULTIPART_BOUNDARY_MAX];
+	char headers[MULTIPART_HEADERS_MAX];
+};
+
+// content_type is a value of Content-Type header, boundary is taken from it
+bool multipart_stream_init(struct multipart_stream *m, const char *content_type, size_t len, multipart_cb value, void *context) {
+	size_t boundarylen;
+	const char *boundary = header_param(content_type, len, "boundary", &boundarylen);
+	if (boundary == NULL or boundarylen == 0 or boundarylen > MULTIPART_BOUNDARY_MAX) return false;
+
+	m->value = value;
+	m->context = context;
+	m->state = MULTIPART_PREAMBLE;
+	m->matched = strizeof("\r\n"); // the first delimiter is right at the start, usually
+	m->delimiterlen = strizeof("\r\n--") + boundarylen;
+	m->headerslen = 0;
+	memcpy(m->delimiter, "\r\n--", strizeof("\r\n--"));
+	memcpy(m->delimiter + strizeof("\r\n--"), boundary, boundarylen);
+	return true;
+}
+
+static void multipart_copy(char *dst, size_t space, size_t *dstlen, const char *src, size_t len) {
+	if (len >= space) len = space - sizeof(char);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	*dstlen = len;
+}
+
+static void multipart_part_parse(struct multipart_part *part, const char *headers, size_t len) {
+	memset(part, 0, sizeof(struct multipart_part));
+	const char *end = headers + len;
+	while(headers < end) {
+		const char *eol = util_memmem(headers, (size_t) (end - headers), "\r\n", strizeof("\r\n"));
+		if (eol == NULL) eol = end;
+		const char *colon = memchr(headers, ':', (size_t) (eol - headers));
+		if (colon) {
+			size_t namelen = (size_t) (colon - headers);
+			const char *value = colon + 1;
+			while(value < eol and (*value == ' ' or *value == '\t')) value++;
+			size_t valuelen = (size_t) (eol - value);
+			if (namelen == strizeof("Content-Disposition") and header_name_eq(headers, "Content-Disposition", namelen)) {
+				size_t plen;
+				const char *p = header_param(value, valuelen, "name", &plen);
+				if (p and plen < sizeof(part->name)) multipart_copy(part->name, sizeof(part->name), &part->namelen, p, plen);
+				p = header_param(value, valuelen, "filename", &plen);
+				if (p) multipart_copy(part->filename, sizeof(part->filename), &part->filenamelen, p, plen);
+			} else if (namelen == strizeof("Content-Type") and header_name_eq(headers, "Content-Type", namelen)) {
+				multipart_copy(part->type, sizeof(part->type), &part->typelen, value, valuelen);
+			}
+		}
+		headers = eol + strizeof("\r\n");
+	}
+}
+
+static bool multipart_out(struct multipart_stream *m, const char *piece, size_t len) {
+	if (len == 0 or m->state != MULTIPART_BODY) return true; // preamble is skipped
+	return m->value(&m->part, piece, len, false, m->context);
+}
+
+// Returns false if body is malformed or callback has returned false
+bool multipart_stream_feed(struct multipart_stream *m, const char *data, size_t len) {
+	const char *p = data;
+	const char *end = data + len;
+	while(p < end) {
+		switch (m->state) {
+		case MULTIPART_PREAMBLE:
+		case MULTIPART_BODY:
+			if (m->matched == 0) {
+				const char *cr = memchr(p, '\r', (size_t) (end - p));
+				const char *until = cr ? cr : end;
+				if (multipart_out(m, p, (size_t) (until - p)) == false) return false;
+				p = until;
+				if (p == end) break;
+			}
+			if (*p != m->delimiter[m->matched]) {
+				// it wasn't delimiter after all, and this byte isn't continuation of what has been matched
+				if (multipart_out(m, m->delimiter, m->matched) == false) return false;
+				m->matched = 0;
+				break;
+			}
+			p++;
+			if (++m->matched < m->delimiterlen) break;
+			m->matched = 0;
+			if (m->state == MULTIPART_BODY and m->value(&m->part, NULL, 0, true, m->context) == false) return false;
+			m->state = MULTIPART_DELIMITER_END;
+			m->headerslen = 0;
+			break;
+		case MULTIPART_DELIMITER_END: // "\r\n" before headers of next part, or "--" after the last one
+			m->headers[m->headerslen++] = *p++;
+			if (m->headerslen < strizeof("--")) break;
+			if (memcmp(m->headers, "--", strizeof("--")) == 0) {
+				m->state = MULTIPART_DONE;
+			} else if (memcmp(m->headers, "\r\n", strizeof("\r\n")) == 0) {
+				m->state = MULTIPART_HEADERS;
+				m->headerslen = 0;
+			} else {
+				return false;
+			}
+			break;
+		case MULTIPART_HEADERS:
+			if (m->headerslen == sizeof(m->headers)) return false;
+			m->headers[m->headerslen++] = *p++;
+			if (m->headerslen == strizeof("\r\n") and memcmp(m->headers, "\r\n", strizeof("\r\n")) == 0) {
+				memset(&m->part, 0, sizeof(struct multipart_part)); // part without headers
+			} else if (m->headerslen < strizeof("\r\n\r\n") or memcmp(m->headers + m->headerslen - strizeof("\r\n\r\n"), "\r\n\r\n", strizeof("\r\n\r\n")) != 0) {
+				break;
+			} else {
+				multipart_part_parse(&m->part, m->headers, m->headerslen - strizeof("\r\n\r\n"));
+			}
+			m->state = MULTIPART_BODY;
+			if (m->value(&m->part, NULL, 0, false, m->context) == false) return false;
+			break;
+		case MULTIPART_DONE: // epilogue is ignored
+			return true;
+		}
+	}
+	return true;
+}
+
+// When body ends. Returns false if the last delimiter hasn't been found
+bool multipart_stream_finish(struct multipart_stream *m) {
+	return m->state == MULTIPART_DONE;
+}
+
 #ifdef __USE_GNU
 #define qsort_pass qsort_r
 #else
@@ -0,0 +1,167 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../src/kdf.c"
+#include "../src/hash_pool.c"
+
+// Logins/s and latency of pages while logins are flooding. LOGINS threads are checking passwords all the
+// time, PAGES threads are "rendering pages" (small fixed amount of work) and measure how long it takes.
+// Without pool every login thread hashes by itself, so pages are competing for CPU with all of them.
+// With pool only it's threads are hashing, logins above threads + queue are refused (503 in app).
+
+#define LOGINS 8
+#define PAGES 4
+#define ITERATIONS 10000
+#define SECONDS 2.0
+#define PAGE_SAMPLES 65536
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+static bool hex_equal(const BYTE *bin, const char *hex, size_t len) {
+	char buf[129];
+	for (size_t i = 0; i < len; i++) sprintf(buf + i * 2, "%02x", bin[i]);
+	return strcmp(buf, hex) == 0;
+}
+
+static bool sanity(void) {
+	// RFC 4231, test case 2
+	struct hmac_sha256 h;
+	BYTE out[64];
+	hmac_sha256_init(&h, "Jefe", 4);
+	hmac_sha256(&h, "what do ya want for nothing?", 28, out);
+	if (hex_equal(out, "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843", 32) == false) {
+		printf("HMAC-SHA256 is wrong\n");
+		return false;
+	}
+	// RFC 7914, section 11
+	pbkdf2_hmac_sha256("passwd", 6, "salt", 4, 1, out, 64);
+	if (hex_equal(out, "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783", 64) == false) {
+		printf("PBKDF2-HMAC-SHA256 with 1 iteration is wrong\n");
+		return false;
+	}
+	pbkdf2_hmac_sha256("Password", 8, "NaCl", 4, 80000, out, 64);
+	if (hex_equal(out, "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d", 64) == false) {
+		printf("PBKDF2-HMAC-SHA256 with 80000 iterations is wrong\n");
+		return false;
+	}
+	return true;
+}
+
+static struct hash_pool pool = HASH_POOL_INITIALIZER;
+static unsigned pool_threads; // 0 is no pool
+static volatile bool running;
+static unsigned long logins, refused;
+static pthread_mutex_t counters = PTHREAD_MUTEX_INITIALIZER;
+
+static void login(void *arg) {
+	BYTE out[SHA256_BLOCK_SIZE];
+	pbkdf2_hmac_sha256("password", 8, "saltsaltsaltsalt", 16, ITERATIONS, out, sizeof(out));
+	*(BYTE *) arg = out[0];
+}
+
+static void *login_thread(void *arg) {
+	(void) arg;
+	BYTE result;
+	while(running) {
+		bool done = true;
+		if (pool_threads == 0) login(&result);
+		else done = hash_pool_run(&pool, pool_threads, PAGES, login, &result);
+		pthread_mutex_lock(&counters);
+		if (done) logins++;
+		else refused++;
+		pthread_mutex_unlock(&counters);
+		if (done == false) {
+			struct timespec t = {.tv_nsec = 1000000}; // client tries again a bit later
+			nanosleep(&t, NULL);
+		}
+	}
+	return NULL;
+}
+
+struct page_stats {
+	double samples[PAGE_SAMPLES];
+	unsigned amount;
+};
+
+static void *page_thread(void *arg) {
+	struct page_stats *s = arg;
+	BYTE page[4096] = {0};
+	while(running) {
+		double start = now();
+		SHA256_CTX ctx; // about as much work as rendering of small page
+		for (unsigned i = 0; i < 8; i++) {
+			sha256_init(&ctx);
+			sha256_update(&ctx, page, sizeof(page));
+			sha256_final(&ctx, page);
+		}
+		if (s->amount < PAGE_SAMPLES) s->samples[s->amount++] = now() - start;
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void run(unsigned threads) {
+	static struct page_stats stats[PAGES];
+	pthread_t t[LOGINS + PAGES];
+	pool_threads = threads;
+	logins = refused = 0;
+	running = true;
+	for (unsigned i = 0; i < LOGINS; i++) pthread_create(&t[i], NULL, login_thread, NULL);
+	for (unsigned i = 0; i < PAGES; i++) {
+		stats[i].amount = 0;
+		pthread_create(&t[LOGINS + i], NULL, page_thread, &stats[i]);
+	}
+	struct timespec d = {.tv_sec = (time_t) SECONDS, .tv_nsec = (long) ((SECONDS - (double) (time_t) SECONDS) * 1e9)};
+	nanosleep(&d, NULL);
+	running = false;
+	for (unsigned i = 0; i < LOGINS + PAGES; i++) pthread_join(t[i], NULL);
+
+	static double all[PAGES * PAGE_SAMPLES];
+	unsigned amount = 0;
+	for (unsigned i = 0; i < PAGES; i++) {
+		memcpy(all + amount, stats[i].samples, stats[i].amount * sizeof(double));
+		amount += stats[i].amount;
+	}
+	qsort(all, amount, sizeof(double), cmp_double);
+	char name[32];
+	if (threads) snprintf(name, sizeof(name), "pool of %u", threads);
+	else snprintf(name, sizeof(name), "no pool");
+	printf("%-10s %8.1f logins/s %8.1f refused/s %9.1f pages/s, page p50 %8.1f us, p99 %9.1f us\n", name,
+	       (double) logins / SECONDS, (double) refused / SECONDS, (double) amount / SECONDS,
+	       amount ? all[amount / 2] * 1e6 : 0.0, amount ? all[amount * 99 / 100] * 1e6 : 0.0);
+}
+
+int main() {
+	if (sanity() == false) return EXIT_FAILURE;
+
+	double start = now();
+	BYTE out[SHA256_BLOCK_SIZE];
+	unsigned hashes = 0;
+	while(now() - start < 1.0) {
+		pbkdf2_hmac_sha256("password", 8, "saltsaltsaltsalt", 16, ITERATIONS, out, sizeof(out));
+		hashes++;
+	}
+	printf("PBKDF2-HMAC-SHA256, %u iterations: %.1f hashes/s on one thread\n", ITERATIONS, hashes / (now() - start));
+	printf("%u threads are logging in, %u are rendering pages\n", LOGINS, PAGES);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	run(0);
+	run(1);
+	if (cpus > 2) run((unsigned) cpus / 2);
+	if (cpus > 1) run((unsigned) cpus);
+
+	return EXIT_SUCCESS;
+}
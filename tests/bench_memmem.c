@@ -0,0 +1,85 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/util.c"
+
+// Compares util_memmem() (dispatched to SIMD version if CPU allows) with portable util_memmem_generic()
+// on inputs that are typical for this project: metadata keys, cookie/form fields and separator in html.
+
+static const char metadata[] = "METADATA1\ndisplay: both\nunix access: 755\nuser id: 1\ngroup id: 0\n"
+                               "title: Shipwrecked during a dreadful storm\ndata: Shipwrecked during a dreadful stormKxhEfHFzvDD\n"
+                               "datasource: Shipwrecked during a dreadful stormQNCKe2Le1WO\ncreation_unixepoch: 1652107591\n"
+                               "modificated_unixepoch: 1652107591\ntags: story, island, sea\nexcerpt: 0000000979\n";
+static const char * const metadata_keys[] = {"\ndisplay: ", "\nunix access: ", "\nuser id: ", "\ngroup id: ", "\ntitle: ", "\ndata: ",
+                                             "\ndatasource: ", "\ntags: ", "\ncreation_unixepoch: ", "\nmodificated_unixepoch: ", NULL};
+
+static const char cookie[] = "_ga=GA1.2.1234567890.1652107591; _gid=GA1.2.987654321.1652107591; theme=dark; lang=uk-UA; "
+                             "consent=necessary%2Cpreferences; id=session_aB3dE5gH7jK";
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+typedef void *(*memmem_fun)(const void *, size_t, const void *, size_t);
+static volatile uintptr_t sink;
+
+static double bench(memmem_fun f, const char *h, size_t hlen, const char * const *needles, unsigned iterations) {
+	double start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		for (const char * const *n = needles; *n != NULL; n++) sink += (uintptr_t) f(h, hlen, *n, strlen(*n));
+	}
+	return (now() - start) * 1e9 / iterations;
+}
+
+static void report(const char *name, const char *h, size_t hlen, const char * const *needles, unsigned iterations) {
+	double generic = bench(util_memmem_generic, h, hlen, needles, iterations);
+	double dispatched = bench(util_memmem, h, hlen, needles, iterations);
+	printf("%-28s %8zu bytes: generic %10.1f ns, util_memmem %10.1f ns, x%.2f\n", name, hlen, generic, dispatched, generic / dispatched);
+}
+
+static bool fuzz(void) {
+	char h[512], n[32];
+	const char alphabet[] = "ab<hr>\n=;";
+	for (unsigned i = 0; i < 200000; i++) {
+		size_t hlen = (size_t) rand() % sizeof(h);
+		size_t nlen = 1 + (size_t) rand() % (sizeof(n) - 1);
+		if (i % 2) nlen = 1 + nlen % 4;
+		for (size_t j = 0; j < hlen; j++) h[j] = alphabet[rand() % strizeof(alphabet)];
+		for (size_t j = 0; j < nlen; j++) n[j] = alphabet[rand() % strizeof(alphabet)];
+		if (hlen > nlen and i % 3 == 0) memcpy(h + hlen - nlen, n, nlen); // match at the very end
+		if (util_memmem(h, hlen, n, nlen) != util_memmem_generic(h, hlen, n, nlen)) {
+			printf("Mismatch: haystack %.*s needle %.*s\n", (int) hlen, h, (int) nlen, n);
+			return false;
+		}
+	}
+	return true;
+}
+
+int main() {
+	srand(1);
+	if (fuzz() == false) return EXIT_FAILURE;
+
+	report("metadata (10 keys)", metadata, strizeof(metadata), metadata_keys, 200000);
+
+	const char * const cookie_keys[] = {"id=", "lang=", NULL};
+	report("cookie (2 keys)", cookie, strizeof(cookie), cookie_keys, 500000);
+
+	size_t htmllen = 256 * 1024;
+	char *html = malloc(htmllen);
+	if (html == NULL) return EXIT_FAILURE;
+	const char paragraph[] = "<p>I went on shore, and <em>looked</em> about for the place, and <a href=\"/x\">found</a> it.</p>\n<h2>";
+	for (size_t i = 0; i < htmllen; i++) html[i] = paragraph[i % strizeof(paragraph)];
+	const char * const separator[] = {"<hr>", NULL};
+	report("html, no separator", html, htmllen, separator, 2000);
+	memcpy(html + htmllen / 2, "<hr>", strizeof("<hr>"));
+	report("html, separator in middle", html, htmllen, separator, 2000);
+	free(html);
+
+	return EXIT_SUCCESS;
+}
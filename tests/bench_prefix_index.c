@@ -0,0 +1,138 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/util.c"
+#include "../src/prefix_index.c"
+
+// Latency of /suggest lookups (see prefix_index.c) with a lot of tags and titles, and how long it takes to fill
+// the index from storage and to add names of a new record after that.
+
+#define NAMES 200000
+#define LOOKUPS 1000000
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+static bool found(struct prefix_index *p, enum prefix_kind kind, const char *prefix, const char *const expected[], const uint32_t values[]) {
+	struct prefix_match m[8];
+	char buffer[1024];
+	size_t amount = prefix_index_find(p, kind, prefix, strlen(prefix), m, 8, buffer, sizeof(buffer));
+	for (size_t i = 0; i < amount; i++) {
+		if (expected[i] == NULL or m[i].len != strlen(expected[i]) or memcmp(m[i].name, expected[i], m[i].len) != STREQ or m[i].value != values[i]) {
+			printf("Prefix \"%s\": %zu-th is %.*s (%u)\n", prefix, i, (int) m[i].len, m[i].name, m[i].value);
+			return false;
+		}
+	}
+	if (expected[amount] != NULL) {
+		printf("Prefix \"%s\": %zu found, %s is missing\n", prefix, amount, expected[amount]);
+		return false;
+	}
+	return true;
+}
+
+static bool sanity(void) {
+	const char *error = NULL;
+	struct prefix_index *p = prefix_index_create(64, 4096, &error);
+	if (p == NULL) {
+		printf("Failed to create index: %s\n", error);
+		return false;
+	}
+
+	// names which are added before index is filled are in storage already, so they're ignored
+	prefix_index_tag(p, "ignored", strizeof("ignored"));
+	if (prefix_index_begin_fill(p) == false) return false;
+	prefix_index_append(p, PREFIX_TITLES, "Travel notes", strizeof("Travel notes"), 2);
+	prefix_index_append(p, PREFIX_TITLES, "trains", strizeof("trains"), 1);
+	prefix_index_append(p, PREFIX_TITLES, "Тролейбус", strlen("Тролейбус"), 3);
+	prefix_index_append(p, PREFIX_TAGS, "travel", strizeof("travel"), 1);
+	prefix_index_append(p, PREFIX_TAGS, "trave", strizeof("trave"), 1);
+	prefix_index_append(p, PREFIX_TAGS, "travel", strizeof("travel"), 1);
+	prefix_index_append(p, PREFIX_TAGS, "life", strizeof("life"), 2);
+	prefix_index_end_fill(p, true);
+	if (prefix_index_begin_fill(p) == true) {
+		printf("Filled index is filled again\n");
+		return false;
+	}
+
+	if (found(p, PREFIX_TITLES, "TR", (const char *[]) {"trains", "Travel notes", NULL}, (uint32_t []) {1, 2}) == false) return false;
+	if (found(p, PREFIX_TITLES, "тро", (const char *[]) {"Тролейбус", NULL}, (uint32_t []) {3}) == false) return false;
+	if (found(p, PREFIX_TAGS, "trav", (const char *[]) {"trave", "travel", NULL}, (uint32_t []) {1, 2}) == false) return false;
+	if (found(p, PREFIX_TAGS, "travels", (const char *[]) {NULL}, NULL) == false) return false;
+	if (found(p, PREFIX_TAGS, "ignored", (const char *[]) {NULL}, NULL) == false) return false;
+
+	// title of record is replaced, tag of new record is counted
+	prefix_index_title(p, 2, "Cooking", strizeof("Cooking"));
+	prefix_index_title(p, 4, "Trams", strizeof("Trams"));
+	prefix_index_tag(p, "life", strizeof("life"));
+	prefix_index_tag(p, "lift", strizeof("lift"));
+	if (found(p, PREFIX_TITLES, "tr", (const char *[]) {"trains", "Trams", NULL}, (uint32_t []) {1, 4}) == false) return false;
+	if (found(p, PREFIX_TITLES, "c", (const char *[]) {"Cooking", NULL}, (uint32_t []) {2}) == false) return false;
+	if (found(p, PREFIX_TAGS, "lif", (const char *[]) {"life", "lift", NULL}, (uint32_t []) {2, 1}) == false) return false;
+
+	prefix_index_clear(p);
+	if (found(p, PREFIX_TAGS, "l", (const char *[]) {NULL}, NULL) == false) return false;
+	prefix_index_destroy(p);
+	return true;
+}
+
+static void name(char *buf, uint32_t i) {
+	static const char *syllables[] = {"ka", "lo", "mi", "ne", "ru", "ta", "vo", "zi", "sha", "pre", "tion", "st"};
+	size_t len = 0;
+	for (uint32_t x = i * 2654435761u | 1; x and len < 24; x /= 12) {
+		const char *s = syllables[x % 12];
+		memcpy(buf + len, s, strlen(s));
+		len += strlen(s);
+	}
+	buf[len] = '\0';
+}
+
+int main() {
+	if (sanity() == false) return EXIT_FAILURE;
+
+	const char *error = NULL;
+	struct prefix_index *p = prefix_index_create(1048576, 134217728, &error);
+	if (p == NULL) {
+		printf("Failed to create index: %s\n", error);
+		return EXIT_FAILURE;
+	}
+
+	char buf[64];
+	double start = now();
+	prefix_index_begin_fill(p);
+	for (uint32_t i = 0; i < NAMES; i++) {
+		name(buf, i);
+		prefix_index_append(p, PREFIX_TAGS, buf, strlen(buf), i);
+		prefix_index_append(p, PREFIX_TITLES, buf, strlen(buf), i);
+	}
+	prefix_index_end_fill(p, true);
+	printf("Filled with %d titles and tags: %.1f ms, %zu distinct tags\n", NAMES, (now() - start) * 1e3, p->amount[PREFIX_TAGS]);
+
+	struct prefix_match m[10];
+	char names[10 * NAME_MAX];
+	size_t total = 0;
+	start = now();
+	for (uint32_t i = 0; i < LOOKUPS; i++) {
+		name(buf, i);
+		total += prefix_index_find(p, i % 2 ? PREFIX_TAGS : PREFIX_TITLES, buf, CBL_MIN(strlen(buf), (size_t) (1 + i % 5)), m, 10, names, sizeof(names));
+	}
+	double seconds = now() - start;
+	printf("Lookups: %.2f us each, %.1f names found on average\n", seconds / LOOKUPS * 1e6, (double) total / LOOKUPS);
+
+	start = now();
+	for (uint32_t i = 0; i < 10000; i++) {
+		name(buf, NAMES + i);
+		prefix_index_title(p, NAMES + i, buf, strlen(buf));
+		prefix_index_tag(p, buf, strlen(buf));
+	}
+	printf("New records: %.2f us each\n", (now() - start) / 10000 * 1e6);
+
+	prefix_index_destroy(p);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUTER_MAX_NODES 4096
+#define ROUTER_MAX_ROUTES 4096
+#define ROUTER_HASH_SIZE 8192
+#include "../src/router.c"
+
+// Dispatch time of compiled router vs chain of length + memcmp() checks (what app_request() used to do),
+// while the amount of routes grows. Worst case for the chain is the last route and the record url,
+// which is checked after every static route. Router should stay flat.
+
+#define GET (1u << 1)
+#define POST (1u << 0)
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+static volatile unsigned sink;
+
+static unsigned chain(char (*patterns)[48], const size_t *lens, unsigned amount, const char *path, size_t len) {
+	for (unsigned i = 0; i < amount; i++) {
+		if (len == lens[i] and memcmp(path, patterns[i], len) == 0) return i;
+	}
+	// fallback for records, like get_u32_from_end_of_string()
+	const char *digits = path + len;
+	while(digits > path and digits[-1] >= '0' and digits[-1] <= '9') digits--;
+	return digits == path + len ? UINT32_MAX : (unsigned) strtoul(digits, NULL, 10);
+}
+
+static bool check(const struct router *r, const char *path, unsigned method, enum router_result expected, unsigned index, uint32_t param) {
+	struct route_match m;
+	enum router_result res = router_match(r, path, strlen(path), method, &m);
+	if (res != expected or (res == ROUTE_FOUND and m.index != index) or (param != UINT32_MAX and (m.params_amount == 0 or m.params[0] != param))) {
+		printf("Unexpected result for %s: %d, route %u\n", path, res, m.index);
+		return false;
+	}
+	return true;
+}
+
+static bool check_allowed(const struct router *r, const char *path, unsigned method, unsigned allowed) {
+	// methods which are given in "Allow:" of 405
+	struct route_match m;
+	if (router_match(r, path, strlen(path), method, &m) != ROUTE_METHOD_NOT_ALLOWED or m.allowed != allowed) {
+		printf("Unexpected allowed methods for %s: %u\n", path, m.allowed);
+		return false;
+	}
+	return true;
+}
+
+static bool sanity(void) {
+	struct router r;
+	const char *error = NULL;
+	router_init(&r);
+	const char *patterns[] = {"/", "/tags", "/user", "/user/{id}", "/user/{id}/posts", "/page", "/{slug-id}", "/media/{name}", NULL};
+	for (unsigned i = 0; patterns[i]; i++) {
+		if (router_add(&r, patterns[i], i == 5 ? GET | POST : GET, i, &error) == false) {
+			printf("Failed to add %s: %s\n", patterns[i], error);
+			return false;
+		}
+	}
+	if (router_add(&r, "/tags", GET, 100, &error) == true) return false;
+	if (router_add(&r, "/{slug-id}/x", GET, 100, &error) == true) return false;
+	if (router_add(&r, "/{name}/x", GET, 100, &error) == true) return false;
+
+	return check(&r, "/", GET, ROUTE_FOUND, 0, UINT32_MAX)
+	   and check(&r, "/tags", GET, ROUTE_FOUND, 1, UINT32_MAX)
+	   and check(&r, "/tags", POST, ROUTE_METHOD_NOT_ALLOWED, 0, UINT32_MAX)
+	   and check_allowed(&r, "/tags", POST, GET)
+	   and check_allowed(&r, "/Hello world-42", POST, GET)
+	   and check(&r, "/page", POST, ROUTE_FOUND, 5, UINT32_MAX)
+	   and check(&r, "/user/15", GET, ROUTE_FOUND, 3, 15)
+	   and check(&r, "/user/15/posts", GET, ROUTE_FOUND, 4, 15)
+	   and check(&r, "/user/abc", GET, ROUTE_NOT_FOUND, 0, UINT32_MAX)
+	   and check(&r, "/user/abc-7", GET, ROUTE_FOUND, 6, 7) // falls back to record
+	   and check(&r, "/Hello world-42", GET, ROUTE_FOUND, 6, 42)
+	   and check(&r, "/a/b/c-42", GET, ROUTE_FOUND, 6, 42)
+	   and check(&r, "/tags/", GET, ROUTE_NOT_FOUND, 0, UINT32_MAX)
+	   and check(&r, "/99999999999", GET, ROUTE_NOT_FOUND, 0, UINT32_MAX)
+	   and check(&r, "/media/photo.jpg", GET, ROUTE_FOUND, 7, UINT32_MAX)
+	   and check(&r, "/media/photo-7", GET, ROUTE_FOUND, 7, UINT32_MAX) // {name} wins over {slug-id}
+	   and check(&r, "/media/a/b-7", GET, ROUTE_FOUND, 6, 7);
+}
+
+int main() {
+	if (sanity() == false) return EXIT_FAILURE;
+
+	const unsigned sizes[] = {6, 60, 600, 3000};
+	for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		unsigned amount = sizes[s];
+		char (*patterns)[48] = malloc(amount * sizeof(*patterns));
+		size_t *lens = malloc(amount * sizeof(size_t));
+		struct router *r = malloc(sizeof(struct router));
+		if (patterns == NULL or lens == NULL or r == NULL) return EXIT_FAILURE;
+		router_init(r);
+		const char *error;
+		for (unsigned i = 0; i < amount; i++) {
+			snprintf(patterns[i], sizeof(patterns[i]), "/section%u/page%u", i / 10, i);
+			lens[i] = strlen(patterns[i]);
+			if (router_add(r, patterns[i], GET, i, &error) == false) {
+				printf("Failed to add route: %s\n", error);
+				return EXIT_FAILURE;
+			}
+		}
+		router_add(r, "/{slug-id}", GET, amount, &error);
+
+		const char *paths[] = {patterns[amount - 1], "/Some record title-1234"};
+		for (unsigned p = 0; p < 2; p++) {
+			size_t len = strlen(paths[p]);
+			const unsigned iterations = 200000;
+			struct route_match m;
+
+			double start = now();
+			for (unsigned i = 0; i < iterations; i++) sink += chain(patterns, lens, amount, paths[p], len);
+			double chain_ns = (now() - start) * 1e9 / iterations;
+
+			start = now();
+			for (unsigned i = 0; i < iterations; i++) {
+				router_match(r, paths[p], len, GET, &m);
+				sink += m.index;
+			}
+			double router_ns = (now() - start) * 1e9 / iterations;
+
+			printf("%5u routes, %-24s memcmp chain %9.1f ns, router %6.1f ns\n", amount, paths[p], chain_ns, router_ns);
+		}
+		free(patterns);
+		free(lens);
+		free(r);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/util.c"
+#include "../src/external/sha256.c"
+
+// Throughput of SHA-256 implementations: portable one (which was the only one before), SHA-NI, and AVX2 which
+// hashes 8 messages at once (sha256_multi() only). Sizes are like HMAC of cookie, small record and big record.
+
+#define SECONDS 0.5
+#define MULTI 64
+
+static const char *names[] = {
+	[SHA256_IMPL_GENERIC] = "generic",
+	[SHA256_IMPL_SHANI] = "sha-ni",
+	[SHA256_IMPL_AVX2] = "avx2 x8",
+};
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+static void digest(const void *data, size_t len, size_t step, BYTE out[SHA256_BLOCK_SIZE]) {
+	SHA256_CTX ctx;
+	sha256_init(&ctx);
+	for (size_t i = 0; i < len; i += step) sha256_update(&ctx, (const BYTE *) data + i, CBL_MIN(step, len - i));
+	sha256_final(&ctx, out);
+}
+
+static bool hex_equal(const BYTE *bin, const char *hex) {
+	char buf[SHA256_BLOCK_SIZE * 2 + 1];
+	for (size_t i = 0; i < SHA256_BLOCK_SIZE; i++) sprintf(buf + i * 2, "%02x", bin[i]);
+	return strcmp(buf, hex) == 0;
+}
+
+static bool sanity(void) {
+	// FIPS 180-2 examples, they are checked by every implementation which CPU has
+	static const struct {
+		const char *message;
+		size_t repeat;
+		const char *hash;
+	} kat[] = {
+		{"", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+		{"abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+		{"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+		{"a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+	};
+
+	size_t biggest = 1000000 + 1024;
+	BYTE *data = malloc(biggest);
+	if (data == NULL) return false;
+	BYTE expected[1024][SHA256_BLOCK_SIZE];
+	for (size_t i = 0; i < biggest; i++) data[i] = (BYTE) (i * 2654435761u >> 13);
+
+	// every length of message up to a few blocks, by the portable implementation which was used before
+	sha256_select(SHA256_IMPL_GENERIC);
+	for (size_t len = 0; len < 1024; len++) digest(data, len, len + 1, expected[len]);
+
+	for (enum sha256_impl impl = SHA256_IMPL_GENERIC; impl <= SHA256_IMPL_AVX2; impl++) {
+		if (sha256_select(impl) == false) {
+			printf("%s: CPU can't do it, skipped\n", names[impl]);
+			continue;
+		}
+		BYTE out[SHA256_BLOCK_SIZE];
+		for (size_t i = 0; i < sizeof(kat) / sizeof(kat[0]); i++) {
+			size_t len = strlen(kat[i].message) * kat[i].repeat;
+			if (kat[i].repeat > 1) memset(data, kat[i].message[0], len);
+			else memcpy(data, kat[i].message, len);
+			digest(data, len, 1000, out);
+			if (hex_equal(out, kat[i].hash) == false) {
+				printf("%s: hash of \"%s\" x %zu is wrong\n", names[impl], kat[i].message, kat[i].repeat);
+				return false;
+			}
+			const BYTE *one = data;
+			BYTE multi[1][SHA256_BLOCK_SIZE];
+			sha256_multi(&one, &len, 1, multi);
+			if (hex_equal(multi[0], kat[i].hash) == false) {
+				printf("%s: sha256_multi() of \"%s\" x %zu is wrong\n", names[impl], kat[i].message, kat[i].repeat);
+				return false;
+			}
+		}
+
+		for (size_t i = 0; i < biggest; i++) data[i] = (BYTE) (i * 2654435761u >> 13);
+		for (size_t len = 0; len < 1024; len++) {
+			// updates of different sizes are going through buffered and unbuffered paths
+			size_t steps[] = {1, 7, 63, 64, 65, 1024};
+			for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+				digest(data + 1, len, steps[s], out); // unaligned on purpose
+				if (len > 0) digest(data, len, steps[s], out);
+				if (memcmp(out, expected[len], SHA256_BLOCK_SIZE) != 0) {
+					printf("%s: hash of %zu bytes by %zu is different\n", names[impl], len, steps[s]);
+					return false;
+				}
+			}
+		}
+
+		// lanes of different lengths are finished at different blocks, and the last group is not full
+		const BYTE *messages[1024 / 7];
+		size_t lens[1024 / 7];
+		BYTE hashes[1024 / 7][SHA256_BLOCK_SIZE];
+		size_t n = 0;
+		for (size_t len = 0; len < 1024 and n < sizeof(lens) / sizeof(lens[0]); len += 7, n++) {
+			messages[n] = data;
+			lens[n] = (len * 37) % 1024;
+		}
+		sha256_multi(messages, lens, n, hashes);
+		for (size_t i = 0; i < n; i++) {
+			if (memcmp(hashes[i], expected[lens[i]], SHA256_BLOCK_SIZE) != 0) {
+				printf("%s: sha256_multi() of %zu bytes (message %zu of %zu) is different\n", names[impl], lens[i], i, n);
+				return false;
+			}
+		}
+	}
+
+	free(data);
+	return true;
+}
+
+static volatile BYTE sink;
+
+static double single(size_t len, const BYTE *data) {
+	BYTE out[SHA256_BLOCK_SIZE];
+	unsigned long bytes = 0;
+	double start = now(), end;
+	do {
+		for (unsigned i = 0; i < 64; i++) {
+			digest(data, len, len, out);
+			sink ^= out[0];
+			bytes += len;
+		}
+	} while((end = now()) - start < SECONDS);
+	return (double) bytes / (end - start) / 1e6;
+}
+
+static double multi(size_t len, const BYTE *data) {
+	const BYTE *messages[MULTI];
+	size_t lens[MULTI];
+	BYTE hashes[MULTI][SHA256_BLOCK_SIZE];
+	for (unsigned i = 0; i < MULTI; i++) {
+		messages[i] = data + i * len;
+		lens[i] = len;
+	}
+	unsigned long bytes = 0;
+	double start = now(), end;
+	do {
+		sha256_multi(messages, lens, MULTI, hashes);
+		sink ^= hashes[0][0];
+		bytes += MULTI * len;
+	} while((end = now()) - start < SECONDS);
+	return (double) bytes / (end - start) / 1e6;
+}
+
+int main() {
+	if (sanity() == false) return EXIT_FAILURE;
+
+	size_t sizes[] = {32, 64, 1024, 16384};
+	BYTE *data = malloc(MULTI * 16384);
+	if (data == NULL) return EXIT_FAILURE;
+	for (size_t i = 0; i < MULTI * 16384; i++) data[i] = (BYTE) i;
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		printf("%6zu bytes:", sizes[s]);
+		for (enum sha256_impl impl = SHA256_IMPL_GENERIC; impl <= SHA256_IMPL_AVX2; impl++) {
+			if (sha256_select(impl) == false) continue;
+			if (impl != SHA256_IMPL_AVX2) printf(" %s %8.1f MB/s,", names[impl], single(sizes[s], data));
+			printf(" %s multi %8.1f MB/s%s", names[impl], multi(sizes[s], data), impl == SHA256_IMPL_AVX2 ? "" : ",");
+		}
+		printf("\n");
+	}
+
+	free(data);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/util.c"
+
+// Throughput of utf8_check() (dispatched to SIMD version if CPU allows) vs portable utf8_check_generic()
+// on markdown bodies of few kilobytes: english text, ukrainian text (mostly 2 byte characters) and mixed one.
+
+static const char english[] = "## Chapter 1\n\nI was born in the year 1632, in the city of *York*, of a good family, though not of that country, "
+                              "my father being a foreigner of [Bremen](https://en.wikipedia.org/wiki/Bremen), who settled first at Hull.\n\n";
+static const char ukrainian[] = "## Розділ 1\n\nЯ народився 1632 року в місті *Йорку*, у заможній родині, хоча й нетутешній: "
+                                "мій батько був чужоземцем з Бремена, що спершу оселився в Галлі.\n\n";
+static const char mixed[] = "- Погода: сонячно ☀️, 25 °C\n- Настрій: 😀 — «чудовий»\n- Price: 10 € / 8 £ / ¥1200\n\n";
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+typedef const unsigned char *(*check_fun)(const void *, size_t);
+static volatile uintptr_t sink;
+
+static double bench(check_fun f, const char *body, size_t len, unsigned iterations) {
+	double start = now();
+	for (unsigned i = 0; i < iterations; i++) sink += (uintptr_t) f(body, len);
+	return (double) len * iterations / (now() - start) / 1e6;
+}
+
+static void report(const char *name, const char *paragraph, size_t paragraphlen, size_t len) {
+	char *body = malloc(len);
+	if (body == NULL) exit(EXIT_FAILURE);
+	size_t filled = 0;
+	while(filled + paragraphlen <= len) {
+		memcpy(body + filled, paragraph, paragraphlen);
+		filled += paragraphlen;
+	}
+
+	if (utf8_check(body, filled) != NULL or utf8_check_generic(body, filled) != NULL) {
+		printf("%s: body is not valid utf-8?\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned iterations = (unsigned) (256 * 1024 * 1024 / filled);
+	double generic = bench(utf8_check_generic, body, filled, iterations);
+	double dispatched = bench(utf8_check, body, filled, iterations);
+	printf("%-10s %7zu bytes: generic %8.1f MB/s, utf8_check %8.1f MB/s, x%.2f\n", name, filled, generic, dispatched, dispatched / generic);
+	free(body);
+}
+
+int main() {
+	size_t sizes[] = {2 * 1024, 16 * 1024, 128 * 1024};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		report("english", english, strizeof(english), sizes[i]);
+		report("ukrainian", ukrainian, strizeof(ukrainian), sizes[i]);
+		report("mixed", mixed, strizeof(mixed), sizes[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
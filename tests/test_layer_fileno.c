@@ -8,6 +8,7 @@
 #include <ftw.h>
 
 #define DATA_LAYER_FILENO
+#define FILENO_INDEX_SEGMENTS_MAX 4096 // writers are compacting index many times below
 #include "../src/util.c"
 #include "../src/abstract_data_layer.c"
 
@@ -31,6 +32,28 @@ void rfill(void *ptr, size_t size) {
 
 #define TESTSETPATH "fileno_testset"
 
+struct collected {
+	char *data;
+	size_t space;
+	size_t len;
+};
+
+static void collect(const void *ptr, unsigned long len, void *context) {
+	struct collected *c = context;
+	if (len > c->space - c->len) len = c->space - c->len;
+	memcpy(c->data + c->len, ptr, len);
+	c->len += len;
+}
+
+static bool searched(const char *query, unsigned total, unsigned long record, struct layer_context *con) {
+	// query finds that many records, the best one is record (if it's not 0)
+	struct search_hit hit;
+	unsigned found = 1, all;
+	const char *error;
+	if (search_records(query, strlen(query), &hit, &found, 0, &all, con, &error) == false) return false;
+	return all == total and (record == 0 or (found == 1 and hit.record == record));
+}
+
 int main() {
 	rmrf(TESTSETPATH);
 	mkdir(TESTSETPATH, 0777);
@@ -165,6 +188,307 @@ int main() {
 		}
 	}
 
+	struct blog_record b2 = {
+		.stack = buffer,
+		.stack_space = sizeof(buffer),
+		.excerpt_only = true,
+	};
+	if (get_record(&b2, 2, &con, &error) == false) {
+		printf("Failed to get excerpt of record #2: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	if (b2.excerptlen == 0 or b2.datasourcelen != b2.excerptlen or util_memmem(b2.datasource, b2.datasourcelen, EXCERPT_SEPARATOR, strizeof(EXCERPT_SEPARATOR)) != NULL) {
+		printf("Excerpt of record #2 is wrong: %.*s\n", b2.datasourcelen, b2.datasource);
+		return EXIT_FAILURE;
+	}
+
+	// record which doesn't fit into the stack is an error, unless there's an arena to take more from
+	struct blog_record full = {.stack = buffer, .stack_space = sizeof(buffer)};
+	if (get_record(&full, 2, &con, &error) == false) {
+		printf("Failed to get record #2: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	char tiny[64];
+	struct blog_record b3 = {.stack = tiny, .stack_space = sizeof(tiny)};
+	if (get_record(&b3, 2, &con, &error) == true) {
+		printf("Record #2 has been read into %zu bytes\n", sizeof(tiny));
+		return EXIT_FAILURE;
+	}
+	struct arena arena;
+	if (arena_init(&arena, 1048576) == false) return EXIT_FAILURE;
+	struct blog_record b4 = {.stack = tiny, .stack_space = sizeof(tiny), .arena = &arena};
+	if (get_record(&b4, 2, &con, &error) == false) {
+		printf("Failed to get record #2 with arena: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	if (b4.datasourcelen != full.datasourcelen or memcmp(b4.datasource, full.datasource, full.datasourcelen) != STREQ or
+	    b4.titlelen != full.titlelen or memcmp(b4.title, full.title, full.titlelen) != STREQ) {
+		printf("Record #2 read with arena is different\n");
+		return EXIT_FAILURE;
+	}
+	arena_free(&arena);
+
+	// streamed record leaves it's body in storage, stream_record() gives the same bytes by chunks
+	char small[1024];
+	struct blog_record b5 = {.stack = small, .stack_space = sizeof(small), .streamed = true};
+	if (get_record(&b5, 2, &con, &error) == false) {
+		printf("Failed to get streamed record #2: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	struct collected c = {.data = malloc(full.datasourcelen), .space = full.datasourcelen};
+	if (c.data == NULL) return EXIT_FAILURE;
+	if (stream_record(&b5, DISPLAY_DATASOURCE, collect, &c, &con, &error) == false) {
+		printf("Failed to stream record #2: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	if (c.len != full.datasourcelen or memcmp(c.data, full.datasource, c.len) != STREQ) {
+		printf("Streamed record #2 is different: %zu bytes instead of %u\n", c.len, full.datasourcelen);
+		return EXIT_FAILURE;
+	}
+	// or it's file is given to be sent as is
+	int recordfd;
+	unsigned long recordsize;
+	if (record_file(&b5, DISPLAY_DATASOURCE, &recordfd, &recordsize, &con, &error) == false or recordsize != full.datasourcelen or
+	    pread(recordfd, c.data, c.space, 0) != (ssize_t) full.datasourcelen or memcmp(c.data, full.datasource, recordsize) != STREQ) {
+		printf("File of record #2 is different\n");
+		return EXIT_FAILURE;
+	}
+	close(recordfd);
+
+	// data written by chunks to a draft becomes record's data without being copied
+	struct record_draft draft = {.fd = -1};
+	if (draft_open(&draft, &con, &error) == false) {
+		printf("Failed to open draft: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < strizeof(test_data2); i += 100) {
+		if (draft_write(&draft, test_data2 + i, CBL_MIN((size_t) 100, strizeof(test_data2) - i), &con, &error) == false) {
+			printf("Failed to write draft: Error: %s\n", error);
+			return EXIT_FAILURE;
+		}
+	}
+	struct blog_record b6 = {
+		.stack = buffer,
+		.stack_space = sizeof(buffer),
+		.title = "Drafted",
+		.titlelen = strizeof("Drafted"),
+		.draft = &draft,
+		.datalen = draft.len,
+		.display = DISPLAY_BOTH,
+	};
+	bool inserted = insert_record(&b6, &con, &error);
+	draft_close(&draft, &con);
+	if (inserted == false) {
+		printf("Failed insert record from draft: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	struct blog_record b7 = {.stack = buffer, .stack_space = sizeof(buffer)};
+	if (get_record(&b7, b6.chosen_record, &con, &error) == false) {
+		printf("Failed to get record from draft: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	if (b7.datalen != strizeof(test_data2) or memcmp(b7.data, test_data2, b7.datalen) != STREQ or
+	    b7.datasourcelen != c.len or memcmp(b7.datasource, c.data, c.len) != STREQ) {
+		printf("Record from draft is different\n");
+		return EXIT_FAILURE;
+	}
+	free(c.data);
+
+	// uploaded file gets a name which can be used in URL as is, and it's extension is kept
+	struct record_draft media = {.fd = -1, .media = true};
+	const char image[] = "\x89PNG\r\n\x1a\n\0\0\0\rIHDR";
+	char media_name[NAME_MAX + 1];
+	if (draft_open(&media, &con, &error) == false or draft_write(&media, image, sizeof(image), &con, &error) == false or
+	    publish_media(&media, "C:\\Photos\\../my photo (1).png", strlen("C:\\Photos\\../my photo (1).png"), media_name, &con, &error) == false) {
+		printf("Failed to upload media: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	draft_close(&media, &con);
+	if (strncmp(media_name, "my-photo--1-", strizeof("my-photo--1-")) != STREQ or strcmp(media_name + strlen(media_name) - strizeof(".png"), ".png") != STREQ) {
+		printf("Unexpected name of media: %s\n", media_name);
+		return EXIT_FAILURE;
+	}
+	char media_data[64];
+	c = (struct collected) {.data = media_data, .space = sizeof(media_data)};
+	if (stream_media(media_name, strlen(media_name), collect, &c, &con, &error) == false or c.len != sizeof(image) or memcmp(c.data, image, c.len) != STREQ) {
+		printf("Media %s is different\n", media_name);
+		return EXIT_FAILURE;
+	}
+	int mediafd;
+	unsigned long mediasize;
+	if (media_file(media_name, strlen(media_name), &mediafd, &mediasize, &con, &error) == false or mediasize != sizeof(image)) {
+		printf("File of media %s is different\n", media_name);
+		return EXIT_FAILURE;
+	}
+	close(mediafd);
+	if (stream_media("../1", strizeof("../1"), collect, &c, &con, &error) == true or stream_media(".draft-x", strizeof(".draft-x"), collect, &c, &con, &error) == true) {
+		printf("Media outside of media/ has been streamed\n");
+		return EXIT_FAILURE;
+	}
+	if (remove_media(media_name, strlen(media_name), &con, &error) == false or stream_media(media_name, strlen(media_name), collect, &c, &con, &error) == true or
+	    remove_media("../1", strizeof("../1"), &con, &error) == true) {
+		printf("Media is removed wrong\n");
+		return EXIT_FAILURE;
+	}
+
+	// records are found by words of their title and contents, altered record by it's new words only
+	struct {
+		const char *query;
+		unsigned total;
+		unsigned long first;
+	} searches[] = {
+		{"heading", 2, 0},
+		{"Title", 1, 1},
+		{"ЗАГОЛОВОК", 1, 2},
+		{"\"italic text\"", 2, 0},
+		{"\"text italic\"", 0, 0},
+		{"bold heading", 2, 0},
+		{"bold nonexistent", 0, 0},
+	};
+	for (unsigned i = 0; i < sizeof(searches) / sizeof(searches[0]); i++) {
+		struct search_hit hits[RLIM];
+		unsigned found = RLIM, total;
+		if (search_records(searches[i].query, strlen(searches[i].query), hits, &found, 0, &total, &con, &error) == false) {
+			printf("Failed to search %s: Error: %s\n", searches[i].query, error);
+			return EXIT_FAILURE;
+		}
+		if (total != searches[i].total or found != total or (searches[i].first and hits[0].record != searches[i].first)) {
+			printf("Search of %s has found %u records instead of %u\n", searches[i].query, total, searches[i].total);
+			return EXIT_FAILURE;
+		}
+	}
+	struct blog_record b8 = {.chosen_record = 1, .data = "Completely different words", .datalen = strizeof("Completely different words")};
+	if (alter_record(&b8, &con, &error) == false) {
+		printf("Failed to alter record #1: Error: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	struct search_hit hit;
+	unsigned found = 1, total;
+	if (search_records("yeees", strizeof("yeees"), &hit, &found, 0, &total, &con, &error) == false or total != 0) {
+		printf("Altered record #1 is searched by it's old words\n");
+		return EXIT_FAILURE;
+	}
+	found = 1;
+	if (search_records("different", strizeof("different"), &hit, &found, 0, &total, &con, &error) == false or total != 1 or hit.record != 1) {
+		printf("Altered record #1 isn't searched by it's new words\n");
+		return EXIT_FAILURE;
+	}
+
+	// every record is in the bucket of this month, altered one isn't counted twice; range is listed from buckets
+	struct month_bucket months[4];
+	size_t monthsamount = 4;
+	uint16_t year;
+	uint8_t month;
+	month_of(time(NULL), &year, &month);
+	if (archive_months(months, &monthsamount, &con, &error) == false or monthsamount != 1 or months[0].year != year or months[0].month != month or
+	    months[0].records != b6.chosen_record or months[0].first != 1 or months[0].last != b6.chosen_record) {
+		printf("Month buckets are wrong\n");
+		return EXIT_FAILURE;
+	}
+	unsigned long listed[8];
+	amount = 8;
+	struct list_filter thismonth = {.from.t = month_start(year, month), .to.t = month_start(year, month + 1) - 1, .sort = DESC};
+	if (list_records(&amount, listed, 0, thismonth, &con, &error) == false or amount != b6.chosen_record or listed[0] != b6.chosen_record) {
+		printf("Records of this month aren't listed\n");
+		return EXIT_FAILURE;
+	}
+	amount = 8;
+	struct list_filter nextmonth = {.from.t = month_start(year, month + 1), .to.t = month_start(year, month + 2) - 1};
+	if (list_records(&amount, listed, 0, nextmonth, &con, &error) == false or amount != 0) {
+		printf("Records of the next month are listed\n");
+		return EXIT_FAILURE;
+	}
+
+	// storage which has been written before buckets existed is bucketed when engine is initialized
+	deinitialize_engine(ENGINE_FILENO, &con);
+	unlink(TESTSETPATH "/index/.months");
+	unlink(TESTSETPATH "/index/.months-complete");
+	char bucket[64];
+	sprintf(bucket, TESTSETPATH "/index/.month-%04u-%02u", (unsigned) year, (unsigned) month);
+	unlink(bucket);
+	// drafts of crashed workers are removed, but not those which might be written right now
+	FILE *stale = fopen(TESTSETPATH "/data/.draft-stale", "w"), *fresh = fopen(TESTSETPATH "/data/.draft-fresh", "w");
+	if (stale) fclose(stale);
+	if (fresh) fclose(fresh);
+	struct timespec old[2] = {{.tv_sec = time(NULL) - FILENO_DRAFT_STALE - 1}, {.tv_sec = time(NULL) - FILENO_DRAFT_STALE - 1}};
+	utimensat(AT_FDCWD, TESTSETPATH "/data/.draft-stale", old, 0);
+	if (initialize_engine(&d, &error) == false) {
+		printf("Failed to initialize engine again: %s\n", error);
+		return EXIT_FAILURE;
+	}
+	monthsamount = 4;
+	amount = 8;
+	if (archive_months(months, &monthsamount, &con, &error) == false or monthsamount != 1 or months[0].records != b6.chosen_record or
+	    list_records(&amount, listed, 0, thismonth, &con, &error) == false or amount != b6.chosen_record or listed[0] != b6.chosen_record) {
+		printf("Older records aren't bucketed\n");
+		return EXIT_FAILURE;
+	}
+	if (access(TESTSETPATH "/data/.draft-stale", F_OK) == 0 or access(TESTSETPATH "/data/.draft-fresh", F_OK) != 0) {
+		printf("Drafts are cleaned up wrong\n");
+		return EXIT_FAILURE;
+	}
+
+	// segments are merged into posting lists when engine is initialized, and search finds the same
+	found = 1;
+	if (access(TESTSETPATH "/index/.segments", F_OK) == 0 or
+	    search_records("different", strizeof("different"), &hit, &found, 0, &total, &con, &error) == false or total != 1 or hit.record != 1 or
+	    search_records("yeees", strizeof("yeees"), &hit, &found, 0, &total, &con, &error) == false or total != 0) {
+		printf("Compacted index is different\n");
+		return EXIT_FAILURE;
+	}
+
+	// writers are compacting segments when there are too many of them, searches are the same meanwhile
+	char word[8] = "", previous[8];
+	for (unsigned i = 0; i < 500; i++) {
+		memcpy(previous, word, sizeof(word));
+		sprintf(word, "zq%c%c", 'a' + i % 26, 'a' + i / 26 % 26);
+		char words[32];
+		sprintf(words, "Round %s of alters", word);
+		struct blog_record round = {.chosen_record = 1, .data = words, .datalen = strlen(words)};
+		struct stat segments = {.st_size = 0};
+		if (alter_record(&round, &con, &error) == false or
+		    (stat(TESTSETPATH "/index/.segments", &segments) < 0 and errno != ENOENT) or segments.st_size > FILENO_INDEX_SEGMENTS_MAX or
+		    searched(word, 1, 1, &con) == false or (i > 0 and searched(previous, 0, 0, &con) == false) or searched("different", 0, 0, &con) == false or
+		    searched("alters", 1, 1, &con) == false or searched("ЗАГОЛОВОК", 1, 2, &con) == false) {
+			printf("Search is wrong after %u alters\n", i + 1);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// html which has been written by author is never rendered again from markdown
+	const char authored[] = "<p>Written by hand</p>";
+	struct blog_record b9 = {
+		.stack = buffer,
+		.stack_space = sizeof(buffer),
+		.title = "Handmade",
+		.titlelen = strizeof("Handmade"),
+		.data = "# Markdown",
+		.datalen = strizeof("# Markdown"),
+		.datasource = authored,
+		.datasourcelen = strizeof(authored),
+		.display = DISPLAY_BOTH,
+	};
+	size_t in, out;
+	bool unflagged;
+	if (insert_record(&b9, &con, &error) == false or rerender_record_fileno(b9.chosen_record, false, &unflagged, &in, &out, &con, &error) == false or in != 0 or
+	    unflagged == false or rerender_record_fileno(1, false, &unflagged, &in, &out, &con, &error) == false or in == 0 or unflagged) {
+		printf("Records are rerendered wrong\n");
+		return EXIT_FAILURE;
+	}
+	struct blog_record b10 = {.stack = buffer, .stack_space = sizeof(buffer)};
+	if (get_record(&b10, b9.chosen_record, &con, &error) == false or b10.datasourcelen != strizeof(authored) or memcmp(b10.datasource, authored, b10.datasourcelen) != STREQ) {
+		printf("Html of author has been replaced\n");
+		return EXIT_FAILURE;
+	}
+	struct blog_record b11 = {.stack = buffer, .stack_space = sizeof(buffer)};
+	// the same record might be a legacy one, it's made from markdown only if it's asked and then it's flagged
+	if (rerender_record_fileno(b9.chosen_record, true, &unflagged, &in, &out, &con, &error) == false or in == 0 or unflagged == false or
+	    rerender_record_fileno(b9.chosen_record, false, &unflagged, &in, &out, &con, &error) == false or in == 0 or unflagged or
+	    get_record(&b11, b9.chosen_record, &con, &error) == false or util_memmem(b11.datasource, b11.datasourcelen, authored, strizeof(authored)) != NULL) {
+		printf("Legacy records are rerendered wrong\n");
+		return EXIT_FAILURE;
+	}
+
 	deinitialize_engine(ENGINE_FILENO, &con);
 
 	return EXIT_SUCCESS;
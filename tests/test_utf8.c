@@ -0,0 +1,141 @@
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/util.c"
+
+#define arrlen(a) (sizeof(a) / sizeof(a[0]))
+
+// Every implementation of utf8_check() is compared with the original NUL-terminated state machine below.
+// All 1, 2 and 3 byte combinations are checked exhaustively, 4 byte ones and random strings are sampled.
+// Sequences are placed at different offsets, so they are crossing SIMD block borders and end of string.
+
+static const unsigned char *reference(const void *a) {
+	const unsigned char *s = a;
+	while(*s) {
+		if (*s < 0x80)
+			s++;
+		else if ((s[0] & 0xe0) == 0xc0) {
+			if ((s[1] & 0xc0) != 0x80 || (s[0] & 0xfe) == 0xc0)
+				return s;
+			else
+				s += 2;
+		} else if ((s[0] & 0xf0) == 0xe0) {
+			if ((s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
+				(s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||
+				(s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||
+				(s[0] == 0xef && s[1] == 0xbf && (s[2] & 0xfe) == 0xbe))
+				return s;
+			else
+				s += 3;
+		} else if ((s[0] & 0xf8) == 0xf0) {
+			if ((s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80 ||
+				(s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||
+				(s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4)
+				return s;
+			else
+				s += 4;
+		} else
+			return s;
+	}
+
+	return NULL;
+}
+
+typedef const unsigned char *(*check_fun)(const void *, size_t);
+
+struct implementation {
+	const char *name;
+	check_fun f;
+};
+
+static struct implementation impls[4];
+static size_t impls_amount;
+
+#define BUFSIZE 96
+static const size_t offsets[] = {0, 1, 2, 15, 30, 31, 32, 33, 47, 60, 61, 62, 63, 64, 65, 66, 80};
+
+static bool compare(unsigned char *buf, size_t len) {
+	// reference() stops at '\0', others are stopping at len too
+	unsigned char saved = buf[len];
+	buf[len] = '\0';
+	const unsigned char *expected = reference(buf);
+	buf[len] = saved;
+
+	for (size_t i = 0; i < impls_amount; i++) {
+		const unsigned char *got = impls[i].f(buf, len);
+		if (got != expected) {
+			printf("%s mismatch on %zu bytes: expected %td, got %td:", impls[i].name, len,
+				expected ? expected - buf : -1, got ? got - buf : -1);
+			for (size_t j = 0; j < len; j++) printf(" %02x", buf[j]);
+			printf("\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool place(const unsigned char *seq, size_t seqlen, size_t offset) {
+	unsigned char buf[BUFSIZE + 1];
+	memset(buf, 'a', sizeof(buf));
+	memcpy(buf + offset, seq, seqlen);
+
+	if (compare(buf, BUFSIZE) == false) return false;
+	if (compare(buf, offset + seqlen) == false) return false; // sequence is at the very end
+	if (offset + seqlen > 1 and compare(buf, offset + seqlen - 1) == false) return false; // sequence is cut by len
+	return true;
+}
+
+int main() {
+	impls[impls_amount++] = (struct implementation) {"generic", utf8_check_generic};
+	impls[impls_amount++] = (struct implementation) {"utf8_check", utf8_check};
+#ifdef CBL_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) impls[impls_amount++] = (struct implementation) {"ssse3", utf8_check_ssse3};
+	if (__builtin_cpu_supports("avx2")) impls[impls_amount++] = (struct implementation) {"avx2", utf8_check_avx2};
+#endif
+	for (size_t i = 0; i < impls_amount; i++) printf("Testing %s\n", impls[i].name);
+
+	unsigned char seq[BUFSIZE];
+	size_t n = 0;
+	for (unsigned b0 = 0; b0 < 256; b0++) {
+		for (unsigned b1 = 0; b1 < 256; b1++) {
+			for (unsigned b2 = 0; b2 < 256; b2++, n++) {
+				seq[0] = (unsigned char) b0;
+				seq[1] = (unsigned char) b1;
+				seq[2] = (unsigned char) b2;
+				if (place(seq, 3, offsets[n % arrlen(offsets)]) == false) return EXIT_FAILURE;
+			}
+		}
+	}
+	printf("1-3 byte sequences: OK\n");
+
+	srand(1);
+	for (unsigned i = 0; i < 4000000; i++) {
+		seq[0] = (unsigned char) (0xf0 + rand() % 8);
+		for (int j = 1; j < 4; j++) seq[j] = (unsigned char) (rand() % 8 ? 0x80 + rand() % 0x40 : rand() % 256);
+		if (place(seq, 4, offsets[i % arrlen(offsets)]) == false) return EXIT_FAILURE;
+	}
+	printf("4 byte sequences: OK\n");
+
+	// Mostly valid strings, so errors are appearing far from the beginning
+	const char *samples[] = {"a", "\xd0\x96", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xef\xbf\xbd", "\xc2\xa0", "\x7f", "\n"};
+	unsigned char buf[BUFSIZE * 4 + 1];
+	for (unsigned i = 0; i < 1000000; i++) {
+		size_t len = 0;
+		size_t target = (size_t) rand() % (sizeof(buf) - 4);
+		while(len < target) {
+			const char *sample = samples[rand() % arrlen(samples)];
+			memcpy(buf + len, sample, strlen(sample));
+			len += strlen(sample);
+		}
+		if (len and rand() % 2) buf[rand() % len] = (unsigned char) (rand() % 256);
+		if (compare(buf, len) == false) return EXIT_FAILURE;
+	}
+	printf("Random strings: OK\n");
+
+	return EXIT_SUCCESS;
+}